@@ -58,6 +58,23 @@ void flush_tlb_local() {
     asm volatile("dsb sy; tlbi vmalle1; dsb sy; isb;");
 }
 
+// Above this, invalidating the whole TLB is cheaper than page by page
+constexpr size_t max_tlbi_pages = 32;
+
+void flush_tlb_range(uintptr_t start, size_t size) {
+    auto first = align_down(start, page_size);
+    auto pages = (align_up(start + size, page_size) - first) / page_size;
+    if (!pages || pages > max_tlbi_pages) {
+        flush_tlb_all();
+        return;
+    }
+    asm volatile("dsb sy;");
+    for (size_t i = 0; i < pages; i++) {
+        asm volatile("tlbi vaae1is, %0;" :: "r"((first + i * page_size) >> 12));
+    }
+    asm volatile("dsb sy; isb;");
+}
+
 static pt_element<4> page_table_root[2] __attribute__((init_priority((int)init_prio::pt_root)));
 u64 mem_addr;
 
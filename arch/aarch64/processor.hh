@@ -75,6 +75,14 @@ inline u64 read_mpidr()
     return mpidr & mpidr_mask;
 }
 
+/* whether affinity level 0 numbers the threads of a multithreaded core */
+inline bool read_mpidr_mt()
+{
+    u64 mpidr;
+    asm volatile("mrs %0, mpidr_el1; isb;" : "=r" (mpidr));
+    return mpidr & (1ULL << 24);
+}
+
 /* the user of ticks() just wants a high resolution counter.
  * We just read the virtual counter, since using the Performance
  * Monitors to get the actual clock cycles has implications:
@@ -64,6 +64,19 @@ void smp_init()
     for (auto c : sched::cpus) {
         c->incoming_wakeups = new sched::cpu::incoming_wakeup_queue[sched::cpus.size()];
     }
+
+    /* Without MT, affinity level 0 numbers the cores of a cluster, which
+     * is taken as the cache domain; the boot cpu speaks for all of them. */
+    bool mt = processor::read_mpidr_mt();
+    for (auto c : sched::cpus) {
+        auto aff = [c] (unsigned level) { return unsigned(c->arch.mpid >> (8 * level)); };
+        if (mt) {
+            c->topology = { aff(1), aff(2), aff(2) };
+        } else {
+            c->topology = { aff(0), aff(1), aff(2) };
+        }
+    }
+    sched::build_sched_domains();
 }
 
 void smp_launch()
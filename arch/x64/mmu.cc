@@ -49,6 +49,21 @@ void flush_tlb_local() {
     processor::write_cr3(processor::read_cr3());
 }
 
+// Above this, reloading cr3 is cheaper than invalidating page by page
+constexpr size_t max_invlpg_pages = 32;
+
+// Flushes @pages pages starting at @start, or the whole TLB if @pages is 0
+static void flush_tlb_local(uintptr_t start, size_t pages)
+{
+    if (!pages) {
+        mmu::flush_tlb_local();
+        return;
+    }
+    for (size_t i = 0; i < pages; i++) {
+        processor::invlpg(reinterpret_cast<void*>(start + i * page_size));
+    }
+}
+
 // tlb_flush() does TLB flush on *all* processors, not returning before all
 // processors confirm flushing their TLB. This is slow, but necessary for
 // correctness so that, for example, after mprotect() returns, no thread on
@@ -56,49 +71,55 @@ void flush_tlb_local() {
 mutex tlb_flush_mutex;
 sched::thread_handle tlb_flush_waiter;
 std::atomic<int> tlb_flush_pendingconfirms;
+// Range of the flush in progress, protected by tlb_flush_mutex
+uintptr_t tlb_flush_start;
+size_t tlb_flush_pages;
 
 inter_processor_interrupt tlb_flush_ipi{IPI_TLB_FLUSH, [] {
-        mmu::flush_tlb_local();
+        flush_tlb_local(tlb_flush_start, tlb_flush_pages);
         if (tlb_flush_pendingconfirms.fetch_add(-1) == 1) {
             tlb_flush_waiter.wake();
         }
 }};
 
-void flush_tlb_all()
+// Cpus running the idle thread, and, if the flush is done by an application
+// thread (so it is of application memory), cpus running kernel threads, do
+// not touch the memory being flushed.  They are not interrupted, but flush
+// their whole TLB at their next context switch instead.
+static void flush_tlb(uintptr_t start, size_t pages)
 {
     static std::vector<sched::cpu*> ipis(sched::max_cpus);
 
     if (sched::cpus.size() <= 1) {
-        mmu::flush_tlb_local();
+        flush_tlb_local(start, pages);
         return;
     }
 
     SCOPE_LOCK(migration_lock);
-    mmu::flush_tlb_local();
+    flush_tlb_local(start, pages);
     std::lock_guard<mutex> guard(tlb_flush_mutex);
     tlb_flush_waiter.reset(*sched::thread::current());
-    int count;
-    if (sched::thread::current()->is_app()) {
-        ipis.clear();
-        std::copy_if(sched::cpus.begin(), sched::cpus.end(), std::back_inserter(ipis),
-                [](sched::cpu* c) {
-            if (c == sched::cpu::current()) {
-                return false;
-            }
-
-            c->lazy_flush_tlb.store(true, std::memory_order_relaxed);
-            if (!c->app_thread.load(std::memory_order_seq_cst)) {
-                return false;
-            }
-            if (!c->lazy_flush_tlb.exchange(false, std::memory_order_relaxed)) {
-                return false;
-            }
-            return true;
-        });
-        count = ipis.size();
-    } else {
-        count = sched::cpus.size() - 1;
-    }
+    tlb_flush_start = start;
+    tlb_flush_pages = pages;
+    bool app = sched::thread::current()->is_app();
+    ipis.clear();
+    std::copy_if(sched::cpus.begin(), sched::cpus.end(), std::back_inserter(ipis),
+            [app](sched::cpu* c) {
+        if (c == sched::cpu::current()) {
+            return false;
+        }
+
+        c->lazy_flush_tlb.store(true, std::memory_order_seq_cst);
+        if (c->idle_thread_running.load(std::memory_order_seq_cst) ||
+                (app && !c->app_thread.load(std::memory_order_seq_cst))) {
+            return false;
+        }
+        if (!c->lazy_flush_tlb.exchange(false, std::memory_order_relaxed)) {
+            return false;
+        }
+        return true;
+    });
+    int count = ipis.size();
     tlb_flush_pendingconfirms.store(count);
     if (count == (int)sched::cpus.size() - 1) {
         tlb_flush_ipi.send_allbutself();
@@ -113,6 +134,21 @@ void flush_tlb_all()
     tlb_flush_waiter.clear();
 }
 
+void flush_tlb_all()
+{
+    flush_tlb(0, 0);
+}
+
+void flush_tlb_range(uintptr_t start, size_t size)
+{
+    auto pages = (align_up(start + size, page_size) - align_down(start, page_size)) / page_size;
+    if (!pages || pages > max_invlpg_pages) {
+        flush_tlb(0, 0);
+    } else {
+        flush_tlb(align_down(start, page_size), pages);
+    }
+}
+
 static pt_element<4> page_table_root __attribute__((init_priority((int)init_prio::pt_root)));
 
 pt_element<4> *get_root_pt(uintptr_t virt __attribute__((unused))) {
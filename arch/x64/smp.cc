@@ -21,6 +21,7 @@ extern "C" {
 #include <osv/barrier.hh>
 #include <osv/prio.hh>
 #include "osv/percpu.hh"
+#include <osv/numa.hh>
 
 extern "C" { void smp_main(void); }
 
@@ -58,6 +59,7 @@ void parse_madt()
             auto c = new sched::cpu(nr_cpus++);
             c->arch.apic_id = lapic->Id;
             c->arch.acpi_id = lapic->ProcessorId;
+            numa::set_cpu_node(c->id, numa::apic_node(lapic->Id));
             c->arch.initstack.next = smp_stack_free;
             smp_stack_free = &c->arch.initstack;
             sched::cpus.push_back(c);
@@ -71,9 +73,77 @@ void parse_madt()
     debug(fmt("%d CPUs detected\n") % nr_cpus);
 }
 
+static unsigned ilog2_roundup(unsigned n)
+{
+    unsigned shift = 0;
+    while ((1u << shift) < n) {
+        ++shift;
+    }
+    return shift;
+}
+
+// Derives each cpu's core, last level cache and package from its apic id,
+// whose low bits number the SMT threads of a core, the next the cores of a
+// package. The field widths come from the boot cpu; the cpus of a guest
+// are assumed to be alike.
+static void parse_topology()
+{
+    auto max_leaf = cpuid(0).a;
+    unsigned smt_shift = 0, pkg_shift = 0;
+    bool found = false;
+    for (u32 leaf : { 0x1f, 0xb }) {
+        if (found || max_leaf < leaf) {
+            continue;
+        }
+        for (u32 sub = 0; ; ++sub) {
+            auto r = cpuid(leaf, sub);
+            auto type = (r.c >> 8) & 0xff;
+            if (!type) {
+                break;
+            }
+            if (type == 1) {
+                smt_shift = r.a & 0x1f;
+            }
+            pkg_shift = r.a & 0x1f;
+            found = true;
+        }
+    }
+    if (!found && (cpuid(1).d & (1 << 28))) {
+        // Legacy: logical processors per package, and cores per package
+        pkg_shift = ilog2_roundup((cpuid(1).b >> 16) & 0xff);
+        unsigned cores = max_leaf >= 4 ? (cpuid(4, 0).a >> 26) + 1 : 1;
+        smt_shift = pkg_shift - std::min(ilog2_roundup(cores), pkg_shift);
+    }
+    // Logical processors sharing the last level cache
+    unsigned cache_sharing = 0;
+    auto last_cache = [&] (u32 leaf) {
+        for (u32 sub = 0; ; ++sub) {
+            auto r = cpuid(leaf, sub);
+            if (!(r.a & 0x1f)) {
+                break;
+            }
+            cache_sharing = ((r.a >> 14) & 0xfff) + 1;
+        }
+    };
+    if (max_leaf >= 4) {
+        last_cache(4);
+    }
+    if (!cache_sharing && cpuid(0x80000000).a >= 0x8000001d) {
+        last_cache(0x8000001d);
+    }
+    unsigned cache_shift = cache_sharing ? ilog2_roundup(cache_sharing) : pkg_shift;
+    for (auto c : sched::cpus) {
+        auto apic_id = c->arch.apic_id;
+        c->topology = { apic_id >> smt_shift, apic_id >> cache_shift,
+                        apic_id >> pkg_shift };
+    }
+}
+
 void smp_init()
 {
     parse_madt();
+    parse_topology();
+    sched::build_sched_domains();
     sched::current_cpu = sched::cpus[0];
     for (auto c : sched::cpus) {
         c->incoming_wakeups = new sched::cpu::incoming_wakeup_queue[sched::cpus.size()];
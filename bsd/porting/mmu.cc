@@ -41,9 +41,9 @@ int vm_throttling_needed(void)
     return memory::throttling_needed();
 }
 
-void mmu_unmap(void* ab)
+int mmu_unmap(void* ab, void* data, size_t size)
 {
-    pagecache::unmap_arc_buf((arc_buf_t*)ab);
+    return pagecache::unmap_arc_buf((arc_buf_t*)ab, data, size);
 }
 
 void mmu_map(void* key, void* ab, void* page)
@@ -51,7 +51,7 @@ uint64_t kmem_used(void);
 int vm_paging_needed(void);
 int vm_throttling_needed(void);
 
-void mmu_unmap(void* ab);
+int mmu_unmap(void* ab, void* data, size_t size);
 void mmu_map(void* key, void* ab, void* page);
 
 #define vtophys(_va) virt_to_phys((void *)_va)
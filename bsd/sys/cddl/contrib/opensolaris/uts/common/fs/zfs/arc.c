@@ -1640,10 +1640,17 @@ arc_buf_destroy(arc_buf_t *buf, boolean_t recycle, boolean_t all)
 		arc_state_t *state = buf->b_hdr->b_state;
 		uint64_t size = buf->b_hdr->b_size;
 		arc_buf_contents_t type = buf->b_hdr->b_type;
+		int lent = 0;
 
+		/*
+		 * Pages lent to the network stack by sendfile() must outlive
+		 * the buffer; the page cache frees the data once they are
+		 * all returned.
+		 */
 		if (buf->b_hdr->b_mmaped) {
-			mmu_unmap(buf);
+			lent = mmu_unmap(buf, buf->b_data, size);
 		}
+		ASSERT(!lent || (!recycle && type == ARC_BUFC_DATA));
 
 		arc_cksum_verify(buf);
 #ifdef illumos
@@ -1656,7 +1663,8 @@ arc_buf_destroy(arc_buf_t *buf, boolean_t recycle, boolean_t all)
 				arc_space_return(size, ARC_SPACE_DATA);
 			} else {
 				ASSERT(type == ARC_BUFC_DATA);
-				arc_buf_data_free(buf, zio_data_buf_free);
+				if (!lent)
+					arc_buf_data_free(buf, zio_data_buf_free);
 				ARCSTAT_INCR(arcstat_data_size, -size);
 				atomic_add_64(&arc_size, -size);
 			}
@@ -1943,9 +1951,10 @@ evict_start:
 				}
 				if (buf->b_data) {
 					bytes_evicted += ab->b_size;
+					/* mmaped data may be lent, never steal it */
 					if (recycle && ab->b_type == type &&
 					    ab->b_size == bytes &&
-					    !HDR_L2_WRITING(ab)) {
+					    !HDR_L2_WRITING(ab) && !ab->b_mmaped) {
 						stolen = buf->b_data;
 						recycle = FALSE;
 					}
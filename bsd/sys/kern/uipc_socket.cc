@@ -2394,6 +2394,7 @@ soreceive_dgram(struct socket *so, struct bsd_sockaddr **psa, struct uio *uio,
 	 * Loop blocking while waiting for a datagram.
 	 */
 	SOCK_LOCK(so);
+	flush_net_channel(so);
 	while ((m = so->so_rcv.sb_mb) == NULL) {
 		KASSERT(so->so_rcv.sb_cc == 0,
 		    ("soreceive_dgram: sb_mb NULL but sb_cc %u",
@@ -61,6 +61,7 @@
 #include <osv/mempool.hh>
 #include <osv/pagealloc.hh>
 #include <osv/zcopy.hh>
+#include <osv/pagecache.hh>
 #include <sys/eventfd.h>
 
 using namespace std;
@@ -1008,6 +1009,98 @@ sockargs(struct mbuf **mp, caddr_t buf, int buflen, int type)
 	return (error);
 }
 
+/* sendfile() never queues more than this in one sosend() */
+static constexpr size_t sendfile_chunk = 64 * 1024;
+
+static void
+sendfile_page_free(void *arg1, void *arg2)
+{
+	pagecache::unlend(reinterpret_cast<pagecache::page_loan *>(arg1));
+}
+
+/*
+ * Transmit count bytes of fp, starting at offset, on stream socket s
+ * without copying them: the page cache pages backing the file are attached
+ * to mbufs as external storage and lent to them until they are freed.
+ */
+int
+sys_sendfile(int s, struct file *fp, off_t offset, size_t count,
+    ssize_t *bytes)
+{
+	struct file *sfp;
+	struct socket *so;
+	int error;
+	auto vfp = dynamic_cast<vfs_file *>(fp);
+
+	*bytes = 0;
+	if (vfp == NULL)
+		return (EINVAL);
+	error = getsock_cap(s, &sfp, NULL);
+	if (error)
+		return (error);
+	so = (struct socket *)file_data(sfp);
+	if (so->so_type != SOCK_STREAM) {
+		fdrop(sfp);
+		return (EINVAL);
+	}
+
+	while (count > 0) {
+		/* sosend() waits until the whole chain fits in the buffer */
+		size_t chunk = std::min({count, sendfile_chunk,
+		    (size_t)so->so_snd.sb_hiwat});
+		struct mbuf *top = NULL, **mp = &top;
+		size_t len = 0;
+
+		while (len < chunk) {
+			off_t pos = offset + len;
+			off_t page = align_down(pos, (off_t)mmu::page_size);
+			size_t off = pos - page;
+			size_t n = std::min(chunk - len, mmu::page_size - off);
+			pagecache::page_loan *loan;
+			struct mbuf *m;
+
+			m = top ? m_get(M_WAITOK, MT_DATA) :
+			    m_gethdr(M_WAITOK, MT_DATA);
+			auto addr = pagecache::lend(vfp, page, &loan);
+			/* The page is the file's cache, never append to it */
+			MEXTADD(m, addr, mmu::page_size, sendfile_page_free,
+			    loan, NULL, M_RDONLY, EXT_SFBUF);
+			if ((m->m_hdr.mh_flags & M_EXT) == 0) {
+				pagecache::unlend(loan);
+				m_free(m);
+				error = ENOBUFS;
+				break;
+			}
+			m->m_hdr.mh_data += off;
+			m->m_hdr.mh_len = n;
+			*mp = m;
+			mp = &m->m_hdr.mh_next;
+			len += n;
+		}
+		if (error) {
+			m_freem(top);
+			break;
+		}
+		top->M_dat.MH.MH_pkthdr.len = len;
+
+		error = sosend(so, NULL, NULL, top, NULL, 0, NULL);
+		if (error)
+			break;
+		offset += len;
+		count -= len;
+		*bytes += len;
+	}
+	fdrop(sfp);
+
+	/*
+	 * As Linux does, report what was sent; an error such as EPIPE is
+	 * reported by the next call.
+	 */
+	if (*bytes != 0)
+		error = 0;
+	return (error);
+}
+
 ssize_t
 zcopy_tx(int s, struct zmsghdr *zm)
 {
@@ -62,6 +62,8 @@ struct if_data {
                                 * be sent due to a lack of free space
                                 * on a HW ring
                                 */
+    u_long  ifi_inc_packets;/* Rx packets delivered to net channels */
+    u_long  ifi_inc_wakeups;/* net channel wakeups for those packets */
     wakeup_stats ifi_iwakeup_stats; /* Rx BH wakeup statistics */
     wakeup_stats ifi_owakeup_stats; /* Tx BH wakeup statistics */
 };
@@ -82,5 +84,21 @@ static inline void if_update_wakeup_stats(wakeup_stats& stats,
     stats.packets_256 += (wakeup_packets >= 256);
 }
 
+/**
+ * Accumulate wakeup_stats of several queues
+ * @param to wakeup_stats struct to update
+ * @param from wakeup_stats struct to add
+ */
+static inline void if_add_wakeup_stats(wakeup_stats& to,
+                                       const wakeup_stats& from)
+{
+    to.packets_8   += from.packets_8;
+    to.packets_16  += from.packets_16;
+    to.packets_32  += from.packets_32;
+    to.packets_64  += from.packets_64;
+    to.packets_128 += from.packets_128;
+    to.packets_256 += from.packets_256;
+}
+
 
 #endif /* _NET_IF_DATA_H */
@@ -217,6 +217,10 @@ struct ifnet {
 
 	void add_net_channel(net_channel* nc, ipv4_tcp_conn_id id) { if_classifier.add(id, nc); }
 	void del_net_channel(ipv4_tcp_conn_id id) { if_classifier.remove(id); }
+	void add_net_channel(net_channel* nc, ipv4_udp_conn_id id) { if_classifier.add(id, nc); }
+	void del_net_channel(ipv4_udp_conn_id id) { if_classifier.remove(id); }
+	void add_net_channel(net_channel* nc, ipv4_udp_bound_id id) { if_classifier.add(id, nc); }
+	void del_net_channel(ipv4_udp_bound_id id) { if_classifier.remove(id); }
 };
 
 typedef void if_init_f_t(void *);
@@ -3205,6 +3205,15 @@ tcp_net_channel_packet(tcpcb* tp, mbuf* m)
 	auto tlen = ip_len - (ip_size + (th->th_off << 2));
 	auto iptos = ip_hdr->ip_tos;
 	SOCK_LOCK_ASSERT(so);
+	// Receive flow steering: we run in the context of the consuming
+	// thread, so tag the connection with its cpu.  ip_output() copies the
+	// flow id to outgoing packets, the driver transmits them on that cpu's
+	// queue and the host then delivers the flow's packets to the same cpu.
+	auto inp = tp->t_inpcb;
+	if (!(inp->inp_flags & INP_HW_FLOWID)) {
+		inp->inp_flowid = sched::cpu::current()->id;
+		inp->inp_flags |= INP_SW_FLOWID;
+	}
 	bool want_close;
 	m_trim(m, ETHER_HDR_LEN + ip_len);
 	tcp_do_segment(m, th, so, tp, drop_hdrlen, tlen, iptos, TI_UNLOCKED, want_close);
@@ -70,6 +70,14 @@
 #include <bsd/sys/netinet/udp.h>
 #include <bsd/sys/netinet/udp_var.h>
 
+#include <bsd/sys/net/ethernet.h>
+#include <bsd/sys/net/netisr.h>
+#include <bsd/sys/net/if_var.h>
+#include <osv/net_channel.hh>
+#include <osv/net_trace.hh>
+#include <osv/poll.h>
+#include <vector>
+
 /*
  * UDP protocol implementation.
  * Per RFC 768, August, 1980.
@@ -190,10 +198,70 @@ void
 udp_discardcb(struct udpcb *up)
 {
 
+	KASSERT(up->u_nc == NULL, ("udp_discardcb: net channel not freed"));
 	uma_zfree(V_udpcb_zone, up);
 }
 
 #ifdef INET
+/*
+ * Subroutine of udp_input() and udp_net_channel_packet(): make the mbuf data
+ * length reflect the UDP length and verify the checksum.  Returns 0, after
+ * freeing the mbuf chain, if the datagram has to be dropped.
+ */
+static int
+udp_validate(struct mbuf *m, struct ip *ip, struct udphdr *uh)
+{
+	int len;
+
+	/*
+	 * Make mbuf data length reflect UDP length.  If not enough data to
+	 * reflect UDP length, drop.
+	 */
+	len = ntohs((u_short)uh->uh_ulen);
+	if (ip->ip_len != len) {
+		if (len > ip->ip_len || len < sizeof(struct udphdr)) {
+			UDPSTAT_INC(udps_badlen);
+			m_freem(m);
+			return (0);
+		}
+		m_adj(m, len - ip->ip_len);
+		/* ip->ip_len = len; */
+	}
+
+	/*
+	 * Checksum extended UDP header and data.
+	 */
+	if (uh->uh_sum) {
+		u_short uh_sum;
+
+		if (m->M_dat.MH.MH_pkthdr.csum_flags & CSUM_DATA_VALID) {
+			if (m->M_dat.MH.MH_pkthdr.csum_flags & CSUM_PSEUDO_HDR)
+				uh_sum = m->M_dat.MH.MH_pkthdr.csum_data;
+			else
+				uh_sum = in_pseudo(ip->ip_src.s_addr,
+				    ip->ip_dst.s_addr, htonl((u_short)len +
+				    m->M_dat.MH.MH_pkthdr.csum_data + IPPROTO_UDP));
+			uh_sum ^= 0xffff;
+		} else {
+			char b[9];
+
+			bcopy(((struct ipovly *)ip)->ih_x1, b, 9);
+			bzero(((struct ipovly *)ip)->ih_x1, 9);
+			((struct ipovly *)ip)->ih_len = uh->uh_ulen;
+			uh_sum = in_cksum(m, len + sizeof (struct ip));
+			bcopy(b, ((struct ipovly *)ip)->ih_x1, 9);
+		}
+		if (uh_sum) {
+			UDPSTAT_INC(udps_badsum);
+			m_freem(m);
+			return (0);
+		}
+	} else
+		UDPSTAT_INC(udps_nosum);
+
+	return (1);
+}
+
 /*
  * Subroutine of udp_input(), which appends the provided mbuf chain to the
  * passed pcb/socket.  The caller must provide a bsd_sockaddr_in via udp_in that
@@ -292,7 +360,6 @@ udp_input(struct mbuf *m, int off)
 	struct udphdr *uh;
 	struct ifnet *ifp;
 	struct inpcb *inp;
-	int len;
 	struct ip save_ip;
 	struct bsd_sockaddr_in udp_in;
 	struct m_tag *fwd_tag;
@@ -339,20 +406,6 @@ udp_input(struct mbuf *m, int off)
 	udp_in.sin_port = uh->uh_sport;
 	udp_in.sin_addr = ip->ip_src;
 
-	/*
-	 * Make mbuf data length reflect UDP length.  If not enough data to
-	 * reflect UDP length, drop.
-	 */
-	len = ntohs((u_short)uh->uh_ulen);
-	if (ip->ip_len != len) {
-		if (len > ip->ip_len || len < sizeof(struct udphdr)) {
-			UDPSTAT_INC(udps_badlen);
-			goto badunlocked;
-		}
-		m_adj(m, len - ip->ip_len);
-		/* ip->ip_len = len; */
-	}
-
 	/*
 	 * Save a copy of the IP header in case we want restore it for
 	 * sending an ICMP error message in response.
@@ -362,36 +415,8 @@ udp_input(struct mbuf *m, int off)
 	else
 		memset(&save_ip, 0, sizeof(save_ip));
 
-	/*
-	 * Checksum extended UDP header and data.
-	 */
-	if (uh->uh_sum) {
-		u_short uh_sum;
-
-		if (m->M_dat.MH.MH_pkthdr.csum_flags & CSUM_DATA_VALID) {
-			if (m->M_dat.MH.MH_pkthdr.csum_flags & CSUM_PSEUDO_HDR)
-				uh_sum = m->M_dat.MH.MH_pkthdr.csum_data;
-			else
-				uh_sum = in_pseudo(ip->ip_src.s_addr,
-				    ip->ip_dst.s_addr, htonl((u_short)len +
-				    m->M_dat.MH.MH_pkthdr.csum_data + IPPROTO_UDP));
-			uh_sum ^= 0xffff;
-		} else {
-			char b[9];
-
-			bcopy(((struct ipovly *)ip)->ih_x1, b, 9);
-			bzero(((struct ipovly *)ip)->ih_x1, 9);
-			((struct ipovly *)ip)->ih_len = uh->uh_ulen;
-			uh_sum = in_cksum(m, len + sizeof (struct ip));
-			bcopy(b, ((struct ipovly *)ip)->ih_x1, 9);
-		}
-		if (uh_sum) {
-			UDPSTAT_INC(udps_badsum);
-			m_freem(m);
-			return;
-		}
-	} else
-		UDPSTAT_INC(udps_nosum);
+	if (!udp_validate(m, ip, uh))
+		return;
 
 	if (IN_MULTICAST(ntohl(ip->ip_dst.s_addr)) ||
 	    in_broadcast(ip->ip_dst, ifp)) {
@@ -574,6 +599,226 @@ udp_input(struct mbuf *m, int off)
 badunlocked:
 	m_freem(m);
 }
+
+/*
+ * Van Jacobson net channel of a bound or connected UDP socket: the
+ * classifier of each interface pushes the socket's datagrams into the
+ * channel, and the consumer processes them in its own context instead of
+ * netisr.
+ */
+struct udp_net_channel {
+	net_channel *nc;
+	/* Interfaces the channel is registered on. */
+	std::vector<struct ifnet *> intfs;
+	/* The key it is registered with, if any intfs. */
+	bool connected;
+	struct in_addr laddr, faddr;
+	in_port_t lport, fport;
+};
+
+/*
+ * Counterpart of ip_input() + udp_input() for a datagram that was
+ * classified to a net channel; called in the context of the consumer.
+ */
+// INP_LOCK held
+static void
+udp_net_channel_packet(struct inpcb *inp, struct mbuf *m)
+{
+	struct ip *ip;
+	struct udphdr *uh;
+	struct bsd_sockaddr_in udp_in;
+	int iphlen = sizeof(struct ip);
+	int sum;
+
+	INP_LOCK_ASSERT(inp);
+	log_packet_handling(m, NETISR_ETHER);
+	m_adj(m, ETHER_HDR_LEN);
+	ip = mtod(m, struct ip *);
+
+	/*
+	 * The classifier has already checked there are no IP options and
+	 * that this is not a fragment, so this is all that ip_input() has
+	 * left to do for us.
+	 */
+	IPSTAT_INC(ips_total);
+	if (m->M_dat.MH.MH_pkthdr.csum_flags & CSUM_IP_CHECKED)
+		sum = !(m->M_dat.MH.MH_pkthdr.csum_flags & CSUM_IP_VALID);
+	else
+		sum = in_cksum_hdr(ip);
+	if (sum) {
+		IPSTAT_INC(ips_badsum);
+		m_freem(m);
+		return;
+	}
+	ip->ip_len = ntohs(ip->ip_len);
+	if (ip->ip_len < iphlen || m->M_dat.MH.MH_pkthdr.len < ip->ip_len) {
+		IPSTAT_INC(ips_badlen);
+		m_freem(m);
+		return;
+	}
+	if (m->M_dat.MH.MH_pkthdr.len > ip->ip_len)
+		m_adj(m, ip->ip_len - m->M_dat.MH.MH_pkthdr.len);
+	ip->ip_off = ntohs(ip->ip_off);
+	ip->ip_len -= iphlen;
+	IPSTAT_INC(ips_delivered);
+
+	UDPSTAT_INC(udps_ipackets);
+	uh = (struct udphdr *)((caddr_t)ip + iphlen);
+
+	bzero(&udp_in, sizeof(udp_in));
+	udp_in.sin_len = sizeof(udp_in);
+	udp_in.sin_family = AF_INET;
+	udp_in.sin_port = uh->uh_sport;
+	udp_in.sin_addr = ip->ip_src;
+
+	if (!udp_validate(m, ip, uh))
+		return;
+
+	if (inp->inp_ip_minttl && inp->inp_ip_minttl > ip->ip_ttl) {
+		m_freem(m);
+		return;
+	}
+
+	/* Steer the flow to our cpu, see tcp_net_channel_packet(). */
+	if (!(inp->inp_flags & INP_HW_FLOWID)) {
+		inp->inp_flowid = sched::cpu::current()->id;
+		inp->inp_flags |= INP_SW_FLOWID;
+	}
+
+	udp_append(inp, ip, m, iphlen, &udp_in);
+}
+
+static void
+udp_net_channel_register(struct udp_net_channel *unc)
+{
+	for (auto ifp : unc->intfs) {
+		if (unc->connected) {
+			ifp->add_net_channel(unc->nc, ipv4_udp_conn_id{
+			    unc->faddr, unc->laddr, ntohs(unc->fport),
+			    ntohs(unc->lport)});
+		} else {
+			ifp->add_net_channel(unc->nc, ipv4_udp_bound_id{
+			    unc->laddr, ntohs(unc->lport)});
+		}
+	}
+}
+
+static void
+udp_net_channel_unregister(struct udp_net_channel *unc)
+{
+	for (auto ifp : unc->intfs) {
+		if (unc->connected) {
+			ifp->del_net_channel(ipv4_udp_conn_id{unc->faddr,
+			    unc->laddr, ntohs(unc->fport), ntohs(unc->lport)});
+		} else {
+			ifp->del_net_channel(ipv4_udp_bound_id{unc->laddr,
+			    ntohs(unc->lport)});
+		}
+	}
+	unc->intfs.clear();
+}
+
+/*
+ * (Re)register the socket's net channel according to its current
+ * addresses and options.  Called whenever the pcb is bound, connected or
+ * disconnected, and when SO_REUSEADDR or SO_REUSEPORT is set.
+ *
+ * Sockets sharing their port (SO_REUSEADDR/SO_REUSEPORT) and kernel
+ * tunnels keep using the netisr path, which knows how to pick among them.
+ */
+// INP_LOCK held
+static void
+udp_update_net_channel(struct inpcb *inp)
+{
+	struct udpcb *up = intoudpcb(inp);
+	struct socket *so = inp->inp_socket;
+	struct udp_net_channel *unc = up->u_nc;
+	struct ifnet *ifp;
+	bool want, connected;
+
+	INP_LOCK_ASSERT(inp);
+	connected = inp->inp_faddr.s_addr != INADDR_ANY;
+	want = inp->inp_lport != 0 && up->u_tun_func == NULL &&
+	    !(so->so_options & (SO_REUSEADDR | SO_REUSEPORT));
+	if (unc && !unc->intfs.empty() && want &&
+	    unc->connected == connected &&
+	    unc->laddr.s_addr == inp->inp_laddr.s_addr &&
+	    unc->lport == inp->inp_lport &&
+	    unc->faddr.s_addr == inp->inp_faddr.s_addr &&
+	    unc->fport == inp->inp_fport) {
+		return;
+	}
+	if (unc) {
+		udp_net_channel_unregister(unc);
+	}
+	if (!want) {
+		return;
+	}
+
+	if (!unc) {
+		unc = new udp_net_channel;
+		unc->nc = new net_channel([=] (mbuf *m) {
+			udp_net_channel_packet(inp, m);
+		});
+		up->u_nc = unc;
+		so->so_nc = unc->nc;
+		if (so->fp) {
+			WITH_LOCK(so->fp->f_lock) {
+				for (auto&& pl : so->fp->f_poll_list) {
+					so->so_nc->add_poller(*pl._req);
+				}
+				if (so->fp->f_epolls) {
+					for (auto&& ep : *so->fp->f_epolls) {
+						so->so_nc->add_epoll(ep);
+					}
+				}
+			}
+		}
+	}
+	unc->connected = connected;
+	unc->laddr = inp->inp_laddr;
+	unc->lport = inp->inp_lport;
+	unc->faddr = inp->inp_faddr;
+	unc->fport = inp->inp_fport;
+
+	/*
+	 * Unlike a TCP connection, which is registered on the interface its
+	 * SYN arrived on, a UDP socket may receive on any of them.
+	 */
+	IFNET_RLOCK();
+	TAILQ_FOREACH(ifp, &V_ifnet, if_link) {
+		if (!(ifp->if_flags & IFF_LOOPBACK)) {
+			unc->intfs.push_back(ifp);
+		}
+	}
+	IFNET_RUNLOCK();
+	udp_net_channel_register(unc);
+}
+
+// INP_LOCK held
+static void
+udp_free_net_channel(struct inpcb *inp)
+{
+	struct udpcb *up = intoudpcb(inp);
+	struct udp_net_channel *unc = up->u_nc;
+	struct socket *so = inp->inp_socket;
+
+	if (!unc) {
+		return;
+	}
+	udp_net_channel_unregister(unc);
+	if (so && so->fp) {
+		for (auto&& pl : so->fp->f_poll_list) {
+			so->so_nc->del_poller(*pl._req);
+		}
+	}
+	if (so) {
+		so->so_nc = nullptr;
+	}
+	osv::rcu_dispose(unc->nc);
+	delete unc;
+	up->u_nc = NULL;
+}
 #endif /* INET */
 
 /*
@@ -808,6 +1053,15 @@ udp_ctloutput(struct socket *so, struct sockopt *sopt)
 	inp = sotoinpcb(so);
 	KASSERT(inp != NULL, ("%s: inp == NULL", __func__));
 	INP_LOCK(inp);
+	if (sopt->sopt_level == SOL_SOCKET && sopt->sopt_dir == SOPT_SET) {
+		switch (sopt->sopt_name) {
+		case SO_REUSEADDR:
+		case SO_REUSEPORT:
+			/* sosetopt() has already updated so_options. */
+			udp_update_net_channel(inp);
+			break;
+		}
+	}
 	if (sopt->sopt_level != IPPROTO_UDP) {
 #ifdef INET6
 		if (INP_CHECK_SOCKAF(so, AF_INET6)) {
@@ -1095,6 +1349,7 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct bsd_sockaddr *addr,
 					goto release;
 				}
 				inp->inp_flags |= INP_ANONPORT;
+				udp_update_net_channel(inp);
 			}
 		} else {
 			faddr = sin->sin_addr;
@@ -1347,6 +1602,7 @@ udp_abort(struct socket *so)
 		inp->inp_laddr.s_addr = INADDR_ANY;
 		INP_HASH_WUNLOCK(&V_udbinfo);
 		soisdisconnected(so);
+		udp_update_net_channel(inp);
 	}
 	INP_UNLOCK(inp);
 }
@@ -1416,6 +1672,8 @@ udp_bind(struct socket *so, struct bsd_sockaddr *nam, struct thread *td)
 	INP_HASH_WLOCK(&V_udbinfo);
 	error = in_pcbbind(inp, nam, 0);
 	INP_HASH_WUNLOCK(&V_udbinfo);
+	if (error == 0)
+		udp_update_net_channel(inp);
 	INP_UNLOCK(inp);
 	return (error);
 }
@@ -1434,6 +1692,7 @@ udp_close(struct socket *so)
 		inp->inp_laddr.s_addr = INADDR_ANY;
 		INP_HASH_WUNLOCK(&V_udbinfo);
 		soisdisconnected(so);
+		udp_update_net_channel(inp);
 	}
 	INP_UNLOCK(inp);
 }
@@ -1456,8 +1715,10 @@ udp_connect(struct socket *so, struct bsd_sockaddr *nam, struct thread *td)
 	INP_HASH_WLOCK(&V_udbinfo);
 	error = in_pcbconnect(inp, nam, 0);
 	INP_HASH_WUNLOCK(&V_udbinfo);
-	if (error == 0)
+	if (error == 0) {
 		soisconnected(so);
+		udp_update_net_channel(inp);
+	}
 	INP_UNLOCK(inp);
 	return (error);
 }
@@ -1476,6 +1737,7 @@ udp_detach(struct socket *so)
 	INP_LOCK(inp);
 	up = intoudpcb(inp);
 	KASSERT(up != NULL, ("%s: up == NULL", __func__));
+	udp_free_net_channel(inp);
 	inp->inp_ppcb = NULL;
 	in_pcbdetach(inp);
 	in_pcbfree(inp);
@@ -1502,6 +1764,7 @@ udp_disconnect(struct socket *so)
 	SOCK_LOCK(so);
 	so->so_state &= ~SS_ISCONNECTED;		/* XXX */
 	SOCK_UNLOCK(so);
+	udp_update_net_channel(inp);
 	INP_UNLOCK(inp);
 	return (0);
 }
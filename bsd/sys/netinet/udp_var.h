@@ -53,12 +53,15 @@ struct udpiphdr {
 
 typedef void(*udp_tun_func_t)(struct mbuf *, int off, struct inpcb *);
 
+struct udp_net_channel;
+
 /*
  * UDP control block; one per udp.
  */
 struct udpcb {
 	udp_tun_func_t	u_tun_func;	/* UDP kernel tunneling callback. */
 	u_int		u_flags;	/* Generic UDP flags. */
+	struct udp_net_channel *u_nc;	/* Net channel, if bound/connected. */
 };
 
 #define	intoudpcb(ip)	((struct udpcb *)(ip)->inp_ppcb)
@@ -38,6 +38,8 @@ int sys_socketpair(int domain, int type, int protocol, int *rsv);
 int sys_sendto(int s, caddr_t buf, size_t  len, int flags, caddr_t to,
     int tolen, ssize_t* bytes);
 int sys_sendmsg(int s, struct msghdr* msg, int flags, ssize_t* bytes);
+int sys_sendfile(int s, struct file *fp, off_t offset, size_t count,
+    ssize_t *bytes);
 int sys_recvfrom(int s, caddr_t buf, size_t  len, int flags,
     struct bsd_sockaddr * __restrict from, socklen_t * __restrict fromlenaddr,
     ssize_t* bytes);
@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include <osv/heap-profiler.hh>
+#include <osv/execinfo.hh>
+#include <osv/mutex.h>
+#include <osv/sched.hh>
+#include <osv/defer.hh>
+#include <osv/mmu.hh>
+
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+namespace prof {
+
+namespace heap {
+
+bool enabled;
+__thread ssize_t bytes_until_sample;
+
+static constexpr unsigned max_frames = 32;
+// sample() and malloc() themselves
+static constexpr unsigned skip_frames = 2;
+// Bounds the memory used by the profiler; further samples are dropped
+static constexpr size_t max_samples = 1 << 16;
+static constexpr size_t max_stacks = 1 << 14;
+
+struct stack {
+    unsigned depth;
+    void* pc[max_frames];
+    bool operator==(const stack& other) const {
+        return depth == other.depth && std::equal(pc, pc + depth, other.pc);
+    }
+};
+
+struct stack_hash {
+    size_t operator()(const stack& s) const {
+        size_t h = s.depth;
+        for (unsigned i = 0; i < s.depth; i++) {
+            h = h * 31 + reinterpret_cast<uintptr_t>(s.pc[i]);
+        }
+        return h;
+    }
+};
+
+struct counts {
+    size_t live_objects;
+    size_t live_bytes;
+    size_t alloc_objects;
+    size_t alloc_bytes;
+};
+
+struct live_sample {
+    counts* bucket;
+    size_t size;
+};
+
+static mutex lock;
+static size_t rate;
+// Allocated while the profiler runs
+static std::unordered_map<stack, counts, stack_hash>* buckets;
+static std::unordered_map<void*, live_sample>* live;
+
+// Number of live samples per hash of their address, so that free() only
+// takes the lock for addresses which may have been sampled
+static constexpr size_t filter_size = 8192;
+static std::atomic<uint16_t> filter[filter_size];
+
+static std::atomic<uint16_t>& filter_of(void* addr)
+{
+    return filter[(reinterpret_cast<uintptr_t>(addr) >> 4) % filter_size];
+}
+
+// The profiler's own allocations are not sampled
+static __thread bool recursed;
+static __thread uint64_t rng;
+
+// malloc() and free() may be called where we cannot take the lock
+static bool can_sleep()
+{
+    return sched::preemptable() && arch::irq_enabled();
+}
+
+// Exponentially distributed, as the unsampling done by pprof assumes
+static ssize_t next_interval()
+{
+    if (!rng) {
+        rng = reinterpret_cast<uintptr_t>(&rng) | 1;
+    }
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    double u = ((rng >> 11) + 1) / double(1ull << 53);
+    return -std::log(u) * rate;
+}
+
+void sample(void* addr, size_t size)
+{
+    // A thread's first allocation finds bytes_until_sample not set yet;
+    // give it an interval of its own rather than always sampling it
+    if (!rng) {
+        bytes_until_sample = next_interval() - size;
+        if (bytes_until_sample >= 0) {
+            return;
+        }
+    }
+    bytes_until_sample = next_interval();
+    if (recursed || !can_sleep()) {
+        return;
+    }
+    recursed = true;
+    auto unrecurse = defer([&] { recursed = false; });
+
+    // This allocation may be servicing a fault, so avoid taking one here
+    void* pc[max_frames + skip_frames];
+    int n = backtrace_safe(pc, max_frames + skip_frames);
+    stack s;
+    s.depth = std::max(n - int(skip_frames), 0);
+    std::copy(pc + n - s.depth, pc + n, s.pc);
+
+    WITH_LOCK(lock) {
+        if (!enabled || live->size() >= max_samples) {
+            return;
+        }
+        auto it = buckets->find(s);
+        if (it == buckets->end()) {
+            if (buckets->size() >= max_stacks) {
+                return;
+            }
+            it = buckets->emplace(s, counts{}).first;
+        }
+        auto& c = it->second;
+        c.live_objects++;
+        c.live_bytes += size;
+        c.alloc_objects++;
+        c.alloc_bytes += size;
+        // The address may still have a sample whose free() we missed
+        // (e.g., freed where we could not take the lock); replace it
+        auto old = live->find(addr);
+        if (old != live->end()) {
+            old->second.bucket->live_objects--;
+            old->second.bucket->live_bytes -= old->second.size;
+            old->second = live_sample{&c, size};
+        } else {
+            live->emplace(addr, live_sample{&c, size});
+            filter_of(addr).fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+void forget(void* addr)
+{
+    auto& f = filter_of(addr);
+    if (!f.load(std::memory_order_relaxed) || recursed || !can_sleep()) {
+        return;
+    }
+    recursed = true;
+    auto unrecurse = defer([&] { recursed = false; });
+    WITH_LOCK(lock) {
+        if (!live) {
+            return;
+        }
+        auto it = live->find(addr);
+        if (it == live->end()) {
+            return;
+        }
+        it->second.bucket->live_objects--;
+        it->second.bucket->live_bytes -= it->second.size;
+        live->erase(it);
+        f.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+}
+
+void start_heap_profiler(size_t sample_rate)
+{
+    stop_heap_profiler();
+    auto buckets = new std::unordered_map<heap::stack, heap::counts, heap::stack_hash>;
+    auto live = new std::unordered_map<void*, heap::live_sample>;
+    WITH_LOCK(heap::lock) {
+        heap::rate = std::max(sample_rate, size_t(1));
+        heap::buckets = buckets;
+        heap::live = live;
+        heap::enabled = true;
+    }
+}
+
+void stop_heap_profiler()
+{
+    std::unordered_map<heap::stack, heap::counts, heap::stack_hash>* buckets;
+    std::unordered_map<void*, heap::live_sample>* live;
+    WITH_LOCK(heap::lock) {
+        heap::enabled = false;
+        buckets = heap::buckets;
+        live = heap::live;
+        heap::buckets = nullptr;
+        heap::live = nullptr;
+        for (auto& f : heap::filter) {
+            f.store(0, std::memory_order_relaxed);
+        }
+    }
+    delete buckets;
+    delete live;
+}
+
+bool heap_profiler_enabled()
+{
+    return heap::enabled;
+}
+
+void dump_heap_profile(std::ostream& os)
+{
+    std::vector<std::pair<heap::stack, heap::counts>> buckets;
+    size_t rate = 0;
+    // Copy the samples first: formatting allocates memory, which may be
+    // sampled
+    heap::recursed = true;
+    WITH_LOCK(heap::lock) {
+        if (heap::buckets) {
+            buckets.assign(heap::buckets->begin(), heap::buckets->end());
+        }
+        rate = heap::rate;
+    }
+    heap::recursed = false;
+
+    heap::counts total{};
+    for (auto& b : buckets) {
+        total.live_objects += b.second.live_objects;
+        total.live_bytes += b.second.live_bytes;
+        total.alloc_objects += b.second.alloc_objects;
+        total.alloc_bytes += b.second.alloc_bytes;
+    }
+    auto print_counts = [&os] (const heap::counts& c) {
+        os << c.live_objects << ": " << c.live_bytes << " ["
+           << c.alloc_objects << ": " << c.alloc_bytes << "] @";
+    };
+    os << "heap profile: ";
+    print_counts(total);
+    os << " heap_v2/" << rate << "\n";
+    for (auto& b : buckets) {
+        print_counts(b.second);
+        for (unsigned i = 0; i < b.first.depth; i++) {
+            os << " " << b.first.pc[i];
+        }
+        os << "\n";
+    }
+    os << "\nMAPPED_LIBRARIES:\n" << mmu::procfs_maps();
+}
+
+}
@@ -9,6 +9,8 @@
 #include <osv/trace.hh>
 #include <osv/sched.hh>
 #include <osv/wait_record.hh>
+#include <osv/barrier.hh>
+#include <osv/lock-profiler.hh>
 
 namespace lockfree {
 
@@ -19,6 +21,47 @@ TRACEPOINT(trace_mutex_try_lock, "%p, success=%d", mutex *, bool);
 TRACEPOINT(trace_mutex_unlock, "%p", mutex *);
 TRACEPOINT(trace_mutex_send_lock, "%p, wr=%p", mutex *, wait_record *);
 TRACEPOINT(trace_mutex_receive_lock, "%p", mutex *);
+TRACEPOINT(trace_mutex_lock_spin, "%p, acquired=%d", mutex *, bool);
+
+// How long a contended lock() may spin before sleeping, in iterations of
+// the loop below: long enough to cover a short critical section, and well
+// below the cost of a context switch and a wakeup.
+constexpr unsigned max_spin = 4096;
+// Finding where the owner runs scans the cpus, so it is rechecked only
+// every so often
+constexpr unsigned owner_check_interval = 64;
+
+static inline void profile_acquired(mutex* m, uint64_t wait_start = 0)
+{
+    if (__builtin_expect(prof::lock::enabled, false)) {
+        prof::lock::acquired(m, prof::lock::kind::mutex, wait_start,
+                wait_start ? prof::lock::now_ns() - wait_start : 0);
+    }
+}
+
+// Spins while the lock's owner runs on another cpu, hoping for the handoff
+// its unlock() will leave us (see the top of mutex.hh). Returns whether we
+// got the lock.
+bool mutex::spin_for_handoff()
+{
+    for (unsigned i = 0; i < max_spin; i++) {
+        auto old_handoff = handoff.load();
+        if (old_handoff && handoff.compare_exchange_strong(old_handoff, 0U)) {
+            trace_mutex_lock_spin(this, true);
+            return true;
+        }
+        if (i % owner_check_interval == 0) {
+            // A null owner is a lock changing hands; keep spinning
+            auto o = owner.load(std::memory_order_relaxed);
+            if (!waitqueue.empty() || (o && !sched::running_elsewhere(o))) {
+                break;
+            }
+        }
+        barrier();
+    }
+    trace_mutex_lock_spin(this, false);
+    return false;
+}
 
 void mutex::lock()
 {
@@ -33,6 +76,7 @@ void mutex::lock()
         // just for implementing a recursive mutex.
         owner.store(current, std::memory_order_relaxed);
         depth = 1;
+        profile_acquired(this);
         return;
     }
 
@@ -46,6 +90,15 @@ void mutex::lock()
     }
 
     // If we're here still here the lock is owned by a different thread.
+    ncontended.fetch_add(1, std::memory_order_relaxed);
+    uint64_t wait_start = prof::lock::enabled ? prof::lock::now_ns() : 0;
+    if (spin_for_handoff()) {
+        owner.store(current, std::memory_order_relaxed);
+        depth = 1;
+        profile_acquired(this, wait_start);
+        return;
+    }
+
     // Put this thread in a waiting queue, so it will eventually be woken
     // when another thread releases the lock.
     // Note "waiter" is on the stack, so we must not return before making sure
@@ -77,6 +130,7 @@ void mutex::lock()
                     assert(other == &waiter);
                     owner.store(current, std::memory_order_relaxed);
                     depth = 1;
+                    profile_acquired(this, wait_start);
                     return;
                 }
             }
@@ -84,11 +138,13 @@ void mutex::lock()
     }
 
     // Wait until another thread pops us from the wait queue and wakes us up.
+    nslept.fetch_add(1, std::memory_order_relaxed);
     trace_mutex_lock_wait(this);
     waiter.wait();
     trace_mutex_lock_wake(this);
     owner.store(current, std::memory_order_relaxed);
     depth = 1;
+    profile_acquired(this, wait_start);
 }
 
 // send_lock() is used for implementing a "wait morphing" technique, where
@@ -172,6 +228,7 @@ void mutex::receive_lock()
     trace_mutex_receive_lock(this);
     owner.store(sched::thread::current(), std::memory_order_relaxed);
     depth = 1;
+    profile_acquired(this);
 }
 
 bool mutex::try_lock()
@@ -182,6 +239,7 @@ bool mutex::try_lock()
         // Uncontended case. We got the lock.
         owner.store(current, std::memory_order_relaxed);
         depth = 1;
+        profile_acquired(this);
         trace_mutex_try_lock(this, true);
         return true;
     }
@@ -202,6 +260,7 @@ bool mutex::try_lock()
         count.fetch_add(1, std::memory_order_relaxed);
         owner.store(current, std::memory_order_relaxed);
         depth = 1;
+        profile_acquired(this);
         trace_mutex_try_lock(this, true);
         return true;
     }
@@ -222,6 +281,10 @@ void mutex::unlock()
     if (--depth)
         return; // recursive mutex still locked.
 
+    if (__builtin_expect(prof::lock::enabled, false)) {
+        prof::lock::released(this);
+    }
+
     // When we return from unlock(), we will no longer be holding the lock.
     // We can't leave owner==current, otherwise a later lock() in the same
     // thread will think it's a recursive lock, while actually another thread
@@ -7,24 +7,476 @@
 
 // This is the Linux-specific asynchronous I/O API / ABI from libaio.
 // Note that this API is different the Posix AIO API.
+//
+// Requests on block devices are turned into bios which are handed to the
+// driver without waiting for them; the driver's completion callback posts
+// the result to the context's completion ring. Other files (e.g., on ZFS)
+// don't have a bio interface, so their requests are queued to a small pool
+// of worker threads of the context, which perform them in parallel with the
+// regular synchronous file operations. Either way, io_submit() doesn't
+// block on the I/O.
 
 #include <api/libaio.h>
 
-#include <osv/stubbing.hh>
+#include <osv/bio.h>
+#include <osv/device.h>
+#include <osv/vnode.h>
+#include <osv/file.h>
+#include <osv/fcntl.h>
+#include <osv/prex.h>
+#include <osv/sched.hh>
+#include <osv/mutex.h>
+#include <osv/condvar.h>
+#include <osv/trace.hh>
+#include <fs/fs.hh>
+#include <fs/vfs/vfs.h>
 
-int io_setup(int nr_events, io_context_t *ctxp_idp) {
-    // This is a stub that doesn't actually do anything. If the caller tries
-    // to follow the io_setup() call with any other libaio call, those will
-    // fail.
-    WARN_STUBBED();
-    if (nr_events < 0) {
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <errno.h>
+#include <limits.h>
+
+TRACEPOINT(trace_aio_submit, "ctx=%p, iocb=%p, op=%d, fd=%d, bio=%d",
+           io_context*, iocb*, int, int, bool);
+TRACEPOINT(trace_aio_complete, "ctx=%p, iocb=%p, res=%ld",
+           io_context*, iocb*, long);
+
+struct aio_request;
+
+// Bounds the number of requests on files without a bio interface which a
+// context performs in parallel (also bounded by its nr_events).
+static constexpr unsigned max_workers = 16;
+
+struct io_context {
+    explicit io_context(unsigned nr_events) : nr_events(nr_events) {}
+    ~io_context();
+
+    int submit(iocb* cb);
+    void complete(aio_request* req);
+    long getevents(long min_nr, long nr, io_event* events,
+            const struct timespec* timeout);
+    int cancel(iocb* cb, io_event* evt);
+    void destroy();
+
+private:
+    void start_worker();
+    void worker();
+
+    mutex _mtx;
+    // Completions not reaped by io_getevents() yet
+    std::deque<io_event> _ring;
+    condvar _ring_cv;
+    // Requests submitted and not yet reaped, at most nr_events
+    unsigned _reserved = 0;
+    // Requests submitted and not completed yet
+    unsigned _inflight = 0;
+    condvar _inflight_cv;
+    // Requests on files without a bio interface, and the threads doing them
+    std::deque<aio_request*> _work;
+    condvar _work_cv;
+    std::vector<std::unique_ptr<sched::thread>> _workers;
+    unsigned _idle_workers = 0;
+    bool _destroying = false;
+public:
+    const unsigned nr_events;
+};
+
+struct aio_request {
+    aio_request(io_context* ctx, iocb* cb) : ctx(ctx), cb(cb) {}
+    io_context* ctx;
+    iocb* cb;
+    fileref fp;
+    // The eventfd to notify, for IOCB_FLAG_RESFD
+    fileref resfd;
+    std::vector<iovec> iov;
+    off_t offset = 0;
+    // Outstanding bios; the last one to complete completes the request
+    std::atomic<unsigned> pending_bios { 0 };
+    std::atomic<size_t> bytes { 0 };
+    std::atomic<int> error { 0 };
+};
+
+static bool is_bio_capable(file* fp)
+{
+    auto vp = fp->f_dentry ? fp->f_dentry->d_vnode : nullptr;
+    if (!vp || vp->v_type != VBLK) {
+        return false;
+    }
+    auto dev = static_cast<device*>(vp->v_data);
+    return dev && dev->driver && dev->driver->devops->strategy;
+}
+
+static void aio_bio_done(bio* b)
+{
+    auto req = static_cast<aio_request*>(b->bio_caller1);
+    if (b->bio_flags & BIO_ERROR) {
+        req->error.store(b->bio_error ? b->bio_error : EIO);
+    } else {
+        req->bytes += b->bio_bcount;
+    }
+    destroy_bio(b);
+    if (--req->pending_bios == 0) {
+        req->ctx->complete(req);
+    }
+}
+
+// Issue the request as one bio per iovec (a single BIO_FLUSH for fsync).
+// The device's own strategy routine splits them further as needed.
+static int aio_submit_bios(aio_request* req, int op)
+{
+    auto dev = static_cast<device*>(req->fp->f_dentry->d_vnode->v_data);
+    std::vector<bio*> bios;
+    auto alloc = [&] (uint8_t cmd) {
+        auto b = alloc_bio();
+        if (b) {
+            b->bio_cmd = cmd;
+            b->bio_dev = dev;
+            b->bio_caller1 = req;
+            b->bio_done = aio_bio_done;
+            bios.push_back(b);
+        }
+        return b;
+    };
+
+    if (op == IO_CMD_FSYNC || op == IO_CMD_FDSYNC) {
+        if (!alloc(BIO_FLUSH)) {
+            return ENOMEM;
+        }
+    } else {
+        off_t offset = req->offset;
+        for (auto& iov : req->iov) {
+            // Like O_DIRECT on Linux, bios need sector aligned requests
+            if ((offset | off_t(iov.iov_len)) & (BSIZE - 1)) {
+                std::for_each(bios.begin(), bios.end(), destroy_bio);
+                return EINVAL;
+            }
+            // Short transfer at the end of the device
+            size_t len = std::min<off_t>(iov.iov_len,
+                    std::max<off_t>(dev->size - offset, 0));
+            if (len == 0) {
+                break;
+            }
+            auto b = alloc(op == IO_CMD_PREAD || op == IO_CMD_PREADV ?
+                    BIO_READ : BIO_WRITE);
+            if (!b) {
+                std::for_each(bios.begin(), bios.end(), destroy_bio);
+                return ENOMEM;
+            }
+            b->bio_data = iov.iov_base;
+            b->bio_offset = offset;
+            b->bio_bcount = len;
+            offset += len;
+        }
+        if (bios.empty()) {
+            req->ctx->complete(req);
+            return 0;
+        }
+    }
+
+    req->pending_bios.store(bios.size());
+    for (auto b : bios) {
+        dev->driver->devops->strategy(b);
+    }
+    return 0;
+}
+
+// Perform a request on a file without a bio interface, synchronously.
+static void aio_do_file_io(aio_request* req)
+{
+    size_t count = 0;
+    int error;
+    switch (req->cb->aio_lio_opcode) {
+    case IO_CMD_PREAD:
+    case IO_CMD_PREADV:
+        error = sys_read(req->fp.get(), req->iov.data(), req->iov.size(),
+                req->offset, &count);
+        break;
+    case IO_CMD_PWRITE:
+    case IO_CMD_PWRITEV:
+        error = sys_write(req->fp.get(), req->iov.data(), req->iov.size(),
+                req->offset, &count);
+        break;
+    case IO_CMD_FSYNC:
+    case IO_CMD_FDSYNC:
+        error = sys_fsync(req->fp.get());
+        break;
+    default:
+        error = EINVAL;
+    }
+    // Like the synchronous calls, report a partial transfer as success
+    if (error && count == 0) {
+        req->error.store(error);
+    }
+    req->bytes.store(count);
+    req->ctx->complete(req);
+}
+
+io_context::~io_context()
+{
+    assert(_inflight == 0 && _work.empty());
+}
+
+int io_context::submit(iocb* cb)
+{
+    int op = cb->aio_lio_opcode;
+    std::unique_ptr<aio_request> req(new aio_request(this, cb));
+
+    req->fp = fileref_from_fd(cb->aio_fildes);
+    if (!req->fp) {
+        return EBADF;
+    }
+    if (cb->u.c.flags & IOCB_FLAG_RESFD) {
+        req->resfd = fileref_from_fd(cb->u.c.resfd);
+        if (!req->resfd) {
+            return EBADF;
+        }
+    }
+    switch (op) {
+    case IO_CMD_PREAD:
+    case IO_CMD_PWRITE:
+        req->iov.push_back({cb->u.c.buf, cb->u.c.nbytes});
+        req->offset = cb->u.c.offset;
+        break;
+    case IO_CMD_PREADV:
+    case IO_CMD_PWRITEV:
+        if (cb->u.v.nr < 0 || cb->u.v.nr > UIO_MAXIOV) {
+            return EINVAL;
+        }
+        req->iov.assign(cb->u.v.vec, cb->u.v.vec + cb->u.v.nr);
+        req->offset = cb->u.v.offset;
+        break;
+    case IO_CMD_FSYNC:
+    case IO_CMD_FDSYNC:
+        break;
+    default:
+        return EINVAL;
+    }
+    if (req->offset < 0) {
+        return EINVAL;
+    }
+    bool is_read = op == IO_CMD_PREAD || op == IO_CMD_PREADV;
+    bool is_write = op == IO_CMD_PWRITE || op == IO_CMD_PWRITEV;
+    if ((is_read && !(req->fp->f_flags & FREAD)) ||
+        (is_write && !(req->fp->f_flags & FWRITE))) {
+        return EBADF;
+    }
+
+    WITH_LOCK(_mtx) {
+        if (_destroying) {
+            return EINVAL;
+        }
+        if (_reserved == nr_events) {
+            return EAGAIN;
+        }
+        _reserved++;
+        _inflight++;
+    }
+
+    bool use_bio = is_bio_capable(req->fp.get());
+    trace_aio_submit(this, cb, op, cb->aio_fildes, use_bio);
+    if (use_bio) {
+        int error = aio_submit_bios(req.get(), op);
+        if (error) {
+            WITH_LOCK(_mtx) {
+                _reserved--;
+                _inflight--;
+            }
+            return error;
+        }
+        req.release();
+        return 0;
+    }
+
+    WITH_LOCK(_mtx) {
+        _work.push_back(req.release());
+        // Start another worker unless an idle one will pick this up
+        if (_work.size() > _idle_workers &&
+                _workers.size() < std::min(nr_events, max_workers)) {
+            start_worker();
+        }
+        _work_cv.wake_one();
+    }
+    return 0;
+}
+
+void io_context::start_worker()
+{
+    auto t = new sched::thread([this] { worker(); },
+            sched::thread::attr().name("aio"));
+    _workers.emplace_back(t);
+    t->start();
+}
+
+void io_context::worker()
+{
+    while (true) {
+        aio_request* req;
+        WITH_LOCK(_mtx) {
+            _idle_workers++;
+            while (_work.empty() && !_destroying) {
+                _work_cv.wait(_mtx);
+            }
+            _idle_workers--;
+            if (_work.empty()) {
+                return;
+            }
+            req = _work.front();
+            _work.pop_front();
+        }
+        aio_do_file_io(req);
+    }
+}
+
+void io_context::complete(aio_request* req)
+{
+    long res = req->error ? -req->error.load() : long(req->bytes.load());
+    trace_aio_complete(this, req->cb, res);
+    WITH_LOCK(_mtx) {
+        _ring.push_back({req->cb->data, req->cb, (unsigned long)res, 0});
+        _ring_cv.wake_all();
+    }
+    // Only signal the eventfd once the event can be reaped
+    if (req->resfd) {
+        uint64_t one = 1;
+        iovec iov {&one, sizeof(one)};
+        uio u {&iov, 1, 0, sizeof(one), UIO_WRITE};
+        req->resfd->write(&u, 0);
+    }
+    delete req;
+    WITH_LOCK(_mtx) {
+        if (--_inflight == 0) {
+            _inflight_cv.wake_all();
+        }
+    }
+}
+
+long io_context::getevents(long min_nr, long nr, io_event* events,
+        const struct timespec* timeout)
+{
+    std::unique_ptr<sched::timer> tmr;
+    if (timeout) {
+        tmr.reset(new sched::timer(*sched::thread::current()));
+        tmr->set(std::chrono::seconds(timeout->tv_sec) +
+                 std::chrono::nanoseconds(timeout->tv_nsec));
+    }
+    long n = 0;
+    WITH_LOCK(_mtx) {
+        while (_ring.size() < size_t(min_nr) && !(tmr && tmr->expired())) {
+            _ring_cv.wait(_mtx, tmr.get());
+        }
+        while (n < nr && !_ring.empty()) {
+            events[n++] = _ring.front();
+            _ring.pop_front();
+        }
+        _reserved -= n;
+    }
+    return n;
+}
+
+int io_context::cancel(iocb* cb, io_event* evt)
+{
+    aio_request* req = nullptr;
+    WITH_LOCK(_mtx) {
+        auto i = std::find_if(_work.begin(), _work.end(),
+                [cb] (aio_request* r) { return r->cb == cb; });
+        if (i == _work.end()) {
+            // Either in progress, or already completed, we can't tell which
+            // without searching the ring, and neither can be cancelled.
+            return EAGAIN;
+        }
+        req = *i;
+        _work.erase(i);
+        // The event is returned to the caller, not posted to the ring
+        _reserved--;
+        if (--_inflight == 0) {
+            _inflight_cv.wake_all();
+        }
+    }
+    *evt = {cb->data, cb, (unsigned long)-ECANCELED, 0};
+    delete req;
+    return 0;
+}
+
+// Cancel what we can, and wait for the rest to complete.
+void io_context::destroy()
+{
+    std::deque<aio_request*> cancelled;
+    WITH_LOCK(_mtx) {
+        _destroying = true;
+        cancelled.swap(_work);
+        _inflight -= cancelled.size();
+        _work_cv.wake_all();
+        while (_inflight) {
+            _inflight_cv.wait(_mtx);
+        }
+    }
+    for (auto req : cancelled) {
+        delete req;
+    }
+    for (auto& t : _workers) {
+        t->join();
+    }
+}
+
+int io_setup(int nr_events, io_context_t *ctxp_idp)
+{
+    if (nr_events <= 0 || !ctxp_idp || *ctxp_idp) {
         return -EINVAL;
     }
+    auto ctx = new (std::nothrow) io_context(nr_events);
+    if (!ctx) {
+        return -ENOMEM;
+    }
+    *ctxp_idp = ctx;
     return 0;
 }
 
-UNIMPL(int io_submit(io_context_t ctx, long nr, struct iocb *ios[]))
-UNIMPL(int io_getevents(io_context_t ctx_id, long min_nr, long nr,
-        struct io_event *events, struct timespec *timeout))
-UNIMPL(int io_destroy(io_context_t ctx))
-UNIMPL(int io_cancel(io_context_t ctx, struct iocb *iocb, struct io_event *evt))
+int io_submit(io_context_t ctx, long nr, struct iocb *ios[])
+{
+    if (!ctx || nr < 0) {
+        return -EINVAL;
+    }
+    long i;
+    for (i = 0; i < nr; i++) {
+        int error = ctx->submit(ios[i]);
+        if (error) {
+            // Report the error only if nothing was submitted
+            return i ? i : -error;
+        }
+    }
+    return i;
+}
+
+int io_getevents(io_context_t ctx_id, long min_nr, long nr,
+        struct io_event *events, struct timespec *timeout)
+{
+    if (!ctx_id || min_nr < 0 || nr < min_nr) {
+        return -EINVAL;
+    }
+    if (timeout && (timeout->tv_sec < 0 ||
+            timeout->tv_nsec < 0 || timeout->tv_nsec >= 1000000000L)) {
+        return -EINVAL;
+    }
+    return ctx_id->getevents(min_nr, nr, events, timeout);
+}
+
+int io_destroy(io_context_t ctx)
+{
+    if (!ctx) {
+        return -EINVAL;
+    }
+    ctx->destroy();
+    delete ctx;
+    return 0;
+}
+
+int io_cancel(io_context_t ctx, struct iocb *iocb, struct io_event *evt)
+{
+    if (!ctx || !iocb || !evt) {
+        return -EINVAL;
+    }
+    return -ctx->cancel(iocb, evt);
+}
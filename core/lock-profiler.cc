@@ -0,0 +1,388 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include <osv/lock-profiler.hh>
+#include <osv/execinfo.hh>
+#include <osv/demangle.hh>
+#include <osv/irqlock.hh>
+#include <osv/mutex.h>
+#include <osv/rcu.hh>
+#include <osv/clock.hh>
+#include <osv/printf.hh>
+
+#include <atomic>
+#include <algorithm>
+#include <map>
+#include <cstring>
+
+namespace prof {
+
+namespace lock {
+
+bool enabled;
+
+// Frames identifying the caller of a lock, through the lock's own wrappers
+static constexpr unsigned site_frames = 6;
+static constexpr unsigned stack_frames = 16;
+// acquired() itself
+static constexpr unsigned skip_frames = 1;
+// Sizes of the open addressing tables below, powers of two
+static constexpr size_t max_sites = 1 << 14;
+static constexpr size_t max_stacks = 1 << 12;
+static constexpr unsigned max_probes = 16;
+// Locks a thread may hold at once and still have their hold time measured
+static constexpr unsigned max_held = 16;
+static constexpr unsigned top_stacks = 5;
+
+// An entry is claimed by setting its key, then filled in, then marked
+// ready; it is never freed while the profiler runs.
+struct site {
+    std::atomic<uint64_t> key;
+    std::atomic<bool> ready;
+    kind k;
+    unsigned depth;
+    void* pc[site_frames];
+    std::atomic<uint64_t> contended;
+    std::atomic<uint64_t> wait_ns;
+    std::atomic<uint64_t> max_hold_ns;
+};
+
+struct stack {
+    std::atomic<uint64_t> key;
+    std::atomic<bool> ready;
+    site* s;
+    unsigned depth;
+    void* pc[stack_frames];
+    std::atomic<uint64_t> contended;
+    std::atomic<uint64_t> wait_ns;
+};
+
+// Allocated when the profiler is first started, and kept: a lock may be
+// released, and look its site up, long after the profiler was stopped.
+static site* sites;
+static stack* stacks;
+// Serializes starting and stopping
+static mutex control_lock;
+
+struct held {
+    const void* lock;
+    site* s;
+    uint64_t since;
+};
+
+// Locks held by the current thread; stale once the profiler is restarted
+static __thread held held_locks[max_held];
+static __thread unsigned nheld;
+static __thread unsigned held_generation;
+static unsigned generation;
+
+uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            osv::clock::uptime::now().time_since_epoch()).count();
+}
+
+static uint64_t hash(void* const* pc, unsigned depth, uint64_t seed)
+{
+    uint64_t h = seed * 31 + depth;
+    for (unsigned i = 0; i < depth; i++) {
+        h = h * 31 + reinterpret_cast<uintptr_t>(pc[i]);
+    }
+    // 0 marks a free entry
+    return h | 1;
+}
+
+template <typename Entry, typename Fill>
+static Entry* lookup(Entry* table, size_t size, uint64_t key, Fill fill)
+{
+    for (unsigned i = 0; i < max_probes; i++) {
+        auto& e = table[(key + i) & (size - 1)];
+        auto k = e.key.load(std::memory_order_acquire);
+        if (!k && e.key.compare_exchange_strong(k, key)) {
+            fill(e);
+            e.ready.store(true, std::memory_order_release);
+            return &e;
+        }
+        if (k == key) {
+            // Another cpu may still be filling it in
+            return e.ready.load(std::memory_order_acquire) ? &e : nullptr;
+        }
+    }
+    return nullptr;
+}
+
+void acquired(const void* lock, kind k, bool contended, uint64_t wait_ns)
+{
+    // Disabling interrupts also holds off rcu_synchronize() in
+    // stop_lock_profiler(), and keeps spinlocks taken by interrupt
+    // handlers from interleaving with our updates of held_locks.
+    irq_save_lock_type irq_lock;
+    WITH_LOCK(irq_lock) {
+        if (!enabled) {
+            return;
+        }
+        void* pc[stack_frames + skip_frames];
+        int n = backtrace_safe(pc, (contended ? stack_frames : site_frames) + skip_frames);
+        unsigned depth = std::max(n - int(skip_frames), 0);
+        auto frames = pc + skip_frames;
+
+        unsigned sdepth = std::min(depth, site_frames);
+        auto s = lookup(sites, max_sites, hash(frames, sdepth, unsigned(k)),
+                [&] (site& e) {
+            e.k = k;
+            e.depth = sdepth;
+            std::copy(frames, frames + sdepth, e.pc);
+        });
+        if (!s) {
+            return;
+        }
+        if (contended) {
+            s->contended.fetch_add(1, std::memory_order_relaxed);
+            s->wait_ns.fetch_add(wait_ns, std::memory_order_relaxed);
+            auto st = lookup(stacks, max_stacks,
+                    hash(frames, depth, reinterpret_cast<uintptr_t>(s)),
+                    [&] (stack& e) {
+                e.s = s;
+                e.depth = depth;
+                std::copy(frames, frames + depth, e.pc);
+            });
+            if (st) {
+                st->contended.fetch_add(1, std::memory_order_relaxed);
+                st->wait_ns.fetch_add(wait_ns, std::memory_order_relaxed);
+            }
+        }
+
+        if (held_generation != generation) {
+            held_generation = generation;
+            nheld = 0;
+        }
+        if (nheld < max_held) {
+            held_locks[nheld++] = held{lock, s, now_ns()};
+        }
+    }
+}
+
+void released(const void* lock)
+{
+    irq_save_lock_type irq_lock;
+    WITH_LOCK(irq_lock) {
+        if (!enabled || held_generation != generation) {
+            return;
+        }
+        // Locks need not be released in the order they were taken
+        for (unsigned i = nheld; i-- > 0;) {
+            auto& h = held_locks[i];
+            if (h.lock != lock) {
+                continue;
+            }
+            auto hold = now_ns() - h.since;
+            auto max = h.s->max_hold_ns.load(std::memory_order_relaxed);
+            while (hold > max && !h.s->max_hold_ns.compare_exchange_weak(max, hold,
+                    std::memory_order_relaxed)) {
+            }
+            std::copy(held_locks + i + 1, held_locks + nheld, held_locks + i);
+            --nheld;
+            return;
+        }
+    }
+}
+
+// Functions implementing or wrapping the locks, which are skipped to find
+// the code which called into the lock
+static const char* lock_functions[] = {
+    "lockfree::mutex::",
+    "lockfree_mutex_",
+    "mtx_lock",
+    "sx_",
+    "rwlock::",
+    "rwlock_for_",
+    "rw_rlock",
+    "rw_wlock",
+    "rw_try_",
+    "spin_lock",
+    "spin_trylock",
+    "spinlock::",
+    "std::lock_guard<",
+    "std::unique_lock<",
+    "lock_guard_for_with_lock<",
+    "pthread_mutex_",
+    "pthread_rwlock_",
+    "pthread_spin_",
+};
+
+static std::string symbol(void* pc)
+{
+    char name[1024];
+    osv::lookup_name_demangled(pc, name, sizeof(name));
+    return name;
+}
+
+static bool is_lock_function(const std::string& name)
+{
+    for (auto f : lock_functions) {
+        if (!name.compare(0, strlen(f), f)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char* kind_name(kind k)
+{
+    switch (k) {
+    case kind::mutex: return "mutex";
+    case kind::rwlock_read: return "rwlock-read";
+    case kind::rwlock_write: return "rwlock-write";
+    case kind::spinlock: return "spinlock";
+    }
+    return "?";
+}
+
+}
+
+void start_lock_profiler()
+{
+    WITH_LOCK(lock::control_lock) {
+        if (lock::enabled) {
+            lock::enabled = false;
+            osv::rcu_synchronize();
+        }
+        // No acquired() or released() is running now, so the tables can
+        // be reset
+        if (!lock::sites) {
+            lock::sites = new lock::site[lock::max_sites]();
+            lock::stacks = new lock::stack[lock::max_stacks]();
+        } else {
+            for (size_t i = 0; i < lock::max_sites; i++) {
+                auto& e = lock::sites[i];
+                e.key.store(0, std::memory_order_relaxed);
+                e.ready.store(false, std::memory_order_relaxed);
+                e.contended.store(0, std::memory_order_relaxed);
+                e.wait_ns.store(0, std::memory_order_relaxed);
+                e.max_hold_ns.store(0, std::memory_order_relaxed);
+            }
+            for (size_t i = 0; i < lock::max_stacks; i++) {
+                auto& e = lock::stacks[i];
+                e.key.store(0, std::memory_order_relaxed);
+                e.ready.store(false, std::memory_order_relaxed);
+                e.contended.store(0, std::memory_order_relaxed);
+                e.wait_ns.store(0, std::memory_order_relaxed);
+            }
+        }
+        ++lock::generation;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        lock::enabled = true;
+    }
+}
+
+void stop_lock_profiler()
+{
+    WITH_LOCK(lock::control_lock) {
+        if (lock::enabled) {
+            lock::enabled = false;
+            osv::rcu_synchronize();
+        }
+    }
+}
+
+bool lock_profiler_enabled()
+{
+    return lock::enabled;
+}
+
+std::vector<lock_class_stats> lock_profile()
+{
+    std::vector<lock_class_stats> ret;
+    if (!lock::sites) {
+        return ret;
+    }
+    // Sites reaching the same caller through different wrappers make up
+    // one class
+    std::map<std::pair<lock::kind, void*>, size_t> classes;
+    std::map<lock::site*, size_t> class_of;
+    for (size_t i = 0; i < lock::max_sites; i++) {
+        auto& s = lock::sites[i];
+        if (!s.ready.load(std::memory_order_acquire) ||
+                !s.contended.load(std::memory_order_relaxed)) {
+            continue;
+        }
+        void* caller = s.depth ? s.pc[s.depth - 1] : nullptr;
+        std::string name = "???";
+        for (unsigned j = 0; j < s.depth; j++) {
+            auto n = lock::symbol(s.pc[j]);
+            if (!lock::is_lock_function(n)) {
+                caller = s.pc[j];
+                name = n;
+                break;
+            }
+        }
+        auto it = classes.find({s.k, caller});
+        if (it == classes.end()) {
+            it = classes.emplace(std::make_pair(s.k, caller), ret.size()).first;
+            ret.push_back(lock_class_stats{lock::kind_name(s.k), name, 0, 0, 0, {}});
+        }
+        auto& c = ret[it->second];
+        c.contended += s.contended.load(std::memory_order_relaxed);
+        c.wait_ns += s.wait_ns.load(std::memory_order_relaxed);
+        c.max_hold_ns = std::max(c.max_hold_ns,
+                uint64_t(s.max_hold_ns.load(std::memory_order_relaxed)));
+        class_of[&s] = it->second;
+    }
+
+    std::vector<std::vector<lock::stack*>> stacks(ret.size());
+    for (size_t i = 0; i < lock::max_stacks; i++) {
+        auto& st = lock::stacks[i];
+        if (!st.ready.load(std::memory_order_acquire)) {
+            continue;
+        }
+        auto it = class_of.find(st.s);
+        if (it != class_of.end()) {
+            stacks[it->second].push_back(&st);
+        }
+    }
+    for (size_t i = 0; i < ret.size(); i++) {
+        auto& v = stacks[i];
+        auto by_wait = [] (lock::stack* a, lock::stack* b) {
+            return a->wait_ns.load(std::memory_order_relaxed) >
+                   b->wait_ns.load(std::memory_order_relaxed);
+        };
+        auto top = std::min(v.size(), size_t(lock::top_stacks));
+        std::partial_sort(v.begin(), v.begin() + top, v.end(), by_wait);
+        for (size_t j = 0; j < top; j++) {
+            lock_stack_stats s{v[j]->contended.load(std::memory_order_relaxed),
+                               v[j]->wait_ns.load(std::memory_order_relaxed), {}};
+            for (unsigned k = 0; k < v[j]->depth; k++) {
+                s.frames.push_back(lock::symbol(v[j]->pc[k]));
+            }
+            ret[i].stacks.push_back(std::move(s));
+        }
+    }
+
+    std::sort(ret.begin(), ret.end(), [] (const lock_class_stats& a, const lock_class_stats& b) {
+        return a.wait_ns > b.wait_ns;
+    });
+    return ret;
+}
+
+void dump_lock_profile(std::ostream& os)
+{
+    osv::fprintf(os, "lock profiler %s\n", lock_profiler_enabled() ? "running" : "stopped");
+    osv::fprintf(os, "%-12s %12s %16s %16s  %s\n",
+                 "kind", "contended", "wait_ns", "max_hold_ns", "site");
+    for (auto& c : lock_profile()) {
+        osv::fprintf(os, "%-12s %12lu %16lu %16lu  %s\n",
+                     c.kind, c.contended, c.wait_ns, c.max_hold_ns, c.site);
+        for (auto& s : c.stacks) {
+            osv::fprintf(os, "    %lu contended, %lu ns:\n", s.contended, s.wait_ns);
+            for (auto& f : s.frames) {
+                osv::fprintf(os, "        %s\n", f);
+            }
+        }
+    }
+}
+
+}
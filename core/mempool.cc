@@ -37,6 +37,9 @@
 #include <boost/lockfree/stack.hpp>
 #include <boost/lockfree/policies.hpp>
 #include <osv/migration-lock.hh>
+#include <osv/numa.hh>
+#include <osv/heap-profiler.hh>
+#include <osv/clock.hh>
 
 TRACEPOINT(trace_memory_malloc, "buf=%p, len=%d, align=%d", void *, size_t,
            size_t);
@@ -165,12 +168,15 @@ static void garbage_collector_fn()
 // allocator was used for allocation and, therefore, which one should be used
 // to free the memory block.
 //
-// Small objects (< page size / 4) are stored in pages.  The beginning of the
+// Small objects (<= 1792 bytes) are stored in pages.  The beginning of the
 // page contains a header with a pointer to a pool, consisting of all free
 // objects of that size.  The pool maintains a singly linked list of free
-// objects, and adds or frees pages as needed.
+// objects, and adds or frees pages as needed.  Sizes are rounded up to one
+// of the malloc_pool size classes: 8, multiples of 16 up to 128, and then
+// four classes per power of two, which bounds internal fragmentation to 25%
+// instead of the 50% of pure power-of-two classes.
 //
-// Objects which size is in range (page size / 4, page size] are given a whole
+// Objects which size is in range (1792, page size] are given a whole
 // page from per-CPU page buffer.  Such objects don't need header they are
 // known to be not larger than a single page.  Page buffer is refilled by
 // allocating memory from large allocator.
@@ -196,9 +202,50 @@ pool::~pool()
 {
 }
 
-const size_t pool::max_object_size = page_size / 4;
+// Size of malloc_pools[i]
+constexpr size_t malloc_pool_size(unsigned i)
+{
+    return i == 0 ? 8 :
+           i <= 8 ? i * 16 :
+           size_t(5 + (i - 9) % 4) << (5 + (i - 9) / 4);
+}
+
+constexpr unsigned nr_malloc_pools = 24;
+constexpr size_t max_malloc_pool_size = malloc_pool_size(nr_malloc_pools - 1);
+static_assert(max_malloc_pool_size == 1792, "unexpected malloc_pool sizes");
+
+const size_t pool::max_object_size = max_malloc_pool_size;
 const size_t pool::min_object_size = sizeof(free_object);
 
+// Index of the smallest malloc_pool that holds @size bytes
+constexpr unsigned malloc_pool_index(size_t size, unsigned i = 0)
+{
+    return malloc_pool_size(i) >= size ? i : malloc_pool_index(size, i + 1);
+}
+
+// Size to pool lookup table, computed at compile time and indexed by the
+// size in 8 byte units, rounded up.
+template <unsigned... Units>
+struct malloc_pool_table {
+    static constexpr uint8_t index[sizeof...(Units)] = {
+        uint8_t(malloc_pool_index(Units * 8))...
+    };
+};
+
+template <unsigned... Units>
+constexpr uint8_t malloc_pool_table<Units...>::index[sizeof...(Units)];
+
+template <unsigned N, unsigned... Units>
+struct make_malloc_pool_table : make_malloc_pool_table<N - 1, N - 1, Units...> {};
+
+template <unsigned... Units>
+struct make_malloc_pool_table<0, Units...> {
+    typedef malloc_pool_table<Units...> type;
+};
+
+typedef make_malloc_pool_table<max_malloc_pool_size / 8 + 1>::type
+    malloc_pool_lookup;
+
 pool::page_header* pool::to_header(free_object* object)
 {
     return reinterpret_cast<page_header*>(
@@ -229,6 +276,7 @@ void* pool::alloc()
         page_header *header = &(*it);
         free_object* obj = header->local_free;
         ++header->nalloc;
+        ++_free->nalloc;
         header->local_free = obj->next;
         if (!header->local_free) {
             _free->erase(it);
@@ -245,6 +293,16 @@ unsigned pool::get_size()
     return _size;
 }
 
+void pool::get_stats(size_t& objects, size_t& pages)
+{
+    objects = pages = 0;
+    for (auto c : sched::cpus) {
+        auto free = _free.for_cpu(c);
+        objects += free->nalloc;
+        pages += free->npages;
+    }
+}
+
 static inline void* untracked_alloc_page();
 static inline void untracked_free_page(void *v);
 
@@ -266,6 +324,7 @@ void pool::add_page()
             header->local_free = obj;
         }
         _free->push_back(*header);
+        ++_free->npages;
         if (_free->empty()) {
             /* encountered when starting to enable TLS for AArch64 in mixed
                LE / IE tls models */
@@ -285,10 +344,12 @@ void pool::free_same_cpu(free_object* obj, unsigned cpu_id)
     trace_pool_free_same_cpu(this, object);
 
     page_header* header = to_header(obj);
+    --_free->nalloc;
     if (!--header->nalloc && have_full_pages()) {
         if (header->local_free) {
             _free->erase(_free->iterator_to(*header));
         }
+        --_free->npages;
         DROP_LOCK(preempt_lock) {
             untracked_free_page(header);
         }
@@ -346,13 +407,28 @@ pool* pool::from_object(void* object)
 class malloc_pool : public pool {
 public:
     malloc_pool();
-private:
-    static size_t compute_object_size(unsigned pos);
 };
 
-malloc_pool malloc_pools[ilog2_roundup_constexpr(page_size) + 1]
+malloc_pool malloc_pools[nr_malloc_pools]
     __attribute__((init_priority((int)init_prio::malloc_pools)));
 
+// Objects are laid out from the end of the page, so each one is aligned to
+// the largest power of two dividing its pool's size.  When that is not
+// enough fall back to a power-of-two pool; returns nullptr if there is none.
+static inline malloc_pool* malloc_pool_for(size_t size, size_t alignment)
+{
+    unsigned n = malloc_pool_lookup::index[(size + 7) / 8];
+    auto pool_size = malloc_pool_size(n);
+    if (alignment > (pool_size & -pool_size)) {
+        size = size_t(1) << ilog2_roundup(std::max(size, alignment));
+        if (size > max_malloc_pool_size) {
+            return nullptr;
+        }
+        n = malloc_pool_lookup::index[size / 8];
+    }
+    return &malloc_pools[n];
+}
+
 struct mark_smp_allocator_intialized {
     mark_smp_allocator_intialized() {
         // FIXME: Handle CPU hot-plugging.
@@ -377,19 +453,10 @@ struct mark_smp_allocator_intialized {
 } s_mark_smp_alllocator_initialized __attribute__((init_priority((int)init_prio::malloc_pools)));
 
 malloc_pool::malloc_pool()
-    : pool(compute_object_size(this - malloc_pools))
+    : pool(malloc_pool_size(this - malloc_pools))
 {
 }
 
-size_t malloc_pool::compute_object_size(unsigned pos)
-{
-    size_t size = 1 << pos;
-    if (size > max_object_size) {
-        size = max_object_size;
-    }
-    return size;
-}
-
 page_range::page_range(size_t _size)
     : size(_size)
 {
@@ -435,18 +502,48 @@ void wake_reclaimer()
     reclaimer_thread.wake();
 }
 
+// Allocations which had to wait for memory, and how long they waited
+static std::atomic<size_t> stall_count(0);
+static std::atomic<u64> stall_time_ns(0);
+
+static pressure pressure_of(size_t free)
+{
+    if (free < min_emergency_pool_size) {
+        return pressure::EMERGENCY;
+    } else if (free < watermark_lo) {
+        return pressure::PRESSURE;
+    } else if (free < 2 * watermark_lo) {
+        return pressure::NORMAL;
+    }
+    return pressure::RELAXED;
+}
+
+const char* pressure_name(pressure p)
+{
+    switch (p) {
+    case pressure::RELAXED: return "relaxed";
+    case pressure::NORMAL: return "normal";
+    case pressure::PRESSURE: return "pressure";
+    case pressure::EMERGENCY: return "emergency";
+    }
+    return "unknown";
+}
+
 static void on_free(size_t mem)
 {
     free_memory.fetch_add(mem);
+    reclaimer_thread.update_pressure(pressure_of(stats::free() + stats::jvm_heap()));
 }
 
 static void on_alloc(size_t mem)
 {
     free_memory.fetch_sub(mem);
     jvm_balloon_adjust_memory(min_emergency_pool_size);
-    if ((stats::free() + stats::jvm_heap()) < watermark_lo) {
+    auto available = stats::free() + stats::jvm_heap();
+    if (available < watermark_lo) {
         reclaimer_thread.wake();
     }
+    reclaimer_thread.update_pressure(pressure_of(available));
 }
 
 static void on_new_memory(size_t mem)
@@ -475,6 +572,36 @@ namespace stats {
         current_jvm_heap_memory.fetch_sub(mem);
     }
     size_t jvm_heap() { return current_jvm_heap_memory.load(); }
+
+    std::vector<shrinker_stats> shrinkers()
+    {
+        std::vector<shrinker_stats> ret;
+        reclaimer_thread.for_each_shrinker([&] (shrinker& s) {
+            ret.push_back({s.name(), s.enabled(), s.invocations(), s.freed(), s.time_ns()});
+        });
+        return ret;
+    }
+
+    pressure_stats memory_pressure()
+    {
+        pressure_stats ret;
+        ret.level = reclaimer_thread.current_pressure();
+        ret.stalls = stall_count.load(std::memory_order_relaxed);
+        ret.stall_ns = stall_time_ns.load(std::memory_order_relaxed);
+        return ret;
+    }
+
+    std::vector<malloc_pool_stats> malloc_pools()
+    {
+        std::vector<malloc_pool_stats> ret;
+        for (auto& mp : memory::malloc_pools) {
+            malloc_pool_stats s;
+            s.object_size = mp.get_size();
+            mp.get_stats(s.objects, s.pages);
+            ret.push_back(s);
+        }
+        return ret;
+    }
 }
 
 void reclaimer::wake()
@@ -485,16 +612,16 @@ void reclaimer::wake()
 pressure reclaimer::pressure_level()
 {
     assert(mutex_owned(&free_page_ranges_lock));
-    if (stats::free() < watermark_lo) {
-        return pressure::PRESSURE;
+    if (_oom_blocked.has_waiters()) {
+        return pressure::EMERGENCY;
     }
-    return pressure::NORMAL;
+    return pressure_of(stats::free());
 }
 
 ssize_t reclaimer::bytes_until_normal(pressure curr)
 {
     assert(mutex_owned(&free_page_ranges_lock));
-    if (curr == pressure::PRESSURE) {
+    if (curr >= pressure::PRESSURE && stats::free() < watermark_lo) {
         return watermark_lo - stats::free();
     } else {
         return 0;
@@ -539,70 +666,103 @@ public:
 
     page_range_allocator() : _deferred_free(nullptr) { }
 
+    // Free ranges are kept per NUMA node, a range never spans two nodes.
+    // alloc() and alloc_aligned() only look at the given node; falling back
+    // to other nodes is up to the caller.
     template<bool UseBitmap = true>
-    page_range* alloc(size_t size);
+    page_range* alloc(size_t size, unsigned node = 0);
     page_range* alloc_aligned(size_t size, size_t offset, size_t alignment,
-                              bool fill = false);
+                              bool fill = false, unsigned node = 0);
     void free(page_range* pr);
 
     void initial_add(page_range* pr);
+    // Splits the free ranges at node boundaries once the topology is known
+    void redistribute();
 
     template<typename Func>
-    void for_each(unsigned min_order, Func f);
+    void for_each(unsigned node, unsigned min_order, Func f);
     template<typename Func>
     void for_each(Func f) {
-        for_each<Func>(0, f);
+        for (unsigned node = 0; node < numa::nr_nodes(); node++) {
+            bool more = true;
+            for_each(node, 0, [&] (page_range& pr) { return more = f(pr); });
+            if (!more) {
+                return;
+            }
+        }
     }
 
+    bool empty(unsigned node) const {
+        return _nodes[node].not_empty.none();
+    }
     bool empty() const {
-        return _not_empty.none();
+        for (unsigned node = 0; node < numa::nr_nodes(); node++) {
+            if (!empty(node)) {
+                return false;
+            }
+        }
+        return true;
     }
     size_t size() const {
-        size_t size = _free_huge.size();
-        for (auto&& list : _free) {
-            size += list.size();
+        size_t size = 0;
+        for (unsigned node = 0; node < numa::nr_nodes(); node++) {
+            size += _nodes[node].free_huge.size();
+            for (auto&& list : _nodes[node].free) {
+                size += list.size();
+            }
         }
         return size;
     }
 
 private:
+    struct node_lists;
+
+    node_lists& lists_of(page_range& pr) {
+        return _nodes[numa::addr_node(&pr)];
+    }
+
     template<bool UseBitmap = true>
     void insert(page_range& pr) {
         auto addr = static_cast<void*>(&pr);
         auto pr_end = static_cast<page_range**>(addr + pr.size - sizeof(page_range**));
         *pr_end = &pr;
+        auto& n = lists_of(pr);
         auto order = ilog2(pr.size / page_size);
         if (order >= max_order) {
-            _free_huge.insert(pr);
-            _not_empty[max_order] = true;
+            n.free_huge.insert(pr);
+            n.not_empty[max_order] = true;
         } else {
-            _free[order].push_front(pr);
-            _not_empty[order] = true;
+            n.free[order].push_front(pr);
+            n.not_empty[order] = true;
         }
         if (UseBitmap) {
             set_bits(pr, true);
         }
     }
-    void remove_huge(page_range& pr) {
-        _free_huge.erase(_free_huge.iterator_to(pr));
-        if (_free_huge.empty()) {
-            _not_empty[max_order] = false;
+    void remove_huge(node_lists& n, page_range& pr) {
+        n.free_huge.erase(n.free_huge.iterator_to(pr));
+        if (n.free_huge.empty()) {
+            n.not_empty[max_order] = false;
         }
     }
-    void remove_list(unsigned order, page_range& pr) {
-        _free[order].erase(_free[order].iterator_to(pr));
-        if (_free[order].empty()) {
-            _not_empty[order] = false;
+    void remove_list(node_lists& n, unsigned order, page_range& pr) {
+        n.free[order].erase(n.free[order].iterator_to(pr));
+        if (n.free[order].empty()) {
+            n.not_empty[order] = false;
         }
     }
     void remove(page_range& pr) {
+        auto& n = lists_of(pr);
         auto order = ilog2(pr.size / page_size);
         if (order >= max_order) {
-            remove_huge(pr);
+            remove_huge(n, pr);
         } else {
-            remove_list(order, pr);
+            remove_list(n, order, pr);
         }
     }
+    bool same_node(page_range& a, page_range& b) const {
+        return numa::nr_nodes() == 1 || numa::addr_node(&a) == numa::addr_node(&b);
+    }
 
     unsigned get_bitmap_idx(page_range& pr) const {
         auto idx = reinterpret_cast<uintptr_t>(&pr);
@@ -621,18 +781,21 @@ private:
         }
     }
 
-    bi::multiset<page_range,
+    struct node_lists {
+        bi::multiset<page_range,
+                     bi::member_hook<page_range,
+                                     bi::set_member_hook<>,
+                                     &page_range::set_hook>,
+                     bi::constant_time_size<false>> free_huge;
+        bi::list<page_range,
                  bi::member_hook<page_range,
-                                 bi::set_member_hook<>,
-                                 &page_range::set_hook>,
-                 bi::constant_time_size<false>> _free_huge;
-    bi::list<page_range,
-             bi::member_hook<page_range,
-                             bi::list_member_hook<>,
-                             &page_range::list_hook>,
-             bi::constant_time_size<false>> _free[max_order];
+                                 bi::list_member_hook<>,
+                                 &page_range::list_hook>,
+                 bi::constant_time_size<false>> free[max_order];
 
-    std::bitset<max_order + 1> _not_empty;
+        std::bitset<max_order + 1> not_empty;
+    };
+    node_lists _nodes[numa::max_nodes];
 
     template<typename T>
     class bitmap_allocator {
@@ -672,13 +835,14 @@ void page_range_allocator::bitmap_allocator<T>::deallocate(T* p, size_t n)
 }
 
 template<bool UseBitmap>
-page_range* page_range_allocator::alloc(size_t size)
+page_range* page_range_allocator::alloc(size_t size, unsigned node)
 {
+    auto& n = _nodes[node];
     auto exact_order = ilog2_roundup(size / page_size);
     if (exact_order > max_order) {
         exact_order = max_order;
     }
-    auto bitset = _not_empty.to_ulong();
+    auto bitset = n.not_empty.to_ulong();
     if (exact_order) {
         bitset &= ~((1 << exact_order) - 1);
     }
@@ -686,14 +850,14 @@ page_range* page_range_allocator::alloc(size_t size)
 
     page_range* range = nullptr;
     if (!bitset) {
-        if (!exact_order || _free[exact_order - 1].empty()) {
+        if (!exact_order || n.free[exact_order - 1].empty()) {
             return nullptr;
         }
         // TODO: This linear search makes worst case complexity of the allocator
         // O(n). It would be better to fall back to non-contiguous allocation
         // and make worst case complexity depend on the size of requested memory
         // block and the logarithm of the number of free huge page ranges.
-        for (auto&& pr : _free[exact_order - 1]) {
+        for (auto&& pr : n.free[exact_order - 1]) {
             if (pr.size >= size) {
                 range = &pr;
                 break;
@@ -701,14 +865,14 @@ page_range* page_range_allocator::alloc(size_t size)
         }
         return nullptr;
     } else if (order == max_order) {
-        range = &*_free_huge.rbegin();
+        range = &*n.free_huge.rbegin();
         if (range->size < size) {
             return nullptr;
         }
-        remove_huge(*range);
+        remove_huge(n, *range);
     } else {
-        range = &_free[order].front();
-        remove_list(order, *range);
+        range = &n.free[order].front();
+        remove_list(n, order, *range);
     }
 
     auto& pr = *range;
@@ -725,10 +889,11 @@ page_range* page_range_allocator::alloc(size_t size)
 }
 
 page_range* page_range_allocator::alloc_aligned(size_t size, size_t offset,
-                                                size_t alignment, bool fill)
+                                                size_t alignment, bool fill,
+                                                unsigned node)
 {
     page_range* ret_header = nullptr;
-    for_each(std::max(ilog2(size / page_size), 1u) - 1, [&] (page_range& header) {
+    for_each(node, std::max(ilog2(size / page_size), 1u) - 1, [&] (page_range& header) {
         char* v = reinterpret_cast<char*>(&header);
         auto expected_ret = v + header.size - size + offset;
         auto alignment_shift = expected_ret - align_down(expected_ret, alignment);
@@ -758,14 +923,18 @@ void page_range_allocator::free(page_range* pr)
 {
     if (_bitmap[get_bitmap_idx(*pr) - 1]) {
         auto pr2 = *(reinterpret_cast<page_range**>(pr) - 1);
-        remove(*pr2);
-        pr2->size += pr->size;
-        pr = pr2;
+        if (same_node(*pr, *pr2)) {
+            remove(*pr2);
+            pr2->size += pr->size;
+            pr = pr2;
+        }
     }
     if (_bitmap[get_bitmap_idx(*pr) + pr->size / page_size]) {
         auto pr2 = static_cast<page_range*>(static_cast<void*>(pr) + pr->size);
-        remove(*pr2);
-        pr->size += pr2->size;
+        if (same_node(*pr, *pr2)) {
+            remove(*pr2);
+            pr->size += pr2->size;
+        }
     }
     insert(*pr);
 }
@@ -795,16 +964,59 @@ void page_range_allocator::initial_add(page_range* pr)
     }
 }
 
+void page_range_allocator::redistribute()
+{
+    if (numa::nr_nodes() == 1) {
+        return;
+    }
+    // Before the topology was known everything went to node 0.  Take the
+    // ranges off its lists (without allocating memory) and insert them again
+    // piece by piece.
+    node_lists old;
+    auto& n = _nodes[0];
+    old.free_huge.swap(n.free_huge);
+    for (unsigned order = 0; order < max_order; order++) {
+        old.free[order].swap(n.free[order]);
+    }
+    n.not_empty.reset();
+    auto split = [this] (page_range* pr) {
+        auto start = reinterpret_cast<char*>(pr);
+        auto end = start + pr->size;
+        while (start < end) {
+            uint64_t node_end;
+            auto pa = reinterpret_cast<uintptr_t>(start) & (mmu::mem_area_size - 1);
+            numa::phys_node(pa, &node_end);
+            auto piece = std::min<uint64_t>(end - start, node_end - pa);
+            piece = std::max<uint64_t>(align_down(piece, page_size), page_size);
+            insert(*new (start) page_range(piece));
+            start += piece;
+        }
+    };
+    while (!old.free_huge.empty()) {
+        auto& pr = *old.free_huge.begin();
+        old.free_huge.erase(old.free_huge.begin());
+        split(&pr);
+    }
+    for (auto&& list : old.free) {
+        while (!list.empty()) {
+            auto& pr = list.front();
+            list.pop_front();
+            split(&pr);
+        }
+    }
+}
+
 template<typename Func>
-void page_range_allocator::for_each(unsigned min_order, Func f)
+void page_range_allocator::for_each(unsigned node, unsigned min_order, Func f)
 {
-    for (auto& pr : _free_huge) {
+    auto& n = _nodes[node];
+    for (auto& pr : n.free_huge) {
         if (!f(pr)) {
             return;
         }
     }
     for (auto order = max_order; order-- > min_order;) {
-        for (auto& pr : _free[order]) {
+        for (auto& pr : n.free[order]) {
             if (!f(pr)) {
                 return;
             }
@@ -812,6 +1024,371 @@ void page_range_allocator::for_each(unsigned min_order, Func f)
     }
 }
 
+// Huge page arena
+//
+// The linear map covers physical memory with 2MB pages, but free_page_ranges
+// hands out single pages and small ranges from wherever they happen to be,
+// so a large heap ends up spread thinly over many huge TLB entries.  When
+// enabled (--huge-arena), the page pools and malloc_large() carve pages out
+// of 2MB aligned chunks instead, filling one chunk before moving to the next.
+// The first page of every chunk holds its header.  A chunk that becomes
+// empty is given back to free_page_ranges, unless it is the last one of its
+// NUMA node.
+//
+// Pages in the arena are accounted as free until they are allocated from
+// it.  Everything is protected by free_page_ranges_lock.
+namespace huge_arena {
+
+constexpr size_t chunk_size = mmu::huge_page_size;
+constexpr unsigned pages_per_chunk = chunk_size / page_size;
+// larger ranges are left to free_page_ranges
+constexpr size_t max_size = 64 * page_size;
+// chunks are only taken from the first 1TB of physical memory
+constexpr size_t max_chunks = (size_t(1) << 40) / chunk_size;
+
+struct chunk {
+    bi::list_member_hook<> link;
+    unsigned nr_free;
+    std::bitset<pages_per_chunk> used;
+};
+
+bool enabled;
+size_t nr_chunks;
+size_t used;
+std::bitset<max_chunks> owned;
+bi::list<chunk,
+         bi::member_hook<chunk, bi::list_member_hook<>, &chunk::link>,
+         bi::constant_time_size<true>> partial[numa::max_nodes];
+
+static size_t chunk_index(void* addr)
+{
+    return (static_cast<char*>(addr) - mmu::phys_mem) / chunk_size;
+}
+
+static bool owns(void* addr)
+{
+    auto idx = chunk_index(addr);
+    return idx < max_chunks && owned[idx];
+}
+
+static chunk* grow(unsigned node)
+{
+    auto pr = free_page_ranges.alloc_aligned(chunk_size, 0, chunk_size, true, node);
+    if (!pr) {
+        return nullptr;
+    }
+    auto idx = chunk_index(pr);
+    if (idx >= max_chunks) {
+        free_page_ranges.free(new (pr) page_range(chunk_size));
+        return nullptr;
+    }
+    on_alloc(page_size);
+    auto c = new (pr) chunk;
+    c->nr_free = pages_per_chunk - 1;
+    c->used[0] = true;
+    owned[idx] = true;
+    ++nr_chunks;
+    partial[node].push_back(*c);
+    return c;
+}
+
+static void release(chunk* c, unsigned node)
+{
+    partial[node].erase(partial[node].iterator_to(*c));
+    owned[chunk_index(c)] = false;
+    --nr_chunks;
+    c->~chunk();
+    on_free(page_size);
+    free_page_ranges.free(new (c) page_range(chunk_size));
+}
+
+// Returns the first page of a run of @n free pages in @c, or 0
+static unsigned find_run(chunk& c, unsigned n)
+{
+    auto avail = ~c.used;
+    unsigned start = avail._Find_first();
+    unsigned run = 0;
+    for (auto i = start; i < pages_per_chunk; i = avail._Find_next(i)) {
+        if (i != start + run) {
+            start = i;
+            run = 0;
+        }
+        if (++run == n) {
+            return start;
+        }
+    }
+    return 0;
+}
+
+static page_range* alloc(size_t size, unsigned node)
+{
+    unsigned n = size / page_size;
+    chunk* c = nullptr;
+    unsigned start = 0;
+    for (auto& pc : partial[node]) {
+        if (pc.nr_free >= n && (start = find_run(pc, n))) {
+            c = &pc;
+            break;
+        }
+    }
+    if (!c) {
+        c = grow(node);
+        if (!c) {
+            return nullptr;
+        }
+        start = 1;
+    }
+    for (auto i = start; i < start + n; i++) {
+        c->used[i] = true;
+    }
+    c->nr_free -= n;
+    if (!c->nr_free) {
+        partial[node].erase(partial[node].iterator_to(*c));
+    }
+    used += size;
+    return new (static_cast<void*>(c) + start * page_size) page_range(size);
+}
+
+static void free(page_range* pr)
+{
+    auto c = static_cast<chunk*>(align_down(static_cast<void*>(pr), chunk_size));
+    auto node = numa::addr_node(c);
+    unsigned n = pr->size / page_size;
+    unsigned start = (reinterpret_cast<char*>(pr) - reinterpret_cast<char*>(c)) / page_size;
+    used -= pr->size;
+    for (auto i = start; i < start + n; i++) {
+        c->used[i] = false;
+    }
+    if (!c->nr_free) {
+        partial[node].push_front(*c);
+    }
+    c->nr_free += n;
+    if (c->nr_free == pages_per_chunk - 1 && partial[node].size() > 1) {
+        release(c, node);
+    }
+}
+
+}
+
+// Called with free_page_ranges_lock held.  Tries the nodes in @allowed,
+// nearest to @node first.
+static page_range* alloc_page_range_locked(size_t size, unsigned node,
+                                           numa::nodemask allowed = numa::all_nodes)
+{
+    auto order = numa::fallback_order(node);
+    for (unsigned i = 0; i < numa::nr_nodes(); i++) {
+        auto n = order[i];
+        if (!(allowed & (1UL << n))) {
+            continue;
+        }
+        if (huge_arena::enabled && size <= huge_arena::max_size) {
+            auto pr = huge_arena::alloc(size, n);
+            if (pr) {
+                return pr;
+            }
+        }
+        auto pr = free_page_ranges.alloc(size, n);
+        if (pr) {
+            return pr;
+        }
+    }
+    return nullptr;
+}
+
+// As above, on the node chosen by the memory policy of the current thread
+static page_range* alloc_page_range_locked(size_t size)
+{
+    unsigned node;
+    numa::nodemask allowed;
+    numa::policy_target(node, allowed);
+    return alloc_page_range_locked(size, node, allowed);
+}
+
+static page_range* alloc_aligned_page_range_locked(size_t size, size_t offset,
+                                                   size_t alignment, bool fill = false)
+{
+    unsigned node;
+    numa::nodemask allowed;
+    numa::policy_target(node, allowed);
+    auto order = numa::fallback_order(node);
+    for (unsigned i = 0; i < numa::nr_nodes(); i++) {
+        auto n = order[i];
+        if (allowed & (1UL << n)) {
+            auto pr = free_page_ranges.alloc_aligned(size, offset, alignment, fill, n);
+            if (pr) {
+                return pr;
+            }
+        }
+    }
+    return nullptr;
+}
+
+void enable_huge_arena()
+{
+    WITH_LOCK(free_page_ranges_lock) {
+        huge_arena::enabled = true;
+    }
+}
+
+stats::huge_arena_stats stats::huge_arena()
+{
+    huge_arena_stats ret;
+    WITH_LOCK(free_page_ranges_lock) {
+        ret.enabled = huge_arena::enabled;
+        ret.chunks = huge_arena::nr_chunks;
+        ret.used = huge_arena::used;
+    }
+    return ret;
+}
+
+static void free_page_range_locked(page_range *range);
+
+// Per-cpu magazines of recently freed multi-page ranges
+//
+// Large objects of up to max_pages pages (including the header) are freed
+// into a magazine of ranges of exactly that size on the current cpu, and
+// allocated from it, without taking free_page_ranges_lock.  An empty
+// magazine is refilled with a batch of ranges taken under one acquisition of
+// the lock, and a full one gives half of its ranges back the same way, much
+// like the l1 and l2 page pools do for single pages.  Cached ranges are
+// accounted as allocated, and are returned by the shrinker under pressure.
+namespace large_cache {
+
+constexpr size_t min_pages = 2;
+// 64K buffers and their header
+constexpr size_t max_pages = 17;
+constexpr unsigned magazine_size = 8;
+constexpr unsigned batch = magazine_size / 2;
+// upper bound of the memory cached by each cpu
+constexpr size_t max_cached_pages = 256;
+
+struct magazine {
+    unsigned nr = 0;
+    page_range* ranges[magazine_size];
+};
+
+struct cpu_cache {
+    // Only contended by migrated threads and the shrinker
+    mutex lock;
+    size_t pages = 0;
+    magazine mags[max_pages - min_pages + 1];
+};
+
+dynamic_percpu<cpu_cache> caches
+    __attribute__((init_priority((int)init_prio::malloc_pools)));
+
+static inline bool cacheable(size_t size)
+{
+    auto pages = size / page_size;
+    return smp_allocator && pages >= min_pages && pages <= max_pages;
+}
+
+static void free_batch(page_range** ranges, unsigned nr)
+{
+    WITH_LOCK(free_page_ranges_lock) {
+        for (unsigned i = 0; i < nr; i++) {
+            free_page_range_locked(ranges[i]);
+        }
+    }
+}
+
+static page_range* alloc(size_t size)
+{
+    auto pages = size / page_size;
+    auto& c = *caches;
+    auto& mag = c.mags[pages - min_pages];
+    WITH_LOCK(c.lock) {
+        if (mag.nr) {
+            c.pages -= pages;
+            return mag.ranges[--mag.nr];
+        }
+    }
+
+    page_range* ranges[batch];
+    unsigned nr = 0;
+    WITH_LOCK(free_page_ranges_lock) {
+        reclaimer_thread.wait_for_minimum_memory();
+        while (nr < batch) {
+            auto pr = alloc_page_range_locked(size);
+            if (!pr) {
+                break;
+            }
+            on_alloc(size);
+            ranges[nr++] = pr;
+        }
+    }
+    if (!nr) {
+        return nullptr;
+    }
+    // We may have migrated or raced with another refill meanwhile, so
+    // only keep what still fits.
+    unsigned kept = 1;
+    WITH_LOCK(c.lock) {
+        while (kept < nr && mag.nr < magazine_size &&
+               c.pages + pages <= max_cached_pages) {
+            mag.ranges[mag.nr++] = ranges[kept++];
+            c.pages += pages;
+        }
+    }
+    free_batch(ranges + kept, nr - kept);
+    return ranges[0];
+}
+
+static void free(page_range* pr)
+{
+    auto pages = pr->size / page_size;
+    auto& c = *caches;
+    auto& mag = c.mags[pages - min_pages];
+    page_range* ranges[batch + 1];
+    unsigned nr = 0;
+    WITH_LOCK(c.lock) {
+        if (mag.nr < magazine_size && c.pages + pages <= max_cached_pages) {
+            mag.ranges[mag.nr++] = pr;
+            c.pages += pages;
+            return;
+        }
+        while (nr < batch && mag.nr) {
+            ranges[nr++] = mag.ranges[--mag.nr];
+            c.pages -= pages;
+        }
+    }
+    ranges[nr++] = pr;
+    free_batch(ranges, nr);
+}
+
+class cache_shrinker : public shrinker {
+public:
+    cache_shrinker() : shrinker("large_cache") {}
+    virtual size_t request_memory(size_t n, bool hard) override;
+};
+
+size_t cache_shrinker::request_memory(size_t n, bool hard)
+{
+    size_t freed = 0;
+    for (auto cpu : sched::cpus) {
+        auto& c = *caches.for_cpu(cpu);
+        page_range* ranges[magazine_size];
+        for (size_t i = 0; i < max_pages - min_pages + 1; i++) {
+            auto& mag = c.mags[i];
+            unsigned nr;
+            WITH_LOCK(c.lock) {
+                nr = mag.nr;
+                std::copy(mag.ranges, mag.ranges + nr, ranges);
+                mag.nr = 0;
+                c.pages -= nr * (i + min_pages);
+            }
+            free_batch(ranges, nr);
+            freed += nr * (i + min_pages) * page_size;
+        }
+    }
+    return freed;
+}
+
+cache_shrinker cache_reclaimer
+    __attribute__((init_priority((int)init_prio::malloc_pools)));
+
+}
+
 static void* malloc_large(size_t size, size_t alignment, bool block = true)
 {
     auto requested_size = size;
@@ -824,14 +1401,25 @@ static void* malloc_large(size_t size, size_t alignment, bool block = true)
     size += offset;
     size = align_up(size, page_size);
 
+    if (alignment <= page_size && !numa::active_policy() &&
+        large_cache::cacheable(size)) {
+        auto ret_header = large_cache::alloc(size);
+        if (ret_header) {
+            void* obj = ret_header;
+            obj += offset;
+            trace_memory_malloc_large(obj, requested_size, size, alignment);
+            return obj;
+        }
+    }
+
     while (true) {
         WITH_LOCK(free_page_ranges_lock) {
             reclaimer_thread.wait_for_minimum_memory();
             page_range* ret_header;
             if (alignment > page_size) {
-                ret_header = free_page_ranges.alloc_aligned(size, page_size, alignment);
+                ret_header = alloc_aligned_page_range_locked(size, page_size, alignment);
             } else {
-                ret_header = free_page_ranges.alloc(size);
+                ret_header = alloc_page_range_locked(size);
             }
             if (ret_header) {
                 on_alloc(size);
@@ -946,14 +1534,77 @@ void reclaimer_waiters::wait(size_t bytes)
     // At this point the reclaimer thread already knows there are waiters,
     // because the _waiters_list was already updated.
     reclaimer_thread.wake();
+    reclaimer_thread.update_pressure(pressure::EMERGENCY);
+    auto start = osv::clock::uptime::now();
     sched::thread::wait_until(&free_page_ranges_lock, [&] { return !wr.owner; });
+    stall_count.fetch_add(1, std::memory_order_relaxed);
+    stall_time_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            osv::clock::uptime::now() - start).count(), std::memory_order_relaxed);
 }
 
 reclaimer::reclaimer()
     : _oom_blocked(), _thread([&] { _do_reclaim(); }, sched::thread::attr().detached().name("reclaimer").stack(mmu::page_size))
+    , _pressure_thread([&] { _notify_pressure(); }, sched::thread::attr().detached().name("mem_pressure"))
 {
     osv_reclaimer_thread = reinterpret_cast<unsigned char *>(&_thread);
     _thread.start();
+    // Catch up with the allocations made so far
+    _pressure_rose.store(true, std::memory_order_relaxed);
+    _pressure_thread.start();
+    _pressure_waker = &_pressure_thread;
+}
+
+void reclaimer::update_pressure(pressure p)
+{
+    auto old = _pressure.load(std::memory_order_relaxed);
+    if (p == old) {
+        return;
+    }
+    old = _pressure.exchange(p, std::memory_order_relaxed);
+    if (p < old) {
+        auto low = _pressure_low.load(std::memory_order_relaxed);
+        while (p < low && !_pressure_low.compare_exchange_weak(low, p, std::memory_order_relaxed)) {
+        }
+    } else if (p > old && _pressure_waker) {
+        _pressure_rose.store(true, std::memory_order_release);
+        _pressure_waker->wake();
+    }
+}
+
+// Listeners are notified when the level rises past theirs, i.e., when it
+// reaches their level having been below it (at the lowest point since the
+// previous notification)
+void reclaimer::_notify_pressure()
+{
+    while (true) {
+        sched::thread::wait_until([&] { return _pressure_rose.load(std::memory_order_acquire); });
+        _pressure_rose.store(false, std::memory_order_relaxed);
+        auto p = _pressure.load(std::memory_order_relaxed);
+        auto low = _pressure_low.exchange(p, std::memory_order_relaxed);
+        WITH_LOCK(_listeners_mutex) {
+            for (auto l : _listeners) {
+                if (l->level() > low && l->level() <= p) {
+                    l->notify(p);
+                }
+            }
+        }
+    }
+}
+
+pressure_listener::pressure_listener(pressure level)
+    : _level(level)
+{
+    WITH_LOCK(reclaimer_thread._listeners_mutex) {
+        reclaimer_thread._listeners.push_back(this);
+    }
+}
+
+pressure_listener::~pressure_listener()
+{
+    WITH_LOCK(reclaimer_thread._listeners_mutex) {
+        auto& l = reclaimer_thread._listeners;
+        l.erase(std::remove(l.begin(), l.end(), this), l.end());
+    }
 }
 
 bool reclaimer::_can_shrink()
@@ -962,7 +1613,7 @@ bool reclaimer::_can_shrink()
     // The active fields are protected by the _shrinkers_mutex lock, but there
     // is no need to take it. Worst that can happen is that we either defer
     // this pass, or take an extra pass without need for it.
-    if (p == pressure::PRESSURE) {
+    if (p >= pressure::PRESSURE) {
         return _active_shrinkers != 0;
     }
     return false;
@@ -982,8 +1633,13 @@ void reclaimer::_shrinker_loop(size_t target, std::function<bool ()> hard)
             // FIXME: If needed, in the future we can introduce another
             // intermediate threshold that will put is into hard mode even
             // before we have waiters.
+            auto start = osv::clock::uptime::now();
             size_t freed = s->request_memory(target, hard());
             trace_memory_reclaim(s->name().c_str(), target, freed);
+            s->_time_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    osv::clock::uptime::now() - start).count();
+            s->_invocations++;
+            s->_freed += freed;
         }
     }
 }
@@ -1033,7 +1689,11 @@ void reclaimer::_do_reclaim()
 static void free_page_range_locked(page_range *range)
 {
     on_free(range->size);
-    free_page_ranges.free(range);
+    if (huge_arena::owns(range)) {
+        huge_arena::free(range);
+    } else {
+        free_page_ranges.free(range);
+    }
 }
 
 // Return a page range back to free_page_ranges. Note how the size of the
@@ -1054,7 +1714,13 @@ static void free_page_range(void *addr, size_t size)
 static void free_large(void* obj)
 {
     obj = align_down(obj - 1, page_size);
-    free_page_range(static_cast<page_range*>(obj));
+    auto pr = static_cast<page_range*>(obj);
+    if (large_cache::cacheable(pr->size) &&
+        numa::addr_node(pr) == numa::current_node()) {
+        large_cache::free(pr);
+    } else {
+        free_page_range(pr);
+    }
 }
 
 static unsigned large_object_size(void *obj)
@@ -1075,9 +1741,13 @@ namespace page_pool {
 //   unfill
 //
 // nr_cpus threads are created to help filling the L1-pool.
+//
+// Pages of other NUMA nodes are not kept in the pool, they are returned to
+// the global free page list when freed.
 struct l1 {
     l1(sched::cpu* cpu)
-        : _fill_thread([] { fill_thread(); },
+        : node(numa::cpu_node(cpu->id))
+        , _fill_thread([] { fill_thread(); },
             sched::thread::attr().pin(cpu).name(osv::sprintf("page_pool_l1_%d", cpu->id)))
     {
         _fill_thread.start();
@@ -1094,6 +1764,10 @@ struct l1 {
 
     static void free_page(void* v)
     {
+        if (numa::addr_node(v) != numa::current_node()) {
+            free_page_range(v, page_size);
+            return;
+        }
         while (!free_page_local(v)) {
             unfill();
         }
@@ -1112,6 +1786,7 @@ struct l1 {
     static constexpr size_t watermark_lo = max * 1 / 4;
     static constexpr size_t watermark_hi = max * 3 / 4;
     size_t nr = 0;
+    const unsigned node;
 
 private:
     sched::thread _fill_thread;
@@ -1138,85 +1813,115 @@ struct page_batch {
 // When L2-pool needs refill or unfill, it moves a batch of pages from or to
 // global free page list.
 //
-// Single thread is created to help filling the L2-pool.
+// There is one L2-pool per NUMA node, sized by the number of cpus of the
+// node, and refilled from its memory first.
+//
+// Single thread is created to help filling the L2-pools.
 class l2 {
 public:
     l2()
-        : _max(sched::cpus.size() * (l1::max / page_batch::nr_pages))
-        , _nr(0)
-        , _watermark_lo(_max * 1 / 4)
-        , _watermark_hi(_max * 3 / 4)
-        , _stack(_max)
-        , _fill_thread([=] { fill_thread(); }, sched::thread::attr().name("page_pool_l2"))
+        : _fill_thread([=] { fill_thread(); }, sched::thread::attr().name("page_pool_l2"))
     {
+        for (unsigned node = 0; node < numa::nr_nodes(); node++) {
+            size_t cpus = 0;
+            for (auto c : sched::cpus) {
+                cpus += numa::cpu_node(c->id) == node;
+            }
+            _pools.emplace_back(new pool(std::max<size_t>(cpus, 1) *
+                                         (l1::max / page_batch::nr_pages)));
+        }
        _fill_thread.start();
     }
 
     page_batch* alloc_page_batch(l1& pbuf)
     {
         page_batch* pb;
-        while (!(pb = try_alloc_page_batch()) &&
+        while (!(pb = try_alloc_page_batch(pbuf.node)) &&
                 // Check again since someone else might change pbuf.nr when we sleep
                 (pbuf.nr + page_batch::nr_pages < pbuf.max / 2)) {
             WITH_LOCK(migration_lock) {
                 DROP_LOCK(preempt_lock) {
-                    refill();
+                    refill(pbuf.node);
                 }
             }
         }
         return pb;
     }
 
-    void free_page_batch(page_batch* pb)
+    void free_page_batch(page_batch* pb, unsigned node)
     {
-        while (!try_free_page_batch(pb)) {
+        while (!try_free_page_batch(pb, node)) {
             WITH_LOCK(migration_lock) {
                 DROP_LOCK(preempt_lock) {
-                    unfill();
+                    unfill(node);
                 }
             }
         }
     }
 
-    page_batch* try_alloc_page_batch()
+    page_batch* try_alloc_page_batch(unsigned node)
     {
-        if (get_nr() < _watermark_lo) {
+        auto& p = *_pools[node];
+        if (p.get_nr() < p.watermark_lo) {
             _fill_thread.wake();
         }
         page_batch* pb;
-        if (!_stack.pop(pb)) {
+        if (!p.stack.pop(pb)) {
             return nullptr;
         }
-        dec_nr();
+        p.dec_nr();
         return pb;
     }
 
-    bool try_free_page_batch(page_batch* pb)
+    bool try_free_page_batch(page_batch* pb, unsigned node)
     {
-        if (get_nr() > _watermark_hi) {
+        auto& p = *_pools[node];
+        if (p.get_nr() > p.watermark_hi) {
             _fill_thread.wake();
         }
-        if (!_stack.push(pb)) {
+        if (!p.stack.push(pb)) {
             return false;
         }
-        inc_nr();
+        p.inc_nr();
         return true;
     }
 
     void fill_thread();
-    void refill();
-    void unfill();
+    void refill(unsigned node);
+    void unfill(unsigned node);
     void free_batch(page_batch& batch);
-    size_t get_nr() { return _nr.load(std::memory_order_relaxed); }
-    void inc_nr() { _nr.fetch_add(1, std::memory_order_relaxed); }
-    void dec_nr() { _nr.fetch_sub(1, std::memory_order_relaxed); }
 
 private:
-    size_t _max;
-    std::atomic<size_t> _nr;
-    size_t _watermark_lo;
-    size_t _watermark_hi;
-    boost::lockfree::stack<page_batch*, boost::lockfree::fixed_sized<true>> _stack;
+    struct pool {
+        explicit pool(size_t max)
+            : max(max)
+            , nr(0)
+            , watermark_lo(max * 1 / 4)
+            , watermark_hi(max * 3 / 4)
+            , stack(max)
+        {
+        }
+        size_t get_nr() { return nr.load(std::memory_order_relaxed); }
+        void inc_nr() { nr.fetch_add(1, std::memory_order_relaxed); }
+        void dec_nr() { nr.fetch_sub(1, std::memory_order_relaxed); }
+
+        size_t max;
+        std::atomic<size_t> nr;
+        size_t watermark_lo;
+        size_t watermark_hi;
+        boost::lockfree::stack<page_batch*, boost::lockfree::fixed_sized<true>> stack;
+    };
+    bool needs_work() {
+        for (auto& p : _pools) {
+            auto nr = p->get_nr();
+            if (nr < p->watermark_lo || nr > p->watermark_hi) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<std::unique_ptr<pool>> _pools;
     sched::thread _fill_thread;
 };
 
@@ -1279,7 +1984,7 @@ void l1::unfill()
         for (size_t i = 0 ; i < page_batch::nr_pages; i++) {
             pb->pages[i] = pbuf.pop();
         }
-        global_l2.free_page_batch(pb);
+        global_l2.free_page_batch(pb, pbuf.node);
     }
 }
 
@@ -1319,24 +2024,25 @@ void l2::fill_thread()
 
     sched::thread::wait_until([] {return smp_allocator;});
     for (;;) {
-        sched::thread::wait_for([=] {
-                auto nr = get_nr();
-                return nr < _watermark_lo || nr > _watermark_hi;
-        });
-        if (get_nr() < _watermark_lo) {
-            refill();
-        }
-        if (get_nr() > _watermark_hi) {
-            unfill();
+        sched::thread::wait_for([=] { return needs_work(); });
+        for (unsigned node = 0; node < _pools.size(); node++) {
+            auto& p = *_pools[node];
+            if (p.get_nr() < p.watermark_lo) {
+                refill(node);
+            }
+            if (p.get_nr() > p.watermark_hi) {
+                unfill(node);
+            }
         }
     }
 }
 
-void l2::refill()
+void l2::refill(unsigned node)
 {
+    auto& p = *_pools[node];
     page_batch batch;
     page_batch* pb;
-    while (get_nr() < _max / 2) {
+    while (p.get_nr() < p.max / 2) {
         WITH_LOCK(free_page_ranges_lock) {
             reclaimer_thread.wait_for_minimum_memory();
             if (free_page_ranges.empty()) {
@@ -1349,7 +2055,7 @@ void l2::refill()
             }
             auto total_size = 0;
             for (size_t i = 0 ; i < page_batch::nr_pages; i++) {
-                batch.pages[i] = free_page_ranges.alloc(page_size);
+                batch.pages[i] = alloc_page_range_locked(page_size, node);
                 total_size += page_size;
             }
             on_alloc(total_size);
@@ -1357,8 +2063,8 @@ void l2::refill()
         // Use the last page to store other page address
         pb = static_cast<page_batch*>(batch.pages[page_batch::nr_pages - 1]);
         *pb = batch;
-        if (_stack.push(pb)) {
-            inc_nr();
+        if (p.stack.push(pb)) {
+            p.inc_nr();
         } else {
             // FIXME: _nr can change within {alloc,free}_page_batch_{fast,slow}
             // _stack might be full at this point, so we need to free the newly
@@ -1368,14 +2074,15 @@ void l2::refill()
     }
 }
 
-void l2::unfill()
+void l2::unfill(unsigned node)
 {
+    auto& p = *_pools[node];
     page_batch batch;
     page_batch* pb;
-    while (get_nr() > _max / 2) {
-        if (_stack.pop(pb)) {
+    while (p.get_nr() > p.max / 2) {
+        if (p.stack.pop(pb)) {
             batch = *pb;
-            dec_nr();
+            p.dec_nr();
             free_batch(batch);
         }
     }
@@ -1399,7 +2106,24 @@ static void* early_alloc_page()
 {
     WITH_LOCK(free_page_ranges_lock) {
         on_alloc(page_size);
-        return static_cast<void*>(free_page_ranges.alloc(page_size));
+        return static_cast<void*>(alloc_page_range_locked(page_size, 0));
+    }
+}
+
+// Pages allocated under a non default memory policy bypass the page pools,
+// which only hold pages of the local node.
+static void* policy_alloc_page()
+{
+    while (true) {
+        WITH_LOCK(free_page_ranges_lock) {
+            reclaimer_thread.wait_for_minimum_memory();
+            auto pr = alloc_page_range_locked(page_size);
+            if (pr) {
+                on_alloc(page_size);
+                return static_cast<void*>(pr);
+            }
+            reclaimer_thread.wait_for_memory(page_size);
+        }
     }
 }
 
@@ -1415,6 +2139,8 @@ static void* untracked_alloc_page()
 
     if (!smp_allocator) {
         ret = early_alloc_page();
+    } else if (numa::active_policy()) {
+        ret = policy_alloc_page();
     } else {
         ret = page_pool::l1::alloc_page();
     }
@@ -1452,7 +2178,7 @@ void free_page(void* v)
 void* alloc_huge_page(size_t N)
 {
     WITH_LOCK(free_page_ranges_lock) {
-        auto pr = free_page_ranges.alloc_aligned(N, 0, N, true);
+        auto pr = alloc_aligned_page_range_locked(N, 0, N, true);
         if (pr) {
             on_alloc(N);
             return static_cast<void*>(pr);
@@ -1509,6 +2235,13 @@ void  __attribute__((constructor(init_prio::mempool))) setup()
     arch_setup_free_memory();
 }
 
+void numa_init()
+{
+    WITH_LOCK(free_page_ranges_lock) {
+        free_page_ranges.redistribute();
+    }
+}
+
 }
 
 extern "C" {
@@ -1522,13 +2255,14 @@ static inline void* std_malloc(size_t size, size_t alignment)
     if ((ssize_t)size < 0)
         return libc_error_ptr<void *>(ENOMEM);
     void *ret;
-    if (size <= memory::pool::max_object_size && alignment <= size && smp_allocator) {
+    memory::malloc_pool* mp;
+    if (size <= memory::pool::max_object_size && alignment <= size && smp_allocator &&
+            (mp = memory::malloc_pool_for(size, alignment))) {
         size = std::max(size, memory::pool::min_object_size);
-        unsigned n = ilog2_roundup(size);
-        ret = memory::malloc_pools[n].alloc();
+        ret = mp->alloc();
         ret = translate_mem_area(mmu::mem_area::main, mmu::mem_area::mempool,
                                  ret);
-        trace_memory_malloc_mempool(ret, size, 1 << n, alignment);
+        trace_memory_malloc_mempool(ret, size, mp->get_size(), alignment);
     } else if (size <= mmu::page_size && alignment <= mmu::page_size) {
         ret = mmu::translate_mem_area(mmu::mem_area::main, mmu::mem_area::page,
                                        memory::alloc_page());
@@ -1537,6 +2271,7 @@ static inline void* std_malloc(size_t size, size_t alignment)
         ret = memory::malloc_large(size, alignment);
     }
     memory::tracker_remember(ret, size);
+    prof::heap::on_alloc(ret, size);
     return ret;
 }
 
@@ -1597,6 +2332,7 @@ void free(void* object)
         return;
     }
     memory::tracker_forget(object);
+    prof::heap::on_free(object);
     switch (mmu::get_mem_area(object)) {
     case mmu::mem_area::page:
         object = mmu::translate_mem_area(mmu::mem_area::page,
@@ -28,6 +28,10 @@
 #include "dump.hh"
 #include <osv/rcu.hh>
 #include <osv/rwlock.h>
+#include <osv/defer.hh>
+#include <osv/condvar.h>
+#include <algorithm>
+#include <deque>
 
 extern void* elf_start;
 extern size_t elf_size;
@@ -74,9 +78,83 @@ vma_list_type vma_list;
 
 // protects vma list and page table modifications.
 // anything that may add, remove, split vma, zaps pte or changes pte permission
-// should hold the lock for write
+// should hold the lock for write, through vma_list_write_lock, and exclude
+// the page faults which do not take it from the vmas it changes (see
+// vma::exclude_faults()).
 rwlock_t vma_list_mutex;
 
+// Copy of the vma list, published for page faults, which look up their vma
+// in it under RCU instead of taking vma_list_mutex.  jvm balloon vmas are
+// left out, so they can be deleted right away, and always fault with the
+// lock held.
+struct published_vma_list {
+    struct entry {
+        uintptr_t start;
+        uintptr_t end;
+        vma* v;
+    };
+    std::vector<entry> vmas;
+    vma* find(uintptr_t addr) const {
+        auto i = std::upper_bound(vmas.begin(), vmas.end(), addr,
+                [] (uintptr_t a, const entry& e) { return a < e.start; });
+        if (i == vmas.begin() || addr >= (--i)->end) {
+            return nullptr;
+        }
+        return i->v;
+    }
+};
+
+static osv::rcu_ptr<published_vma_list> published_vmas;
+// Vmas excluded from faults since the list was last published
+static vma* excluded_vmas;
+
+static void publish_vmas()
+{
+    auto p = new published_vma_list;
+    p->vmas.reserve(vma_list.size());
+    for (auto& v : vma_list) {
+        if (!v.has_flags(mmap_jvm_balloon)) {
+            p->vmas.push_back({v.start(), v.end(), &v});
+        }
+    }
+    auto old = published_vmas.read_by_owner();
+    published_vmas.assign(p);
+    if (old) {
+        osv::rcu_dispose(old);
+    }
+    // Removed vmas are deleted once the faults which may have found them
+    // in the old copy are gone
+    while (auto v = excluded_vmas) {
+        excluded_vmas = v->_next_excluded;
+        if (v->_vma_list_hook.is_linked()) {
+            v->allow_faults();
+        } else {
+            osv::rcu_dispose(v);
+        }
+    }
+}
+
+// vma_list_mutex for write, publishing the vma list when released.  As
+// vma_list_mutex, it is recursive; only the outermost release publishes.
+// Until the scheduler runs (and with it RCU), faults always take the lock.
+class vma_list_write_lock_type {
+public:
+    void lock() {
+        vma_list_mutex.wlock();
+        ++_depth;
+    }
+    void unlock() {
+        if (!--_depth && sched::thread::current()) {
+            publish_vmas();
+        }
+        vma_list_mutex.wunlock();
+    }
+private:
+    unsigned _depth = 0;
+};
+
+static vma_list_write_lock_type vma_list_write_lock;
+
 // A mutex serializing modifications to the high part of the page table
 // (linear map, etc.) which are not part of vma_list.
 mutex page_table_high_mutex;
@@ -211,6 +289,8 @@ struct page_allocator {
     virtual bool map(uintptr_t offset, hw_ptep<1> ptep, pt_element<1> pte, bool write) = 0;
     virtual bool unmap(void *addr, uintptr_t offset, hw_ptep<0> ptep) = 0;
     virtual bool unmap(void *addr, uintptr_t offset, hw_ptep<1> ptep) = 0;
+    // Whether map() can map the page without doing any I/O
+    virtual bool cached(uintptr_t offset) { return false; }
     virtual ~page_allocator() {}
 };
 
@@ -478,6 +558,10 @@ class vma_operation :
 public:
     // returns true if tlb flush is needed after address range processing is completed.
     bool tlb_flush_needed(void) { return false; }
+    // returns true if that flush may be postponed to the end of the enclosing
+    // tlb_batch, i.e., finalize() does not free anything the stale TLB
+    // entries may still point to.
+    bool tlb_flush_deferrable(void) { return false; }
     // this function is called at the very end of operate_range(). vma_operation may do
     // whatever cleanup is needed here.
     void finalize(void) { return; }
@@ -552,6 +636,27 @@ public:
     unsigned nr_page_sizes(void) { return 1; }
 };
 
+/*
+ * populate_cached() populates only the pages the page provider has cached,
+ * so mapping them costs no I/O. Used to map the neighbours of a faulting
+ * page of a file.
+ */
+template <account_opt Account = account_opt::no>
+class populate_cached : public populate_small<Account> {
+private:
+    page_allocator* _page_provider;
+public:
+    populate_cached(page_allocator* pops, unsigned int perm, bool map_dirty = true) :
+        populate_small<Account>(pops, perm, false, map_dirty), _page_provider(pops) { }
+    template<int N>
+    bool page(hw_ptep<N> ptep, uintptr_t offset) {
+        if (!ptep.read().empty() || !_page_provider->cached(offset)) {
+            return true;
+        }
+        return populate_small<Account>::page(ptep, offset);
+    }
+};
+
 class splithugepages : public vma_operation<allocate_intermediate_opt::no, skip_empty_opt::yes, account_opt::no> {
 public:
     splithugepages() { }
@@ -586,6 +691,11 @@ struct tlb_gather {
             return false;
         }
         mmu::flush_tlb_all();
+        free();
+        return true;
+    }
+    // Frees the pages once the TLB was flushed, e.g., by operate_range()
+    void free() {
         for (auto i = 0u; i < nr_pages; ++i) {
             auto&& tp = pages[i];
             if (tp.size == page_size) {
@@ -595,7 +705,6 @@ struct tlb_gather {
             }
         }
         nr_pages = 0;
-        return true;
     }
 };
 
@@ -631,9 +740,11 @@ public:
         ptep.write(make_empty_pte<1>());
     }
     bool tlb_flush_needed(void) {
-        return !_tlb_gather.flush() && do_flush;
+        return _tlb_gather.nr_pages || do_flush;
+    }
+    void finalize(void) {
+        _tlb_gather.free();
     }
-    void finalize(void) {}
 };
 
 class protection : public vma_operation<allocate_intermediate_opt::no, skip_empty_opt::yes> {
@@ -648,6 +759,215 @@ public:
         return true;
     }
     bool tlb_flush_needed(void) {return do_flush;}
+    // Nothing is freed, so the flush may be batched with others
+    bool tlb_flush_deferrable(void) { return true; }
+};
+
+/*
+ * Move the pages which are on nodes not allowed by a memory policy to the
+ * allowed ones.  Called with vma_list_mutex held for write, so the page is
+ * write protected while it is copied and any fault on it waits until the
+ * new page is mapped.  The old pages are freed after the TLB flush.
+ */
+class migration : public vma_operation<allocate_intermediate_opt::no, skip_empty_opt::yes> {
+private:
+    const numa::mempolicy& _policy;
+    tlb_gather _tlb_gather;
+    bool do_flush = false;
+public:
+    migration(const numa::mempolicy& policy) : _policy(policy) { }
+    template<int N>
+    bool page(hw_ptep<N> ptep, uintptr_t offset) {
+        auto pte = ptep.read();
+        if (!pte.valid() || pte_is_cow(pte)) {
+            return true;
+        }
+        void* old = phys_to_virt(pte.addr());
+        if (_policy.nodes & (1ul << numa::addr_node(old))) {
+            return true;
+        }
+        size_t size = pt_level_traits<N>::size::value;
+        void* page;
+        {
+            numa::policy_scope policy(_policy);
+            page = size == page_size ? memory::alloc_page() : memory::alloc_huge_page(size);
+        }
+        if (!page) {
+            return true;
+        }
+        if (pte.writable()) {
+            auto ro = pte;
+            ro.set_writable(false);
+            ptep.write(ro);
+            mmu::flush_tlb_all();
+        }
+        memcpy(page, old, size);
+        pte.set_addr(virt_to_phys(page), pte.large());
+        ptep.write(pte);
+        do_flush = !_tlb_gather.push(old, size);
+        return true;
+    }
+    bool tlb_flush_needed(void) {
+        return _tlb_gather.nr_pages || do_flush;
+    }
+    void finalize(void) {
+        _tlb_gather.free();
+    }
+};
+
+static struct {
+    std::atomic<u64> scanned;
+    std::atomic<u64> collapsed;
+    std::atomic<u64> failed;
+} collapse_counters;
+
+// Set when a region may have become collapsible since the collapser's last
+// pass over the address space
+static std::atomic<bool> collapse_pending { false };
+
+static void collapse_hint()
+{
+    if (!collapse_pending.load(std::memory_order_relaxed)) {
+        collapse_pending.store(true, std::memory_order_relaxed);
+    }
+}
+
+// Whether a page table is fully populated with small pages of the same
+// permissions, which a huge page can replace
+class small_page_census {
+public:
+    static constexpr unsigned nr_ptes = huge_page_size / page_size;
+    void reset() {
+        _nr = 0;
+        _mixed = false;
+    }
+    void add(pt_element<0> pte) {
+        if (!pte.valid() || pte_is_cow(pte)) {
+            _mixed = true;
+        } else if (!_nr++) {
+            _writable = pte.writable();
+            _executable = pte.executable();
+        } else if (pte.writable() != _writable || pte.executable() != _executable) {
+            _mixed = true;
+        }
+    }
+    bool full() const { return !_mixed && _nr == nr_ptes; }
+    bool writable() const { return _writable; }
+    bool executable() const { return _executable; }
+private:
+    unsigned _nr = 0;
+    bool _mixed = false;
+    bool _writable = false;
+    bool _executable = false;
+};
+
+/*
+ * Finds whether a 2MB region can be collapsed, without changing anything,
+ * so the collapser only takes vma_list_mutex for write for regions which
+ * it can collapse.
+ */
+class collapse_check : public page_table_operation<allocate_intermediate_opt::no,
+        skip_empty_opt::yes, descend_opt::yes, once_opt::no, split_opt::no> {
+private:
+    small_page_census _census;
+    bool _found = false;
+public:
+    bool page(hw_ptep<0> ptep, uintptr_t offset) {
+        _census.add(ptep.read());
+        return true;
+    }
+    // Already a huge page
+    template<int N>
+    bool page(hw_ptep<N> ptep, uintptr_t offset) {
+        return true;
+    }
+    void intermediate_page_pre(hw_ptep<1> ptep, uintptr_t offset) {
+        _census.reset();
+    }
+    void intermediate_page_post(hw_ptep<1> ptep, uintptr_t offset) {
+        _found |= _census.full();
+    }
+    bool found() const { return _found; }
+};
+
+/*
+ * Replace a page table fully populated with small pages by a huge page
+ * holding a copy of them.  Called with vma_list_mutex held for write, so
+ * no fault populates the region meanwhile, and the small pages are write
+ * protected while they are copied.  The small pages are freed after the
+ * TLB flush, and the page table after an RCU grace period, as
+ * virt_visit_pte_rcu() may still be walking it.
+ */
+class collapse : public vma_operation<allocate_intermediate_opt::no, skip_empty_opt::yes> {
+private:
+    static constexpr unsigned nr_ptes = small_page_census::nr_ptes;
+    const numa::mempolicy& _policy;
+    small_page_census _census;
+    phys _old_pt = 0;
+public:
+    collapse(const numa::mempolicy& policy) : _policy(policy) { }
+    bool page(hw_ptep<0> ptep, uintptr_t offset) {
+        _census.add(ptep.read());
+        return true;
+    }
+    // Already a huge page
+    template<int N>
+    bool page(hw_ptep<N> ptep, uintptr_t offset) {
+        return true;
+    }
+    void intermediate_page_pre(hw_ptep<1> ptep, uintptr_t offset) {
+        _census.reset();
+    }
+    void intermediate_page_post(hw_ptep<1> ptep, uintptr_t offset) {
+        if (!_census.full()) {
+            return;
+        }
+        bool writable = _census.writable();
+        bool executable = _census.executable();
+        void* huge;
+        {
+            numa::policy_scope policy(_policy);
+            huge = memory::alloc_huge_page(huge_page_size);
+        }
+        if (!huge) {
+            collapse_counters.failed.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        auto pt = hw_ptep<0>::force(phys_cast<pt_element<0>>(ptep.read().next_pt_addr()));
+        if (writable) {
+            for (unsigned i = 0; i < nr_ptes; i++) {
+                auto pte = pt.at(i).read();
+                pte.set_writable(false);
+                pt.at(i).write(pte);
+            }
+            mmu::flush_tlb_all();
+        }
+        bool dirty = false;
+        for (unsigned i = 0; i < nr_ptes; i++) {
+            auto pte = pt.at(i).read();
+            dirty |= pte.dirty();
+            memcpy(static_cast<char*>(huge) + i * page_size, phys_to_virt(pte.addr()), page_size);
+        }
+        unsigned perm = perm_read | (writable ? perm_write : 0) | (executable ? perm_exec : 0);
+        auto pte = make_leaf_pte(ptep, virt_to_phys(huge), perm);
+        pte.set_dirty(dirty);
+        _old_pt = ptep.read().next_pt_addr();
+        ptep.write(pte);
+        collapse_counters.collapsed.fetch_add(1, std::memory_order_relaxed);
+    }
+    bool tlb_flush_needed(void) {
+        return _old_pt;
+    }
+    void finalize(void) {
+        if (!_old_pt) {
+            return;
+        }
+        auto pt = hw_ptep<0>::force(phys_cast<pt_element<0>>(_old_pt));
+        for (unsigned i = 0; i < nr_ptes; i++) {
+            memory::free_page(phys_to_virt(pt.at(i).read().addr()));
+        }
+        osv::rcu_defer([](void *page) { memory::free_page(page); }, phys_to_virt(_old_pt));
+    }
 };
 
 class virt_to_phys_map :
@@ -708,6 +1028,7 @@ public:
         }
     }
     bool tlb_flush_needed() { return do_flush; }
+    bool tlb_flush_deferrable() { return false; }
     void finalize() {}
     ulong account_results(void) { return 0; }
 private:
@@ -740,6 +1061,41 @@ public:
     }
 };
 
+/*
+ * Coalesces the TLB flushes of the page table operations done while it is
+ * alive (e.g., by an mprotect() spanning several vmas) into one flush, done
+ * when it is destroyed.  Only flushes of operations which do not free
+ * memory are postponed.
+ */
+class tlb_batch {
+public:
+    tlb_batch() : _outer(_current) { _current = this; }
+    ~tlb_batch() {
+        _current = _outer;
+        if (_start < _end) {
+            mmu::flush_tlb_range(_start, _end - _start);
+        }
+    }
+    tlb_batch(const tlb_batch&) = delete;
+    tlb_batch& operator=(const tlb_batch&) = delete;
+    // Returns false if there is no batch to add the flush to
+    static bool defer(uintptr_t start, size_t size) {
+        if (!_current) {
+            return false;
+        }
+        _current->_start = std::min(_current->_start, start);
+        _current->_end = std::max(_current->_end, start + size);
+        return true;
+    }
+private:
+    tlb_batch* _outer;
+    uintptr_t _start = ~uintptr_t(0);
+    uintptr_t _end = 0;
+    static __thread tlb_batch* _current;
+};
+
+__thread tlb_batch* tlb_batch::_current;
+
 template<typename T> ulong operate_range(T mapper, void *vma_start, void *start, size_t size)
 {
     start = align_down(start, page_size);
@@ -747,12 +1103,12 @@ template<typename T> ulong operate_range(T mapper, void *vma_start, void *start,
     uintptr_t virt = reinterpret_cast<uintptr_t>(start);
     map_range(reinterpret_cast<uintptr_t>(vma_start), virt, size, mapper);
 
-    // TODO: consider if instead of requesting a full TLB flush, we should
-    // instead try to make more judicious use of INVLPG - e.g., in
-    // split_large_page() and other specific places where we modify specific
-    // page table entries.
+    // Only the range operated on can have stale TLB entries, so a small
+    // range is invalidated page by page.
     if (mapper.tlb_flush_needed()) {
-        mmu::flush_tlb_all();
+        if (!mapper.tlb_flush_deferrable() || !tlb_batch::defer(virt, size)) {
+            mmu::flush_tlb_range(virt, size);
+        }
     }
     mapper.finalize();
     return mapper.account_results();
@@ -800,6 +1156,7 @@ static error protect(const void *addr, size_t size, unsigned int perm)
     uintptr_t end = start + size;
     addr_range r(start, end);
     auto range = vma_list.equal_range(r, vma::addr_compare());
+    tlb_batch batch;
     for (auto i = range.first; i != range.second; ++i) {
         if (i->perm() == perm)
             continue;
@@ -812,6 +1169,8 @@ static error protect(const void *addr, size_t size, unsigned int perm)
         if (contains(start, end, *i)) {
             i->protect(perm);
             i->operate_range(protection(perm));
+            // The small pages of a region may have the same permissions now
+            collapse_hint();
         }
     }
     return no_error();
@@ -857,13 +1216,22 @@ ulong evacuate(uintptr_t start, uintptr_t end)
         i->split(start);
         if (contains(start, end, *i)) {
             auto& dead = *i--;
+            dead.exclude_faults();
             auto size = dead.operate_range(unpopulate<account_opt::yes>(dead.page_ops()));
             ret += size;
             if (dead.has_flags(mmap_jvm_heap)) {
                 memory::stats::on_jvm_heap_free(size);
             }
             vma_list.erase(dead);
-            delete &dead;
+            // Unless it is a jvm balloon, the vma may still be in the list
+            // published for faults; publish_vmas() deletes it.  What it
+            // holds (e.g., the file) is released now, not in an RCU
+            // callback.
+            if (dead.has_flags(mmap_jvm_balloon)) {
+                delete &dead;
+            } else {
+                dead.release();
+            }
         }
     }
     return ret;
@@ -985,6 +1353,9 @@ public:
     virtual bool unmap(void *addr, uintptr_t offset, hw_ptep<0> ptep) override {
         return _file->put_page(addr, offset + _foffset, ptep);
     }
+    virtual bool cached(uintptr_t offset) override {
+        return _file->page_cached(offset + _foffset);
+    }
     virtual bool unmap(void *addr, uintptr_t offset, hw_ptep<1> ptep) override {
         return _file->put_page(addr, offset + _foffset, ptep);
     }
@@ -1047,6 +1418,7 @@ static void depopulate(void* addr, size_t length)
     auto start = reinterpret_cast<uintptr_t>(addr);
     auto range = vma_list.equal_range(addr_range(start, start + length), vma::addr_compare());
     for (auto i = range.first; i != range.second; ++i) {
+        i->exclude_faults();
         i->operate_range(unpopulate<>(i->page_ops()), reinterpret_cast<void*>(start), std::min(length, i->size()));
         start += i->size();
         length -= i->size();
@@ -1055,22 +1427,277 @@ static void depopulate(void* addr, size_t length)
 
 static void nohugepage(void* addr, size_t length)
 {
-    length = align_up(length, mmu::page_size);
     auto start = reinterpret_cast<uintptr_t>(addr);
-    auto range = vma_list.equal_range(addr_range(start, start + length), vma::addr_compare());
+    auto end = start + align_up(length, mmu::page_size);
+    auto range = vma_list.equal_range(addr_range(start, end), vma::addr_compare());
     for (auto i = range.first; i != range.second; ++i) {
-        if (!i->has_flags(mmap_small)) {
+        if (i->has_flags(mmap_small)) {
+            continue;
+        }
+        i->split(end);
+        i->split(start);
+        if (contains(start, end, *i)) {
             i->update_flags(mmap_small);
-            i->operate_range(splithugepages(), reinterpret_cast<void*>(start), std::min(length, i->size()));
+            i->operate_range(splithugepages());
         }
-        start += i->size();
-        length -= i->size();
     }
 }
 
+/*
+ * Background collapse of anonymous memory into huge pages, as Linux's
+ * khugepaged does.  A fault only maps a huge page when the whole 2MB region
+ * around it is unpopulated; regions populated with small pages (e.g., after
+ * splithugepages() or a partial munmap()) are collapsed here once all of
+ * their small pages are present.
+ *
+ * The address space is only scanned again after something may have made a
+ * region collapsible (see collapse_hint()), a batch of regions at a time.
+ * Regions are checked with vma_list_mutex held for read; the lock is only
+ * taken for write, and faults excluded, to collapse the ones which can be.
+ */
+class huge_page_collapser {
+public:
+    huge_page_collapser()
+        : _thread([=] { run(); }, sched::thread::attr().name("collapse_huge"))
+    {
+        _thread.start();
+    }
+    void wake() {
+        collapse_hint();
+        _wakeup.store(true, std::memory_order_relaxed);
+        _thread.wake();
+    }
+private:
+    static constexpr unsigned regions_per_scan = 512;
+    static bool collapsible(vma& v) {
+        return dynamic_cast<anon_vma*>(&v) &&
+            !v.has_flags(mmap_small | mmap_jvm_heap | mmap_jvm_balloon);
+    }
+    void run() {
+        sched::timer tmr(*sched::thread::current());
+        for (;;) {
+            tmr.set(std::chrono::seconds(1));
+            sched::thread::wait_until([&] {
+                return tmr.expired() || _wakeup.load(std::memory_order_relaxed);
+            });
+            tmr.cancel();
+            _wakeup.store(false, std::memory_order_relaxed);
+            if (!_scanning) {
+                if (!collapse_pending.exchange(false, std::memory_order_relaxed)) {
+                    continue;
+                }
+                _scanning = true;
+            }
+            _scanning = scan();
+        }
+    }
+    // Checks the next regions_per_scan regions after the cursor, and
+    // collapses those which can be; returns false, and starts over, at the
+    // end of the address space
+    bool scan() {
+        std::vector<uintptr_t> candidates;
+        unsigned n = 0;
+        WITH_LOCK(vma_list_mutex.for_read()) {
+            auto i = vma_list.lower_bound(addr_range(_cursor, _cursor + 1), vma::addr_compare());
+            for (; i != vma_list.end(); ++i) {
+                if (!collapsible(*i)) {
+                    continue;
+                }
+                auto start = std::max(align_up(i->start(), huge_page_size), _cursor);
+                auto end = align_down(i->end(), huge_page_size);
+                for (; start < end; start += huge_page_size) {
+                    if (n++ == regions_per_scan) {
+                        break;
+                    }
+                    _cursor = start + huge_page_size;
+                    collapse_check check;
+                    map_range(start, start, huge_page_size, check);
+                    if (check.found()) {
+                        candidates.push_back(start);
+                    }
+                }
+                if (n > regions_per_scan) {
+                    break;
+                }
+            }
+        }
+        for (auto start : candidates) {
+            collapse_region(start);
+        }
+        if (n <= regions_per_scan) {
+            _cursor = 0;
+            return false;
+        }
+        return true;
+    }
+    void collapse_region(uintptr_t start) {
+        WITH_LOCK(vma_list_write_lock) {
+            auto i = vma_list.find(addr_range(start, start + 1), vma::addr_compare());
+            if (i == vma_list.end() || !collapsible(*i) ||
+                    start < i->start() || start + huge_page_size > i->end()) {
+                return;
+            }
+            collapse_counters.scanned.fetch_add(1, std::memory_order_relaxed);
+            i->exclude_faults();
+            i->operate_range(collapse(i->mempolicy()), reinterpret_cast<void*>(start), huge_page_size);
+        }
+    }
+    sched::thread _thread;
+    std::atomic<bool> _wakeup { false };
+    bool _scanning = false;
+    uintptr_t _cursor = 0;
+};
+
+static huge_page_collapser collapser;
+
+collapse_stats get_collapse_stats()
+{
+    collapse_stats stats;
+    stats.scanned = collapse_counters.scanned.load(std::memory_order_relaxed);
+    stats.collapsed = collapse_counters.collapsed.load(std::memory_order_relaxed);
+    stats.failed = collapse_counters.failed.load(std::memory_order_relaxed);
+    return stats;
+}
+
+// Undoes nohugepage(); huge pages are mapped again by later faults, and by
+// the collapser
+static void hugepage(void* addr, size_t length)
+{
+    auto start = reinterpret_cast<uintptr_t>(addr);
+    auto end = start + align_up(length, mmu::page_size);
+    auto range = vma_list.equal_range(addr_range(start, end), vma::addr_compare());
+    for (auto i = range.first; i != range.second; ++i) {
+        if (!dynamic_cast<anon_vma*>(&*i) || !i->has_flags(mmap_small)) {
+            continue;
+        }
+        i->split(end);
+        i->split(start);
+        if (contains(start, end, *i)) {
+            i->clear_flags(mmap_small);
+        }
+    }
+    collapser.wake();
+}
+
+// Read-ahead hints, only used by file mappings
+static void access_pattern(void* addr, size_t length, unsigned flags)
+{
+    auto start = reinterpret_cast<uintptr_t>(addr);
+    auto end = start + align_up(length, mmu::page_size);
+    auto range = vma_list.equal_range(addr_range(start, end), vma::addr_compare());
+    for (auto i = range.first; i != range.second; ++i) {
+        if (!dynamic_cast<file_vma*>(&*i) ||
+                (i->flags() & (mmap_sequential | mmap_random)) == flags) {
+            continue;
+        }
+        i->split(end);
+        i->split(start);
+        if (contains(start, end, *i)) {
+            i->clear_flags(mmap_sequential | mmap_random);
+            i->update_flags(flags);
+        }
+    }
+}
+
+// Finds the vma containing @addr in the list published for faults, and
+// enters it as a fault does (see vma::enter_fault()).  Returns nullptr if
+// there is none, or it is being changed.
+static vma* enter_published_vma(uintptr_t addr)
+{
+    vma* v;
+    WITH_LOCK(osv::rcu_read_lock) {
+        auto vmas = published_vmas.read();
+        v = vmas ? vmas->find(addr) : nullptr;
+        if (v && !v->enter_fault()) {
+            v = nullptr;
+        }
+        // The list may be older than the vma's last split
+        if (v && (addr < v->start() || addr >= v->end())) {
+            v->exit_fault();
+            v = nullptr;
+        }
+    }
+    return v;
+}
+
+static void exit_published_vma(vma* v)
+{
+    WITH_LOCK(osv::rcu_read_lock) {
+        v->exit_fault();
+    }
+}
+
+/*
+ * Reads in the ranges advised with MADV_WILLNEED, in the background.  Like
+ * a fault, the read takes no vma_list_mutex, so it holds up neither mmap()
+ * and friends nor the advising thread.  Parts of the range being changed
+ * meanwhile are skipped, as is advice beyond what is pending: it is only a
+ * hint.
+ */
+class read_ahead_worker {
+public:
+    read_ahead_worker()
+        : _thread([=] { run(); }, sched::thread::attr().name("read_ahead"))
+    {
+        _thread.start();
+    }
+    void queue(uintptr_t start, uintptr_t end) {
+        WITH_LOCK(_mtx) {
+            if (_pending.size() < max_pending) {
+                _pending.push_back(addr_range(start, end));
+                _cv.wake_one();
+            }
+        }
+    }
+private:
+    static constexpr unsigned max_pending = 64;
+    void run() {
+        for (;;) {
+            addr_range r(0, 0);
+            WITH_LOCK(_mtx) {
+                while (_pending.empty()) {
+                    _cv.wait(_mtx);
+                }
+                r = _pending.front();
+                _pending.pop_front();
+            }
+            auto addr = r.start();
+            while (addr < r.end()) {
+                auto v = enter_published_vma(addr);
+                if (!v) {
+                    addr += page_size;
+                    continue;
+                }
+                auto end = std::min(r.end(), v->end());
+                if (auto fvma = dynamic_cast<file_vma*>(v)) {
+                    fvma->prefetch(addr, end);
+                }
+                exit_published_vma(v);
+                addr = end;
+            }
+        }
+    }
+    sched::thread _thread;
+    mutex _mtx;
+    condvar _cv;
+    std::deque<addr_range> _pending;
+};
+
+static read_ahead_worker read_ahead;
+
+// The most MADV_WILLNEED reads ahead per call, as a sequential fault does
+constexpr size_t max_willneed_size = 512 * mmu::page_size;
+
+static void willneed(void* addr, size_t length)
+{
+    auto start = reinterpret_cast<uintptr_t>(addr);
+    auto end = start + std::min(align_up(length, mmu::page_size), max_willneed_size);
+    read_ahead.queue(start, end);
+}
+
 error advise(void* addr, size_t size, int advice)
 {
-    WITH_LOCK(vma_list_mutex.for_write()) {
+    WITH_LOCK(vma_list_write_lock) {
         if (!ismapped(addr, size)) {
             return make_error(ENOMEM);
         }
@@ -1080,6 +1707,21 @@ error advise(void* addr, size_t size, int advice)
         } else if (advice == advise_nohugepage) {
             nohugepage(addr, size);
             return no_error();
+        } else if (advice == advise_hugepage) {
+            hugepage(addr, size);
+            return no_error();
+        } else if (advice == advise_normal) {
+            access_pattern(addr, size, 0);
+            return no_error();
+        } else if (advice == advise_sequential) {
+            access_pattern(addr, size, mmap_sequential);
+            return no_error();
+        } else if (advice == advise_random) {
+            access_pattern(addr, size, mmap_random);
+            return no_error();
+        } else if (advice == advise_willneed) {
+            willneed(addr, size);
+            return no_error();
         }
         return make_error(EINVAL);
     }
@@ -1102,7 +1744,7 @@ void* map_anon(const void* addr, size_t size, unsigned flags, unsigned perm)
     size = align_up(size, mmu::page_size);
     auto start = reinterpret_cast<uintptr_t>(addr);
     auto* vma = new mmu::anon_vma(addr_range(start, start + size), perm, flags);
-    SCOPE_LOCK(vma_list_mutex.for_write());
+    SCOPE_LOCK(vma_list_write_lock);
     auto v = (void*) allocate(vma, start, size, search);
     if (flags & mmap_populate) {
         populate_vma(vma, v, size);
@@ -1128,7 +1770,7 @@ void* map_file(const void* addr, size_t size, unsigned flags, unsigned perm,
     auto start = reinterpret_cast<uintptr_t>(addr);
     auto *vma = f->mmap(addr_range(start, start + size), flags | mmap_file, perm, offset).release();
     void *v;
-    WITH_LOCK(vma_list_mutex.for_write()) {
+    WITH_LOCK(vma_list_write_lock) {
         v = (void*) allocate(vma, start, size, search);
         if (flags & mmap_populate) {
             populate_vma(vma, v, std::min(size, align_up(::size(f), page_size)));
@@ -1209,6 +1851,24 @@ static void vm_sigbus(uintptr_t addr, exception_frame* ef)
     osv::handle_mmap_fault(addr, SIGBUS, ef);
 }
 
+// Handles a fault without vma_list_mutex, so that faults are not held up by
+// mmap() and friends, looking up the vma in the published list.  Returns
+// false if the fault has to take the lock: the vma is being changed, or the
+// fault is bad (the locked path sends the signal).
+static bool fault_unlocked(uintptr_t addr, exception_frame* ef)
+{
+    auto v = enter_published_vma(addr);
+    if (!v) {
+        return false;
+    }
+    auto exit = defer([v] { exit_published_vma(v); });
+    if (access_fault(*v, ef->get_error())) {
+        return false;
+    }
+    v->fault(addr, ef);
+    return true;
+}
+
 void vm_fault(uintptr_t addr, exception_frame* ef)
 {
     trace_mmu_vm_fault(addr, ef->get_error());
@@ -1218,6 +1878,10 @@ void vm_fault(uintptr_t addr, exception_frame* ef)
         return;
     }
     addr = align_down(addr, mmu::page_size);
+    if (fault_unlocked(addr, ef)) {
+        trace_mmu_vm_fault_ret(addr, ef->get_error());
+        return;
+    }
     WITH_LOCK(vma_list_mutex.for_read()) {
         auto vma = vma_list.find(addr_range(addr, addr+1), vma::addr_compare());
         if (vma == vma_list.end() || access_fault(*vma, ef->get_error())) {
@@ -1236,7 +1900,56 @@ vma::vma(addr_range range, unsigned perm, unsigned flags, bool map_dirty, page_a
     , _flags(flags)
     , _map_dirty(map_dirty)
     , _page_ops(page_ops)
+    , _mempolicy()
+    , _faults(0)
+    , _fault_waiter(nullptr)
+    , _next_excluded(nullptr)
+{
+}
+
+// The high bit of _faults keeps faults out, the others count them
+constexpr unsigned faults_excluded = 1u << 31;
+
+bool vma::enter_fault()
+{
+    auto n = _faults.load(std::memory_order_relaxed);
+    do {
+        if (n & faults_excluded) {
+            return false;
+        }
+    } while (!_faults.compare_exchange_weak(n, n + 1, std::memory_order_acquire));
+    return true;
+}
+
+// Called under rcu_read_lock, as once the count drops exclude_faults() may
+// return and the vma be disposed of.
+void vma::exit_fault()
+{
+    if (_faults.fetch_sub(1, std::memory_order_acq_rel) == (faults_excluded | 1)) {
+        _fault_waiter->wake();
+    }
+}
+
+void vma::exclude_faults()
+{
+    assert(vma_list_mutex.wowned());
+    if (has_flags(mmap_jvm_balloon) ||
+            (_faults.load(std::memory_order_relaxed) & faults_excluded)) {
+        return;
+    }
+    _next_excluded = excluded_vmas;
+    excluded_vmas = this;
+    _fault_waiter = sched::thread::current();
+    if (_faults.fetch_or(faults_excluded, std::memory_order_acq_rel)) {
+        sched::thread::wait_until([&] {
+            return _faults.load(std::memory_order_acquire) == faults_excluded;
+        });
+    }
+}
+
+void vma::allow_faults()
 {
+    _faults.fetch_and(~faults_excluded, std::memory_order_release);
 }
 
 vma::~vma()
@@ -1250,6 +1963,7 @@ void vma::set(uintptr_t start, uintptr_t end)
 
 void vma::protect(unsigned perm)
 {
+    exclude_faults();
     _perm = perm;
 }
 
@@ -1285,10 +1999,16 @@ unsigned vma::flags() const
 
 void vma::update_flags(unsigned flag)
 {
-    assert(vma_list_mutex.wowned());
+    exclude_faults();
     _flags |= flag;
 }
 
+void vma::clear_flags(unsigned flag)
+{
+    exclude_faults();
+    _flags &= ~flag;
+}
+
 bool vma::has_flags(unsigned flag)
 {
     return _flags & flag;
@@ -1322,8 +2042,14 @@ void vma::fault(uintptr_t addr, exception_frame *ef)
         size = page_size;
     }
 
+    numa::policy_scope policy(_mempolicy);
     auto total = populate_vma<account_opt::yes>(this, (void*)addr, size,
         mmu::is_page_fault_write(ef->get_error()));
+    // A region which already had small pages was filled up with more, so
+    // the collapser may replace them with a huge page
+    if (size == huge_page_size && total && total != huge_page_size) {
+        collapse_hint();
+    }
 
     if (_flags & mmap_jvm_heap) {
         memory::stats::on_jvm_heap_alloc(total);
@@ -1349,7 +2075,9 @@ void anon_vma::split(uintptr_t edge)
     if (edge <= _range.start() || edge >= _range.end()) {
         return;
     }
+    exclude_faults();
     vma* n = new anon_vma(addr_range(edge, _range.end()), _perm, _flags);
+    n->set_mempolicy(_mempolicy);
     set(_range.start(), edge);
     vma_list.insert(*n);
 }
@@ -1494,7 +2222,7 @@ ulong map_jvm(unsigned char* jvm_addr, size_t size, size_t align, balloon_ptr b)
 
     auto* vma = new mmu::jvm_balloon_vma(jvm_addr, start, start + size, b, v->perm(), v->flags());
 
-    WITH_LOCK(vma_list_mutex.for_write()) {
+    WITH_LOCK(vma_list_write_lock) {
         // This means that the mapping that we had before was a balloon mapping
         // that was laying around and wasn't updated to an anon mapping. If we
         // allow it to split it would significantly complicate our code, since
@@ -1585,8 +2313,75 @@ void file_vma::fault(uintptr_t addr, exception_frame *ef)
         size = page_size;
     }
 
-    populate_vma<account_opt::no>(this, (void*)addr, size,
-            mmu::is_page_fault_write(ef->get_error()));
+    bool write = mmu::is_page_fault_write(ef->get_error());
+    populate_vma<account_opt::no>(this, (void*)addr, size, write);
+    // The neighbours of a page faulted in for writing could only be mapped
+    // read-only, and would fault again when written
+    if (!write && size == page_size && !has_flags(mmap_random)) {
+        map_around(addr, fsize);
+    }
+}
+
+// Window of pages mapped around a read fault, if they are already cached
+constexpr unsigned fault_around_pages = 16;
+// Bounds of the window read ahead of a sequential read fault
+constexpr unsigned min_read_ahead_pages = 32;
+constexpr unsigned max_read_ahead_pages = 512;
+
+/*
+ * Maps the neighbours of the page faulted in at @addr, to save the faults
+ * on them.  A fault following the previous one, within the pages that fault
+ * mapped (or tried to), belongs to a sequential scan: the pages ahead of it
+ * are read in, in a window which doubles with each such fault.  Otherwise,
+ * only the pages around @addr which are already cached are mapped.
+ *
+ * Faults may run concurrently (see fault_unlocked()); the read-ahead state
+ * is only a hint, so races on it are harmless.
+ */
+void file_vma::map_around(uintptr_t addr, f_offset fsize)
+{
+    // Pages past the end of the file must keep faulting, for the SIGBUS
+    auto end = std::min(_range.end(), _range.start() + align_up(fsize - _offset, page_size));
+    auto off = offset(addr);
+    auto prev = _ra_prev.exchange(off, std::memory_order_relaxed);
+    auto sequential = has_flags(mmap_sequential);
+    if (sequential || (off > prev && off <= _ra_end.load(std::memory_order_relaxed))) {
+        auto pages = sequential ? max_read_ahead_pages :
+            std::min(std::max(_ra_pages.load(std::memory_order_relaxed) * 2, min_read_ahead_pages),
+                     max_read_ahead_pages);
+        auto ra_end = std::min(end, addr + pages * page_size);
+        _ra_pages.store(pages, std::memory_order_relaxed);
+        _ra_end.store(offset(ra_end), std::memory_order_relaxed);
+        addr += page_size;
+        if (addr < ra_end) {
+            populate_vma<account_opt::no>(this, (void*)addr, ra_end - addr);
+        }
+    } else {
+        auto window = fault_around_pages * page_size;
+        auto start = std::max(_range.start(), align_down(addr, window));
+        auto around_end = std::min(end, align_down(addr, window) + window);
+        _ra_pages.store(0, std::memory_order_relaxed);
+        _ra_end.store(offset(around_end), std::memory_order_relaxed);
+        operate_range(populate_cached<account_opt::no>(_page_ops, _perm, map_dirty()),
+                (void*)start, around_end - start);
+    }
+}
+
+void file_vma::prefetch(uintptr_t start, uintptr_t end)
+{
+    auto fsize = ::size(_file);
+    if (offset(start) >= fsize) {
+        return;
+    }
+    end = std::min(end, _range.start() + align_up(fsize - _offset, page_size));
+    populate_vma<account_opt::no>(this, (void*)start, end - start);
+}
+
+void file_vma::release()
+{
+    delete _page_ops;
+    _page_ops = nullptr;
+    _file.reset();
 }
 
 file_vma::~file_vma()
@@ -1599,8 +2394,10 @@ void file_vma::split(uintptr_t edge)
     if (edge <= _range.start() || edge >= _range.end()) {
         return;
     }
+    exclude_faults();
     auto off = offset(edge);
     vma *n = _file->mmap(addr_range(edge, _range.end()), _flags, _perm, off).release();
+    n->set_mempolicy(_mempolicy);
     set(_range.start(), edge);
     vma_list.insert(*n);
 }
@@ -1717,7 +2514,7 @@ void free_initial_memory_range(uintptr_t addr, size_t size)
 
 error mprotect(const void *addr, size_t len, unsigned perm)
 {
-    SCOPE_LOCK(vma_list_mutex.for_write());
+    SCOPE_LOCK(vma_list_write_lock);
 
     if (!ismapped(addr, len)) {
         return make_error(ENOMEM);
@@ -1728,7 +2525,7 @@ error mprotect(const void *addr, size_t len, unsigned perm)
 
 error munmap(const void *addr, size_t length)
 {
-    SCOPE_LOCK(vma_list_mutex.for_write());
+    SCOPE_LOCK(vma_list_write_lock);
 
     length = align_up(length, mmu::page_size);
     if (!ismapped(addr, length)) {
@@ -1749,6 +2546,82 @@ error msync(const void* addr, size_t length, int flags)
     return sync(addr, length, flags);
 }
 
+error mbind(const void* addr, size_t length, const numa::mempolicy& policy, bool move)
+{
+    SCOPE_LOCK(vma_list_write_lock);
+
+    if (!ismapped(addr, length)) {
+        return make_error(EFAULT);
+    }
+    uintptr_t start = reinterpret_cast<uintptr_t>(addr);
+    uintptr_t end = start + length;
+    move &= bool(policy.nodes & numa::online_nodes()) && !policy.is_default();
+    auto range = vma_list.equal_range(addr_range(start, end), vma::addr_compare());
+    for (auto i = range.first; i != range.second; ++i) {
+        i->exclude_faults();
+        i->split(end);
+        i->split(start);
+        if (contains(start, end, *i)) {
+            i->set_mempolicy(policy);
+            if (move && dynamic_cast<anon_vma*>(&*i)) {
+                i->operate_range(migration(i->mempolicy()));
+            }
+        }
+    }
+    return no_error();
+}
+
+numa::mempolicy vma_mempolicy(const void* addr)
+{
+    auto a = reinterpret_cast<uintptr_t>(addr);
+    SCOPE_LOCK(vma_list_mutex.for_read());
+    auto v = vma_list.find(addr_range(a, a + 1), vma::addr_compare());
+    if (v == vma_list.end()) {
+        return numa::mempolicy();
+    }
+    return v->mempolicy();
+}
+
+int page_node(const void* addr)
+{
+    struct : virt_pte_visitor {
+        bool present = false;
+        phys pa;
+        void pte(pt_element<0> pte) override { visit(pte.valid(), pte.addr()); }
+        void pte(pt_element<1> pte) override { visit(pte.valid(), pte.addr()); }
+        void visit(bool valid, phys addr) {
+            present = valid;
+            pa = addr;
+        }
+    } visitor;
+    SCOPE_LOCK(vma_list_mutex.for_read());
+    if (!ismapped(addr, 1)) {
+        return -EFAULT;
+    }
+    virt_visit_pte_rcu(reinterpret_cast<uintptr_t>(addr), visitor);
+    if (!visitor.present) {
+        return -ENOENT;
+    }
+    return numa::phys_node(visitor.pa);
+}
+
+int move_page(const void* addr, unsigned node)
+{
+    auto a = align_down(reinterpret_cast<uintptr_t>(addr), page_size);
+    WITH_LOCK(vma_list_write_lock) {
+        auto v = vma_list.find(addr_range(a, a + 1), vma::addr_compare());
+        if (v == vma_list.end()) {
+            return -EFAULT;
+        }
+        if (dynamic_cast<anon_vma*>(&*v)) {
+            numa::mempolicy bind{numa::mpol_bind, 1ul << node};
+            v->exclude_faults();
+            v->operate_range(migration(bind), reinterpret_cast<void*>(a), page_size);
+        }
+    }
+    return page_node(addr);
+}
+
 error mincore(const void *addr, size_t length, unsigned char *vec)
 {
     char *end = align_up((char *)addr + length, page_size);
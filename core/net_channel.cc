@@ -12,11 +12,19 @@
 #include <bsd/sys/netinet/ip.h>
 #include <bsd/sys/netinet/ip.h>
 #include <bsd/sys/netinet/tcp.h>
+#include <bsd/sys/netinet/udp.h>
 #include <bsd/sys/net/ethernet.h>
 #include <bsd/sys/net/netisr.h>
 
 #include <osv/debug.hh>
 #include <osv/net_trace.hh>
+#include <osv/trace.hh>
+
+#include <algorithm>
+#include <array>
+
+TRACEPOINT(trace_net_channel_post_remote, "nc=%p, cpu=%d, consumer_cpu=%d",
+           net_channel*, unsigned, unsigned);
 
 std::ostream& operator<<(std::ostream& os, in_addr ia)
 {
@@ -32,6 +40,7 @@ std::ostream& operator<<(std::ostream& os, ipv4_tcp_conn_id id)
 
 void net_channel::process_queue()
 {
+    update_consumer_cpu();
     mbuf* m;
     while (_queue.pop(m)) {
         _process_packet(m);
@@ -109,32 +118,69 @@ classifier::classifier()
 {
 }
 
-void classifier::add(ipv4_tcp_conn_id id, net_channel* channel)
+template <typename Key>
+void classifier::add(channels<Key>& table, const Key& id, net_channel* channel)
 {
     WITH_LOCK(_mtx) {
-        _ipv4_tcp_channels.emplace(id, channel);
+        table.emplace(id, channel);
     }
 }
 
-void classifier::remove(ipv4_tcp_conn_id id)
+template <typename Key>
+void classifier::remove(channels<Key>& table, const Key& id)
 {
     WITH_LOCK(_mtx) {
-        auto i = _ipv4_tcp_channels.owner_find(id,
-                std::hash<ipv4_tcp_conn_id>(), key_item_compare());
+        auto i = table.owner_find(id, std::hash<Key>(), key_item_compare<Key>());
         assert(i);
-        _ipv4_tcp_channels.erase(i);
+        table.erase(i);
+    }
+}
+
+// must be called with rcu lock held
+template <typename Key>
+net_channel* classifier::find(channels<Key>& table, const Key& id)
+{
+    auto i = table.reader_find(id, std::hash<Key>(), key_item_compare<Key>());
+    if (!i) {
+        return nullptr;
     }
+    return i->chan;
+}
+
+void classifier::add(ipv4_tcp_conn_id id, net_channel* channel)
+{
+    add(_ipv4_tcp_channels, id, channel);
+}
+
+void classifier::remove(ipv4_tcp_conn_id id)
+{
+    remove(_ipv4_tcp_channels, id);
+}
+
+void classifier::add(ipv4_udp_conn_id id, net_channel* channel)
+{
+    add(_ipv4_udp_conn_channels, id, channel);
+}
+
+void classifier::remove(ipv4_udp_conn_id id)
+{
+    remove(_ipv4_udp_conn_channels, id);
+}
+
+void classifier::add(ipv4_udp_bound_id id, net_channel* channel)
+{
+    add(_ipv4_udp_bound_channels, id, channel);
+}
+
+void classifier::remove(ipv4_udp_bound_id id)
+{
+    remove(_ipv4_udp_bound_channels, id);
 }
 
 bool classifier::post_packet(mbuf* m)
 {
     WITH_LOCK(osv::rcu_read_lock) {
-        if (auto nc = classify_ipv4_tcp(m)) {
-            log_packet_in(m, NETISR_ETHER);
-            if (!nc->push(m)) {
-                return false;
-            }
-            // FIXME: find a way to batch wakes
+        if (auto nc = push(m)) {
             nc->wake();
             return true;
         }
@@ -142,8 +188,59 @@ bool classifier::post_packet(mbuf* m)
     return false;
 }
 
+unsigned classifier::post_packets(std::vector<mbuf*>& packets)
+{
+    assert(packets.size() <= max_batch);
+    // The channels may only be touched under the rcu lock, and we can't
+    // allocate memory there, hence the fixed size array.
+    std::array<net_channel*, max_batch> woken;
+    unsigned nr_woken = 0;
+    unsigned nr_rejected = 0;
+    WITH_LOCK(osv::rcu_read_lock) {
+        for (auto m : packets) {
+            auto nc = push(m);
+            if (!nc) {
+                packets[nr_rejected++] = m;
+                continue;
+            }
+            // batches are small and mostly carry few flows, so a linear
+            // search beats anything fancier
+            auto end = woken.begin() + nr_woken;
+            if (std::find(woken.begin(), end, nc) == end) {
+                woken[nr_woken++] = nc;
+            }
+        }
+        for (unsigned i = 0; i < nr_woken; i++) {
+            woken[i]->wake();
+        }
+    }
+    packets.resize(nr_rejected);
+    return nr_woken;
+}
+
+// must be called with rcu lock held
+net_channel* classifier::push(mbuf* m)
+{
+    auto nc = classify_ipv4(m);
+    if (!nc) {
+        return nullptr;
+    }
+    log_packet_in(m, NETISR_ETHER);
+    if (!nc->push(m)) {
+        return nullptr;
+    }
+    // Flows are steered to their consumer by transmitting on the
+    // consumer cpu's queue (see tcp_net_channel_packet()); record
+    // the packets that still arrive elsewhere.
+    auto cpu = sched::cpu::current()->id;
+    if (cpu != nc->consumer_cpu()) {
+        trace_net_channel_post_remote(nc, cpu, nc->consumer_cpu());
+    }
+    return nc;
+}
+
 // must be called with rcu lock held
-net_channel* classifier::classify_ipv4_tcp(mbuf* m)
+net_channel* classifier::classify_ipv4(mbuf* m)
 {
     caddr_t h = m->m_hdr.mh_data;
     if (unsigned(m->m_hdr.mh_len) < ETHER_HDR_LEN + sizeof(ip)) {
@@ -159,26 +256,64 @@ net_channel* classifier::classify_ipv4_tcp(mbuf* m)
     if (ip_size < sizeof(ip)) {
         return nullptr;
     }
-    if (ip_hdr->ip_p != IPPROTO_TCP) {
+    if (ntohs(ip_hdr->ip_off) & ~IP_DF) {
         return nullptr;
     }
-    if (ntohs(ip_hdr->ip_off) & ~IP_DF) {
+    switch (ip_hdr->ip_p) {
+    case IPPROTO_TCP:
+        return classify_ipv4_tcp(m, ip_hdr, ip_size);
+    case IPPROTO_UDP:
+        // broadcast and multicast datagrams may have several receivers
+        if (ETHER_IS_MULTICAST(ether_hdr->ether_dhost)) {
+            return nullptr;
+        }
+        return classify_ipv4_udp(m, ip_hdr, ip_size);
+    default:
         return nullptr;
     }
+}
+
+// must be called with rcu lock held
+net_channel* classifier::classify_ipv4_tcp(mbuf* m, ip* ip_hdr, unsigned ip_size)
+{
     auto src_addr = ip_hdr->ip_src;
     auto dst_addr = ip_hdr->ip_dst;
-    h += ip_size;
-    auto tcp_hdr = reinterpret_cast<tcphdr*>(h);
+    auto tcp_hdr = reinterpret_cast<tcphdr*>(reinterpret_cast<caddr_t>(ip_hdr) + ip_size);
     if (tcp_hdr->th_flags & (TH_SYN | TH_FIN | TH_RST)) {
 	    return nullptr;
     }
     auto src_port = ntohs(tcp_hdr->th_sport);
     auto dst_port = ntohs(tcp_hdr->th_dport);
     auto id = ipv4_tcp_conn_id{src_addr, dst_addr, src_port, dst_port};
-    auto i = _ipv4_tcp_channels.reader_find(id,
-            std::hash<ipv4_tcp_conn_id>(), key_item_compare());
-    if (!i) {
+    return find(_ipv4_tcp_channels, id);
+}
+
+// must be called with rcu lock held
+net_channel* classifier::classify_ipv4_udp(mbuf* m, ip* ip_hdr, unsigned ip_size)
+{
+    // udp_net_channel_packet() doesn't know how to strip IP options
+    if (ip_size != sizeof(ip)) {
         return nullptr;
     }
-    return i->chan;
+    if (unsigned(m->m_hdr.mh_len) < ETHER_HDR_LEN + ip_size + sizeof(udphdr)) {
+        return nullptr;
+    }
+    auto src_addr = ip_hdr->ip_src;
+    auto dst_addr = ip_hdr->ip_dst;
+    auto udp_hdr = reinterpret_cast<udphdr*>(reinterpret_cast<caddr_t>(ip_hdr) + ip_size);
+    auto src_port = ntohs(udp_hdr->uh_sport);
+    auto dst_port = ntohs(udp_hdr->uh_dport);
+    // a connected socket takes precedence over a bound one, and a socket
+    // bound to a specific address over one bound to INADDR_ANY
+    auto nc = find(_ipv4_udp_conn_channels,
+            ipv4_udp_conn_id{src_addr, dst_addr, src_port, dst_port});
+    if (!nc) {
+        nc = find(_ipv4_udp_bound_channels,
+                ipv4_udp_bound_id{dst_addr, dst_port});
+    }
+    if (!nc) {
+        nc = find(_ipv4_udp_bound_channels,
+                ipv4_udp_bound_id{in_addr{INADDR_ANY}, dst_port});
+    }
+    return nc;
 }
@@ -0,0 +1,297 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include <osv/numa.hh>
+#include <osv/sched.hh>
+#include <osv/mmu-defs.hh>
+#include <osv/debug.hh>
+
+#include <algorithm>
+#include <errno.h>
+
+namespace numa {
+
+struct mem_range {
+    uint64_t start;
+    uint64_t end;
+    unsigned node;
+};
+
+struct apic_entry {
+    uint32_t apic_id;
+    unsigned node;
+};
+
+constexpr unsigned max_ranges = 64;
+
+// Filled while parsing the ACPI tables, before static constructors run, so
+// only statically initialized arrays are used.  Node n is proximity domain
+// domains[n].
+static uint32_t domains[max_nodes];
+static unsigned nr_domains;
+static apic_entry apic_nodes[sched::max_cpus];
+static unsigned nr_apic_nodes;
+static bool have_slit;
+static uint8_t slit[max_nodes][max_nodes];
+
+// The effective topology, set up by commit()
+static unsigned nodes = 1;
+static mem_range ranges[max_ranges];
+static unsigned nr_ranges;
+static unsigned cpu_nodes[sched::max_cpus];
+static unsigned order[max_nodes][max_nodes];
+
+static __thread mempolicy own_policy;
+static __thread const mempolicy* policy;
+static __thread unsigned interleave_next;
+
+static int find_domain(uint32_t domain)
+{
+    auto it = std::find(domains, domains + nr_domains, domain);
+    return it == domains + nr_domains ? -1 : it - domains;
+}
+
+static unsigned domain_node(uint32_t domain)
+{
+    auto node = find_domain(domain);
+    if (node >= 0) {
+        return node;
+    }
+    if (nr_domains == max_nodes) {
+        debug("numa: too many proximity domains, using node 0 for %d\n", domain);
+        return 0;
+    }
+    domains[nr_domains] = domain;
+    return nr_domains++;
+}
+
+void add_cpu(uint32_t apic_id, uint32_t domain)
+{
+    if (nr_apic_nodes < sched::max_cpus) {
+        apic_nodes[nr_apic_nodes++] = apic_entry{apic_id, domain_node(domain)};
+    }
+}
+
+void add_memory(uint64_t start, uint64_t size, uint32_t domain)
+{
+    if (nr_ranges == max_ranges) {
+        debug("numa: too many memory ranges, ignoring %x-%x\n", start, start + size);
+        return;
+    }
+    ranges[nr_ranges++] = mem_range{start, start + size, domain_node(domain)};
+}
+
+void set_distance(uint32_t from_domain, uint32_t to_domain, unsigned distance)
+{
+    auto from = find_domain(from_domain);
+    auto to = find_domain(to_domain);
+    if (from < 0 || to < 0) {
+        return;
+    }
+    slit[from][to] = distance;
+    have_slit = true;
+}
+
+unsigned distance(unsigned from, unsigned to)
+{
+    if (have_slit) {
+        return slit[from][to];
+    }
+    return from == to ? local_distance : remote_distance;
+}
+
+void commit()
+{
+    if (nr_domains < 2) {
+        nr_ranges = 0;
+        return;
+    }
+    nodes = nr_domains;
+    std::sort(ranges, ranges + nr_ranges, [] (const mem_range& a, const mem_range& b) {
+        return a.start < b.start;
+    });
+    for (unsigned n = 0; n < nodes; n++) {
+        auto o = order[n];
+        for (unsigned i = 0; i < nodes; i++) {
+            o[i] = i;
+        }
+        std::stable_sort(o, o + nodes, [n] (unsigned a, unsigned b) {
+            return distance(n, a) < distance(n, b);
+        });
+        // the node itself goes first, even with a strange SLIT
+        std::rotate(o, std::find(o, o + nodes, n), std::find(o, o + nodes, n) + 1);
+    }
+}
+
+unsigned nr_nodes()
+{
+    return nodes;
+}
+
+nodemask online_nodes()
+{
+    return nodes == max_nodes ? all_nodes : (1UL << nodes) - 1;
+}
+
+unsigned apic_node(uint32_t apic_id)
+{
+    for (unsigned i = 0; i < nr_apic_nodes; i++) {
+        if (apic_nodes[i].apic_id == apic_id) {
+            return apic_nodes[i].node;
+        }
+    }
+    return 0;
+}
+
+void set_cpu_node(unsigned cpu_id, unsigned node)
+{
+    cpu_nodes[cpu_id] = node;
+}
+
+unsigned cpu_node(unsigned cpu_id)
+{
+    return cpu_nodes[cpu_id];
+}
+
+unsigned current_node()
+{
+    if (nodes == 1) {
+        return 0;
+    }
+    return cpu_nodes[sched::cpu::current()->id];
+}
+
+unsigned phys_node(uint64_t pa, uint64_t* end)
+{
+    auto last = ranges + nr_ranges;
+    auto it = std::upper_bound(ranges, last, pa,
+        [] (uint64_t pa, const mem_range& r) { return pa < r.start; });
+    if (it != ranges && pa < std::prev(it)->end) {
+        if (end) {
+            *end = std::prev(it)->end;
+        }
+        return std::prev(it)->node;
+    }
+    // not described by the SRAT
+    if (end) {
+        *end = it == last ? ~uint64_t(0) : it->start;
+    }
+    return 0;
+}
+
+unsigned addr_node(const void* addr)
+{
+    if (nodes == 1) {
+        return 0;
+    }
+    return phys_node(reinterpret_cast<uintptr_t>(addr) & (mmu::mem_area_size - 1));
+}
+
+const unsigned* fallback_order(unsigned node)
+{
+    return order[node];
+}
+
+const mempolicy* active_policy()
+{
+    return policy;
+}
+
+unsigned next_interleave_node(nodemask mask)
+{
+    mask &= online_nodes();
+    if (!mask) {
+        return current_node();
+    }
+    for (unsigned i = 0; i < max_nodes; i++) {
+        auto n = interleave_next++ % nodes;
+        if (mask & (1UL << n)) {
+            return n;
+        }
+    }
+    return current_node();
+}
+
+void policy_target(unsigned& node, nodemask& allowed)
+{
+    auto p = policy;
+    node = current_node();
+    allowed = all_nodes;
+    if (!p) {
+        return;
+    }
+    auto mask = p->nodes & online_nodes();
+    switch (p->mode) {
+    case mpol_preferred:
+        if (mask) {
+            node = __builtin_ctzl(mask);
+        }
+        break;
+    case mpol_bind:
+        // the nearest of the allowed nodes
+        for (unsigned i = 0; i < nodes; i++) {
+            auto n = order[node][i];
+            if (mask & (1UL << n)) {
+                node = n;
+                break;
+            }
+        }
+        allowed = mask;
+        break;
+    case mpol_interleave:
+        node = next_interleave_node(mask);
+        break;
+    default:
+        break;
+    }
+}
+
+int validate(const mempolicy& p)
+{
+    switch (p.mode) {
+    case mpol_default:
+    case mpol_local:
+        return p.nodes ? EINVAL : 0;
+    case mpol_preferred:
+        // an empty mask means the local node
+        return (!p.nodes || (p.nodes & online_nodes())) ? 0 : EINVAL;
+    case mpol_bind:
+    case mpol_interleave:
+        return (p.nodes & online_nodes()) ? 0 : EINVAL;
+    default:
+        return EINVAL;
+    }
+}
+
+void set_thread_policy(const mempolicy& p)
+{
+    own_policy = p;
+    policy = p.is_default() ? nullptr : &own_policy;
+}
+
+mempolicy thread_policy()
+{
+    return own_policy;
+}
+
+policy_scope::policy_scope(const mempolicy& p)
+    : _saved(policy)
+    , _active(!p.is_default())
+{
+    if (_active) {
+        policy = &p;
+    }
+}
+
+policy_scope::~policy_scope()
+{
+    if (_active) {
+        policy = _saved;
+    }
+}
+
+}
@@ -8,14 +8,19 @@
 
 #include <unordered_map>
 #include <unordered_set>
-#include <deque>
 #include <stack>
+#include <atomic>
+#include <array>
+#include <bitset>
 #include <boost/variant.hpp>
+#include <boost/intrusive/list.hpp>
 #include <osv/pagecache.hh>
 #include <osv/mempool.hh>
 #include <fs/vfs/vfs.h>
 #include <osv/trace.hh>
 #include <osv/prio.hh>
+#include <osv/defer.hh>
+#include <arch.hh>
 #include <chrono>
 
 extern "C" {
@@ -23,6 +28,7 @@ void arc_unshare_buf(arc_buf_t*);
 void arc_share_buf(arc_buf_t*);
 void arc_buf_accessed(const uint64_t[4]);
 void arc_buf_get_hashkey(arc_buf_t*, uint64_t[4]);
+void zio_data_buf_free(void*, size_t);
 }
 
 namespace std {
@@ -62,19 +68,102 @@ std::unordered_set<mmu::hw_ptep<0>>::iterator end(std::unique_ptr<std::unordered
 
 namespace pagecache {
 
-static unsigned lru_max_length = 100;
-static unsigned lru_free_count = 20;
+// The caches are split into shards by hashkey, each with its own locks and
+// write LRU, so faults on different pages do not contend.
+constexpr unsigned nr_shards = 64;
+constexpr unsigned min_shard_lru_length = 8;
+static std::atomic<unsigned> lru_max_length {100}; // per shard, see set_max_pages()
 constexpr unsigned max_lru_free_count = 200;
 static void* zero_page;
 
+// number of write cache pages evicted together, sharing one TLB flush
+static unsigned lru_free_count(unsigned max_length)
+{
+    return std::max(std::min(max_length / 5, max_lru_free_count), 1u);
+}
+
 void  __attribute__((constructor(init_prio::pagecache))) setup()
 {
-    lru_max_length = std::max(memory::phys_mem_size / memory::page_size / 100, size_t(100));
-    lru_free_count = std::min(lru_max_length/5, max_lru_free_count);
+    lru_max_length = std::max(memory::phys_mem_size / memory::page_size / 100 / nr_shards, size_t(min_shard_lru_length));
     zero_page = memory::alloc_page();
     memset(zero_page, 0, mmu::page_size);
 }
 
+// Pages lent to the network stack by sendfile() are referenced by mbufs after
+// the cache locks are dropped, so the cache can not free them together with
+// their owner. The loan is orphaned instead and the last unlend() frees them.
+class page_loan {
+public:
+    enum class source { arc, write };
+    page_loan(source src, void* owner, mutex& lock) : _src(src), _owner(owner), _lock(lock) {}
+    ~page_loan() {
+        if (_data) {
+            if (_src == source::arc) {
+                zio_data_buf_free(_data, _size);
+            } else {
+                memory::free_page(_data);
+            }
+        }
+    }
+    source src() const {
+        return _src;
+    }
+    void* owner() const {
+        return _owner;
+    }
+    mutex& lock() {
+        return _lock;
+    }
+    void ref() {
+        _refs++;
+    }
+    bool unref() {
+        return --_refs == 0;
+    }
+    void orphan(void* data, size_t size) {
+        _owner = nullptr;
+        _data = data;
+        _size = size;
+    }
+    bool orphaned() const {
+        return !_owner;
+    }
+private:
+    const source _src;
+    void* _owner;
+    mutex& _lock; // protects _refs and the owner's entry in its loan map
+    unsigned _refs = 0;
+    void* _data = nullptr;
+    size_t _size = 0;
+};
+
+class cached_page_write;
+class cached_page_arc;
+struct cache_shard;
+
+static unsigned shard_index(const hashkey& key)
+{
+    // offsets are page aligned, so the low bits of the hash are always zero
+    return (std::hash<hashkey>()(key) >> mmu::page_size_shift) % nr_shards;
+}
+
+static cache_shard& shard_of(const hashkey& key);
+
+// An ARC buffer usually spans several pages, hence several shards
+static mutex arc_map_lock; // protects cached_page_arc::arc_cache_map and arc_loans
+static std::unordered_map<arc_buf_t*, page_loan*> arc_loans;
+
+template<typename T>
+static page_loan* lend_page(std::unordered_map<T*, page_loan*>& loans, page_loan::source src, T* owner, mutex& lock)
+{
+    auto& loan = loans[owner];
+    if (!loan) {
+        loan = new page_loan(src, owner, lock);
+    }
+    loan->ref();
+    return loan;
+}
+
 class cached_page {
 protected:
     const hashkey _key;
@@ -193,20 +282,16 @@ class cached_page_write : public cached_page {
 private:
     struct vnode* _vp;
     bool _dirty = false;
+    bool _active = false;
+    bool _referenced = false;
 public:
+    boost::intrusive::list_member_hook<> _lru_link;
+
     cached_page_write(hashkey key, vfs_file* fp) : cached_page(key, memory::alloc_page()) {
         _vp = fp->f_dentry->d_vnode;
         vref(_vp);
     }
-    ~cached_page_write() {
-        if (_page) {
-            if (_dirty) {
-                writeback();
-            }
-            memory::free_page(_page);
-            vrele(_vp);
-        }
-    }
+    ~cached_page_write();
     int writeback()
     {
         int error;
@@ -234,9 +319,73 @@ public:
     bool flush_check_dirty() {
         return for_each_pte([] (mmu::hw_ptep<0> pte) { return mmu::clear_pte(pte).dirty(); }, std::logical_or<bool>(), false);
     }
+    bool active() const {
+        return _active;
+    }
+    void set_active(bool active) {
+        _active = active;
+        _referenced = false;
+    }
+    bool referenced() const {
+        return _referenced;
+    }
+    void set_referenced() {
+        _referenced = true;
+    }
 };
 
-class cached_page_arc;
+typedef boost::intrusive::list<cached_page_write,
+        boost::intrusive::member_hook<cached_page_write,
+                boost::intrusive::list_member_hook<>,
+                &cached_page_write::_lru_link>,
+        boost::intrusive::constant_time_size<true>> lru_list;
+
+// Lock order: shard write_lock, shard arc_lock(s) in shard order, arc_map_lock.
+// The file system may be called with a write_lock held, and ARC calls
+// unmap_arc_buf() under its own locks, so arc_lock must never be held across
+// a call into the file system.
+struct cache_shard {
+    mutex write_lock; // protects the write cache, its lists, loans and stats
+    std::unordered_map<hashkey, cached_page_write*> write_cache;
+    // Write cache pages start on the inactive list and only move to the
+    // active list once they are found referenced twice, so a scan through
+    // a large file can only push out other inactive pages.
+    lru_list active;
+    lru_list inactive;
+    std::unordered_map<cached_page_write*, page_loan*> write_loans;
+    stats st {};
+    mutex arc_lock; // protects read_cache and the ptes of its pages
+    std::unordered_map<hashkey, cached_page_arc*> read_cache;
+
+    size_t write_pages() const {
+        return active.size() + inactive.size();
+    }
+} CACHELINE_ALIGNED;
+
+static std::array<cache_shard, nr_shards> shards;
+
+static cache_shard& shard_of(const hashkey& key)
+{
+    return shards[shard_index(key)];
+}
+
+cached_page_write::~cached_page_write()
+{
+    if (_page) {
+        if (_dirty) {
+            writeback();
+        }
+        auto& loans = shard_of(_key).write_loans;
+        auto loan = loans.find(this);
+        if (loan != loans.end()) {
+            loan->second->orphan(_page, mmu::page_size);
+            loans.erase(loan);
+        } else {
+            memory::free_page(_page);
+        }
+        vrele(_vp);
+    }
+}
 
 unsigned drop_read_cached_page(cached_page_arc* cp, bool flush = true);
 
@@ -252,6 +401,7 @@ private:
 
     static arc_buf_t* ref(arc_buf_t* ab, cached_page_arc* pc)
     {
+        SCOPE_LOCK(arc_map_lock);
         arc_cache_map.emplace(ab, pc);
         return ab;
     }
@@ -268,13 +418,18 @@ private:
 public:
     cached_page_arc(hashkey key, void* page, arc_buf_t* ab) : cached_page(key, page), _ab(ref(ab, this)) {}
     ~cached_page_arc() {
-        if (!_removed && unref(_ab, this)) {
-            arc_unshare_buf(_ab);
+        if (!_removed) {
+            SCOPE_LOCK(arc_map_lock);
+            // a lent buffer stays shared, so ARC keeps telling us about its eviction
+            if (unref(_ab, this) && !arc_loans.count(_ab)) {
+                arc_unshare_buf(_ab);
+            }
         }
     }
     arc_buf_t* arcbuf() {
         return _ab;
     }
+    // called with arc_map_lock and the arc_lock of every shard caching a page of ab held
     static void unmap_arc_buf(arc_buf_t* ab) {
         auto it = arc_cache_map.equal_range(ab);
         unsigned count = 0;
@@ -296,11 +451,6 @@ static bool operator==(const cached_page_arc::arc_map::value_type& l, const cach
 }
 
 std::unordered_multimap<arc_buf_t*, cached_page_arc*> cached_page_arc::arc_cache_map;
-static std::unordered_map<hashkey, cached_page_arc*> read_cache;
-static std::unordered_map<hashkey, cached_page_write*> write_cache;
-static std::deque<cached_page_write*> write_lru;
-static mutex arc_lock; // protects against parallel access to the read cache
-static mutex write_lock; // protect against parallel access to the write cache
 
 template<typename T>
 static T find_in_cache(std::unordered_map<hashkey, T>& cache, hashkey& key)
@@ -326,15 +476,15 @@ void remove_read_mapping(cached_page_arc* cp, mmu::hw_ptep<0> ptep)
 {
     trace_remove_mapping(cp->arcbuf(), cp->addr(), ptep.release());
     if (cp->unmap(ptep) == 0) {
-        read_cache.erase(cp->key());
+        shard_of(cp->key()).read_cache.erase(cp->key());
         delete cp;
     }
 }
 
-void remove_read_mapping(hashkey& key, mmu::hw_ptep<0> ptep)
+void remove_read_mapping(cache_shard& shard, hashkey& key, mmu::hw_ptep<0> ptep)
 {
-    SCOPE_LOCK(arc_lock);
-    cached_page_arc* cp = find_in_cache(read_cache, key);
+    SCOPE_LOCK(shard.arc_lock);
+    cached_page_arc* cp = find_in_cache(shard.read_cache, key);
     if (cp) {
         remove_read_mapping(cp, ptep);
     }
@@ -345,7 +495,7 @@ unsigned drop_read_cached_page(cached_page_arc* cp, bool flush)
 {
     trace_drop_read_cached_page(cp->arcbuf(), cp->addr());
     int flushed = cp->flush();
-    read_cache.erase(cp->key());
+    shard_of(cp->key()).read_cache.erase(cp->key());
 
     if (flush && flushed > 1) { // if there was only one pte it is the one we are faulting on; no need to flush.
         mmu::flush_tlb_all();
@@ -356,30 +506,90 @@ unsigned drop_read_cached_page(cached_page_arc* cp, bool flush)
     return flushed;
 }
 
-void drop_read_cached_page(hashkey& key)
+void drop_read_cached_page(cache_shard& shard, hashkey& key)
 {
-    SCOPE_LOCK(arc_lock);
-    cached_page_arc* cp = find_in_cache(read_cache, key);
+    SCOPE_LOCK(shard.arc_lock);
+    cached_page_arc* cp = find_in_cache(shard.read_cache, key);
     if (cp) {
         drop_read_cached_page(cp, true);
     }
 }
 
+typedef std::bitset<nr_shards> shard_set;
+
+static void lock_arc_shards(const shard_set& set)
+{
+    for (unsigned i = 0; i < nr_shards; i++) {
+        if (set[i]) {
+            shards[i].arc_lock.lock();
+        }
+    }
+}
+
+static void unlock_arc_shards(const shard_set& set)
+{
+    for (unsigned i = 0; i < nr_shards; i++) {
+        if (set[i]) {
+            shards[i].arc_lock.unlock();
+        }
+    }
+}
+
 TRACEPOINT(trace_unmap_arc_buf, "buf=%p", void*);
-void unmap_arc_buf(arc_buf_t* ab)
+bool unmap_arc_buf(arc_buf_t* ab, void* data, size_t size)
 {
     trace_unmap_arc_buf(ab);
-    SCOPE_LOCK(arc_lock);
-    cached_page_arc::unmap_arc_buf(ab);
+
+    // Lock every shard holding a page of the buffer. Pages may be added in
+    // other shards while arc_map_lock is not held, so the check that the
+    // locked shards cover the buffer and the unmap must be done under the
+    // same arc_map_lock; retry until they are.
+    shard_set locked;
+    bool lent = false;
+    while (true) {
+        shard_set wanted;
+        bool done = false;
+        WITH_LOCK(arc_map_lock) {
+            auto it = cached_page_arc::arc_cache_map.equal_range(ab);
+            std::for_each(it.first, it.second, [&wanted](cached_page_arc::arc_map::value_type& p) {
+                wanted.set(shard_index(p.second->key()));
+            });
+            if ((wanted & ~locked).none()) {
+                cached_page_arc::unmap_arc_buf(ab);
+
+                auto loan = arc_loans.find(ab);
+                if (loan != arc_loans.end()) {
+                    loan->second->orphan(data, size);
+                    arc_loans.erase(loan);
+                    lent = true;
+                }
+                done = true;
+            }
+        }
+        if (done) {
+            break;
+        }
+        unlock_arc_shards(locked);
+        locked |= wanted;
+        lock_arc_shards(locked);
+    }
+    unlock_arc_shards(locked);
+
+    return lent;
 }
 
 TRACEPOINT(trace_map_arc_buf, "buf=%p page=%p", void*, void*);
 void map_arc_buf(hashkey *key, arc_buf_t* ab, void *page)
 {
     trace_map_arc_buf(ab, page);
-    SCOPE_LOCK(arc_lock);
+    auto& shard = shard_of(*key);
+    SCOPE_LOCK(shard.arc_lock);
+    if (shard.read_cache.count(*key)) {
+        // another thread faulting on the same page got here first
+        return;
+    }
     cached_page_arc* pc = new cached_page_arc(*key, page, ab);
-    read_cache.emplace(*key, pc);
+    shard.read_cache.emplace(*key, pc);
     arc_share_buf(ab);
 }
 
@@ -398,51 +608,174 @@ static std::unique_ptr<cached_page_write> create_write_cached_page(vfs_file* fp,
     return std::unique_ptr<cached_page_write>(cp);
 }
 
+static void activate(cache_shard& shard, cached_page_write& cp)
+{
+    cp.set_active(true);
+    shard.active.push_front(cp);
+    shard.st.activations++;
+}
+
+// a fault found the page in the write cache
+static void mark_accessed(cache_shard& shard, cached_page_write* cp)
+{
+    shard.st.hits++;
+    if (cp->active()) {
+        return;
+    }
+    if (cp->referenced()) {
+        shard.inactive.erase(shard.inactive.iterator_to(*cp));
+        activate(shard, *cp);
+    } else {
+        cp->set_referenced();
+    }
+}
+
+// Keep the active list no longer than the inactive one: its pages that were
+// not accessed through their ptes since the last pass are demoted.
+static void balance(cache_shard& shard)
+{
+    auto budget = shard.active.size();
+    while (shard.active.size() > shard.inactive.size() && budget--) {
+        auto& cp = shard.active.back();
+        shard.active.pop_back();
+        if (cp.clear_accessed()) {
+            shard.active.push_front(cp);
+        } else {
+            cp.set_active(false);
+            shard.inactive.push_front(cp);
+        }
+    }
+}
+
 TRACEPOINT(trace_drop_write_cached_page, "addr=%p", void*);
-static void insert(cached_page_write* cp) {
-    static cached_page_write* tofree[max_lru_free_count];
-    write_cache.emplace(cp->key(), cp);
-    write_lru.push_front(cp);
-
-    if (write_lru.size() > lru_max_length) {
-        for (unsigned i = 0; i < lru_free_count; i++) {
-            cached_page_write *p = write_lru.back();
-            write_lru.pop_back();
-            trace_drop_write_cached_page(p->addr());
-            write_cache.erase(p->key());
-            if (p->flush_check_dirty()) {
-                p->mark_dirty();
+// Takes up to count pages off the tail of the inactive list. A page accessed
+// since it was last looked at gets another round on the inactive list, or is
+// activated if that already happened once. Once every page got its chance,
+// the tail is evicted regardless.
+static unsigned evict(cache_shard& shard, cached_page_write** victims, unsigned count)
+{
+    unsigned n = 0;
+    auto budget = shard.write_pages();
+
+    balance(shard);
+    while (n < count) {
+        if (shard.inactive.empty()) {
+            if (shard.active.empty()) {
+                break;
             }
-            tofree[i] = p;
+            auto& cp = shard.active.back();
+            shard.active.pop_back();
+            cp.set_active(false);
+            shard.inactive.push_front(cp);
         }
+        auto& cp = shard.inactive.back();
+        shard.inactive.pop_back();
+        if (budget && cp.clear_accessed()) {
+            budget--;
+            if (cp.referenced()) {
+                activate(shard, cp);
+            } else {
+                cp.set_referenced();
+                shard.inactive.push_front(cp);
+            }
+            continue;
+        }
+        trace_drop_write_cached_page(cp.addr());
+        shard.write_cache.erase(cp.key());
+        if (cp.flush_check_dirty()) {
+            cp.mark_dirty();
+        }
+        victims[n++] = &cp;
+    }
+    shard.st.evictions += n;
+    return n;
+}
+
+static void shrink(cache_shard& shard, size_t target)
+{
+    cached_page_write* victims[max_lru_free_count];
+
+    while (shard.write_pages() > target) {
+        auto n = evict(shard, victims, std::min(shard.write_pages() - target, size_t(max_lru_free_count)));
         mmu::flush_tlb_all();
-        for (auto p: tofree) {
-            delete p;
+        for (unsigned i = 0; i < n; i++) {
+            delete victims[i];
         }
     }
 }
 
+static void insert(cache_shard& shard, cached_page_write* cp) {
+    unsigned max_length = lru_max_length.load(std::memory_order_relaxed);
+
+    // make room before adding the page, so it can not be picked itself
+    if (shard.write_pages() >= max_length) {
+        shrink(shard, max_length - lru_free_count(max_length));
+    }
+    shard.write_cache.emplace(cp->key(), cp);
+    shard.inactive.push_front(*cp);
+}
+
+stats get_stats()
+{
+    stats ret {};
+
+    for (auto& shard : shards) {
+        SCOPE_LOCK(shard.write_lock);
+        ret.hits += shard.st.hits;
+        ret.misses += shard.st.misses;
+        ret.evictions += shard.st.evictions;
+        ret.activations += shard.st.activations;
+        ret.active += shard.active.size();
+        ret.inactive += shard.inactive.size();
+    }
+    ret.max_pages = get_max_pages();
+
+    return ret;
+}
+
+size_t get_max_pages()
+{
+    return size_t(lru_max_length.load(std::memory_order_relaxed)) * nr_shards;
+}
+
+void set_max_pages(size_t pages)
+{
+    unsigned max_length = std::max(pages / nr_shards, size_t(min_shard_lru_length));
+
+    lru_max_length.store(max_length, std::memory_order_relaxed);
+    for (auto& shard : shards) {
+        SCOPE_LOCK(shard.write_lock);
+        shrink(shard, max_length);
+    }
+}
+
 bool get(vfs_file* fp, off_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pte, bool write, bool shared)
 {
     struct stat st;
     fp->stat(&st);
     hashkey key {st.st_dev, st.st_ino, offset};
-    SCOPE_LOCK(write_lock);
-    cached_page_write* wcp = find_in_cache(write_cache, key);
+    auto& shard = shard_of(key);
+    SCOPE_LOCK(shard.write_lock);
+    cached_page_write* wcp = find_in_cache(shard.write_cache, key);
+
+    if (wcp) {
+        mark_accessed(shard, wcp);
+    }
 
     if (write) {
         if (!wcp) {
+            shard.st.misses++;
             auto newcp = create_write_cached_page(fp, key);
             if (shared) {
                 // write fault into shared mapping, there page is not in write cache yet, add it.
                 wcp = newcp.release();
-                insert(wcp);
+                insert(shard, wcp);
                 // page is moved from ARC to write cache
                 // drop ARC page if exists, removing all mappings
-                drop_read_cached_page(key);
+                drop_read_cached_page(shard, key);
             } else {
                 // remove mapping to ARC page if exists
-                remove_read_mapping(key, ptep);
+                remove_read_mapping(shard, key, ptep);
                 // cow of private page from ARC
                 return mmu::write_pte(newcp->release(), ptep, pte);
             }
@@ -456,22 +789,22 @@ bool get(vfs_file* fp, off_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pt
         int ret;
         // read fault and page is not in write cache yet, return one from ARC, mark it cow
         do {
-            WITH_LOCK(arc_lock) {
-                cached_page_arc* cp = find_in_cache(read_cache, key);
+            WITH_LOCK(shard.arc_lock) {
+                cached_page_arc* cp = find_in_cache(shard.read_cache, key);
                 if (cp) {
                     add_read_mapping(cp, ptep);
                     return mmu::write_pte(cp->addr(), ptep, mmu::pte_mark_cow(pte, true));
                 }
             }
 
-            DROP_LOCK(write_lock) {
+            DROP_LOCK(shard.write_lock) {
                 // page is not in cache yet, create and try again
                 // function may sleep so drop write lock while executing it
                 ret = create_read_cached_page(fp, key);
             }
 
             // we dropped write lock, need to re-check write cache again
-            wcp = find_in_cache(write_cache, key);
+            wcp = find_in_cache(shard.write_cache, key);
             if (wcp) {
                 // write cache page appeared while we were creating a read cache page from ARC
                 // return will cause faulting thread to re-fault and we will try again
@@ -489,18 +822,103 @@ bool get(vfs_file* fp, off_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pt
     return mmu::write_pte(wcp->addr(), ptep, mmu::pte_mark_cow(pte, !shared));
 }
 
+bool cached(vfs_file* fp, off_t offset)
+{
+    struct stat st;
+    fp->stat(&st);
+    hashkey key {st.st_dev, st.st_ino, offset};
+    auto& shard = shard_of(key);
+    WITH_LOCK(shard.write_lock) {
+        if (find_in_cache(shard.write_cache, key)) {
+            return true;
+        }
+    }
+    SCOPE_LOCK(shard.arc_lock);
+    return find_in_cache(shard.read_cache, key) != nullptr;
+}
+
+TRACEPOINT(trace_lend, "offset=0x%x, addr=%p, loan=%p", off_t, void*, void*);
+void* lend(vfs_file* fp, off_t offset, page_loan** loan)
+{
+    struct stat st;
+    fp->stat(&st);
+    hashkey key {st.st_dev, st.st_ino, offset};
+    auto& shard = shard_of(key);
+    SCOPE_LOCK(shard.write_lock);
+    int ret;
+
+    do {
+        cached_page_write* wcp = find_in_cache(shard.write_cache, key);
+        if (wcp) {
+            *loan = lend_page(shard.write_loans, page_loan::source::write, wcp, shard.write_lock);
+            trace_lend(offset, wcp->addr(), *loan);
+            return wcp->addr();
+        }
+
+        WITH_LOCK(shard.arc_lock) {
+            cached_page_arc* cp = find_in_cache(shard.read_cache, key);
+            if (cp) {
+                WITH_LOCK(arc_map_lock) {
+                    *loan = lend_page(arc_loans, page_loan::source::arc, cp->arcbuf(), arc_map_lock);
+                }
+                trace_lend(offset, cp->addr(), *loan);
+                return cp->addr();
+            }
+        }
+
+        DROP_LOCK(shard.write_lock) {
+            ret = create_read_cached_page(fp, key);
+        }
+    } while (ret != -1);
+
+    // a hole in the file
+    *loan = nullptr;
+    return zero_page;
+}
+
+TRACEPOINT(trace_unlend, "loan=%p", void*);
+void unlend(page_loan* loan)
+{
+    trace_unlend(loan);
+    if (!loan) {
+        return;
+    }
+
+    WITH_LOCK(loan->lock()) {
+        if (!loan->unref()) {
+            return;
+        }
+        if (loan->orphaned()) {
+            // nothing to detach from
+        } else if (loan->src() == page_loan::source::arc) {
+            auto ab = static_cast<arc_buf_t*>(loan->owner());
+            arc_loans.erase(ab);
+            if (cached_page_arc::arc_cache_map.find(ab) == cached_page_arc::arc_cache_map.end()) {
+                arc_unshare_buf(ab);
+            }
+        } else {
+            auto wcp = static_cast<cached_page_write*>(loan->owner());
+            shard_of(wcp->key()).write_loans.erase(wcp);
+        }
+    }
+
+    // frees the page if its owner was evicted meanwhile
+    delete loan;
+}
+
 bool release(vfs_file* fp, void *addr, off_t offset, mmu::hw_ptep<0> ptep)
 {
     struct stat st;
     fp->stat(&st);
     hashkey key {st.st_dev, st.st_ino, offset};
+    auto& shard = shard_of(key);
 
     auto old = clear_pte(ptep);
 
     // page is either in ARC cache or write cache or zero page or private page
 
-    WITH_LOCK(write_lock) {
-        cached_page_write* wcp = find_in_cache(write_cache, key);
+    WITH_LOCK(shard.write_lock) {
+        cached_page_write* wcp = find_in_cache(shard.write_cache, key);
 
         if (wcp && mmu::virt_to_phys(wcp->addr()) == old.addr()) {
             // page is in write cache
@@ -513,8 +931,8 @@ bool release(vfs_file* fp, void *addr, off_t offset, mmu::hw_ptep<0> ptep)
         }
     }
 
-    WITH_LOCK(arc_lock) {
-        cached_page_arc* rcp = find_in_cache(read_cache, key);
+    WITH_LOCK(shard.arc_lock) {
+        cached_page_arc* rcp = find_in_cache(shard.read_cache, key);
         if (rcp && mmu::virt_to_phys(rcp->addr()) == old.addr()) {
             // page is in ARC
             remove_read_mapping(rcp, ptep);
@@ -528,14 +946,24 @@ bool release(vfs_file* fp, void *addr, off_t offset, mmu::hw_ptep<0> ptep)
 
 void sync(vfs_file* fp, off_t start, off_t end)
 {
-    static std::stack<cached_page_write*> dirty; // protected by write_lock
+    std::stack<cached_page_write*> dirty;
     struct stat st;
     fp->stat(&st);
     hashkey key {st.st_dev, st.st_ino, 0};
-    SCOPE_LOCK(write_lock);
+
+    // the range spans all shards, and pages must not be evicted before
+    // they are written back
+    for (auto& shard : shards) {
+        shard.write_lock.lock();
+    }
+    auto unlock = defer([] {
+        for (auto& shard : shards) {
+            shard.write_lock.unlock();
+        }
+    });
 
     for (key.offset = start; key.offset < end; key.offset += mmu::page_size) {
-        cached_page_write* cp = find_in_cache(write_cache, key);
+        cached_page_write* cp = find_in_cache(shard_of(key).write_cache, key);
         if (cp && cp->clear_dirty()) {
             dirty.push(cp);
         }
@@ -578,14 +1006,14 @@ private:
     }
     void run()
     {
-        cached_page_arc::arc_map::size_type current_bucket = 0;
+        unsigned current_shard = 0;
+        std::unordered_map<hashkey, cached_page_arc*>::size_type current_bucket = 0;
         std::unordered_set<arc_hashkey> accessed;
         unsigned scanned = 0, cleared = 0;
 
         while (true) {
-            unsigned buckets_scanned = 0;
+            unsigned shards_scanned = 0;
             bool flush = false;
-            auto bucket_count = cached_page_arc::arc_cache_map.bucket_count();
 
             double work = (1000000000 * _cpu)/100;
             double sleep = 1000000000 - work;
@@ -595,43 +1023,50 @@ private:
             auto start = sched::thread::current()->thread_clock();
             auto deadline = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::nanoseconds(static_cast<unsigned long>(work/_freq))) + start;
 
-            WITH_LOCK(arc_lock) {
-                while (sched::thread::current()->thread_clock() < deadline && buckets_scanned < bucket_count) {
-                    if (current_bucket >= cached_page_arc::arc_cache_map.bucket_count()) {
-                        current_bucket = 0;
-                    }
-                    std::for_each(cached_page_arc::arc_cache_map.begin(current_bucket), cached_page_arc::arc_cache_map.end(current_bucket),
-                            [&accessed, &scanned, &cleared](cached_page_arc::arc_map::value_type& p) {
-                        auto arcbuf = p.first;
-                        auto cp = p.second;
-                        if (cp->clear_accessed()) {
-                            arc_hashkey arc_hashkey;
-                            arc_buf_get_hashkey(arcbuf, arc_hashkey.key);
-                            accessed.emplace(arc_hashkey);
-                            cleared++;
-                        }
-                        scanned++;
-                    });
-                    current_bucket++;
-                    buckets_scanned++;
-
-                    // mark ARC buffers as accessed when we have 1024 of them
-                    if (!(cleared % 1024)) {
-                        DROP_LOCK(arc_lock) {
-                            flush = mark_accessed(accessed);
-                        }
+            while (sched::thread::current()->thread_clock() < deadline && shards_scanned < nr_shards) {
+                auto& shard = shards[current_shard];
+                bool done;
+
+                WITH_LOCK(shard.arc_lock) {
+                    auto& cache = shard.read_cache;
+                    while (sched::thread::current()->thread_clock() < deadline && current_bucket < cache.bucket_count()) {
+                        std::for_each(cache.begin(current_bucket), cache.end(current_bucket),
+                                [&accessed, &scanned, &cleared](std::unordered_map<hashkey, cached_page_arc*>::value_type& p) {
+                            auto cp = p.second;
+                            if (cp->clear_accessed()) {
+                                arc_hashkey arc_hashkey;
+                                arc_buf_get_hashkey(cp->arcbuf(), arc_hashkey.key);
+                                accessed.emplace(arc_hashkey);
+                                cleared++;
+                            }
+                            scanned++;
+                        });
+                        current_bucket++;
                     }
+                    done = current_bucket >= cache.bucket_count();
+                }
+
+                if (done) {
+                    current_bucket = 0;
+                    current_shard = (current_shard + 1) % nr_shards;
+                    shards_scanned++;
+                }
+
+                // mark ARC buffers as accessed when we have 1024 of them,
+                // ARC takes its own locks so do it between shards
+                if (accessed.size() >= 1024) {
+                    flush |= mark_accessed(accessed);
                 }
             }
 
             // mark leftovers ARC buffers as accessed
-            flush = mark_accessed(accessed);
+            flush |= mark_accessed(accessed);
 
             if (flush) {
                 mmu::flush_tlb_all();
             }
 
-            if (buckets_scanned == bucket_count || !scanned) {
+            if (shards_scanned == nr_shards || !scanned) {
                 _cpu = _min_cpu;
             } else {
                 _cpu = std::max(_min_cpu, std::min(_max_cpu, _cpu * ((cleared*5.0)/scanned)));
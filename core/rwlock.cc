@@ -8,6 +8,24 @@
 #include <mutex>
 #include <osv/sched.hh>
 #include <osv/rwlock.h>
+#include <osv/lock-profiler.hh>
+
+using lock_kind = prof::lock::kind;
+
+static inline void profile_acquired(rwlock* rw, lock_kind k, uint64_t wait_start = 0)
+{
+    if (__builtin_expect(prof::lock::enabled, false)) {
+        prof::lock::acquired(rw, k, wait_start,
+                wait_start ? prof::lock::now_ns() - wait_start : 0);
+    }
+}
+
+static inline void profile_released(rwlock* rw)
+{
+    if (__builtin_expect(prof::lock::enabled, false)) {
+        prof::lock::released(rw);
+    }
+}
 
 rwlock::rwlock()
     : _readers(0),
@@ -26,9 +44,14 @@ rwlock::~rwlock()
 void rwlock::rlock()
 {
     std::lock_guard<mutex> guard(_mtx);
+    uint64_t wait_start = 0;
+    if (prof::lock::enabled && !read_lockable()) {
+        wait_start = prof::lock::now_ns();
+    }
     reader_wait_lockable();
 
     _readers++;
+    profile_acquired(this, lock_kind::rwlock_read, wait_start);
 }
 
 bool rwlock::try_rlock()
@@ -39,6 +62,7 @@ bool rwlock::try_rlock()
     }
 
     _readers++;
+    profile_acquired(this, lock_kind::rwlock_read);
     return true;
 }
 
@@ -47,6 +71,7 @@ void rwlock::runlock()
     WITH_LOCK(_mtx) {
         assert(_wowner == nullptr);
         assert(_readers > 0);
+        profile_released(this);
 
         // If we are the last reader and we have a write waiter,
         // then wake up one writer
@@ -65,6 +90,8 @@ bool rwlock::try_upgrade()
         assert(_wowner == nullptr);
         _readers = 0;
         _wowner = sched::thread::current();
+        profile_released(this);
+        profile_acquired(this, lock_kind::rwlock_write);
         return true;
     }
 
@@ -74,14 +101,20 @@ bool rwlock::try_upgrade()
 void rwlock::wlock()
 {
     std::lock_guard<mutex> guard(_mtx);
+    uint64_t wait_start = 0;
+    if (prof::lock::enabled && !write_lockable()) {
+        wait_start = prof::lock::now_ns();
+    }
     writer_wait_lockable();
 
     // recursive write lock
     if (_wowner == sched::thread::current()) {
         _wrecurse++;
+        return;
     }
 
     _wowner = sched::thread::current();
+    profile_acquired(this, lock_kind::rwlock_write, wait_start);
 }
 
 bool rwlock::try_wlock()
@@ -94,9 +127,11 @@ bool rwlock::try_wlock()
     // recursive write lock
     if (_wowner == sched::thread::current()) {
         _wrecurse++;
+        return true;
     }
 
     _wowner = sched::thread::current();
+    profile_acquired(this, lock_kind::rwlock_write);
     return true;
 }
 
@@ -109,6 +144,7 @@ void rwlock::wunlock()
             _wrecurse--;
         } else {
             _wowner = nullptr;
+            profile_released(this);
         }
 
         if (!_write_waiters.empty()) {
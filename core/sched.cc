@@ -25,6 +25,7 @@
 #include <osv/preempt-lock.hh>
 #include <osv/app.hh>
 #include <osv/symbols.hh>
+#include <osv/numa.hh>
 
 MAKE_SYMBOL(sched::thread::current);
 MAKE_SYMBOL(sched::cpu::current);
@@ -139,6 +140,7 @@ private:
 
 cpu::cpu(unsigned _id)
     : id(_id)
+    , topology{_id, 0, 0}
     , preemption_timer(*this)
     , idle_thread()
     , terminating_thread(nullptr)
@@ -235,6 +237,7 @@ void cpu::reschedule_from_interrupt(bool called_from_yield,
     assert(sched::exception_depth <= 1);
     need_reschedule = false;
     handle_incoming_wakeups();
+    handle_steal_requests();
 
     auto now = osv::clock::uptime::now();
     auto interval = now - running_since;
@@ -252,31 +255,28 @@ void cpu::reschedule_from_interrupt(bool called_from_yield,
 
     p->_total_cpu_time += interval;
     p->_runtime.ran_for(interval);
+    if (p->_realtime._priority) {
+        p->_realtime._run_time += interval;
+    }
+    account_realtime(now, interval, p->_realtime._priority);
+    // p is not queued, so a change of its real-time class can be taken up
+    p->_realtime.update();
 
     if (p_status == thread::status::running) {
-        // The current thread is still runnable. Check if it still has the
-        // lowest runtime, and update the timer until the next thread's turn.
-        if (runqueue.empty()) {
-            preemption_timer.cancel();
+        // The current thread is still runnable. Check if it should still
+        // run, and update the timer until the next thread's turn.
+        auto t = next_thread();
+        if (!t || (!called_from_yield && !preempts(*t, *p))) {
+            set_preemption_timer(*p, now);
             return;
-        } else if (!called_from_yield) {
-            auto &t = *runqueue.begin();
-            if (p->_runtime.get_local() < t._runtime.get_local()) {
-                preemption_timer.cancel();
-                auto delta = p->_runtime.time_until(t._runtime.get_local());
-                if (delta > 0) {
-                    preemption_timer.set(now + delta);
-                }
-                return;
-            }
         }
-        // If we're here, p no longer has the lowest runtime. Before queuing
-        // p, return the runtime it borrowed for hysteresis.
+        // If we're here, p should make way for t. Before queuing p, return
+        // the runtime it borrowed for hysteresis.
         p->_runtime.hysteresis_run_stop();
         p->_detached_state->st.store(thread::status::queued);
 
         if (!called_from_yield) {
-            enqueue(*p);
+            requeue(*p);
         }
 
         trace_sched_preempt();
@@ -287,9 +287,10 @@ void cpu::reschedule_from_interrupt(bool called_from_yield,
         p->_runtime.hysteresis_run_stop();
     }
 
-    auto ni = runqueue.begin();
-    auto n = &*ni;
-    runqueue.erase(ni);
+    // The idle thread is queued unless p is the idle thread, which is still
+    // running if we got here, so there is a thread to run
+    auto n = next_thread();
+    runqueue.erase(runqueue.iterator_to(*n));
     n->cputime_estimator_set(now, n->_total_cpu_time);
     assert(n->_detached_state->st.load() == thread::status::queued);
     trace_sched_switch(n, p->_runtime.get_local(), n->_runtime.get_local());
@@ -304,6 +305,7 @@ void cpu::reschedule_from_interrupt(bool called_from_yield,
         trace_sched_idle_ret();
     }
     n->stat_switches.incr();
+    p->_last_run = now;
 
     trace_sched_load(runqueue.size());
 
@@ -316,22 +318,23 @@ void cpu::reschedule_from_interrupt(bool called_from_yield,
             && p != idle_thread) {
         n->_runtime.add_context_switch_penalty();
     }
-    preemption_timer.cancel();
     if (!called_from_yield) {
-        if (!runqueue.empty()) {
-            auto& t = *runqueue.begin();
-            auto delta = n->_runtime.time_until(t._runtime.get_local());
-            if (delta > 0) {
-                preemption_timer.set(now + delta);
-            }
-        }
+        set_preemption_timer(*n, now);
     } else {
+        preemption_timer.cancel();
         preemption_timer.set(now + preempt_after);
     }
 
     if (app_thread.load(std::memory_order_relaxed) != n->_app) { // don't write into a cache line if it can be avoided
         app_thread.store(n->_app, std::memory_order_relaxed);
     }
+    if (idle_thread_running.load(std::memory_order_relaxed) != (n == idle_thread)) {
+        idle_thread_running.store(n == idle_thread, std::memory_order_relaxed);
+    }
+    running_thread.store(n, std::memory_order_relaxed);
+    if (running_realtime_priority.load(std::memory_order_relaxed) != n->_realtime._priority) {
+        running_realtime_priority.store(n->_realtime._priority, std::memory_order_relaxed);
+    }
     if (lazy_flush_tlb.exchange(false, std::memory_order_seq_cst)) {
         mmu::flush_tlb_local();
     }
@@ -348,6 +351,113 @@ void cpu::reschedule_from_interrupt(bool called_from_yield,
     }
 }
 
+// The queued thread to run next: the first in the runqueue, skipping the
+// real-time threads while they are throttled
+thread* cpu::next_thread()
+{
+    for (auto& t : runqueue) {
+        if (!t._realtime._priority || !rt_throttled()) {
+            return &t;
+        }
+    }
+    return nullptr;
+}
+
+// Whether the idle thread has a thread to make way for.  Real-time threads
+// throttled for the rest of the period don't count; the preemption timer
+// set when the idle thread was switched in ends the halt at the period's
+// end.
+bool cpu::idle_has_work()
+{
+    if (runqueue.empty()) {
+        return false;
+    }
+    irq_save_lock_type irq_lock;
+    WITH_LOCK(irq_lock) {
+        account_realtime(osv::clock::uptime::now(), thread_runtime::duration(0), false);
+        return next_thread();
+    }
+}
+
+// Whether the queued thread t should replace the running thread p
+bool cpu::preempts(thread& t, thread& p)
+{
+    if (p._realtime._priority) {
+        // A real-time thread runs until one of a higher priority is queued,
+        // its time slice runs out, or it is throttled
+        return t._realtime._priority > p._realtime._priority ||
+               (t._realtime._priority == p._realtime._priority &&
+                       p._realtime.slice_expired()) ||
+               rt_throttled();
+    }
+    if (t._realtime._priority) {
+        return true;
+    }
+    return !(p._runtime.get_local() < t._runtime.get_local());
+}
+
+// Queues the preempted thread t. A real-time thread with time left in its
+// slice goes ahead of the others of its priority, as if it never stopped.
+void cpu::requeue(thread& t)
+{
+    if (t._realtime._priority && !t._realtime.slice_expired()) {
+        trace_sched_queue(&t);
+        runqueue.insert_before(runqueue.lower_bound(t), t);
+    } else {
+        t._realtime._run_time = thread_runtime::duration(0);
+        enqueue(t);
+    }
+}
+
+void cpu::account_realtime(osv::clock::uptime::time_point now,
+                           thread_runtime::duration interval, bool realtime)
+{
+    if (now - rt_period_start >= rt_throttle_period) {
+        rt_period_start = now;
+        rt_period_runtime = thread_runtime::duration(0);
+    }
+    if (realtime) {
+        rt_period_runtime += interval;
+    }
+}
+
+bool cpu::rt_throttled() const
+{
+    return rt_period_runtime >= rt_throttle_runtime;
+}
+
+// Sets the preemption timer for when the running thread n should make way
+// for the next queued thread, if that can come without another thread
+// being queued
+void cpu::set_preemption_timer(thread& n, osv::clock::uptime::time_point now)
+{
+    preemption_timer.cancel();
+    auto t = next_thread();
+    auto delta = thread_runtime::duration::max();
+    if (n._realtime._priority) {
+        if (t && t->_realtime._priority == n._realtime._priority &&
+                n._realtime._time_slice.count()) {
+            delta = n._realtime._time_slice - n._realtime._run_time;
+        }
+        // The idle thread is queued, so n may be throttled
+        delta = std::min(delta, rt_throttle_runtime - rt_period_runtime);
+    } else {
+        if (t && !t->_realtime._priority) {
+            auto d = n._runtime.time_until(t->_runtime.get_local());
+            if (d > thread_runtime::duration(0)) {
+                delta = d;
+            }
+        }
+        if (!runqueue.empty() && runqueue.begin()->_realtime._priority) {
+            // Throttled real-time threads are let back in the next period
+            delta = std::min(delta, rt_period_start + rt_throttle_period - now);
+        }
+    }
+    if (delta != thread_runtime::duration::max() && delta > thread_runtime::duration(0)) {
+        preemption_timer.set(now + delta);
+    }
+}
+
 void cpu::timer_fired()
 {
     // nothing to do, preemption will happen if needed
@@ -371,38 +481,45 @@ void cpu::idle_poll_end()
     std::atomic_thread_fence(std::memory_order_seq_cst);
 }
 
-void cpu::send_wakeup_ipi()
+// A busy cpu notices incoming wakeups when it next reschedules, so it is
+// only interrupted to preempt its running thread.
+void cpu::send_wakeup_ipi(bool preempt)
 {
     std::atomic_thread_fence(std::memory_order_seq_cst);
-    if (!idle_poll.load(std::memory_order_relaxed) && runqueue.size() <= 1) {
+    if (!idle_poll.load(std::memory_order_relaxed) && (preempt || runqueue.size() <= 1)) {
         trace_sched_ipi(id);
         wakeup_ipi.send(this);
     }
 }
 
+// Spins of the idle loop between two attempts at stealing work
+constexpr unsigned steal_interval = 1024;
+
 void cpu::do_idle()
 {
     do {
         idle_poll_lock_type idle_poll_lock{*this};
         WITH_LOCK(idle_poll_lock) {
-            // spin for a bit before halting
+            // spin for a bit before halting, asking loaded cpus for work
             for (unsigned ctr = 0; ctr < 10000; ++ctr) {
-                // FIXME: can we pull threads from loaded cpus?
+                if (ctr % steal_interval == 0) {
+                    try_steal();
+                }
                 handle_incoming_wakeups();
-                if (!runqueue.empty()) {
+                if (idle_has_work()) {
                     return;
                 }
             }
         }
         std::unique_lock<irq_lock_type> guard(irq_lock);
         handle_incoming_wakeups();
-        if (!runqueue.empty()) {
+        if (idle_has_work()) {
             return;
         }
         guard.release();
         arch::wait_for_interrupt(); // this unlocks irq_lock
         handle_incoming_wakeups();
-    } while (runqueue.empty());
+    } while (!idle_has_work());
 }
 
 void start_early_threads();
@@ -427,6 +544,9 @@ void cpu::idle()
 
 void cpu::handle_incoming_wakeups()
 {
+    // Cleared first, so a waker which still finds it set, having queued its
+    // thread before looking, knows this pass will take the thread
+    preempt_pending.store(false);
     cpu_set queues_with_wakes{incoming_wakeups_mask.fetch_clear()};
     if (!queues_with_wakes) {
         return;
@@ -444,6 +564,7 @@ void cpu::handle_incoming_wakeups()
                     t._detached_state->st.store(thread::status::running);
                 } else {
                     t._detached_state->st.store(thread::status::queued);
+                    t._realtime.update();
                     // Make sure the CPU-local runtime measure is suitably
                     // normalized. We may need to convert a global value to the
                     // local value when waking up after a CPU migration, or to
@@ -451,6 +572,9 @@ void cpu::handle_incoming_wakeups()
                     t._runtime.update_after_sleep();
                     enqueue(t);
                     t.resume_timers();
+                    if (!t._migration_lock_counter) {
+                        kick_idle_cpu();
+                    }
                 }
             }
         }
@@ -459,6 +583,203 @@ void cpu::handle_incoming_wakeups()
     trace_sched_load(runqueue.size());
 }
 
+// A thread which ran on its cpu this recently probably still has its data in
+// the cpu's cache, and is left there if possible
+constexpr auto migration_cost = 500_us;
+// How many queued threads to look at for one to give away
+constexpr unsigned max_steal_scan = 16;
+
+static bool is_idle(cpu* c)
+{
+    return c->idle_thread_running.load(std::memory_order_relaxed);
+}
+
+unsigned cpu::busy_siblings()
+{
+    return std::count_if(siblings.begin(), siblings.end(),
+            [this] (cpu* c) { return c != this && !is_idle(c); });
+}
+
+// A runnable thread was just queued behind another one. A halted cpu would
+// only notice it at the next load_balance(), so wake one up: it will ask us
+// for a thread (see try_steal()) before going back to sleep. Closer cpus are
+// preferred, but a cpu on an idle core over an SMT sibling of a busy one.
+void cpu::kick_idle_cpu()
+{
+    // Don't wake a cpu we would then refuse a thread to
+    if (!steal_candidate(osv::clock::uptime::now())) {
+        return;
+    }
+    cpu* target = nullptr;
+    for (auto& d : domains) {
+        for (auto c : d.cpus) {
+            if (c != this && is_idle(c) && !c->idle_poll.load(std::memory_order_relaxed) &&
+                    (!target || c->busy_siblings() < target->busy_siblings())) {
+                target = c;
+            }
+        }
+        if (target && !target->busy_siblings()) {
+            break;
+        }
+    }
+    if (target) {
+        trace_sched_ipi(target->id);
+        wakeup_ipi.send(target);
+    }
+}
+
+// Called by an idle cpu: asks the busiest cpu of the closest domain which
+// has a thread to spare for one of its queued threads. Only a cpu may touch
+// its runqueue, so the thread is pushed to us by the busy cpu itself, when
+// it next reschedules (see handle_steal_requests()).
+bool cpu::try_steal()
+{
+    // A busy cpu's runqueue holds its idle thread. If our core is busy
+    // already, sharing it is only worth it to cut a longer queue.
+    unsigned min_load = busy_siblings() ? 2 : 1;
+    for (auto& d : domains) {
+        cpu* busiest = nullptr;
+        unsigned max_load = min_load;
+        for (auto c : d.cpus) {
+            if (c == this || is_idle(c)) {
+                continue;
+            }
+            auto l = c->load();
+            if (l > max_load) {
+                max_load = l;
+                busiest = c;
+            }
+        }
+        if (busiest) {
+            if (!busiest->steal_requests.test_and_set(id)) {
+                trace_sched_ipi(busiest->id);
+                wakeup_ipi.send(busiest);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// The cpu a thread queued here is best moved to, if any. Closer cpus are
+// preferred, as the thread's data may still be in a cache they share with
+// us; among equally loaded ones, cpus on idle cores over SMT siblings of
+// busy ones.
+cpu* cpu::balance_target()
+{
+    for (auto& d : domains) {
+        cpu* min = nullptr;
+        for (auto c : d.cpus) {
+            if (c != this && (!min || c->load() < min->load() ||
+                    (c->load() == min->load() && c->busy_siblings() < min->busy_siblings()))) {
+                min = c;
+            }
+        }
+        // This CPU is temporarily running one extra thread (the balancer),
+        // so don't migrate a thread away if the difference is only 1.
+        if (min && min->load() < (load() - 1)) {
+            return min;
+        }
+    }
+    return nullptr;
+}
+
+void build_sched_domains()
+{
+    for (auto c : cpus) {
+        c->domains.clear();
+        auto add = [c] (const char* name, std::function<bool (cpu*)> shares) {
+            std::vector<cpu*> members;
+            for (auto o : cpus) {
+                if (shares(o)) {
+                    members.push_back(o);
+                }
+            }
+            if (c->domains.empty() || members.size() > c->domains.back().cpus.size()) {
+                c->domains.push_back(sched_domain{name, members});
+            }
+        };
+        add("core", [c] (cpu* o) { return o->topology.core == c->topology.core; });
+        c->siblings = c->domains.back().cpus;
+        if (c->siblings.size() == 1) {
+            // a domain of one cpu has nothing to balance
+            c->domains.clear();
+        }
+        add("cache", [c] (cpu* o) { return o->topology.cache == c->topology.cache; });
+        add("package", [c] (cpu* o) { return o->topology.package == c->topology.package; });
+        add("node", [c] (cpu* o) { return numa::cpu_node(o->id) == numa::cpu_node(c->id); });
+        add("system", [] (cpu* o) { return true; });
+    }
+}
+
+void cpu::handle_steal_requests()
+{
+    if (!steal_requests) {
+        return;
+    }
+    cpu_set requests{steal_requests.fetch_clear()};
+    auto now = osv::clock::uptime::now();
+    for (auto i : requests) {
+        auto thief = cpus[i];
+        // It may have found something to run meanwhile
+        if (thief->load() || !thief->idle_thread_running.load(std::memory_order_relaxed)) {
+            continue;
+        }
+        auto mig = steal_candidate(now);
+        if (!mig) {
+            continue;
+        }
+        push_thread(*mig, thief);
+    }
+}
+
+// The queued thread an idle cpu asking for work gets, if any. Threads at the
+// back of the runqueue have the longest wait ahead. Prefer one whose cache
+// footprint has gone cold; a warm one is only worth moving if it would
+// otherwise wait behind another thread.
+thread* cpu::steal_candidate(osv::clock::uptime::time_point now)
+{
+    thread* warm = nullptr;
+    unsigned candidates = 0, scanned = 0;
+    for (auto it = runqueue.rbegin(); it != runqueue.rend() && scanned < max_steal_scan; ++it, ++scanned) {
+        auto& t = *it;
+        if (&t == idle_thread || t._migration_lock_counter) {
+            continue;
+        }
+        candidates++;
+        if (now - t._last_run >= migration_cost) {
+            return &t;
+        } else if (!warm) {
+            warm = &t;
+        }
+    }
+    return candidates >= 2 ? warm : nullptr;
+}
+
+// Moves a thread queued on this cpu to @target's runqueue; irqs must be
+// disabled
+void cpu::push_thread(thread& mig, cpu* target)
+{
+    trace_sched_migrate(&mig, target->id);
+    runqueue.erase(runqueue.iterator_to(mig));
+    // we won't race with wake(), since we're not thread::waiting
+    assert(mig._detached_state->st.load() == thread::status::queued);
+    mig._detached_state->st.store(thread::status::waking);
+    mig.suspend_timers();
+    mig._detached_state->_cpu = target;
+    // Convert the CPU-local runtime measure to a globally meaningful
+    // measure
+    mig._runtime.export_runtime();
+    mig.remote_thread_local_var(::percpu_base) = target->percpu_base;
+    mig.remote_thread_local_var(current_cpu) = target;
+    mig.stat_migrations.incr();
+    target->incoming_wakeups[id].push_back(mig);
+    target->incoming_wakeups_mask.set(id);
+    // FIXME: avoid if the cpu is alive and if the priority does not
+    // FIXME: warrant an interruption
+    target->send_wakeup_ipi();
+}
+
 void cpu::enqueue(thread& t)
 {
     trace_sched_queue(&t);
@@ -525,14 +846,8 @@ void cpu::load_balance()
         if (runqueue.empty()) {
             continue;
         }
-        auto min = *std::min_element(cpus.begin(), cpus.end(),
-                [](cpu* c1, cpu* c2) { return c1->load() < c2->load(); });
-        if (min == this) {
-            continue;
-        }
-        // This CPU is temporarily running one extra thread (this thread),
-        // so don't migrate a thread away if the difference is only 1.
-        if (min->load() >= (load() - 1)) {
+        auto min = balance_target();
+        if (!min) {
             continue;
         }
         WITH_LOCK(irq_lock) {
@@ -541,25 +856,7 @@ void cpu::load_balance()
             if (i == runqueue.rend()) {
                 continue;
             }
-            auto& mig = *i;
-            trace_sched_migrate(&mig, min->id);
-            runqueue.erase(std::prev(i.base()));  // i.base() returns off-by-one
-            // we won't race with wake(), since we're not thread::waiting
-            assert(mig._detached_state->st.load() == thread::status::queued);
-            mig._detached_state->st.store(thread::status::waking);
-            mig.suspend_timers();
-            mig._detached_state->_cpu = min;
-            // Convert the CPU-local runtime measure to a globally meaningful
-            // measure
-            mig._runtime.export_runtime();
-            mig.remote_thread_local_var(::percpu_base) = min->percpu_base;
-            mig.remote_thread_local_var(current_cpu) = min;
-            mig.stat_migrations.incr();
-            min->incoming_wakeups[id].push_back(mig);
-            min->incoming_wakeups_mask.set(id);
-            // FIXME: avoid if the cpu is alive and if the priority does not
-            // FIXME: warrant an interruption
-            min->send_wakeup_ipi();
+            push_thread(*i, min);
         }
     }
 }
@@ -596,13 +893,18 @@ void thread::yield(thread_runtime::duration preempt_after)
     // FIXME: drive by IPI
     cpu::current()->handle_incoming_wakeups();
     // FIXME: what about other cpus?
-    if (cpu::current()->runqueue.empty()) {
+    auto tnext = cpu::current()->next_thread();
+    if (!tnext) {
         return;
     }
     assert(t->_detached_state->st.load() == status::running);
-    // Do not yield to a thread with idle priority
-    thread &tnext = *(cpu::current()->runqueue.begin());
-    if (tnext.priority() == thread::priority_idle) {
+    // Do not yield to a thread with idle priority, or to one of a lower
+    // real-time priority unless we are throttled
+    if (tnext->priority() == thread::priority_idle) {
+        return;
+    }
+    if (tnext->_realtime._priority < t->_realtime._priority &&
+            !cpu::current()->rt_throttled()) {
         return;
     }
     trace_sched_yield_switch();
@@ -620,6 +922,52 @@ float thread::priority() const
     return _runtime.priority();
 }
 
+void thread::realtime::update()
+{
+    if (!_changed.load(std::memory_order_relaxed) ||
+            !_changed.exchange(false, std::memory_order_acquire)) {
+        return;
+    }
+    _priority = _new_priority.load(std::memory_order_relaxed);
+    _time_slice = thread_runtime::duration(
+            _new_time_slice.load(std::memory_order_relaxed));
+}
+
+void thread::update_realtime()
+{
+    _realtime._changed.store(true, std::memory_order_release);
+    if (this == current()) {
+        // Lowering our own priority may let a queued thread run; the
+        // scheduler takes the change up in any case
+        WITH_LOCK(irq_lock) {
+            preempt();
+        }
+    }
+}
+
+void thread::set_realtime_priority(unsigned priority)
+{
+    _realtime._new_priority.store(priority, std::memory_order_relaxed);
+    update_realtime();
+}
+
+unsigned thread::realtime_priority() const
+{
+    return _realtime._new_priority.load(std::memory_order_relaxed);
+}
+
+void thread::set_realtime_time_slice(thread_runtime::duration time_slice)
+{
+    _realtime._new_time_slice.store(time_slice.count(), std::memory_order_relaxed);
+    update_realtime();
+}
+
+thread_runtime::duration thread::realtime_time_slice() const
+{
+    return thread_runtime::duration(
+            _realtime._new_time_slice.load(std::memory_order_relaxed));
+}
+
 sched::thread::status thread::get_status() const
 {
     return _detached_state->st.load(std::memory_order_relaxed);
@@ -974,15 +1322,23 @@ void thread::wake_impl(detached_state* st, unsigned allowed_initial_states_mask)
         unsigned c = cpu::current()->id;
         // we can now use st->t here, since the thread cannot terminate while
         // it's waking, but not afterwards, when it may be running
+        auto priority = st->t->realtime_priority();
         irq_save_lock_type irq_lock;
         WITH_LOCK(irq_lock) {
             tcpu->incoming_wakeups[c].push_back(*st->t);
         }
-        if (!tcpu->incoming_wakeups_mask.test_all_and_set(c)) {
+        // A real-time thread should not wait for the preemption timer of a
+        // thread it preempts, but one preempting IPI is enough for all the
+        // wakeups queued before it is handled
+        bool first = !tcpu->incoming_wakeups_mask.test_all_and_set(c);
+        bool preempt = priority >
+                tcpu->running_realtime_priority.load(std::memory_order_relaxed) &&
+                !tcpu->preempt_pending.exchange(true);
+        if (first || preempt) {
             // FIXME: avoid if the cpu is alive and if the priority does not
             // FIXME: warrant an interruption
             if (tcpu != current()->tcpu()) {
-                tcpu->send_wakeup_ipi();
+                tcpu->send_wakeup_ipi(preempt);
             } else {
                 need_reschedule = true;
             }
@@ -1595,6 +1951,23 @@ void with_all_threads(std::function<void(thread &)> f) {
     }
 }
 
+bool running_elsewhere(const thread* t)
+{
+    auto self = cpu::current();
+    for (auto c : cpus) {
+        if (c != self && c->running_thread.load(std::memory_order_relaxed) == t) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void with_thread_by_id(unsigned id, std::function<void(thread *)> f) {
+    WITH_LOCK(thread_map_mutex) {
+        f(thread::find_by_id(id));
+    }
+}
+
 
 }
 
@@ -7,15 +7,24 @@
 
 #include <osv/spinlock.h>
 #include <osv/sched.hh>
+#include <osv/lock-profiler.hh>
 
 void spin_lock(spinlock_t *sl)
 {
     sched::preempt_disable();
+    uint64_t wait_start = 0;
     while (__sync_lock_test_and_set(&sl->_lock, 1)) {
+        if (prof::lock::enabled && !wait_start) {
+            wait_start = prof::lock::now_ns();
+        }
         while (sl->_lock) {
             barrier();
         }
     }
+    if (__builtin_expect(prof::lock::enabled, false)) {
+        prof::lock::acquired(sl, prof::lock::kind::spinlock, wait_start,
+                wait_start ? prof::lock::now_ns() - wait_start : 0);
+    }
 }
 
 bool spin_trylock(spinlock_t *sl)
@@ -25,11 +34,17 @@ bool spin_trylock(spinlock_t *sl)
         sched::preempt_enable();
         return false;
     }
+    if (__builtin_expect(prof::lock::enabled, false)) {
+        prof::lock::acquired(sl, prof::lock::kind::spinlock, false, 0);
+    }
     return true;
 }
 
 void spin_unlock(spinlock_t *sl)
 {
+    if (__builtin_expect(prof::lock::enabled, false)) {
+        prof::lock::released(sl);
+    }
     __sync_lock_release(&sl->_lock, 0);
     sched::preempt_enable();
 }
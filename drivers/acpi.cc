@@ -30,6 +30,8 @@ extern "C" {
 #include <osv/interrupt.hh>
 
 #include <osv/prio.hh>
+#include <osv/numa.hh>
+#include <osv/mempool.hh>
 
 #define acpi_tag "acpi"
 #define acpi_d(...)   tprintf_d(acpi_tag, __VA_ARGS__)
@@ -537,6 +539,73 @@ namespace acpi {
 
 #define ACPI_MAX_INIT_TABLES 16
 
+// The System Resource Affinity Table assigns cpus (by APIC id) and memory
+// ranges to proximity domains
+static void parse_srat()
+{
+    char srat_sig[] = ACPI_SIG_SRAT;
+    ACPI_TABLE_HEADER* srat_header;
+    if (AcpiGetTable(srat_sig, 0, &srat_header) != AE_OK) {
+        return;
+    }
+    void* subtable = reinterpret_cast<ACPI_TABLE_SRAT*>(srat_header) + 1;
+    void* srat_end = static_cast<void*>(srat_header) + srat_header->Length;
+    while (subtable < srat_end) {
+        auto s = static_cast<ACPI_SUBTABLE_HEADER*>(subtable);
+        if (!s->Length) {
+            break;
+        }
+        switch (s->Type) {
+        case ACPI_SRAT_TYPE_CPU_AFFINITY: {
+            auto cpu = static_cast<ACPI_SRAT_CPU_AFFINITY*>(subtable);
+            if (cpu->Flags & ACPI_SRAT_CPU_USE_AFFINITY) {
+                uint32_t domain = cpu->ProximityDomainLo |
+                                  cpu->ProximityDomainHi[0] << 8 |
+                                  cpu->ProximityDomainHi[1] << 16 |
+                                  cpu->ProximityDomainHi[2] << 24;
+                numa::add_cpu(cpu->ApicId, domain);
+            }
+            break;
+        }
+        case ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY: {
+            auto cpu = static_cast<ACPI_SRAT_X2APIC_CPU_AFFINITY*>(subtable);
+            if (cpu->Flags & ACPI_SRAT_CPU_ENABLED) {
+                numa::add_cpu(cpu->ApicId, cpu->ProximityDomain);
+            }
+            break;
+        }
+        case ACPI_SRAT_TYPE_MEMORY_AFFINITY: {
+            auto mem = static_cast<ACPI_SRAT_MEM_AFFINITY*>(subtable);
+            if ((mem->Flags & ACPI_SRAT_MEM_ENABLED) && mem->Length) {
+                numa::add_memory(mem->BaseAddress, mem->Length, mem->ProximityDomain);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        subtable += s->Length;
+    }
+}
+
+// The System Locality Information Table holds the relative distance between
+// every pair of proximity domains
+static void parse_slit()
+{
+    char slit_sig[] = ACPI_SIG_SLIT;
+    ACPI_TABLE_HEADER* slit_header;
+    if (AcpiGetTable(slit_sig, 0, &slit_header) != AE_OK) {
+        return;
+    }
+    auto slit = reinterpret_cast<ACPI_TABLE_SLIT*>(slit_header);
+    auto n = slit->LocalityCount;
+    for (UINT64 i = 0; i < n; i++) {
+        for (UINT64 j = 0; j < n; j++) {
+            numa::set_distance(i, j, slit->Entry[i * n + j]);
+        }
+    }
+}
+
 static ACPI_TABLE_DESC TableArray[ACPI_MAX_INIT_TABLES];
 
 void early_init()
@@ -569,6 +638,11 @@ void early_init()
         acpi_e("AcpiLoadTables failed: %s\n", AcpiFormatException(status));
         return;
     }
+
+    parse_srat();
+    parse_slit();
+    numa::commit();
+    memory::numa_init();
 }
 
 UINT32 acpi_poweroff(void *unused)
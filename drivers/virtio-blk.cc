@@ -38,7 +38,8 @@ TRACEPOINT(trace_virtio_blk_read_config_wce, "wce=%u", u32);
 TRACEPOINT(trace_virtio_blk_read_config_ro, "readonly=true");
 TRACEPOINT(trace_virtio_blk_make_request_seg_max, "request of size %d needs more segment than the max %d", size_t, u32);
 TRACEPOINT(trace_virtio_blk_make_request_readonly, "write on readonly device");
-TRACEPOINT(trace_virtio_blk_wake, "");
+TRACEPOINT(trace_virtio_blk_wake, "queue=%d", u16);
+TRACEPOINT(trace_virtio_blk_queues, "num_queues=%d, used=%d", u16, unsigned);
 TRACEPOINT(trace_virtio_blk_strategy, "bio=%p", struct bio*);
 TRACEPOINT(trace_virtio_blk_req_ok, "bio=%p, sector=%lu, len=%lu, type=%x", struct bio*, u64, size_t, u32);
 TRACEPOINT(trace_virtio_blk_req_unsupp, "bio=%p, sector=%lu, len=%lu, type=%x", struct bio*, u64, size_t, u32);
@@ -101,7 +102,7 @@ struct driver blk_driver = {
 bool blk::ack_irq()
 {
     auto isr = virtio_conf_readb(VIRTIO_PCI_ISR);
-    auto queue = get_virt_queue(0);
+    auto queue = _rqs[0]->vqueue;
 
     if (isr) {
         queue->disable_interrupts();
@@ -123,22 +124,46 @@ blk::blk(pci::device& pci_dev)
     setup_features();
     read_config();
 
-    //register the single irq callback for the block
-    sched::thread* t = new sched::thread([this] { this->req_done(); },
-            sched::thread::attr().name("virtio-blk"));
-    t->start();
-    auto queue = get_virt_queue(0);
+    unsigned nr_queues = choose_queues();
+    for (unsigned i = 0; i < nr_queues; i++) {
+        auto attr = sched::thread::attr();
+        std::string suffix;
+
+        // Complete each queue's requests on the CPU submitting them
+        if (nr_queues > 1) {
+            attr.pin(sched::cpus[i]);
+            suffix = std::to_string(i);
+        }
+        attr.name("virtio-blk" + suffix);
+
+        _rqs.emplace_back(new request_queue(get_virt_queue(i),
+                [this, i] { this->req_done(*_rqs[i]); }, attr));
+        // Enable indirect descriptor
+        _rqs[i]->vqueue->set_use_indirect(true);
+    }
+    for (auto&& rq : _rqs) {
+        rq->done_task.start();
+    }
+
     if (pci_dev.is_msix()) {
-        _msi.easy_register({ { 0, [=] { queue->disable_interrupts(); }, t } });
+        // Queue i uses MSI-X entry i (see probe_virt_queues()); since the
+        // completion threads are pinned, easy_register() also moves each
+        // vector to the CPU of its queue.
+        std::vector<msix_binding> bindings;
+        for (auto&& rq : _rqs) {
+            auto queue = rq->vqueue;
+            bindings.push_back({ queue->index(),
+                                 [=] { queue->disable_interrupts(); },
+                                 &rq->done_task });
+        }
+        _msi.easy_register(bindings);
     } else {
+        sched::thread* t = &_rqs[0]->done_task;
         _irq.reset(new pci_interrupt(pci_dev,
                                      [=] { return ack_irq(); },
                                      [=] { t->wake(); }));
     }
 
-    // Enable indirect descriptor
-    queue->set_use_indirect(true);
-
     add_dev_status(VIRTIO_CONFIG_S_DRIVER_OK);
 
     struct blk_priv* prv;
@@ -188,15 +213,33 @@ void blk::read_config()
     }
 }
 
-void blk::req_done()
+unsigned blk::choose_queues()
 {
-    auto* queue = get_virt_queue(0);
+    // Multiple queues are only useful if each of them has its own vector
+    if (!get_guest_feature_bit(VIRTIO_BLK_F_MQ) || !_dev.is_msix()) {
+        return 1;
+    }
+
+    unsigned nr = std::min<unsigned>(_config.num_queues, sched::cpus.size());
+    nr = std::min(nr, _num_queues);
+    trace_virtio_blk_queues(_config.num_queues, nr);
+    return std::max(nr, 1U);
+}
+
+blk::request_queue& blk::current_queue()
+{
+    return *_rqs[sched::cpu::current()->id % _rqs.size()];
+}
+
+void blk::req_done(request_queue& rq)
+{
+    auto* queue = rq.vqueue;
     blk_req* req;
 
     while (1) {
 
         virtio_driver::wait_for_queue(queue, &vring::used_ring_not_empty);
-        trace_virtio_blk_wake();
+        trace_virtio_blk_wake(queue->index());
 
         u32 len;
         while((req = static_cast<blk_req*>(queue->get_buf_elem(&len))) != nullptr) {
@@ -235,8 +278,12 @@ static const int sector_size = 512;
 
 int blk::make_request(struct bio* bio)
 {
+    // We may migrate to another CPU after choosing the queue, which is
+    // harmless: the queue's lock still serializes its submitters.
+    auto& rq = current_queue();
+
     // The lock is here for parallel requests protection
-    WITH_LOCK(_lock) {
+    WITH_LOCK(rq.lock) {
 
         if (!bio) return EIO;
 
@@ -245,7 +292,7 @@ int blk::make_request(struct bio* bio)
             return EIO;
         }
 
-        auto* queue = get_virt_queue(0);
+        auto* queue = rq.vqueue;
         blk_request_type type;
 
         switch (bio->bio_cmd) {
@@ -303,7 +350,8 @@ u32 blk::get_driver_features()
                  | ( 1 << VIRTIO_BLK_F_RO)
                  | ( 1 << VIRTIO_BLK_F_BLK_SIZE)
                  | ( 1 << VIRTIO_BLK_F_CONFIG_WCE)
-                 | ( 1 << VIRTIO_BLK_F_WCE));
+                 | ( 1 << VIRTIO_BLK_F_WCE)
+                 | ( 1 << VIRTIO_BLK_F_MQ));
 }
 
 hw_driver* blk::probe(hw_device* dev)
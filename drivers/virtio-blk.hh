@@ -10,6 +10,11 @@
 #include "drivers/virtio.hh"
 #include "drivers/pci-device.hh"
 #include <osv/bio.h>
+#include <osv/sched.hh>
+
+#include <functional>
+#include <memory>
+#include <vector>
 
 namespace virtio {
 
@@ -28,6 +33,7 @@ public:
         VIRTIO_BLK_F_WCE        = 9,  /* Writeback mode enabled after reset */
         VIRTIO_BLK_F_TOPOLOGY   = 10, /* Topology information is available */
         VIRTIO_BLK_F_CONFIG_WCE = 11, /* Writeback mode available in config */
+        VIRTIO_BLK_F_MQ         = 12, /* Support more than one vq */
     };
 
     enum {
@@ -95,6 +101,10 @@ public:
 
             /* writeback mode (if VIRTIO_BLK_F_CONFIG_WCE) */
             u8 wce;
+            u8 unused;
+
+            /* number of vqs, only available when VIRTIO_BLK_F_MQ is set */
+            u16 num_queues;
     } __attribute__((packed));
 
     /* This is the first element of the read scatter-gather list. */
@@ -128,7 +138,6 @@ public:
 
     int make_request(struct bio*);
 
-    void req_done();
     int64_t size();
 
     void set_readonly() {_ro = true;}
@@ -148,6 +157,26 @@ private:
         struct bio* bio;
     };
 
+    /**
+     * @struct request_queue
+     * A virtqueue together with the lock serializing submissions to it and
+     * the thread completing its requests. With VIRTIO_BLK_F_MQ there is one
+     * per CPU, and requests are submitted on the queue of the current CPU.
+     */
+    struct request_queue {
+        request_queue(vring* vq, std::function<void ()> done_func,
+                      sched::thread::attr attr)
+            : vqueue(vq), done_task(done_func, attr) {}
+        vring* vqueue;
+        // This mutex protects parallel make_request invocations
+        mutex lock;
+        sched::thread done_task;
+    };
+
+    void req_done(request_queue& rq);
+    unsigned choose_queues();
+    request_queue& current_queue();
+
     std::string _driver_name;
     blk_config _config;
 
@@ -155,8 +184,7 @@ private:
     static int _instance;
     int _id;
     bool _ro;
-    // This mutex protects parallel make_request invocations
-    mutex _lock;
+    std::vector<std::unique_ptr<request_queue>> _rqs;
     std::unique_ptr<pci_interrupt> _irq;
 };
 
@@ -50,11 +50,12 @@ TRACEPOINT(trace_virtio_net_tx_no_space_calling_gc, "if=%d", int);
 TRACEPOINT(trace_virtio_net_tx_packet_size, "vring %p vec_sz %d", void*, int);
 TRACEPOINT(trace_virtio_net_tx_xmit_one_failed_to_post, "vring %p vec_sz %d",
            void*, int);
+TRACEPOINT(trace_virtio_net_ctrl_cmd, "if=%d, class=%d, cmd=%d, ack=%d",
+           int, int, int, int);
 
 using namespace memory;
 
 // TODO list
-// irq thread affinity and tx affinity
 // tx zero copy
 // vlans?
 
@@ -136,10 +137,11 @@ static int if_transmit(struct ifnet* ifp, struct mbuf* m_head)
 inline int net::xmit(struct mbuf* buff)
 {
     //
-    // We currently have only a single TX queue. Select a proper TXq here when
-    // we implement a multi-queue.
+    // The xmitter copes with us being migrated in the middle or with
+    // transmitting on the queue of another CPU, so no need to pin ourselves
+    // here.
     //
-    return _txq.xmit(buff);
+    return select_txq(buff).xmit(buff);
 }
 
 inline int net::txq::xmit(mbuf* buff)
@@ -186,33 +188,50 @@ static void if_getinfo(struct ifnet* ifp, struct if_data* out_data)
 
 void net::fill_stats(struct if_data* out_data) const
 {
-    // We currently support only a single Tx/Rx queue so no iteration so far
-    fill_qstats(_rxq, out_data);
-    fill_qstats(_txq, out_data);
+    assert(!out_data->ifi_oerrors && !out_data->ifi_obytes && !out_data->ifi_opackets);
+
+    for (auto&& rxq : _rxq) {
+        fill_qstats(*rxq, out_data);
+    }
+
+    for (auto&& txq : _txq) {
+        fill_qstats(*txq, out_data);
+    }
+}
+
+void net::fill_qstats(unsigned qp, struct if_data* out_data) const
+{
+    assert(qp < queue_pairs());
+
+    fill_qstats(*_rxq[qp], out_data);
+    fill_qstats(*_txq[qp], out_data);
 }
 
 void net::fill_qstats(const struct rxq& rxq, struct if_data* out_data) const
 {
-    out_data->ifi_ipackets   += rxq.stats.rx_packets;
-    out_data->ifi_ibytes     += rxq.stats.rx_bytes;
-    out_data->ifi_iqdrops    += rxq.stats.rx_drops;
-    out_data->ifi_ierrors    += rxq.stats.rx_csum_err;
-    out_data->ifi_ibh_wakeups = rxq.stats.rx_bh_wakeups;
-    out_data->ifi_iwakeup_stats = rxq.stats.rx_wakeup_stats;
+    out_data->ifi_ipackets    += rxq.stats.rx_packets;
+    out_data->ifi_ibytes      += rxq.stats.rx_bytes;
+    out_data->ifi_iqdrops     += rxq.stats.rx_drops;
+    out_data->ifi_ierrors     += rxq.stats.rx_csum_err;
+    out_data->ifi_ibh_wakeups += rxq.stats.rx_bh_wakeups;
+    out_data->ifi_inc_packets += rxq.stats.rx_nc_packets;
+    out_data->ifi_inc_wakeups += rxq.stats.rx_nc_wakeups;
+    if_add_wakeup_stats(out_data->ifi_iwakeup_stats,
+                        rxq.stats.rx_wakeup_stats);
 }
 
 void net::fill_qstats(const struct txq& txq, struct if_data* out_data) const
 {
-    assert(!out_data->ifi_oerrors && !out_data->ifi_obytes && !out_data->ifi_opackets);
-    out_data->ifi_opackets       += txq.stats.tx_packets;
-    out_data->ifi_obytes         += txq.stats.tx_bytes;
-    out_data->ifi_oerrors        += txq.stats.tx_err + txq.stats.tx_drops;
-    out_data->ifi_oworker_kicks   = txq.stats.tx_worker_kicks;
-    out_data->ifi_oworker_wakeups = txq.stats.tx_worker_wakeups;
-    out_data->ifi_oworker_packets = txq.stats.tx_worker_packets;
-    out_data->ifi_okicks          = txq.stats.tx_kicks;
-    out_data->ifi_oqueue_is_full  = txq.stats.tx_hw_queue_is_full;
-    out_data->ifi_owakeup_stats   = txq.stats.tx_wakeup_stats;
+    out_data->ifi_opackets        += txq.stats.tx_packets;
+    out_data->ifi_obytes          += txq.stats.tx_bytes;
+    out_data->ifi_oerrors         += txq.stats.tx_err + txq.stats.tx_drops;
+    out_data->ifi_oworker_kicks   += txq.stats.tx_worker_kicks;
+    out_data->ifi_oworker_wakeups += txq.stats.tx_worker_wakeups;
+    out_data->ifi_oworker_packets += txq.stats.tx_worker_packets;
+    out_data->ifi_okicks          += txq.stats.tx_kicks;
+    out_data->ifi_oqueue_is_full  += txq.stats.tx_hw_queue_is_full;
+    if_add_wakeup_stats(out_data->ifi_owakeup_stats,
+                        txq.stats.tx_wakeup_stats);
 }
 
 bool net::ack_irq()
@@ -220,7 +239,8 @@ bool net::ack_irq()
     auto isr = virtio_conf_readb(VIRTIO_PCI_ISR);
 
     if (isr) {
-        _rxq.vqueue->disable_interrupts();
+        // Without MSI-X we only ever use a single queue pair
+        _rxq[0]->vqueue->disable_interrupts();
         return true;
     } else {
         return false;
@@ -228,15 +248,30 @@ bool net::ack_irq()
 
 }
 
-net::net(pci::device& dev)
-    : virtio_driver(dev),
-      _rxq(get_virt_queue(0), [this] { this->receiver(); }),
-      _txq(this, get_virt_queue(1))
+unsigned net::choose_queue_pairs()
 {
-    sched::thread* poll_task = &_rxq.poll_task;
+    // Multiple queues are only useful if each of them has its own vector
+    if (!_mq || !_dev.is_msix()) {
+        return 1;
+    }
 
-    poll_task->set_priority(sched::thread::priority_infinity);
+    unsigned pairs = std::min<unsigned>(_config.max_virtqueue_pairs,
+                                        sched::cpus.size());
+
+    // The control queue follows the last Rx/Tx pair offered by the host
+    _ctrl_vq = get_virt_queue(2 * _config.max_virtqueue_pairs);
+    if (!_ctrl_vq) {
+        net_w("Control virtqueue %d is not available, using a single queue",
+              2 * _config.max_virtqueue_pairs);
+        return 1;
+    }
+
+    return std::max(pairs, 1U);
+}
 
+net::net(pci::device& dev)
+    : virtio_driver(dev)
+{
     _driver_name = "virtio-net";
     virtio_i("VIRTIO NET INSTANCE");
     _id = _instance++;
@@ -246,6 +281,27 @@ net::net(pci::device& dev)
 
     _hdr_size = _mergeable_bufs ? sizeof(net_hdr_mrg_rxbuf) : sizeof(net_hdr);
 
+    unsigned pairs = choose_queue_pairs();
+    for (unsigned i = 0; i < pairs; i++) {
+        auto attr = sched::thread::attr();
+        std::string suffix;
+
+        if (pairs > 1) {
+            attr.pin(sched::cpus[i]);
+            suffix = std::to_string(i);
+        }
+        attr.name("virtio-net-rx" + suffix);
+
+        _rxq.emplace_back(new rxq(get_virt_queue(2 * i), attr,
+                                  [this, i] { this->receiver(*_rxq[i]); }));
+        _rxq[i]->poll_task.set_priority(sched::thread::priority_infinity);
+
+        _txq.emplace_back(new txq(this, get_virt_queue(2 * i + 1),
+                                  "virtio-tx" + suffix));
+    }
+
+    net_i("Using %d Rx/Tx queue pair(s)", pairs);
+
     //initialize the BSD interface _if
     _ifn = if_alloc(IFT_ETHER);
     if (_ifn == NULL) {
@@ -264,7 +320,7 @@ net::net(pci::device& dev)
     _ifn->if_qflush = if_qflush;
     _ifn->if_init = if_init;
     _ifn->if_getinfo = if_getinfo;
-    IFQ_SET_MAXLEN(&_ifn->if_snd, _txq.vqueue->size());
+    IFQ_SET_MAXLEN(&_ifn->if_snd, _txq[0]->vqueue->size());
 
     _ifn->if_capabilities = 0;
 
@@ -284,26 +340,107 @@ net::net(pci::device& dev)
 
     _ifn->if_capenable = _ifn->if_capabilities | IFCAP_HWSTATS;
 
-    //Start the polling thread before attaching it to the Rx interrupt
-    poll_task->start();
-    _txq.start();
+    //Start the polling threads before attaching them to the Rx interrupts
+    for (unsigned i = 0; i < pairs; i++) {
+        _rxq[i]->poll_task.start();
+        _txq[i]->start();
+    }
 
     ether_ifattach(_ifn, _config.mac);
 
     if (dev.is_msix()) {
-        _msi.easy_register({
-            { 0, [&] { _rxq.vqueue->disable_interrupts(); }, poll_task },
-            { 1, [&] { _txq.vqueue->disable_interrupts(); }, nullptr }
-        });
+        //
+        // Since every poll thread is pinned, easy_register() will move the
+        // Rx vector of each pair to the CPU that serves it.
+        //
+        std::vector<msix_binding> bindings;
+        for (unsigned i = 0; i < pairs; i++) {
+            struct rxq* rxq = _rxq[i].get();
+            struct txq* txq = _txq[i].get();
+
+            bindings.push_back({ 2 * i,
+                                 [rxq] { rxq->vqueue->disable_interrupts(); },
+                                 &rxq->poll_task });
+            bindings.push_back({ 2 * i + 1,
+                                 [txq] { txq->vqueue->disable_interrupts(); },
+                                 nullptr });
+        }
+        _msi.easy_register(bindings);
     } else {
+        sched::thread* poll_task = &_rxq[0]->poll_task;
+
         _irq.reset(new pci_interrupt(dev,
                                      [=] { return this->ack_irq(); },
                                      [=] { poll_task->wake(); }));
     }
 
-    fill_rx_ring();
+    for (auto&& rxq : _rxq) {
+        fill_rx_ring(*rxq);
+    }
 
     add_dev_status(VIRTIO_CONFIG_S_DRIVER_OK);
+
+    //
+    // The device starts with a single pair enabled, the rest of them are
+    // turned on with a control command once we are up.
+    //
+    if (pairs > 1 && !set_queue_pairs(pairs)) {
+        net_w("Failed to enable %d queue pairs", pairs);
+    }
+}
+
+bool net::ctrl_cmd(u8 class_t, u8 cmd, const void* data, u32 len)
+{
+    //
+    // The buffers are handed to the host, keep them off the stack.
+    //
+    struct ctrl_req {
+        net_ctrl_hdr hdr;
+        net_ctrl_ack ack;
+        u8 data[];
+    };
+
+    std::unique_ptr<u8[]> buf(new u8[sizeof(ctrl_req) + len]);
+    auto req = reinterpret_cast<ctrl_req*>(buf.get());
+
+    req->hdr.class_t = class_t;
+    req->hdr.cmd = cmd;
+    req->ack = VIRTIO_NET_ERR;
+    memcpy(req->data, data, len);
+
+    vring* vq = _ctrl_vq;
+    vq->init_sg();
+    vq->add_out_sg(&req->hdr, sizeof(req->hdr));
+    vq->add_out_sg(req->data, len);
+    vq->add_in_sg(&req->ack, sizeof(req->ack));
+    if (!vq->add_buf(req)) {
+        return false;
+    }
+    vq->kick();
+
+    //
+    // Control commands are rare and the host handles them synchronously, so
+    // don't bother with an interrupt for this queue - just poll.
+    //
+    u32 used_len;
+    while (!vq->used_ring_not_empty()) {
+        sched::thread::yield();
+    }
+    vq->get_buf_elem(&used_len);
+    vq->get_buf_finalize();
+    vq->get_buf_gc();
+
+    trace_virtio_net_ctrl_cmd(_id, class_t, cmd, req->ack);
+
+    return req->ack == VIRTIO_NET_OK;
+}
+
+bool net::set_queue_pairs(u16 pairs)
+{
+    net_ctrl_mq mq = { pairs };
+
+    return ctrl_cmd(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+                    &mq, sizeof(mq));
 }
 
 net::~net()
@@ -344,11 +481,16 @@ void net::read_config()
     _guest_tso4 = get_guest_feature_bit(VIRTIO_NET_F_GUEST_TSO4);
     _host_tso4 = get_guest_feature_bit(VIRTIO_NET_F_HOST_TSO4);
     _guest_ufo = get_guest_feature_bit(VIRTIO_NET_F_GUEST_UFO);
+    _mq = get_guest_feature_bit(VIRTIO_NET_F_MQ) &&
+          get_guest_feature_bit(VIRTIO_NET_F_CTRL_VQ);
 
     net_i("Features: %s=%d,%s=%d", "Status", _status, "TSO_ECN", _tso_ecn);
     net_i("Features: %s=%d,%s=%d", "Host TSO ECN", _host_tso_ecn, "CSUM", _csum);
     net_i("Features: %s=%d,%s=%d", "Guest_csum", _guest_csum, "guest tso4", _guest_tso4);
-    net_i("Features: %s=%d", "host tso4", _host_tso4);
+    net_i("Features: %s=%d,%s=%d", "host tso4", _host_tso4, "mq", _mq);
+    if (_mq) {
+        net_i("Max virtqueue pairs %d", _config.max_virtqueue_pairs);
+    }
 }
 
 /**
@@ -411,10 +553,12 @@ bool net::bad_rx_csum(struct mbuf* m, struct net_hdr* hdr)
     return false;
 }
 
-void net::receiver()
+void net::receiver(struct rxq& rxq)
 {
-    vring* vq = _rxq.vqueue;
+    vring* vq = rxq.vqueue;
     std::vector<iovec> packet;
+    std::vector<mbuf*> batch;
+    batch.reserve(classifier::max_batch);
     u64 rx_drops = 0, rx_packets = 0, csum_ok = 0;
     u64 csum_err = 0, rx_bytes = 0;
     static const u16 refill_thresh = 16;
@@ -425,8 +569,8 @@ void net::receiver()
         virtio_driver::wait_for_queue(vq, &vring::used_ring_not_empty);
         trace_virtio_net_rx_wake();
 
-        _rxq.stats.rx_bh_wakeups++;
-        _rxq.update_wakeup_stats(rx_packets);
+        rxq.stats.rx_bh_wakeups++;
+        rxq.update_wakeup_stats(rx_packets);
 
         u32 len;
         int nbufs;
@@ -442,7 +586,7 @@ void net::receiver()
             vq->get_buf_finalize();
 
             if (vq->effective_avail_ring_count() >= refill_thresh)
-                fill_rx_ring();
+                fill_rx_ring(rxq);
 
             // Bad packet/buffer - discard and continue to the next one
             if (len < _hdr_size + ETHER_HDR_LEN) {
@@ -492,26 +636,44 @@ void net::receiver()
             rx_packets++;
             rx_bytes += m_head->M_dat.MH.MH_pkthdr.len;
 
-            bool fast_path = _ifn->if_classifier.post_packet(m_head);
-            if (!fast_path) {
-                (*_ifn->if_input)(_ifn, m_head);
-            }
-
             trace_virtio_net_rx_packet(_ifn->if_index, rx_bytes);
 
+            // Net channels are woken once per batch rather than per packet
+            batch.push_back(m_head);
+            if (batch.size() == classifier::max_batch) {
+                post_batch(rxq, batch);
+            }
+
             // The interface may have been stopped while we were
             // passing the packet up the network stack.
             if ((_ifn->if_drv_flags & IFF_DRV_RUNNING) == 0)
                 break;
         }
 
+        post_batch(rxq, batch);
+
         // Update the stats
-        _rxq.stats.rx_drops      += rx_drops;
-        _rxq.stats.rx_packets    += rx_packets;
-        _rxq.stats.rx_csum       += csum_ok;
-        _rxq.stats.rx_csum_err   += csum_err;
-        _rxq.stats.rx_bytes      += rx_bytes;
+        rxq.stats.rx_drops      += rx_drops;
+        rxq.stats.rx_packets    += rx_packets;
+        rxq.stats.rx_csum       += csum_ok;
+        rxq.stats.rx_csum_err   += csum_err;
+        rxq.stats.rx_bytes      += rx_bytes;
+    }
+}
+
+void net::post_batch(struct rxq& rxq, std::vector<mbuf*>& batch)
+{
+    if (batch.empty()) {
+        return;
+    }
+    auto nr_packets = batch.size();
+    rxq.stats.rx_nc_wakeups += _ifn->if_classifier.post_packets(batch);
+    rxq.stats.rx_nc_packets += nr_packets - batch.size();
+    // What's left goes up the stack the usual way
+    for (auto m : batch) {
+        (*_ifn->if_input)(_ifn, m);
     }
+    batch.clear();
 }
 
 mbuf* net::packet_to_mbuf(const std::vector<iovec>& packet)
@@ -558,11 +720,11 @@ void net::do_free_buffer(void* buffer)
     memory::free_page(buffer);
 }
 
-void net::fill_rx_ring()
+void net::fill_rx_ring(struct rxq& rxq)
 {
     trace_virtio_net_fill_rx_ring(_ifn->if_index);
     int added = 0;
-    vring* vq = _rxq.vqueue;
+    vring* vq = rxq.vqueue;
 
     while (vq->avail_ring_not_empty()) {
         auto page = memory::alloc_page();
@@ -851,6 +1013,8 @@ u32 net::get_driver_features()
                  | (1 << VIRTIO_NET_F_HOST_TSO4)  \
                  | (1 << VIRTIO_NET_F_GUEST_ECN)
                  | (1 << VIRTIO_NET_F_GUEST_UFO)
+                 | (1 << VIRTIO_NET_F_CTRL_VQ)
+                 | (1 << VIRTIO_NET_F_MQ)
             );
 }
 
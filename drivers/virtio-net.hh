@@ -214,8 +214,6 @@ public:
 
     void wait_for_queue(vring* queue);
     bool bad_rx_csum(struct mbuf* m, struct net_hdr* hdr);
-    void receiver();
-    void fill_rx_ring();
     mbuf* packet_to_mbuf(const std::vector<iovec>& iovec);
     static void free_buffer_and_refcnt(void* buffer, void* refcnt);
     static void free_buffer(iovec iov) { do_free_buffer(iov.iov_base); }
@@ -232,6 +230,19 @@ public:
      */
     void fill_stats(struct if_data* out_data) const;
 
+    /**
+     * Fill the if_data buffer with the statistics of a single Rx/Tx queue
+     * pair.
+     * @param qp queue pair index (less than queue_pairs())
+     * @param out_data output buffer
+     */
+    void fill_qstats(unsigned qp, struct if_data* out_data) const;
+
+    /**
+     * @return the number of Rx/Tx queue pairs in use
+     */
+    unsigned queue_pairs() const { return _rxq.size(); }
+
     /**
      * Transmit a single frame.
      *
@@ -266,6 +277,7 @@ private:
     bool _guest_tso4 = false;
     bool _host_tso4 = false;
     bool _guest_ufo = false;
+    bool _mq = false;
 
     u32 _hdr_size;
 
@@ -278,6 +290,8 @@ private:
         u64 rx_csum;    /* number of packets with correct csum */
         u64 rx_csum_err;/* number of packets with a bad checksum */
         u64 rx_bh_wakeups;
+        u64 rx_nc_packets;  /* packets delivered to net channels */
+        u64 rx_nc_wakeups;  /* net channel wakeups for those packets */
 
         wakeup_stats rx_wakeup_stats;
     };
@@ -301,9 +315,8 @@ private:
 
     /* Single Rx queue object */
     struct rxq {
-        rxq(vring* vq, std::function<void ()> poll_func)
-            : vqueue(vq), poll_task(poll_func, sched::thread::attr().
-                                    name("virtio-net-rx")) {};
+        rxq(vring* vq, sched::thread::attr attr, std::function<void ()> poll_func)
+            : vqueue(vq), poll_task(poll_func, attr) {};
         vring* vqueue;
         sched::thread  poll_task;
         struct rxq_stats stats = { 0 };
@@ -322,13 +335,13 @@ private:
     struct txq {
         friend osv::xmitter_functor<txq>;
 
-        txq(net* parent, vring* vq) :
+        txq(net* parent, vring* vq, const std::string& name) :
             vqueue(vq), _parent(parent), _xmit_it(this),
             _kick_thresh(vqueue->size()),
             _xmitter(this,
                      // TODO: implement a proper StopPred when we fix a SP code
                      [] { return false; },
-                     _xmit_it, "virtio-tx")
+                     _xmit_it, name)
         {
             //
             // Kick at least every full ring of packets (see _kick_thresh
@@ -474,9 +487,63 @@ private:
      */
     void fill_qstats(const struct txq& txq, struct if_data* out_data) const;
 
-    /* We currently support only a single Rx+Tx queue */
-    struct rxq _rxq;
-    struct txq _txq;
+    void receiver(struct rxq& rxq);
+    void fill_rx_ring(struct rxq& rxq);
+
+    /**
+     * Hand a batch of received frames to the net channels, waking each
+     * channel once, and pass the rest up the stack
+     * @param rxq Rx queue the frames were received on
+     * @param batch frames, cleared on return
+     */
+    void post_batch(struct rxq& rxq, std::vector<mbuf*>& batch);
+
+    /**
+     * Returns the Tx queue to transmit the given frame on: the queue of the
+     * CPU its flow is steered to if the stack has tagged it with a flow id,
+     * the queue of the current CPU otherwise.
+     *
+     * The host delivers a flow's packets to the Rx queue paired with the Tx
+     * queue the flow was last sent on, so this is what steers a connection
+     * to the CPU of its consumer.
+     */
+    struct txq& select_txq(mbuf* m) {
+        unsigned cpu = (m->m_hdr.mh_flags & M_FLOWID) ?
+                       m->M_dat.MH.MH_pkthdr.flowid :
+                       sched::cpu::current()->id;
+
+        return *_txq[cpu % _txq.size()];
+    }
+
+    /**
+     * Decide how many Rx/Tx queue pairs to use: one per vCPU, bounded by
+     * the number of pairs the host offers.
+     */
+    unsigned choose_queue_pairs();
+
+    /**
+     * Synchronously send a command on the control virtqueue.
+     * @param class_t command class (VIRTIO_NET_CTRL_*)
+     * @param cmd command
+     * @param data command payload
+     * @param len payload length
+     *
+     * @return TRUE if the device has acknowledged the command
+     */
+    bool ctrl_cmd(u8 class_t, u8 cmd, const void* data, u32 len);
+
+    /**
+     * Tell the host how many queue pairs we are going to use.
+     */
+    bool set_queue_pairs(u16 pairs);
+
+    /*
+     * Rx queue i and Tx queue i live on virtqueues 2*i and 2*i+1. With
+     * VIRTIO_NET_F_MQ there is one pair per CPU and pair i is served on CPU i.
+     */
+    std::vector<std::unique_ptr<struct rxq>> _rxq;
+    std::vector<std::unique_ptr<struct txq>> _txq;
+    vring* _ctrl_vq = nullptr;
 
     //maintains the virtio instance number for multiple drives
     static int _instance;
@@ -182,6 +182,7 @@ class virtio_driver;
         bool kick();
         // Total number of descriptors in ring
         int size() {return _num;}
+        u16 index() const {return _q_index;}
 
         // Use memory order acquire when there are prior updates to local variables that must
         // be seen by the reading threads
@@ -20,6 +20,7 @@
 #include <libgen.h>
 #include <osv/mempool.hh>
 #include <osv/printf.hh>
+#include <osv/lock-profiler.hh>
 
 #include <sys/resource.h>
 #include <mntent.h>
@@ -329,6 +330,34 @@ static std::string procfs_stats()
 
 }
 
+static std::string procfs_shrinkers()
+{
+    std::ostringstream os;
+    osv::fprintf(os, "%-16s %7s %11s %16s %16s\n",
+                 "name", "enabled", "invocations", "freed_bytes", "time_ns");
+    for (auto& s : memory::stats::shrinkers()) {
+        osv::fprintf(os, "%-16s %7d %11lu %16lu %16lu\n",
+                     s.name, s.enabled, s.invocations, s.freed, s.time_ns);
+    }
+    return os.str();
+}
+
+static std::string procfs_memory_pressure()
+{
+    auto p = memory::stats::memory_pressure();
+    std::ostringstream os;
+    osv::fprintf(os, "level %s\nstalls %lu\nstall_ns %lu\n",
+                 memory::pressure_name(p.level), p.stalls, p.stall_ns);
+    return os.str();
+}
+
+static std::string procfs_lock_stat()
+{
+    std::ostringstream os;
+    prof::dump_lock_profile(os);
+    return os.str();
+}
+
 static std::string procfs_mounts()
 {
 	std::string rstr;
@@ -364,6 +393,9 @@ procfs_mount(mount* mp, const char *dev, int flags, const void* data)
     root->add("0", self); // our standard pid
     root->add("mounts", inode_count++, procfs_mounts);
     root->add("cpuinfo", inode_count++, [] { return processor::features_str(); });
+    root->add("shrinkers", inode_count++, procfs_shrinkers);
+    root->add("memory_pressure", inode_count++, procfs_memory_pressure);
+    root->add("lock_stat", inode_count++, procfs_lock_stat);
 
     vp->v_data = static_cast<void*>(root);
 
@@ -1999,6 +1999,44 @@ int lchown(const char *path, uid_t owner, gid_t group)
 }
 
 
+// bsd/sys/kern/uipc_syscalls.cc
+extern "C" int sys_sendfile(int s, struct file *fp, off_t offset, size_t count,
+        ssize_t *bytes);
+
+// Files that can't lend their pages to the network are copied through a
+// mapping of at most this size at a time.
+static constexpr size_t sendfile_window = 2 << 20;
+
+static ssize_t sendfile_mmap(int out_fd, int in_fd, off_t offset, size_t count)
+{
+    size_t sent = 0;
+
+    while (sent < count) {
+        off_t pos = offset + sent;
+        off_t start = align_down(pos, (off_t)mmu::page_size);
+        size_t skip = pos - start;
+        size_t len = std::min(count - sent, sendfile_window - skip);
+
+        char *src = static_cast<char *>(mmap(nullptr, skip + len, PROT_READ, MAP_SHARED, in_fd, start));
+        if (src == MAP_FAILED) {
+            return sent ? sent : -1;
+        }
+
+        auto ret = write(out_fd, src + skip, len);
+        munmap(src, skip + len);
+
+        if (ret < 0) {
+            return sent ? sent : -1;
+        }
+        sent += ret;
+        if ((size_t)ret < len) {
+            break;
+        }
+    }
+
+    return sent;
+}
+
 extern "C"
 int sendfile(int out_fd, int in_fd, off_t *_offset, size_t count)
 {
@@ -2039,27 +2077,35 @@ int sendfile(int out_fd, int in_fd, off_t *_offset, size_t count)
         offset = lseek(in_fd, 0, SEEK_CUR);
     }
 
-    size_t bytes_to_mmap = count + (offset % mmu::page_size);
-    off_t offset_for_mmap =  align_down(offset, (off_t)mmu::page_size);
-
-    char *src = static_cast<char *>(mmap(nullptr, bytes_to_mmap, PROT_READ, MAP_SHARED, in_fd, offset_for_mmap));
-
-    if (src == MAP_FAILED) {
-        return -1;
+    ssize_t ret;
+    struct vnode *vp = in_fp->f_dentry->d_vnode;
+
+    // Stream the page cache straight into the socket when the file system
+    // can share its cache pages (ZFS), otherwise copy through a mapping.
+    // Same size restriction as vfs_file::mmap(). Only stream sockets take
+    // the zero-copy path; sys_sendfile() refuses the others with EINVAL
+    // before sending anything.
+    int error = EINVAL;
+    if (out_fp->f_type == DTYPE_SOCKET && vp->v_type == VREG && vp->v_op->vop_cache &&
+            vp->v_size >= (off_t)mmu::page_size) {
+        auto n = std::min<off_t>(count, std::max<off_t>(vp->v_size - offset, 0));
+        error = sys_sendfile(out_fd, in_fp, offset, n, &ret);
+        if (error && error != EINVAL) {
+            return libc_error(error);
+        }
+    }
+    if (error) {
+        ret = sendfile_mmap(out_fd, in_fd, offset, count);
     }
-
-    auto ret = write(out_fd, src + (offset % PAGESIZE), count);
 
     if (ret < 0) {
-        return libc_error(errno);
+        return -1;
     } else if(_offset == nullptr) {
         lseek(in_fd, ret, SEEK_CUR);
     } else {
         *_offset += ret;
     }
 
-    assert(munmap(src, count) == 0);
-
     return ret;
 }
 
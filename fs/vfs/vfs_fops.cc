@@ -148,6 +148,11 @@ bool vfs_file::put_page(void *addr, uintptr_t off, mmu::hw_ptep<0> ptep)
     return pagecache::release(this, addr, off, ptep);
 }
 
+bool vfs_file::page_cached(uintptr_t off)
+{
+    return pagecache::cached(this, off);
+}
+
 void vfs_file::sync(off_t start, off_t end)
 {
     pagecache::sync(this, start, end);
@@ -11,12 +11,66 @@
 #ifndef INCLUDED_LIBAIO_H
 #define INCLUDED_LIBAIO_H
 
+#include <sys/uio.h>
+#include <string.h>
+#include <time.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef struct io_context *io_context_t;
 
+typedef enum io_iocb_cmd {
+    IO_CMD_PREAD = 0,
+    IO_CMD_PWRITE = 1,
+    IO_CMD_FSYNC = 2,
+    IO_CMD_FDSYNC = 3,
+    IO_CMD_POLL = 5,
+    IO_CMD_NOOP = 6,
+    IO_CMD_PREADV = 7,
+    IO_CMD_PWRITEV = 8,
+} io_iocb_cmd_t;
+
+// Notify the eventfd in u.c.resfd of the completion
+#define IOCB_FLAG_RESFD (1 << 0)
+
+// The layouts below are those of the Linux ABI on 64-bit little endian.
+struct io_iocb_common {
+    void *buf;
+    unsigned long nbytes;
+    long long offset;
+    long long __pad3;
+    unsigned flags;
+    unsigned resfd;
+};
+
+struct io_iocb_vector {
+    const struct iovec *vec;
+    int nr;
+    long long offset;
+};
+
+struct iocb {
+    void *data;
+    unsigned key;
+    unsigned __pad2;
+    short aio_lio_opcode;
+    short aio_reqprio;
+    int aio_fildes;
+    union {
+        struct io_iocb_common c;
+        struct io_iocb_vector v;
+    } u;
+};
+
+struct io_event {
+    void *data;
+    struct iocb *obj;
+    unsigned long res;
+    unsigned long res2;
+};
+
 int io_setup(int nr_events, io_context_t *ctxp_idp);
 int io_submit(io_context_t ctx, long nr, struct iocb *ios[]);
 int io_getevents(io_context_t ctx_id, long min_nr, long nr,
@@ -24,6 +78,70 @@ int io_getevents(io_context_t ctx_id, long min_nr, long nr,
 int io_destroy(io_context_t ctx);
 int io_cancel(io_context_t ctx, struct iocb *iocb, struct io_event *evt);
 
+static inline void io_prep_pread(struct iocb *iocb, int fd, void *buf,
+        size_t count, long long offset)
+{
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->aio_fildes = fd;
+    iocb->aio_lio_opcode = IO_CMD_PREAD;
+    iocb->u.c.buf = buf;
+    iocb->u.c.nbytes = count;
+    iocb->u.c.offset = offset;
+}
+
+static inline void io_prep_pwrite(struct iocb *iocb, int fd, void *buf,
+        size_t count, long long offset)
+{
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->aio_fildes = fd;
+    iocb->aio_lio_opcode = IO_CMD_PWRITE;
+    iocb->u.c.buf = buf;
+    iocb->u.c.nbytes = count;
+    iocb->u.c.offset = offset;
+}
+
+static inline void io_prep_preadv(struct iocb *iocb, int fd,
+        const struct iovec *iov, int iovcnt, long long offset)
+{
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->aio_fildes = fd;
+    iocb->aio_lio_opcode = IO_CMD_PREADV;
+    iocb->u.v.vec = iov;
+    iocb->u.v.nr = iovcnt;
+    iocb->u.v.offset = offset;
+}
+
+static inline void io_prep_pwritev(struct iocb *iocb, int fd,
+        const struct iovec *iov, int iovcnt, long long offset)
+{
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->aio_fildes = fd;
+    iocb->aio_lio_opcode = IO_CMD_PWRITEV;
+    iocb->u.v.vec = iov;
+    iocb->u.v.nr = iovcnt;
+    iocb->u.v.offset = offset;
+}
+
+static inline void io_prep_fsync(struct iocb *iocb, int fd)
+{
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->aio_fildes = fd;
+    iocb->aio_lio_opcode = IO_CMD_FSYNC;
+}
+
+static inline void io_prep_fdsync(struct iocb *iocb, int fd)
+{
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->aio_fildes = fd;
+    iocb->aio_lio_opcode = IO_CMD_FDSYNC;
+}
+
+static inline void io_set_eventfd(struct iocb *iocb, int eventfd)
+{
+    iocb->u.c.flags |= IOCB_FLAG_RESFD;
+    iocb->u.c.resfd = eventfd;
+}
+
 #ifdef __cplusplus
 }
 #endif
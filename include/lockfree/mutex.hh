@@ -48,6 +48,14 @@
 // duration for our (currently 32-bit) sequence number to wrap, we won't have
 // a problem. A per-mutex sequence number is slower than a per-cpu one, but
 // I doubt this will make a practical difference.
+//
+// Before going to sleep, a contended lock() spins for a while if the lock
+// holder is running on another CPU, as it will probably release the lock
+// sooner than a context switch and a wakeup would take. The spinner has
+// already incremented count, so the releasing unlock() sees a concurrent
+// lock() and leaves it a handoff, which the spinner takes exactly as
+// try_lock() does. Spinning stops once other threads are queued, as unlock()
+// wakes them rather than leaving a handoff.
 
 #include <atomic>
 #include <lockfree/queue-mpsc.hh>
@@ -75,11 +83,15 @@ protected:
     queue_mpsc<wait_record> waitqueue;
     std::atomic<unsigned int> handoff;
     unsigned int sequence;
+    // Contention statistics, see contended() and slept()
+    std::atomic<unsigned int> ncontended;
+    std::atomic<unsigned int> nslept;
+    bool spin_for_handoff();
 public:
     // Note: mutex's constructor just initializes the whole structure to
     // zero, and its destructor does nothing. This is useful to know when
     // allocating a mutex in C.
-    constexpr mutex() : count(0), depth(0), owner(nullptr), waitqueue(), handoff(0), sequence(0) { }
+    constexpr mutex() : count(0), depth(0), owner(nullptr), waitqueue(), handoff(0), sequence(0), ncontended(0), nslept(0) { }
     ~mutex() { /*assert(count==0);*/ }
 
     void lock();
@@ -90,6 +102,15 @@ public:
     // getdepth() should only be used by the thread holding the lock
     inline unsigned int getdepth() const { return depth; }
 
+    // Number of lock() calls which found the mutex held by another thread,
+    // and how many of those had to sleep (rather than get it by spinning)
+    unsigned int contended() const { return ncontended.load(std::memory_order_relaxed); }
+    unsigned int slept() const { return nslept.load(std::memory_order_relaxed); }
+    void reset_stats() {
+        ncontended.store(0, std::memory_order_relaxed);
+        nslept.store(0, std::memory_order_relaxed);
+    }
+
     // For wait morphing. Do not use unless you know what you are doing :-)
     void send_lock(wait_record *wr);
     bool send_lock_unless_already_waiting(wait_record *wr);
@@ -169,6 +169,8 @@ struct file {
 	virtual bool map_page(uintptr_t offset, mmu::hw_ptep<1> ptep, mmu::pt_element<1> pte, bool write, bool shared) { throw make_error(ENOSYS); }
 	virtual bool put_page(void *addr, uintptr_t offset, mmu::hw_ptep<0> ptep) { throw make_error(ENOSYS); }
 	virtual bool put_page(void *addr, uintptr_t offset, mmu::hw_ptep<1> ptep) { throw make_error(ENOSYS); }
+	// Whether map_page() can map the page without reading it in
+	virtual bool page_cached(uintptr_t offset) { return false; }
 	virtual void sync(off_t start, off_t end) { throw make_error(ENOSYS); }
 
 	int		f_flags;	/* open flags */
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef _OSV_HEAP_PROFILER_HH
+#define _OSV_HEAP_PROFILER_HH
+
+#include <cstddef>
+#include <ostream>
+#include <sys/types.h>
+
+// Sampling heap profiler
+//
+// Unlike memory::alloc_tracker, which remembers every allocation, only one
+// allocation per sample_rate bytes (on average) is recorded, together with
+// its backtrace, so the profiler is cheap enough to leave running.
+namespace prof {
+
+/**
+ * Starts the heap profiler, dropping the samples of a previous run.
+ *
+ * May block.
+ */
+void start_heap_profiler(size_t sample_rate);
+
+/**
+ * Stops the heap profiler and drops its samples.
+ *
+ * May block.
+ */
+void stop_heap_profiler();
+
+bool heap_profiler_enabled();
+
+/**
+ * Writes the samples in the pprof legacy heap profile format ("heap_v2"),
+ * which carries both the live objects and everything allocated since the
+ * profiler was started.
+ */
+void dump_heap_profile(std::ostream& os);
+
+namespace heap {
+
+// Called by malloc() and free()
+extern bool enabled;
+extern __thread ssize_t bytes_until_sample;
+void sample(void* addr, size_t size);
+void forget(void* addr);
+
+inline void on_alloc(void* addr, size_t size)
+{
+    if (__builtin_expect(enabled, false) && addr &&
+            (bytes_until_sample -= size) < 0) {
+        sample(addr, size);
+    }
+}
+
+inline void on_free(void* addr)
+{
+    if (__builtin_expect(enabled, false)) {
+        forget(addr);
+    }
+}
+
+}
+
+}
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef _OSV_LOCK_PROFILER_HH
+#define _OSV_LOCK_PROFILER_HH
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Lock contention profiler
+//
+// While enabled, every acquisition of a mutex, rwlock or spinlock (including
+// the BSD mtx and sx wrappers, which use them) is attributed to a lock
+// class: the lock type and the code which called into the lock. For each
+// class the profiler counts the contended acquisitions and the time spent
+// waiting in them, remembers the longest time the lock was held, and
+// keeps the call stacks which waited the most.
+//
+// The hooks neither allocate nor take locks; when the profiler's tables
+// fill up, further classes and stacks are dropped.
+namespace prof {
+
+struct lock_stack_stats {
+    uint64_t contended;
+    uint64_t wait_ns;
+    std::vector<std::string> frames;
+};
+
+struct lock_class_stats {
+    const char* kind;
+    std::string site;
+    uint64_t contended;
+    uint64_t wait_ns;
+    uint64_t max_hold_ns;
+    // The stacks which waited the longest, longest first
+    std::vector<lock_stack_stats> stacks;
+};
+
+/**
+ * Starts the lock profiler, dropping the statistics of a previous run.
+ *
+ * May block.
+ */
+void start_lock_profiler();
+
+/**
+ * Stops the lock profiler. The statistics gathered so far are kept until
+ * it is started again.
+ *
+ * May block.
+ */
+void stop_lock_profiler();
+
+bool lock_profiler_enabled();
+
+/**
+ * Returns the lock classes which saw contention, the most waited for first.
+ */
+std::vector<lock_class_stats> lock_profile();
+
+void dump_lock_profile(std::ostream& os);
+
+namespace lock {
+
+enum class kind : uint8_t {
+    mutex,
+    rwlock_read,
+    rwlock_write,
+    spinlock,
+};
+
+// Called by the lock implementations. wait_ns is the time a contended
+// acquisition waited for the lock.
+extern bool enabled;
+void acquired(const void* lock, kind k, bool contended, uint64_t wait_ns);
+void released(const void* lock);
+
+// Timestamps for wait_ns
+uint64_t now_ns();
+
+}
+
+}
+
+#endif
@@ -11,6 +11,7 @@
 #include <cstdint>
 #include <functional>
 #include <list>
+#include <vector>
 #include <boost/intrusive/set.hpp>
 #include <boost/intrusive/list.hpp>
 #include <osv/mutex.h>
@@ -47,6 +48,8 @@ public:
     void* alloc();
     void free(void* object);
     unsigned get_size();
+    // Sums the per-cpu counters; may be slightly stale while in use.
+    void get_stats(size_t& objects, size_t& pages);
     static pool* from_object(void* object);
     static void collect_garbage();
 private:
@@ -79,6 +82,9 @@ private:
     class free_list_type : public free_list_base_type {
     public:
         ~free_list_type() { assert(empty()); }
+        // objects allocated from, and pages owned by, this cpu
+        size_t nalloc = 0;
+        size_t npages = 0;
     };
     // maintain a list of free pages percpu
     dynamic_percpu<free_list_type> _free;
@@ -99,11 +105,22 @@ struct page_range {
 
 void free_initial_memory_range(void* addr, size_t size);
 void enable_debug_allocator();
+void enable_huge_arena();
+// Spreads the free memory over the NUMA nodes, once the topology is known
+void numa_init();
 
 extern bool tracker_enabled;
 
+// Memory pressure levels, by the amount of free memory:
+//  RELAXED   - plenty of it
+//  NORMAL    - less than twice the reclaim watermark; caches should stop
+//              growing, and may shed memory before the reclaimer has to
+//  PRESSURE  - below the reclaim watermark, the shrinkers are running
+//  EMERGENCY - almost none left, or allocations are waiting for memory
 enum class pressure { RELAXED, NORMAL, PRESSURE, EMERGENCY };
 
+const char* pressure_name(pressure p);
+
 class shrinker {
 public:
     explicit shrinker(std::string name);
@@ -115,9 +132,33 @@ public:
 
     void deactivate_shrinker();
     void activate_shrinker();
+
+    bool enabled() const { return _enabled; }
+    size_t invocations() const { return _invocations; }
+    size_t freed() const { return _freed; }
+    u64 time_ns() const { return _time_ns; }
+
+    friend class reclaimer;
 private:
     std::string _name;
     int _enabled = 1;
+    // Protected by the reclaimer's _shrinkers_mutex
+    size_t _invocations = 0;
+    size_t _freed = 0;
+    u64 _time_ns = 0;
+};
+
+// Notified each time the memory pressure rises to the listener's level, or
+// above it, from below that level.  notify() is called from a dedicated
+// thread, and may sleep and free memory.
+class pressure_listener {
+public:
+    explicit pressure_listener(pressure level);
+    virtual ~pressure_listener();
+    virtual void notify(pressure current) = 0;
+    pressure level() const { return _level; }
+private:
+    pressure _level;
 };
 
 class reclaimer_waiters {
@@ -149,8 +190,22 @@ public:
     void wait_for_memory(size_t mem);
     void wait_for_minimum_memory();
 
+    // Called as the amount of free memory changes; cheap unless the level
+    // rose, in which case the listeners are woken
+    void update_pressure(pressure p);
+    pressure current_pressure() const { return _pressure.load(std::memory_order_relaxed); }
+    template <typename Func>
+    void for_each_shrinker(Func f) {
+        WITH_LOCK(_shrinkers_mutex) {
+            for (auto s : _shrinkers) {
+                f(*s);
+            }
+        }
+    }
+
     friend void start_reclaimer();
     friend class shrinker;
+    friend class pressure_listener;
     friend class reclaimer_waiters;
 private:
     void _do_reclaim();
@@ -173,6 +228,17 @@ private:
     unsigned int _active_shrinkers = 0;
     bool _can_shrink();
 
+    void _notify_pressure();
+    sched::thread _pressure_thread;
+    // Set once _pressure_thread can be woken
+    sched::thread* _pressure_waker = nullptr;
+    std::atomic<pressure> _pressure { pressure::RELAXED };
+    // Lowest level since the listeners were last notified
+    std::atomic<pressure> _pressure_low { pressure::RELAXED };
+    std::atomic<bool> _pressure_rose { false };
+    std::vector<pressure_listener*> _listeners;
+    mutex _listeners_mutex;
+
     pressure pressure_level();
     ssize_t bytes_until_normal(pressure curr);
     ssize_t bytes_until_normal() { return bytes_until_normal(pressure_level()); }
@@ -185,6 +251,37 @@ namespace stats {
     size_t jvm_heap();
     void on_jvm_heap_alloc(size_t mem);
     void on_jvm_heap_free(size_t mem);
+
+    struct malloc_pool_stats {
+        size_t object_size;
+        size_t objects;
+        size_t pages;
+    };
+    std::vector<malloc_pool_stats> malloc_pools();
+
+    struct huge_arena_stats {
+        bool enabled;
+        size_t chunks;
+        // bytes allocated from the arena's chunks
+        size_t used;
+    };
+    huge_arena_stats huge_arena();
+
+    struct shrinker_stats {
+        std::string name;
+        bool enabled;
+        size_t invocations;   // calls to request_memory()
+        size_t freed;         // bytes it returned
+        u64 time_ns;          // time spent in it
+    };
+    std::vector<shrinker_stats> shrinkers();
+
+    struct pressure_stats {
+        pressure level;
+        size_t stalls;        // allocations which waited for memory
+        u64 stall_ns;         // total time they waited
+    };
+    pressure_stats memory_pressure();
 }
 
 class phys_contiguous_memory final {
@@ -84,11 +84,18 @@ enum {
     mmap_small       = 1ul << 5,
     mmap_jvm_balloon = 1ul << 6,
     mmap_file        = 1ul << 7,
+    mmap_sequential  = 1ul << 8,
+    mmap_random      = 1ul << 9,
 };
 
 enum {
     advise_dontneed = 1ul << 0,
     advise_nohugepage = 1ul << 1,
+    advise_hugepage = 1ul << 2,
+    advise_normal = 1ul << 3,
+    advise_sequential = 1ul << 4,
+    advise_random = 1ul << 5,
+    advise_willneed = 1ul << 6,
 };
 
 enum {
@@ -99,6 +106,9 @@ enum {
 void flush_tlb_local();
 /* flush tlb for all */
 void flush_tlb_all();
+/* flush tlb entries of [start, start + size) for all; small ranges are
+   invalidated page by page instead of flushing the whole tlb */
+void flush_tlb_range(uintptr_t start, size_t size);
 
 constexpr size_t page_size_level(unsigned level)
 {
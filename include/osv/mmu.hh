@@ -17,14 +17,20 @@
 #include <osv/addr_range.hh>
 #include <unordered_map>
 #include <memory>
+#include <atomic>
 #include <osv/mmu-defs.hh>
 #include <osv/align.hh>
 #include <osv/trace.hh>
+#include <osv/numa.hh>
 
 struct exception_frame;
 class balloon;
 typedef std::shared_ptr<balloon> balloon_ptr;
 
+namespace sched {
+class thread;
+}
+
 /**
  * MMU namespace
  */
@@ -61,10 +67,26 @@ public:
     virtual int validate_perm(unsigned perm) { return 0; }
     virtual page_allocator* page_ops();
     void update_flags(unsigned flag);
+    void clear_flags(unsigned flag);
     bool has_flags(unsigned flag);
     template<typename T> ulong operate_range(T mapper, void *start, size_t size);
     template<typename T> ulong operate_range(T mapper);
     bool map_dirty();
+    const numa::mempolicy& mempolicy() const { return _mempolicy; }
+    void set_mempolicy(const numa::mempolicy& p) { _mempolicy = p; }
+    // Page faults which do not take vma_list_mutex (see vm_fault()) are
+    // inside the vma between enter_fault() and exit_fault().  Whoever
+    // changes the vma calls exclude_faults() first, which waits for them
+    // and keeps new ones out until allow_faults(), called when the vma list
+    // is published again.
+    bool enter_fault();
+    void exit_fault();
+    void exclude_faults();
+    void allow_faults();
+    // Drops what the vma holds besides its own memory, once it is out of
+    // the vma list and excluded from faults.  The vma itself is freed
+    // later, after an RCU grace period.
+    virtual void release() {}
     class addr_compare;
 protected:
     addr_range _range;
@@ -72,8 +94,13 @@ protected:
     unsigned _flags;
     bool _map_dirty;
     page_allocator *_page_ops;
+    numa::mempolicy _mempolicy;
+    std::atomic<unsigned> _faults;
+    sched::thread* _fault_waiter;
 public:
     boost::intrusive::set_member_hook<> _vma_list_hook;
+    // Link in the list of vmas excluded from faults
+    vma* _next_excluded;
 };
 
 // compare object for searching the vma list
@@ -103,12 +130,21 @@ public:
     virtual error sync(uintptr_t start, uintptr_t end) override;
     virtual int validate_perm(unsigned perm);
     virtual void fault(uintptr_t addr, exception_frame *ef) override;
+    virtual void release() override;
     fileref file() const { return _file; }
     f_offset offset() const { return _offset; }
+    // Reads in and maps the pages of [start, end) which are in the file
+    void prefetch(uintptr_t start, uintptr_t end);
 private:
     f_offset offset(uintptr_t addr);
+    void map_around(uintptr_t addr, f_offset fsize);
     fileref _file;
     f_offset _offset;
+    // Read-ahead state: offset of the last read fault, end of the pages it
+    // mapped, and the size of the read-ahead window (0 if not sequential)
+    std::atomic<f_offset> _ra_prev {0};
+    std::atomic<f_offset> _ra_end {0};
+    std::atomic<unsigned> _ra_pages {0};
 };
 
 ulong map_jvm(unsigned char* addr, size_t size, size_t align, balloon_ptr b);
@@ -167,6 +203,25 @@ error munmap(const void* addr, size_t size);
 error mprotect(const void *addr, size_t size, unsigned int perm);
 error msync(const void* addr, size_t length, int flags);
 error mincore(const void *addr, size_t length, unsigned char *vec);
+// Sets the NUMA memory policy of [addr, addr+length).  With @move, pages of
+// anonymous mappings in the range which are on nodes the policy does not
+// allow are migrated.
+error mbind(const void* addr, size_t length, const numa::mempolicy& policy, bool move);
+numa::mempolicy vma_mempolicy(const void* addr);
+// Node of the page mapped at @addr, or -EFAULT/-ENOENT if there is none
+int page_node(const void* addr);
+// Migrates the page mapped at @addr to @node; returns the node it is on
+// afterwards, or a negative errno value as page_node()
+int move_page(const void* addr, unsigned node);
+
+// Collapse of anonymous memory populated with small pages into huge pages,
+// done in the background
+struct collapse_stats {
+    u64 scanned;    // 2MB regions found full of small pages
+    u64 collapsed;  // regions remapped with a huge page
+    u64 failed;     // regions left alone for lack of a free huge page
+};
+collapse_stats get_collapse_stats();
 bool is_linear_mapped(const void *addr, size_t size);
 bool ismapped(const void *addr, size_t size);
 bool isreadable(void *addr, size_t size);
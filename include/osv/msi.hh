@@ -11,6 +11,7 @@
 #include "drivers/pci-function.hh"
 
 #include <list>
+#include <vector>
 
 class msix_vector {
 public:
@@ -60,7 +61,7 @@ public:
     // 2. Allocate vectors and assign ISRs
     // 3. Setup entries
     // 4. Unmask interrupts
-    bool easy_register(std::initializer_list<msix_binding> bindings);
+    bool easy_register(const std::vector<msix_binding>& bindings);
     void easy_unregister();
 
     /////////////////////
@@ -13,6 +13,7 @@
 #include <lockfree/ring.hh>
 #include <functional>
 #include <unordered_map>
+#include <vector>
 #include <osv/rcu.hh>
 #include <osv/rcu-hashtable.hh>
 #include <bsd/porting/netport.h>
@@ -35,6 +36,8 @@ private:
     std::function<void (mbuf*)> _process_packet;
     ring_spsc<mbuf*, 256> _queue;
     sched::thread_handle _waiting_thread CACHELINE_ALIGNED;
+    // cpu of the thread that last consumed packets from this channel
+    std::atomic<unsigned> _consumer_cpu { 0 };
     // extra list of threads to wake
     osv::rcu_ptr<std::vector<pollreq*>> _pollers;
     osv::rcu_hashtable<epoll_ptr> _epollers;
@@ -53,6 +56,10 @@ public:
     }
     // consumer: consume all available packets using process_packet()
     void process_queue();
+    // producer: the cpu the packets should preferably be delivered on
+    unsigned consumer_cpu() const {
+        return _consumer_cpu.load(std::memory_order_relaxed);
+    }
     // add/remove current thread from poller list
     void add_poller(pollreq& pr);
     void del_poller(pollreq& pr);
@@ -60,6 +67,13 @@ public:
     void del_epoll(const epoll_ptr& ep);
 private:
     void wake_pollers();
+    void update_consumer_cpu() {
+        auto cpu = sched::cpu::current()->id;
+        // avoid dirtying the cache line the producer reads if nothing changed
+        if (_consumer_cpu.load(std::memory_order_relaxed) != cpu) {
+            _consumer_cpu.store(cpu, std::memory_order_relaxed);
+        }
+    }
 private:
     friend class sched::wait_object<net_channel>;
 };
@@ -100,6 +114,29 @@ struct ipv4_tcp_conn_id {
     }
 };
 
+// A connected UDP socket is identified by the same 4-tuple as a TCP
+// connection, but lives in a lookup table of its own.
+struct ipv4_udp_conn_id : ipv4_tcp_conn_id {
+    using ipv4_tcp_conn_id::ipv4_tcp_conn_id;
+};
+
+// A bound, unconnected, UDP socket only has a local address (which may be
+// INADDR_ANY) and port.
+struct ipv4_udp_bound_id {
+    ipv4_udp_bound_id(in_addr addr, in_port_t port)
+        : addr(addr), port(port) {}
+
+    in_addr addr;
+    in_port_t port;
+
+    size_t hash() const {
+        return addr.s_addr ^ port;
+    }
+    bool operator==(const ipv4_udp_bound_id& x) const {
+        return addr == x.addr && port == x.port;
+    }
+};
+
 namespace std {
 
 template <>
@@ -107,6 +144,16 @@ struct hash<ipv4_tcp_conn_id> {
     size_t operator()(ipv4_tcp_conn_id x) const { return x.hash(); }
 };
 
+template <>
+struct hash<ipv4_udp_conn_id> {
+    size_t operator()(ipv4_udp_conn_id x) const { return x.hash(); }
+};
+
+template <>
+struct hash<ipv4_udp_bound_id> {
+    size_t operator()(ipv4_udp_bound_id x) const { return x.hash(); }
+};
+
 }
 
 class classifier {
@@ -115,27 +162,52 @@ public:
     // consumer side operations
     void add(ipv4_tcp_conn_id id, net_channel* channel);
     void remove(ipv4_tcp_conn_id id);
+    void add(ipv4_udp_conn_id id, net_channel* channel);
+    void remove(ipv4_udp_conn_id id);
+    void add(ipv4_udp_bound_id id, net_channel* channel);
+    void remove(ipv4_udp_bound_id id);
     // producer side operations
     bool post_packet(mbuf* m);
+    // Post a batch of up to max_batch packets, waking each channel only once
+    // after all of its packets were pushed.  The packets that didn't go to
+    // a channel are left in 'packets', in order, for the caller to pass up
+    // the stack.  Returns the number of channels woken.
+    unsigned post_packets(std::vector<mbuf*>& packets);
+    static constexpr unsigned max_batch = 64;
 private:
-    net_channel* classify_ipv4_tcp(mbuf* m);
+    net_channel* push(mbuf* m);
+    net_channel* classify_ipv4(mbuf* m);
+    net_channel* classify_ipv4_tcp(mbuf* m, ip* ip_hdr, unsigned ip_size);
+    net_channel* classify_ipv4_udp(mbuf* m, ip* ip_hdr, unsigned ip_size);
 private:
+    template <typename Key>
     struct item {
-        item(const ipv4_tcp_conn_id& key, net_channel* chan) : key(key), chan(chan) {}
-        ipv4_tcp_conn_id key;
+        item(const Key& key, net_channel* chan) : key(key), chan(chan) {}
+        Key key;
         net_channel* chan;
     };
-    struct item_hash : private std::hash<ipv4_tcp_conn_id> {
-        size_t operator()(const item& i) const { return std::hash<ipv4_tcp_conn_id>::operator()(i.key); }
+    template <typename Key>
+    struct item_hash : private std::hash<Key> {
+        size_t operator()(const item<Key>& i) const { return std::hash<Key>::operator()(i.key); }
     };
+    template <typename Key>
     struct key_item_compare {
-        bool operator()(const ipv4_tcp_conn_id& key, const item& item) const {
+        bool operator()(const Key& key, const item<Key>& item) const {
             return key == item.key;
         }
     };
-    using ipv4_tcp_channels = osv::rcu_hashtable<item, item_hash>;
+    template <typename Key>
+    using channels = osv::rcu_hashtable<item<Key>, item_hash<Key>>;
+    template <typename Key>
+    void add(channels<Key>& table, const Key& id, net_channel* channel);
+    template <typename Key>
+    void remove(channels<Key>& table, const Key& id);
+    template <typename Key>
+    net_channel* find(channels<Key>& table, const Key& id);
     mutex _mtx;
-    ipv4_tcp_channels _ipv4_tcp_channels;
+    channels<ipv4_tcp_conn_id> _ipv4_tcp_channels;
+    channels<ipv4_udp_conn_id> _ipv4_udp_conn_channels;
+    channels<ipv4_udp_bound_id> _ipv4_udp_bound_channels;
 };
 
 #endif /* NETCHANNEL_HH_ */
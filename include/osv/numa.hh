@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef OSV_NUMA_HH_
+#define OSV_NUMA_HH_
+
+#include <cstdint>
+
+// NUMA topology and memory policies
+//
+// The topology is read from the ACPI SRAT and SLIT during early boot; without
+// them (or on architectures without ACPI) everything belongs to node 0.
+// Proximity domains are numbered densely, in the order in which they appear.
+namespace numa {
+
+constexpr unsigned max_nodes = 64;
+typedef unsigned long nodemask;
+constexpr nodemask all_nodes = ~0UL;
+
+// Distances as in the SLIT, used when it is missing
+constexpr unsigned local_distance = 10;
+constexpr unsigned remote_distance = 20;
+
+unsigned nr_nodes();
+nodemask online_nodes();
+unsigned cpu_node(unsigned cpu_id);
+// Node of the cpu we are running on
+unsigned current_node();
+// Node of physical address @pa.  If @end is given, it is set to the end of
+// the range of addresses around @pa which belong to the same node.
+unsigned phys_node(uint64_t pa, uint64_t* end = nullptr);
+// Node of a linear mapped (e.g., malloc()ed) address
+unsigned addr_node(const void* addr);
+unsigned distance(unsigned from, unsigned to);
+// All nodes, ordered by their distance from @node (starting with it)
+const unsigned* fallback_order(unsigned node);
+
+// Called while parsing the ACPI tables, before the topology is used
+void add_cpu(uint32_t apic_id, uint32_t domain);
+void add_memory(uint64_t start, uint64_t size, uint32_t domain);
+void set_distance(uint32_t from_domain, uint32_t to_domain, unsigned distance);
+// Makes the topology parsed so far effective
+void commit();
+// Called when cpus are enumerated
+unsigned apic_node(uint32_t apic_id);
+void set_cpu_node(unsigned cpu_id, unsigned node);
+
+// Memory policy modes, as in set_mempolicy(2)
+enum {
+    mpol_default,
+    mpol_preferred,
+    mpol_bind,
+    mpol_interleave,
+    mpol_local,
+};
+
+// Value initialization gives the default policy
+struct mempolicy {
+    int mode;
+    nodemask nodes;
+    bool is_default() const { return mode == mpol_default || mode == mpol_local; }
+};
+
+// Policy applying to page allocations of the current thread: its own
+// policy, or that of the vma it is faulting in.  nullptr when the default
+// (local) policy applies, so the per-cpu page pools can be used.
+const mempolicy* active_policy();
+// The node a page allocation should come from under the active policy, and
+// the nodes it may fall back to.
+void policy_target(unsigned& node, nodemask& allowed);
+// Checks @p against the online nodes; returns an errno value, or 0
+int validate(const mempolicy& p);
+void set_thread_policy(const mempolicy& p);
+mempolicy thread_policy();
+// Node the next interleaved allocation of the current thread goes to
+unsigned next_interleave_node(nodemask nodes);
+
+// Applies @p to page allocations of the current thread until destroyed
+class policy_scope {
+public:
+    explicit policy_scope(const mempolicy& p);
+    ~policy_scope();
+    policy_scope(const policy_scope&) = delete;
+    policy_scope& operator=(const policy_scope&) = delete;
+private:
+    const mempolicy* _saved;
+    bool _active;
+};
+
+}
+
+#endif
@@ -30,9 +30,35 @@ struct arc_hashkey {
     }
 };
 
+class page_loan;
+
+// Write cache statistics, summed over all shards
+struct stats {
+    uint64_t hits;        // faults that found the page in the write cache
+    uint64_t misses;      // write faults that had to read the page in first
+    uint64_t evictions;
+    uint64_t activations; // pages promoted to the active list
+    uint64_t active;      // pages on the active list
+    uint64_t inactive;    // pages on the inactive list
+    uint64_t max_pages;
+};
+
 bool get(vfs_file* fp, off_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pte, bool write, bool shared);
 bool release(vfs_file* fp, void *addr, off_t offset, mmu::hw_ptep<0> ptep);
 void sync(vfs_file* fp, off_t start, off_t end);
-void unmap_arc_buf(arc_buf_t* ab);
+// Whether get() would find the page in the write cache or the ARC read cache
+bool cached(vfs_file* fp, off_t offset);
+// Returns the cached page holding the page aligned file offset and keeps it
+// alive until unlend(*loan), e.g. while an mbuf points at it. Holes are
+// backed by the zero page and get a null loan.
+void* lend(vfs_file* fp, off_t offset, page_loan** loan);
+void unlend(page_loan* loan);
+// Returns true if some of the buffer's pages are still lent; the page cache
+// then takes over freeing the buffer's data.
+bool unmap_arc_buf(arc_buf_t* ab, void* data, size_t size);
+stats get_stats();
+size_t get_max_pages();
+// Limits the write cache, evicting pages over the new limit right away
+void set_max_pages(size_t pages);
 void map_arc_buf(hashkey* key, arc_buf_t* ab, void* page);
 }
@@ -319,6 +319,13 @@ constexpr thread_runtime::duration thyst = std::chrono::milliseconds(5);
 constexpr thread_runtime::duration context_switch_penalty =
                                            std::chrono::microseconds(10);
 
+// Real-time threads may run for at most rt_throttle_runtime out of every
+// rt_throttle_period on a cpu, so that a spinning one cannot lock out the
+// idle thread, the rcu threads and the rest of the system.
+constexpr thread_runtime::duration rt_throttle_period = std::chrono::seconds(1);
+constexpr thread_runtime::duration rt_throttle_runtime =
+                                           std::chrono::milliseconds(950);
+
 
 /**
  * OSv thread
@@ -539,7 +546,36 @@ public:
       * which could cause the whole system to block. So use at your own peril.
       */
      bool unsafe_stop();
+    /**
+     * Set thread's real-time priority
+     *
+     * A thread with a real-time priority above 0 (the default) always runs
+     * ahead of the threads without one, whose share of the CPU is governed
+     * by priority(), and ahead of the real-time threads of lower priority.
+     * Real-time threads of the same priority run in turn: each one until it
+     * waits or yields (like SCHED_FIFO) or, if it has a time slice, for at
+     * most that long (like SCHED_RR).
+     *
+     * Real-time threads are throttled to rt_throttle_runtime out of every
+     * rt_throttle_period on each CPU.
+     *
+     * A thread queued on a runqueue, or running on another CPU, takes the
+     * change up when it is next switched out; any other thread (including
+     * the current one) at once.
+     */
+    void set_realtime_priority(unsigned priority);
+    unsigned realtime_priority() const;
+    /**
+     * Set thread's real-time time slice
+     *
+     * The time a real-time thread may run before giving way to the queued
+     * threads of its own real-time priority. A zero time slice (the default)
+     * means it runs until it waits or yields.
+     */
+    void set_realtime_time_slice(thread_runtime::duration time_slice);
+    thread_runtime::duration realtime_time_slice() const;
 private:
+    void update_realtime();
     static void wake_impl(detached_state* st,
             unsigned allowed_initial_states_mask = 1 << unsigned(status::waiting));
     static void sleep_impl(timer &tmr);
@@ -615,6 +651,22 @@ private:
     //
     // wake() on any state except waiting is discarded.
     thread_runtime _runtime;
+    // The real-time scheduling class. The fields keying the runqueue may
+    // only be changed by the thread's cpu while the thread is not queued,
+    // so requested changes are staged, and taken up by update().
+    struct realtime {
+        unsigned _priority = 0;
+        thread_runtime::duration _time_slice {0};
+        // Time run in the current time slice
+        thread_runtime::duration _run_time {0};
+        std::atomic<unsigned> _new_priority {0};
+        std::atomic<s64> _new_time_slice {0};
+        std::atomic<bool> _changed {false};
+        void update();
+        bool slice_expired() const {
+            return _time_slice.count() && _run_time >= _time_slice;
+        }
+    } _realtime;
     // part of the thread state is detached from the thread structure,
     // and freed by rcu, so that waking a thread and destroying it can
     // occur in parallel without synchronization via thread_handle
@@ -699,6 +751,9 @@ public:
     stat_counter stat_migrations;
 private:
     thread_runtime::duration _total_cpu_time {0};
+    // When the thread last stopped running, to tell whether its cache
+    // footprint is still warm
+    osv::clock::uptime::time_point _last_run;
     std::atomic<u64> _cputime_estimator {0}; // for thread_clock()
     inline void cputime_estimator_set(
             osv::clock::uptime::time_point running_since,
@@ -752,9 +807,17 @@ private:
 std::chrono::nanoseconds osv_run_stats();
 osv::clock::uptime::duration process_cputime();
 
+// Real-time threads go first, by decreasing priority and then in the
+// order in which they were queued; the others by their runtime.
 class thread_runtime_compare {
 public:
     bool operator()(const thread& t1, const thread& t2) const {
+        if (t1._realtime._priority != t2._realtime._priority) {
+            return t1._realtime._priority > t2._realtime._priority;
+        }
+        if (t1._realtime._priority) {
+            return false;
+        }
         return t1._runtime.get_local() < t2._runtime.get_local();
     }
 };
@@ -767,9 +830,28 @@ typedef bi::rbtree<thread,
                    bi::constant_time_size<true> // for load estimation
                   > runqueue_type;
 
+// A group of cpus which share some hardware (see build_sched_domains())
+struct sched_domain {
+    const char* name;
+    std::vector<cpu*> cpus;
+};
+
 struct cpu : private timer_base::client {
     explicit cpu(unsigned id);
     unsigned id;
+    // Where the cpu sits, set by the architecture code: cpus with equal
+    // core ids are SMT siblings, and cpus with equal cache ids share their
+    // last level cache. By default, each cpu is a core of its own.
+    struct topology_ids {
+        unsigned core;
+        unsigned cache;
+        unsigned package;
+    } topology;
+    // Groups of cpus around this one, from the closest (its core, or its
+    // cache if it has no SMT siblings) to all cpus
+    std::vector<sched_domain> domains;
+    // This cpu and its SMT siblings
+    std::vector<cpu*> siblings;
     struct arch_cpu arch;
     thread* bringup_thread;
     runqueue_type runqueue;
@@ -783,12 +865,26 @@ struct cpu : private timer_base::client {
     // they should observe changes in the same order
     std::atomic<bool> lazy_flush_tlb = { false };
     std::atomic<bool> app_thread = {false};
+    std::atomic<bool> idle_thread_running = {false};
+    // real-time priority of the running thread, so a waker knows whether
+    // the thread it wakes should preempt it
+    std::atomic<unsigned> running_realtime_priority = {0};
+    // a waker has sent, or is about to send, an IPI to preempt the running
+    // thread; cleared when the incoming wakeups are handled
+    std::atomic<bool> preempt_pending = {false};
+    // the running thread, for threads spinning on a lock it may hold
+    std::atomic<thread*> running_thread = {nullptr};
     // for each cpu, a list of threads that are migrating into this cpu:
     typedef lockless_queue<thread, &thread::_wakeup_link> incoming_wakeup_queue;
     cpu_set incoming_wakeups_mask;
     incoming_wakeup_queue* incoming_wakeups;
+    // idle cpus asking this one for a thread to run
+    cpu_set steal_requests;
     thread* terminating_thread;
     osv::clock::uptime::time_point running_since;
+    // run time of real-time threads in the current throttling period
+    osv::clock::uptime::time_point rt_period_start;
+    thread_runtime::duration rt_period_runtime {0};
     char* percpu_base;
     static cpu* current();
     void init_on_cpu();
@@ -799,9 +895,16 @@ struct cpu : private timer_base::client {
     void do_idle();
     void idle_poll_start();
     void idle_poll_end();
-    void send_wakeup_ipi();
+    void send_wakeup_ipi(bool preempt = false);
     void load_balance();
     unsigned load();
+    bool try_steal();
+    void handle_steal_requests();
+    thread* steal_candidate(osv::clock::uptime::time_point now);
+    void kick_idle_cpu();
+    unsigned busy_siblings();
+    cpu* balance_target();
+    void push_thread(thread& t, cpu* target);
     /**
      * Try to reschedule.
      *
@@ -819,6 +922,14 @@ struct cpu : private timer_base::client {
     void reschedule_from_interrupt(bool called_from_yield = false,
                                 thread_runtime::duration preempt_after = thyst);
     void enqueue(thread& t);
+    void requeue(thread& t);
+    void account_realtime(osv::clock::uptime::time_point now,
+                          thread_runtime::duration interval, bool realtime);
+    bool rt_throttled() const;
+    thread* next_thread();
+    bool idle_has_work();
+    bool preempts(thread& t, thread& p);
+    void set_preemption_timer(thread& n, osv::clock::uptime::time_point now);
     void init_idle_thread();
     virtual void timer_fired() override;
     class notifier;
@@ -1257,6 +1368,10 @@ timer::timer(thread& t)
 
 extern std::vector<cpu*> cpus;
 
+// Groups the cpus into scheduling domains by their topology; called once
+// the cpus are enumerated
+void build_sched_domains();
+
 inline void migrate_disable()
 {
     thread::current()->_migration_lock_counter++;
@@ -1280,6 +1395,14 @@ inline void migrate_enable()
 // this function should be used sparingly, e.g., for debugging.
 void with_all_threads(std::function<void(sched::thread &)>);
 
+// Whether t is running on a cpu other than the current one. t is only
+// compared, never dereferenced, so it may be a thread which has exited.
+bool running_elsewhere(const thread* t);
+
+// with_thread_by_id(id, f) calls f() on the thread with the given id, or on
+// nullptr if there is none; the thread will not be destroyed while f runs.
+void with_thread_by_id(unsigned id, std::function<void(sched::thread *)> f);
+
 }
 
 #endif /* SCHED_HH_ */
@@ -1,6 +1,16 @@
 #ifndef SHRINKER_H_
 #define SHRINKER_H_
 
+/* Memory pressure levels, as memory::pressure.
+ *
+ * osv_memory_pressure_fd() returns a file descriptor which becomes readable
+ * each time the memory pressure rises to @level or above.  Like an eventfd,
+ * read() returns the number of such events since the previous read.  @flags
+ * may contain O_NONBLOCK and O_CLOEXEC. */
+#define OSV_MEMORY_NORMAL    1
+#define OSV_MEMORY_PRESSURE  2
+#define OSV_MEMORY_EMERGENCY 3
+
 #ifdef __cplusplus
 
 #include <osv/mempool.hh>
@@ -16,13 +26,16 @@ private:
 };
 
 
-extern "C"
+extern "C" {
 void *osv_register_shrinker(const char *name,
                             size_t (*func)(size_t target, bool hard));
+int osv_memory_pressure_fd(int level, int flags);
+}
 #else
 #include <stdbool.h>
 void *osv_register_shrinker(const char *name,
                             size_t (*func)(size_t target, bool hard));
+int osv_memory_pressure_fd(int level, int flags);
 #endif
 
 #endif
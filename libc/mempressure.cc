@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// A file which becomes readable when the memory pressure rises to a given
+// level, so that applications can poll for it and shed memory before the
+// reclaimer has to take it from them.  Reads work as for an eventfd: they
+// return the number of notifications since the previous read.
+
+#include <fs/fs.hh>
+#include <libc/libc.hh>
+#include <osv/fcntl.h>
+#include <osv/mutex.h>
+#include <osv/condvar.h>
+#include <osv/poll.h>
+#include <osv/shrinker.h>
+
+class pressure_fd final : public special_file, private memory::pressure_listener {
+public:
+    pressure_fd(memory::pressure level, int flags)
+        : special_file(FREAD | flags, DTYPE_UNSPEC)
+        , memory::pressure_listener(level)
+    {}
+
+    virtual int read(struct uio *uio, int flags) override;
+    virtual int poll(int events) override;
+    virtual int close() override { return 0; }
+private:
+    virtual void notify(memory::pressure current) override;
+
+    mutex _mutex;
+    uint64_t _count = 0;
+    condvar _blocked_reader;
+};
+
+void pressure_fd::notify(memory::pressure current)
+{
+    WITH_LOCK(_mutex) {
+        _count++;
+        _blocked_reader.wake_all();
+    }
+    poll_wake(this, POLLIN);
+}
+
+int pressure_fd::read(uio *data, int flags)
+{
+    uint64_t v;
+
+    if (data->uio_resid < (ssize_t) sizeof(v)) {
+        return EINVAL;
+    }
+
+    WITH_LOCK(_mutex) {
+        while (!_count) {
+            if (f_flags & O_NONBLOCK) {
+                return EAGAIN;
+            }
+            _blocked_reader.wait(_mutex);
+        }
+        v = _count;
+        _count = 0;
+    }
+
+    return uiomove(&v, sizeof(v), data);
+}
+
+int pressure_fd::poll(int events)
+{
+    WITH_LOCK(_mutex) {
+        return (_count && (events & POLLIN)) ? POLLIN : 0;
+    }
+}
+
+int osv_memory_pressure_fd(int level, int flags)
+{
+    if (level < OSV_MEMORY_NORMAL || level > OSV_MEMORY_EMERGENCY ||
+            (flags & ~(O_NONBLOCK | O_CLOEXEC))) {
+        return libc_error(EINVAL);
+    }
+
+    try {
+        fileref f = make_file<pressure_fd>(memory::pressure(level), flags);
+        fdesc fd(f);
+        return fd.release();
+    } catch (int error) {
+        return libc_error(error);
+    }
+}
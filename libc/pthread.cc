@@ -30,6 +30,7 @@
 #include <api/time.h>
 #include <osv/spinlock.h>
 #include <osv/rwlock.h>
+#include "libc.hh"
 
 namespace pthread_private {
 
@@ -858,30 +859,163 @@ void pthread_exit(void *retval)
     t->_thread.exit();
 }
 
+// SCHED_FIFO and SCHED_RR map to the real-time priorities of sched::thread,
+// in Linux's range; the other policies to the fair scheduler
+constexpr int sched_rt_priority_min = 1;
+constexpr int sched_rt_priority_max = 99;
+// The time slice of SCHED_RR threads, as on Linux
+constexpr sched::thread_runtime::duration sched_rr_time_slice =
+        std::chrono::milliseconds(100);
+
+static bool sched_policy_realtime(int policy)
+{
+    return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static bool sched_policy_valid(int policy)
+{
+    switch (policy) {
+    case SCHED_OTHER:
+    case SCHED_FIFO:
+    case SCHED_RR:
+    case SCHED_BATCH:
+    case SCHED_IDLE:
+        return true;
+    default:
+        return false;
+    }
+}
+
 int sched_get_priority_max(int policy)
 {
-    WARN_STUBBED();
-    return EINVAL;
+    if (!sched_policy_valid(policy)) {
+        return libc_error(EINVAL);
+    }
+    return sched_policy_realtime(policy) ? sched_rt_priority_max : 0;
 }
 
 int sched_get_priority_min(int policy)
 {
-    WARN_STUBBED();
-    return EINVAL;
+    if (!sched_policy_valid(policy)) {
+        return libc_error(EINVAL);
+    }
+    return sched_policy_realtime(policy) ? sched_rt_priority_min : 0;
+}
+
+// Returns an errno value, or 0
+static int set_sched_policy(sched::thread& t, int policy,
+        const struct sched_param *param)
+{
+    policy &= ~SCHED_RESET_ON_FORK;
+    if (!param || !sched_policy_valid(policy) ||
+            param->sched_priority < sched_get_priority_min(policy) ||
+            param->sched_priority > sched_get_priority_max(policy)) {
+        return EINVAL;
+    }
+    t.set_realtime_time_slice(policy == SCHED_RR ? sched_rr_time_slice :
+            sched::thread_runtime::duration(0));
+    t.set_realtime_priority(param->sched_priority);
+    return 0;
+}
+
+static int get_sched_policy(sched::thread& t)
+{
+    if (!t.realtime_priority()) {
+        return SCHED_OTHER;
+    }
+    return t.realtime_time_slice().count() ? SCHED_RR : SCHED_FIFO;
+}
+
+// Calls f on the thread with the given id (the current thread for 0), and
+// returns f's result, an errno value
+template <typename Func>
+static int with_sched_pid(pid_t pid, Func f)
+{
+    if (pid < 0) {
+        return EINVAL;
+    }
+    if (pid == 0) {
+        return f(*sched::thread::current());
+    }
+    int ret = ESRCH;
+    sched::with_thread_by_id(pid, [&] (sched::thread* t) {
+        if (t) {
+            ret = f(*t);
+        }
+    });
+    return ret;
 }
 
 int pthread_setschedparam(pthread_t thread, int policy,
         const struct sched_param *param)
 {
-    WARN_STUBBED();
-    return EINVAL;
+    return set_sched_policy(pthread::from_libc(thread)->_thread, policy, param);
 }
 
 int pthread_getschedparam(pthread_t thread, int *policy,
         struct sched_param *param)
 {
-    WARN_STUBBED();
-    return EINVAL;
+    auto& t = pthread::from_libc(thread)->_thread;
+    *policy = get_sched_policy(t);
+    *param = {};
+    param->sched_priority = t.realtime_priority();
+    return 0;
+}
+
+int pthread_setschedprio(pthread_t thread, int prio)
+{
+    auto& t = pthread::from_libc(thread)->_thread;
+    struct sched_param param = {};
+    param.sched_priority = prio;
+    return set_sched_policy(t, get_sched_policy(t), &param);
+}
+
+int sched_setscheduler(pid_t pid, int policy, const struct sched_param *param)
+{
+    int err = with_sched_pid(pid, [&] (sched::thread& t) {
+        return set_sched_policy(t, policy, param);
+    });
+    return err ? libc_error(err) : 0;
+}
+
+int sched_getscheduler(pid_t pid)
+{
+    int policy;
+    int err = with_sched_pid(pid, [&] (sched::thread& t) {
+        policy = get_sched_policy(t);
+        return 0;
+    });
+    return err ? libc_error(err) : policy;
+}
+
+int sched_setparam(pid_t pid, const struct sched_param *param)
+{
+    int err = with_sched_pid(pid, [&] (sched::thread& t) {
+        return set_sched_policy(t, get_sched_policy(t), param);
+    });
+    return err ? libc_error(err) : 0;
+}
+
+int sched_getparam(pid_t pid, struct sched_param *param)
+{
+    int err = with_sched_pid(pid, [&] (sched::thread& t) {
+        *param = {};
+        param->sched_priority = t.realtime_priority();
+        return 0;
+    });
+    return err ? libc_error(err) : 0;
+}
+
+int sched_rr_get_interval(pid_t pid, struct timespec *interval)
+{
+    int err = with_sched_pid(pid, [&] (sched::thread& t) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                t.realtime_time_slice()).count();
+        interval->tv_sec = ns / 1000000000;
+        interval->tv_nsec = ns % 1000000000;
+        return 0;
+    });
+    return err ? libc_error(err) : 0;
 }
 
 int pthread_kill(pthread_t thread, int sig)
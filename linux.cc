@@ -11,7 +11,9 @@
 #include <boost/format.hpp>
 #include <osv/sched.hh>
 #include <osv/mutex.h>
-#include <osv/waitqueue.hh>
+#include <osv/clock.hh>
+#include <osv/mmu.hh>
+#include <osv/numa.hh>
 
 #include <syscall.h>
 #include <stdarg.h>
@@ -21,83 +23,368 @@
 #include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/utsname.h>
+#include <unistd.h>
 
-#include <unordered_map>
+#include <atomic>
+#include <algorithm>
+
+#include <boost/intrusive/list.hpp>
 
 extern "C" long gettid()
 {
     return sched::thread::current()->id();
 }
 
-// We don't expect applications to use the Linux futex() system call (it is
-// normally only used to implement higher-level synchronization mechanisms),
-// but unfortunately gcc's C++ runtime uses a subset of futex in the
-// __cxa__guard_* functions, which safeguard the concurrent initialization
-// of function-scope static objects. We only implement here this subset.
-// The __cxa_guard_* functions only call futex in the rare case of contention,
-// in fact so rarely that OSv existed for a year before anyone noticed futex
-// was missing. So the performance of this implementation is not critical.
-static std::unordered_map<void*, waitqueue> queues;
-static mutex queues_mutex;
+// The Linux futex() system call is used by the C++ runtime (the
+// __cxa_guard_* functions) and by applications and libraries which carry
+// their own synchronization primitives on top of it, e.g., the JVM or
+// code built against a newer glibc's condition variables. The latter use it
+// heavily, so waiters are kept in a hash table of buckets, each with its own
+// lock, rather than in a single map behind a global mutex; futexes hashing
+// to different buckets can be waited on and woken concurrently.
+//
+// Each waiter is queued, from its own stack, on the bucket of the address it
+// waits on. A waker unlinks the waiter and clears its 'bucket' pointer, which
+// is what the waiter waits for. FUTEX_REQUEUE moves waiters to the bucket of
+// another address, so a waiter giving up after a timeout needs to find the
+// bucket it is on now - see futex_unqueue().
 enum {
     FUTEX_WAIT           = 0,
     FUTEX_WAKE           = 1,
+    FUTEX_REQUEUE        = 3,
+    FUTEX_CMP_REQUEUE    = 4,
+    FUTEX_WAKE_OP        = 5,
+    FUTEX_WAIT_BITSET    = 9,
+    FUTEX_WAKE_BITSET    = 10,
     FUTEX_PRIVATE_FLAG   = 128,
     FUTEX_CLOCK_REALTIME = 256,
     FUTEX_CMD_MASK       = ~(FUTEX_PRIVATE_FLAG|FUTEX_CLOCK_REALTIME),
+
+    FUTEX_BITSET_MATCH_ANY = 0xffffffff,
+
+    // FUTEX_WAKE_OP operations and comparisons
+    FUTEX_OP_SET         = 0,
+    FUTEX_OP_ADD         = 1,
+    FUTEX_OP_OR          = 2,
+    FUTEX_OP_ANDN        = 3,
+    FUTEX_OP_XOR         = 4,
+    FUTEX_OP_OPARG_SHIFT = 8,
+    FUTEX_OP_CMP_EQ      = 0,
+    FUTEX_OP_CMP_NE      = 1,
+    FUTEX_OP_CMP_LT      = 2,
+    FUTEX_OP_CMP_LE      = 3,
+    FUTEX_OP_CMP_GT      = 4,
+    FUTEX_OP_CMP_GE      = 5,
+};
+
+struct futex_bucket;
+
+struct futex_waiter {
+    futex_waiter(int* uaddr, u32 bitset)
+        : uaddr(uaddr), bitset(bitset), t(sched::thread::current()) {}
+    int* uaddr;
+    u32 bitset;
+    sched::thread* t;
+    // The bucket we are queued on, nullptr once woken
+    std::atomic<futex_bucket*> bucket { nullptr };
+    boost::intrusive::list_member_hook<> hook;
 };
 
+struct futex_bucket {
+    mutex mtx;
+    boost::intrusive::list<futex_waiter,
+        boost::intrusive::member_hook<futex_waiter,
+            boost::intrusive::list_member_hook<>,
+            &futex_waiter::hook>,
+        boost::intrusive::constant_time_size<false>> waiters;
+} CACHELINE_ALIGNED;
+
+static constexpr unsigned futex_buckets_nr = 1024;
+static futex_bucket futex_buckets[futex_buckets_nr];
+
+static futex_bucket* futex_hash(int* uaddr)
+{
+    // Futexes are at least 4-byte aligned, and are often allocated at a
+    // larger stride, so mix the address bits before taking the modulo.
+    auto x = reinterpret_cast<uintptr_t>(uaddr) >> 2;
+    x ^= x >> 17;
+    x *= 0x9e3779b97f4a7c15ULL;
+    return &futex_buckets[(x >> 32) % futex_buckets_nr];
+}
+
+// Lock the buckets of two futexes in a fixed order to avoid deadlocking
+// against another thread locking them in the opposite order.
+static void futex_lock2(futex_bucket* b1, futex_bucket* b2)
+{
+    if (b1 > b2) {
+        std::swap(b1, b2);
+    }
+    b1->mtx.lock();
+    if (b2 != b1) {
+        b2->mtx.lock();
+    }
+}
+
+static void futex_unlock2(futex_bucket* b1, futex_bucket* b2)
+{
+    b1->mtx.unlock();
+    if (b2 != b1) {
+        b2->mtx.unlock();
+    }
+}
+
+// Wake up to 'nr' waiters on uaddr, whose bitset intersects 'bitset'.
+// Must be called with the futex's bucket locked.
+static int futex_wake_locked(futex_bucket* b, int* uaddr, int nr, u32 bitset)
+{
+    int woken = 0;
+    for (auto i = b->waiters.begin(); i != b->waiters.end() && woken < nr;) {
+        auto& w = *i;
+        if (w.uaddr != uaddr || !(w.bitset & bitset)) {
+            ++i;
+            continue;
+        }
+        i = b->waiters.erase(i);
+        // Once 'bucket' is cleared the waiter may return and pop 'w' off
+        // its stack, so we can't touch it after this.
+        w.t->wake_with([&w] { w.bucket.store(nullptr, std::memory_order_release); });
+        woken++;
+    }
+    return woken;
+}
+
+// Remove a waiter which timed out from its queue. Returns false if it was
+// woken in the meantime.
+static bool futex_unqueue(futex_waiter& w)
+{
+    while (auto b = w.bucket.load(std::memory_order_acquire)) {
+        WITH_LOCK(b->mtx) {
+            // we may have been requeued while we were taking the lock
+            if (w.bucket.load(std::memory_order_relaxed) == b) {
+                b->waiters.erase(b->waiters.iterator_to(w));
+                w.bucket.store(nullptr, std::memory_order_relaxed);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static int futex_wait(int* uaddr, int val, u32 bitset, sched::timer* tmr)
+{
+    futex_waiter w(uaddr, bitset);
+    auto b = futex_hash(uaddr);
+    WITH_LOCK(b->mtx) {
+        // Checking the value under the bucket lock orders us against a
+        // waker which modified it before taking the same lock.
+        if (*uaddr != val) {
+            errno = EWOULDBLOCK;
+            return -1;
+        }
+        w.bucket.store(b, std::memory_order_relaxed);
+        b->waiters.push_back(w);
+    }
+    auto woken = [&w] { return !w.bucket.load(std::memory_order_acquire); };
+    if (tmr) {
+        sched::thread::wait_for(*tmr, woken);
+    } else {
+        sched::thread::wait_until(woken);
+    }
+    if (!woken() && futex_unqueue(w)) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+static int futex_wake(int* uaddr, int nr, u32 bitset)
+{
+    auto b = futex_hash(uaddr);
+    int woken;
+    WITH_LOCK(b->mtx) {
+        woken = futex_wake_locked(b, uaddr, nr, bitset);
+    }
+    return woken;
+}
+
+// Wake up to 'nr_wake' waiters on uaddr, and move up to 'nr_requeue' of the
+// remaining ones to wait on uaddr2. If 'cmpval' is given, do nothing unless
+// *uaddr still holds it. Returns the number of waiters woken or requeued.
+static int futex_requeue(int* uaddr, int* uaddr2, int nr_wake, int nr_requeue,
+        const int* cmpval)
+{
+    auto b1 = futex_hash(uaddr);
+    auto b2 = futex_hash(uaddr2);
+    futex_lock2(b1, b2);
+    if (cmpval && *uaddr != *cmpval) {
+        futex_unlock2(b1, b2);
+        errno = EAGAIN;
+        return -1;
+    }
+    int ret = futex_wake_locked(b1, uaddr, nr_wake, FUTEX_BITSET_MATCH_ANY);
+    int requeued = 0;
+    for (auto i = b1->waiters.begin(); i != b1->waiters.end() && requeued < nr_requeue;) {
+        auto& w = *i;
+        if (w.uaddr != uaddr) {
+            ++i;
+            continue;
+        }
+        if (b1 == b2) {
+            w.uaddr = uaddr2;
+            ++i;
+        } else {
+            i = b1->waiters.erase(i);
+            w.uaddr = uaddr2;
+            w.bucket.store(b2, std::memory_order_relaxed);
+            b2->waiters.push_back(w);
+        }
+        requeued++;
+    }
+    futex_unlock2(b1, b2);
+    return ret + requeued;
+}
+
+// Atomically apply the operation encoded in 'encoded_op' to *uaddr, and
+// return the result of comparing the old value as it specifies, or -1 if
+// the encoding is invalid.
+static int futex_atomic_op(int* uaddr, int encoded_op)
+{
+    int op = (encoded_op >> 28) & 0xf;
+    int cmp = (encoded_op >> 24) & 0xf;
+    // the arguments are sign-extended 12 bit fields
+    int oparg = (encoded_op >> 12) & 0xfff;
+    int cmparg = encoded_op & 0xfff;
+    if (oparg & 0x800) {
+        oparg -= 0x1000;
+    }
+    if (cmparg & 0x800) {
+        cmparg -= 0x1000;
+    }
+    if (op & FUTEX_OP_OPARG_SHIFT) {
+        if (oparg < 0 || oparg > 31) {
+            return -1;
+        }
+        oparg = 1 << oparg;
+        op &= ~FUTEX_OP_OPARG_SHIFT;
+    }
+
+    auto a = reinterpret_cast<std::atomic<int>*>(uaddr);
+    int oldval = a->load(std::memory_order_relaxed);
+    int newval;
+    do {
+        switch (op) {
+        case FUTEX_OP_SET:  newval = oparg; break;
+        case FUTEX_OP_ADD:  newval = oldval + oparg; break;
+        case FUTEX_OP_OR:   newval = oldval | oparg; break;
+        case FUTEX_OP_ANDN: newval = oldval & ~oparg; break;
+        case FUTEX_OP_XOR:  newval = oldval ^ oparg; break;
+        default: return -1;
+        }
+    } while (!a->compare_exchange_weak(oldval, newval));
+
+    switch (cmp) {
+    case FUTEX_OP_CMP_EQ: return oldval == cmparg;
+    case FUTEX_OP_CMP_NE: return oldval != cmparg;
+    case FUTEX_OP_CMP_LT: return oldval < cmparg;
+    case FUTEX_OP_CMP_LE: return oldval <= cmparg;
+    case FUTEX_OP_CMP_GT: return oldval > cmparg;
+    case FUTEX_OP_CMP_GE: return oldval >= cmparg;
+    default: return -1;
+    }
+}
+
+static int futex_wake_op(int* uaddr, int* uaddr2, int nr_wake, int nr_wake2,
+        int encoded_op)
+{
+    auto b1 = futex_hash(uaddr);
+    auto b2 = futex_hash(uaddr2);
+    futex_lock2(b1, b2);
+    int cond = futex_atomic_op(uaddr2, encoded_op);
+    if (cond < 0) {
+        futex_unlock2(b1, b2);
+        errno = ENOSYS;
+        return -1;
+    }
+    int woken = futex_wake_locked(b1, uaddr, nr_wake, FUTEX_BITSET_MATCH_ANY);
+    if (cond) {
+        woken += futex_wake_locked(b2, uaddr2, nr_wake2, FUTEX_BITSET_MATCH_ANY);
+    }
+    futex_unlock2(b1, b2);
+    return woken;
+}
+
+static bool futex_timeout_valid(const struct timespec* timeout)
+{
+    return timeout->tv_sec >= 0 &&
+           timeout->tv_nsec >= 0 && timeout->tv_nsec < 1000000000L;
+}
+
 int futex(int *uaddr, int op, int val, const struct timespec *timeout,
         int *uaddr2, int val3)
 {
-    switch (op & FUTEX_CMD_MASK) {
+    // The REQUEUE and WAKE_OP operations pass a second count in place of
+    // the timeout.
+    int val2 = static_cast<int>(reinterpret_cast<uintptr_t>(timeout));
+    int cmd = op & FUTEX_CMD_MASK;
+
+    if ((op & FUTEX_CLOCK_REALTIME) &&
+            cmd != FUTEX_WAIT && cmd != FUTEX_WAIT_BITSET) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    switch (cmd) {
     case FUTEX_WAIT:
-        WITH_LOCK(queues_mutex) {
-            if (*uaddr == val) {
-                waitqueue &q = queues[uaddr];
-                if (timeout) {
-                    sched::timer tmr(*sched::thread::current());
-                    tmr.set(std::chrono::seconds(timeout->tv_sec) +
-                            std::chrono::nanoseconds(timeout->tv_nsec));
-                    sched::thread::wait_for(queues_mutex, tmr, q);
-                    // FIXME: testing if tmr was expired isn't quite right -
-                    // we could have had both a wakeup and timer expiration
-                    // racing. It would be more correct to check if we were
-                    // waken by a FUTEX_WAKE. But how?
-                    if (tmr.expired()) {
-                        errno = ETIMEDOUT;
-                        return -1;
-                    }
-                } else {
-                    q.wait(queues_mutex);
-                }
-                return 0;
-            } else {
-                errno = EWOULDBLOCK;
-                return -1;
-            }
+        val3 = FUTEX_BITSET_MATCH_ANY;
+        /* fallthrough */
+    case FUTEX_WAIT_BITSET: {
+        if (!val3) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (!timeout) {
+            return futex_wait(uaddr, val, val3, nullptr);
         }
+        if (!futex_timeout_valid(timeout)) {
+            errno = EINVAL;
+            return -1;
+        }
+        sched::timer tmr(*sched::thread::current());
+        auto t = std::chrono::seconds(timeout->tv_sec) +
+                 std::chrono::nanoseconds(timeout->tv_nsec);
+        if (cmd == FUTEX_WAIT) {
+            // FUTEX_WAIT's timeout is relative
+            tmr.set(t);
+        } else if (op & FUTEX_CLOCK_REALTIME) {
+            tmr.set(osv::clock::wall::time_point(t));
+        } else {
+            tmr.set(osv::clock::uptime::time_point(t));
+        }
+        return futex_wait(uaddr, val, val3, &tmr);
+    }
     case FUTEX_WAKE:
-        if(val < 0) {
+        val3 = FUTEX_BITSET_MATCH_ANY;
+        /* fallthrough */
+    case FUTEX_WAKE_BITSET:
+        if (val < 0 || !val3) {
             errno = EINVAL;
             return -1;
         }
-
-        WITH_LOCK(queues_mutex) {
-            auto i = queues.find(uaddr);
-            if (i != queues.end()) {
-                int waken = 0;
-                while( (val > waken) && !(i->second.empty()) ) {
-                    i->second.wake_one(queues_mutex);
-                    waken++;
-                }
-                if(i->second.empty()) {
-                    queues.erase(i);
-                }
-                return waken;
-            }
+        return futex_wake(uaddr, val, val3);
+    case FUTEX_REQUEUE:
+    case FUTEX_CMP_REQUEUE:
+        if (val < 0 || val2 < 0) {
+            errno = EINVAL;
+            return -1;
         }
-        return 0;
+        return futex_requeue(uaddr, uaddr2, val, val2,
+                cmd == FUTEX_CMP_REQUEUE ? &val3 : nullptr);
+    case FUTEX_WAKE_OP:
+        if (val < 0 || val2 < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        return futex_wake_op(uaddr, uaddr2, val, val2, val3);
     default:
         abort("Unimplemented futex() operation %d\n", op);
     }
@@ -109,31 +396,167 @@ int futex(int *uaddr, int op, int val, const struct timespec *timeout,
 // implementation of get_mempolicy() calls syscall(__NR_get_mempolicy,...),
 // so this is what we need to expose, below.
 
-#define MPOL_DEFAULT 0
+// The same goes for set_mempolicy(), mbind() and move_pages().  The policy
+// modes are numbered as numa::mpol_*.
+
 #define MPOL_F_NODE         (1<<0)
 #define MPOL_F_ADDR         (1<<1)
 #define MPOL_F_MEMS_ALLOWED (1<<2)
+#define MPOL_MODE_FLAGS     (3<<14)
+#define MPOL_MF_STRICT      (1<<0)
+#define MPOL_MF_MOVE        (1<<1)
+#define MPOL_MF_MOVE_ALL    (1<<2)
+
+static constexpr unsigned nodemask_bits = 8 * sizeof(numa::nodemask);
+
+static long store_nodemask(unsigned long *nmask, unsigned long maxnode,
+        numa::nodemask mask)
+{
+    if (!nmask) {
+        return 0;
+    }
+    if (maxnode < numa::nr_nodes()) {
+        errno = EINVAL;
+        return -1;
+    }
+    // Like Linux, only maxnode - 1 bits of the mask are written
+    auto bits = maxnode - 1;
+    auto words = (bits + nodemask_bits - 1) / nodemask_bits;
+    if (!words) {
+        return 0;
+    }
+    std::fill(nmask, nmask + words, 0);
+    if (bits < nodemask_bits) {
+        mask &= (1UL << bits) - 1;
+    }
+    nmask[0] = mask;
+    return 0;
+}
+
+// Like Linux, only maxnode - 1 bits of the mask are used
+static long load_nodemask(const unsigned long *nmask, unsigned long maxnode,
+        numa::nodemask& mask)
+{
+    mask = 0;
+    if (!nmask || maxnode < 2) {
+        return 0;
+    }
+    auto bits = maxnode - 1;
+    mask = nmask[0];
+    if (bits < nodemask_bits) {
+        mask &= (1UL << bits) - 1;
+    }
+    // nodes we do not support
+    for (unsigned long i = 1; i < (bits + nodemask_bits - 1) / nodemask_bits; i++) {
+        if (nmask[i]) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    return 0;
+}
 
 static long get_mempolicy(int *policy, unsigned long *nmask,
         unsigned long maxnode, void *addr, int flags)
 {
-    // As OSv has no support for NUMA nodes, we do here the minimum possible,
-    // which is basically to return the same policy (MPOL_DEFAULT) and list
-    // of nodes (just node 0) no matter if the caller asked for the default
-    // policy, the allowed policy, or the policy for a specific address.
-    if ((flags & MPOL_F_NODE)) {
-        *policy = 0; // in this case, store a node id, not a policy
+    if (flags & MPOL_F_MEMS_ALLOWED) {
+        if (flags & (MPOL_F_NODE | MPOL_F_ADDR)) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (policy) {
+            *policy = 0;
+        }
+        return store_nodemask(nmask, maxnode, numa::online_nodes());
+    }
+    numa::mempolicy p = numa::thread_policy();
+    if (flags & MPOL_F_ADDR) {
+        if (!mmu::isreadable(addr, 1)) {
+            errno = EFAULT;
+            return -1;
+        }
+        if (flags & MPOL_F_NODE) {
+            // the page has just been faulted in, if it was not there
+            auto node = mmu::page_node(addr);
+            if (node < 0) {
+                errno = -node;
+                return -1;
+            }
+            if (policy) {
+                *policy = node;
+            }
+            return store_nodemask(nmask, maxnode, 0);
+        }
+        p = mmu::vma_mempolicy(addr);
+    } else if (flags & MPOL_F_NODE) {
+        // in this case, store a node id, not a policy
+        if (policy) {
+            *policy = p.mode == numa::mpol_interleave ?
+                    numa::next_interleave_node(p.nodes) : numa::current_node();
+        }
         return 0;
     }
     if (policy) {
-        *policy = MPOL_DEFAULT;
+        *policy = p.mode;
     }
-    if (nmask) {
-        if (maxnode < 1) {
-            errno = EINVAL;
-            return -1;
+    return store_nodemask(nmask, maxnode, p.nodes);
+}
+
+static long set_mempolicy(int mode, const unsigned long *nmask,
+        unsigned long maxnode)
+{
+    numa::mempolicy p{mode & ~MPOL_MODE_FLAGS, 0};
+    if (load_nodemask(nmask, maxnode, p.nodes) < 0) {
+        return -1;
+    }
+    auto err = numa::validate(p);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    numa::set_thread_policy(p);
+    return 0;
+}
+
+static long mbind(void *addr, unsigned long len, int mode,
+        const unsigned long *nmask, unsigned long maxnode, unsigned flags)
+{
+    if (reinterpret_cast<uintptr_t>(addr) & (mmu::page_size - 1) ||
+        flags & ~(MPOL_MF_STRICT | MPOL_MF_MOVE | MPOL_MF_MOVE_ALL)) {
+        errno = EINVAL;
+        return -1;
+    }
+    numa::mempolicy p{mode & ~MPOL_MODE_FLAGS, 0};
+    if (load_nodemask(nmask, maxnode, p.nodes) < 0) {
+        return -1;
+    }
+    auto err = numa::validate(p);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    if (!len) {
+        return 0;
+    }
+    return mmu::mbind(addr, len, p, flags & (MPOL_MF_MOVE | MPOL_MF_MOVE_ALL)).to_libc();
+}
+
+static long move_pages(int pid, unsigned long count, void **pages,
+        const int *nodes, int *status, int flags)
+{
+    if (pid && pid != getpid()) {
+        errno = ESRCH;
+        return -1;
+    }
+    for (unsigned long i = 0; i < count; i++) {
+        if (!nodes) {
+            status[i] = mmu::page_node(pages[i]);
+        } else if (nodes[i] < 0 || unsigned(nodes[i]) >= numa::nr_nodes() ||
+                !(numa::online_nodes() & (1UL << nodes[i]))) {
+            status[i] = -ENODEV;
+        } else {
+            status[i] = mmu::move_page(pages[i], nodes[i]);
         }
-        nmask[0] |= 1;
     }
     return 0;
 }
@@ -273,6 +696,9 @@ long syscall(long number, ...)
     SYSCALL4(epoll_wait, int, struct epoll_event *, int, int);
     SYSCALL4(accept4, int, struct sockaddr *, socklen_t *, int);
     SYSCALL5(get_mempolicy, int *, unsigned long *, unsigned long, void *, int);
+    SYSCALL3(set_mempolicy, int, const unsigned long *, unsigned long);
+    SYSCALL6(mbind, void *, unsigned long, int, const unsigned long *, unsigned long, unsigned);
+    SYSCALL6(move_pages, int, unsigned long, void **, const int *, int *, int);
     SYSCALL3(sched_getaffinity_syscall, pid_t, unsigned, unsigned long *);
     }
 
@@ -42,6 +42,7 @@
 #include <osv/commands.hh>
 #include <osv/boot.hh>
 #include <osv/sampler.hh>
+#include <osv/lock-profiler.hh>
 #include <osv/app.hh>
 #include <osv/firmware.hh>
 #include <dirent.h>
@@ -143,6 +144,7 @@ int maxnic;
 
 static int sampler_frequency;
 static bool opt_enable_sampler = false;
+static bool opt_lock_profiler = false;
 
 std::tuple<int, char**> parse_options(int ac, char** av)
 {
@@ -163,9 +165,11 @@ std::tuple<int, char**> parse_options(int ac, char** av)
     desc.add_options()
         ("help", "show help text")
         ("sampler", bpo::value<int>(), "start stack sampling profiler")
+        ("lock-profiler", "start lock contention profiler")
         ("trace", bpo::value<std::vector<std::string>>(), "tracepoints to enable")
         ("trace-backtrace", "log backtraces in the tracepoint log")
         ("leak", "start leak detector after boot")
+        ("huge-arena", "allocate heap pages from 2MB chunks to reduce huge TLB misses")
         ("nomount", "don't mount the ZFS file system")
         ("nopivot", "do not pivot the root from bootfs to the ZFS")
         ("assign-net", "assign virtio network to the application")
@@ -206,6 +210,10 @@ std::tuple<int, char**> parse_options(int ac, char** av)
         opt_leak = true;
     }
 
+    if (vars.count("huge-arena")) {
+        memory::enable_huge_arena();
+    }
+
     if (vars.count("noshutdown")) {
         opt_noshutdown = true;
     }
@@ -237,6 +245,8 @@ std::tuple<int, char**> parse_options(int ac, char** av)
         opt_enable_sampler = true;
     }
 
+    opt_lock_profiler = vars.count("lock-profiler");
+
     if (vars.count("bootchart")) {
         opt_bootchart = true;
     }
@@ -582,6 +592,10 @@ void main_cont(int ac, char** av)
     }
 #endif /* !AARCH64_PORT_STUB */
 
+    if (opt_lock_profiler) {
+        prof::start_lock_profiler();
+    }
+
     // multiple programs can be run -> separate their arguments
 
     pthread_t pthread;
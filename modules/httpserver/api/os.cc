@@ -18,6 +18,9 @@
 #include <osv/sched.hh>
 #include <api/unistd.h>
 #include <osv/commands.hh>
+#include <osv/pagecache.hh>
+#include <osv/mempool.hh>
+#include <osv/mmu.hh>
 #include <algorithm>
 #include "java/jvm/balloon_api.hh"
 
@@ -79,6 +82,86 @@ void init(routes& routes)
         return memory::get_balloon_size();
     });
 
+    os_memory_pagecache.set_handler([](const_req req) {
+        auto st = pagecache::get_stats();
+        httpserver::json::PageCacheStats stats;
+        stats.hits = st.hits;
+        stats.misses = st.misses;
+        stats.evictions = st.evictions;
+        stats.activations = st.activations;
+        stats.active = st.active;
+        stats.inactive = st.inactive;
+        stats.max_pages = st.max_pages;
+        return stats;
+    });
+
+    os_set_memory_pagecache.set_handler([](const_req req) {
+        size_t max_pages;
+        try {
+            max_pages = std::stoul(req.get_query_param("max_pages"));
+        } catch (std::logic_error &e) {
+            throw bad_request_exception("invalid max_pages");
+        }
+        pagecache::set_max_pages(max_pages);
+        return "";
+    });
+
+    os_memory_malloc_pools.set_handler([](const_req req) {
+        vector<httpserver::json::MallocPoolStats> res;
+        httpserver::json::MallocPoolStats stats;
+        for (auto& mp : memory::stats::malloc_pools()) {
+            stats.size = mp.object_size;
+            stats.objects = mp.objects;
+            stats.pages = mp.pages;
+            stats.utilization = mp.pages ?
+                double(mp.objects * mp.object_size) / (mp.pages * memory::page_size) : 0;
+            res.push_back(stats);
+        }
+        return res;
+    });
+
+    os_memory_huge_arena.set_handler([](const_req req) {
+        auto st = memory::stats::huge_arena();
+        httpserver::json::HugeArenaStats stats;
+        stats.enabled = st.enabled;
+        stats.chunks = st.chunks;
+        stats.used = st.used;
+        stats.heap = memory::stats::total() - memory::stats::free();
+        return stats;
+    });
+
+    os_memory_huge_collapse.set_handler([](const_req req) {
+        auto st = mmu::get_collapse_stats();
+        httpserver::json::HugeCollapseStats stats;
+        stats.scanned = st.scanned;
+        stats.collapsed = st.collapsed;
+        stats.failed = st.failed;
+        return stats;
+    });
+
+    os_memory_shrinkers.set_handler([](const_req req) {
+        vector<httpserver::json::ShrinkerStats> res;
+        httpserver::json::ShrinkerStats stats;
+        for (auto& s : memory::stats::shrinkers()) {
+            stats.name = s.name;
+            stats.enabled = s.enabled;
+            stats.invocations = s.invocations;
+            stats.freed = s.freed;
+            stats.time_ns = s.time_ns;
+            res.push_back(stats);
+        }
+        return res;
+    });
+
+    os_memory_pressure.set_handler([](const_req req) {
+        auto st = memory::stats::memory_pressure();
+        httpserver::json::MemoryPressure stats;
+        stats.level = memory::pressure_name(st.level);
+        stats.stalls = st.stalls;
+        stats.stall_ns = st.stall_ns;
+        return stats;
+    });
+
     os_shutdown.set_handler([](const_req req) {
         osv::shutdown();
         return "";
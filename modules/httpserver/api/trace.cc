@@ -14,9 +14,12 @@
 #include <algorithm>
 #include <cctype>
 #include <fstream>
+#include <sstream>
 #include <sys/stat.h>
 #include <osv/tracecontrol.hh>
 #include <osv/sampler.hh>
+#include <osv/heap-profiler.hh>
+#include <osv/lock-profiler.hh>
 #include <osv/trace-count.hh>
 
 using namespace httpserver::json;
@@ -107,6 +110,57 @@ void httpserver::api::trace::init(routes & routes)
         return "Sampler started successfully";
     });
 
+    trace_json::setHeapProfiler.set_handler([](const_req req) {
+        auto rate = std::stol(req.get_query_param("rate"));
+        if (rate < 0) {
+            throw bad_request_exception("Negative sampling rate");
+        }
+        if (rate == 0) {
+            prof::stop_heap_profiler();
+            return "Heap profiler stopped successfully";
+        }
+        prof::start_heap_profiler(rate);
+        return "Heap profiler started successfully";
+    });
+
+    trace_json::getHeapProfile.set_handler("txt", [](const_req req) {
+        std::ostringstream os;
+        prof::dump_heap_profile(os);
+        return os.str();
+    });
+
+    trace_json::setLockProfiler.set_handler([](const_req req) {
+        if (!str2bool(req.get_query_param("enabled"))) {
+            prof::stop_lock_profiler();
+            return "Lock profiler stopped successfully";
+        }
+        prof::start_lock_profiler();
+        return "Lock profiler started successfully";
+    });
+
+    trace_json::getLockProfile.set_handler([](const_req req) {
+        std::vector<LockClass> res;
+        for (auto& c : prof::lock_profile()) {
+            LockClass lc;
+            lc.kind = c.kind;
+            lc.site = c.site;
+            lc.contended = c.contended;
+            lc.wait_ns = c.wait_ns;
+            lc.max_hold_ns = c.max_hold_ns;
+            for (auto& s : c.stacks) {
+                LockStack ls;
+                ls.contended = s.contended;
+                ls.wait_ns = s.wait_ns;
+                for (auto& f : s.frames) {
+                    ls.frames.push(f);
+                }
+                lc.stacks.push(ls);
+            }
+            res.push_back(lc);
+        }
+        return res;
+    });
+
     class create_trace_dump_file {
     public:
         create_trace_dump_file()
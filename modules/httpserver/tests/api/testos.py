@@ -31,6 +31,51 @@ class testos(basetest.Basetest):
         val = self.curl(path)
         self.assertGreater(val, 1024 * 1024 * 256, msg="Free memory should be greater than 256Mb")
 
+    def test_os_pagecache(self):
+        path = self.path_by_nick(self.os_api, "os_memory_pagecache")
+        val = self.curl(path)
+        for key in ["hits", "misses", "evictions", "activations", "active", "inactive", "max_pages"]:
+            self.assert_key_in(key, val)
+        max_pages = val["max_pages"]
+        self.curl(path + "?max_pages=" + str(max_pages * 2), method='POST')
+        self.assertEqual(self.curl(path)["max_pages"], max_pages * 2)
+        self.curl(path + "?max_pages=" + str(max_pages), method='POST')
+
+    def test_os_malloc_pools(self):
+        path = self.path_by_nick(self.os_api, "os_memory_malloc_pools")
+        val = self.curl(path)
+        self.assertGreater(len(val), 0)
+        for key in ["size", "objects", "pages", "utilization"]:
+            self.assert_key_in(key, val[0])
+
+    def test_os_huge_arena(self):
+        path = self.path_by_nick(self.os_api, "os_memory_huge_arena")
+        val = self.curl(path)
+        for key in ["enabled", "chunks", "used", "heap"]:
+            self.assert_key_in(key, val)
+        self.assertLessEqual(val["used"], val["heap"])
+
+    def test_os_huge_collapse(self):
+        path = self.path_by_nick(self.os_api, "os_memory_huge_collapse")
+        val = self.curl(path)
+        for key in ["scanned", "collapsed", "failed"]:
+            self.assert_key_in(key, val)
+        self.assertLessEqual(val["collapsed"], val["scanned"])
+
+    def test_os_shrinkers(self):
+        path = self.path_by_nick(self.os_api, "os_memory_shrinkers")
+        val = self.curl(path)
+        for shrinker in val:
+            for key in ["name", "enabled", "invocations", "freed", "time_ns"]:
+                self.assert_key_in(key, shrinker)
+
+    def test_os_memory_pressure(self):
+        path = self.path_by_nick(self.os_api, "os_memory_pressure")
+        val = self.curl(path)
+        for key in ["level", "stalls", "stall_ns"]:
+            self.assert_key_in(key, val)
+        self.assertIn(val["level"], ["relaxed", "normal", "pressure", "emergency"])
+
     def test_os_threads(self):
         path = self.path_by_nick(self.os_api, "os_threads")
         val = self.curl(path)
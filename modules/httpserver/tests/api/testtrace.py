@@ -1,5 +1,7 @@
 #!/usr/bin/env python
 import basetest
+import requests
+import threading
 
 class testtrace(basetest.Basetest):
     def setUp(self):
@@ -47,6 +49,47 @@ class testtrace(basetest.Basetest):
                     self.assertEqual(bt, s3['backtrace'])
                     self.assertEqual(en, s3['enabled'])
 
+    def test_heap_profile(self):
+        self.curl(self.path + '/heap?rate=4096', method='POST')
+        try:
+            self.curl(self.path + '/heap')
+        except ValueError: # not json. that is fine
+            pass
+        self.curl(self.path + '/heap?rate=0', method='POST')
+
+    def make_lock_contention(self):
+        # Concurrent requests make the server's threads wait for each
+        # other on the allocator and file system locks
+        def worker():
+            for i in range(50):
+                self.curl('/file/etc/hosts?op=GETFILESTATUS')
+        threads = [threading.Thread(target=worker) for i in range(8)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+
+    def test_lock_profile(self):
+        self.curl(self.path + '/locks?enabled=true', method='POST')
+        try:
+            for i in range(10):
+                self.make_lock_contention()
+                classes = self.curl(self.path + '/locks')
+                if classes:
+                    break
+            self.assertTrue(classes)
+            for c in classes:
+                self.assertIn(c['kind'], ['mutex', 'rwlock-read', 'rwlock-write', 'spinlock'])
+                self.assertGreater(c['contended'], 0)
+                self.assertGreater(c['wait_ns'], 0)
+            r = requests.get(self.get_url('/file/proc/lock_stat?op=GET'),
+                             **self._client.get_request_kwargs())
+            self.assertEqual(r.status_code, 200)
+            self.assertIn('lock profiler running', r.text)
+            self.assertIn(classes[0]['site'], r.text)
+        finally:
+            self.curl(self.path + '/locks?enabled=false', method='POST')
+
     def test_get_trace_dump(self):
         self.curl(self.path + '/status?enabled=true&backtrace=true', method='POST')
         try:
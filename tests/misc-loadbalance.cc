@@ -43,6 +43,11 @@
 //    intermittent thread should take 1/11th of one CPU, and the expected
 //    measurement is x2.1.
 //
+// 6. A burst of short threads, all started from one CPU. Idle CPUs should
+//    steal them right away instead of waiting for the periodic load
+//    balancer, so we report how long the threads waited before they first
+//    ran: well under the balancer's 100ms period is expected.
+//
 // Unexpected results in any of these tests should be debugged as follows:
 //
 // 1. Running "top" on the host during all these tests should show 200% CPU
@@ -135,6 +140,31 @@ void concurrent_loops_priority(int looplen, double secs)
 }
 #endif
 
+void burst(int looplen, int N)
+{
+    std::cout << "\nStarting a burst of " << N << " threads, each running for ~10ms.\n";
+    typedef std::chrono::high_resolution_clock clock;
+    std::vector<clock::duration> waited(N);
+    std::vector<std::thread> threads;
+    auto start = clock::now();
+    for (int i = 0; i < N; i++) {
+        threads.push_back(std::thread([=, &waited]() {
+            waited[i] = clock::now() - start;
+            _loop(looplen);
+        }));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    std::chrono::duration<double, std::milli> total(0), max(0);
+    for (auto w : waited) {
+        total += w;
+        max = std::max<std::chrono::duration<double, std::milli>>(max, w);
+    }
+    std::cout << "time to run: average " << total.count() / N << "ms, max "
+            << max.count() << "ms\n";
+}
+
 class background_intermittent {
 public:
     void start(int looplen, int sleepms) {
@@ -223,5 +253,7 @@ int main()
     concurrent_loops(looplen, 4, secs, 2.0*2/(2-1.0/11));
     bi.stop();
 
+    burst(looplen_1ms * 10, 8);
+
     return 0;
 }
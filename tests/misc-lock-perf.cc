@@ -7,8 +7,13 @@
 
 #include <osv/preempt-lock.hh>
 #include <osv/migration-lock.hh>
+#include <osv/mutex.h>
+#include <osv/sched.hh>
+#include <osv/barrier.hh>
 #include <future>
 #include <chrono>
+#include <vector>
+#include <thread>
 
 using _clock = std::chrono::high_resolution_clock;
 
@@ -45,11 +50,51 @@ void test(const char *name, Lock& lock)
     printf("%-10s = %7.3f ns/cycle\n", name, time(lock));
 }
 
+// nthreads threads, on different cpus, take turns holding the mutex for a
+// short critical section. Shows how often lock() found the mutex taken, and
+// how often spinning did not get it and it had to sleep.
+void test_contended(unsigned nthreads)
+{
+    const std::chrono::seconds test_duration(3);
+    mutex m;
+    std::atomic<long> count(0);
+    std::vector<std::thread> threads;
+    auto end_after = _clock::now() + test_duration;
+
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads.emplace_back([&, i] {
+            sched::thread::pin(sched::cpus[i % sched::cpus.size()]);
+            long n = 0;
+            while (_clock::now() < end_after) {
+                for (int j = 0; j < 1000; j++) {
+                    WITH_LOCK(m) {
+                        for (int k = 0; k < 20; k++) {
+                            barrier();
+                        }
+                        n++;
+                    }
+                }
+            }
+            count += n;
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(test_duration).count();
+    printf("mutex x%-3u = %7.3f ns/cycle, %u contended, %u slept\n", nthreads,
+            double(ns) / count, m.contended(), m.slept());
+}
+
 int main(int argc, char const *argv[])
 {
     test("dummy", *new dummy_lock);
     test("preempt", preempt_lock);
     test("migrate", migration_lock);
     test("mutex", *new mutex);
+    for (unsigned n : {2, 4}) {
+        test_contended(n);
+    }
     return 0;
 }
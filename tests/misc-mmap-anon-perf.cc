@@ -1,6 +1,9 @@
 #include <sys/mman.h>
 #include <cstdio>
 #include <chrono>
+#include <thread>
+#include <vector>
+#include <atomic>
 
 std::chrono::duration<double> mmap_and_write(size_t mb, int flags)
 {
@@ -23,6 +26,62 @@ void mmap_bench(size_t mb)
     printf("%4lu %-6.3f %-6.3f\n", mb, demand.count(), populate.count());
 }
 
+// Faults in @mb of small pages, in a loop, until @stop
+static size_t fault_loop(size_t mb, std::atomic<bool>& stop)
+{
+    size_t size = mb*1024*1024;
+    size_t faults = 0;
+    while (!stop.load(std::memory_order_relaxed)) {
+        char *p = reinterpret_cast<char*>(mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0));
+        madvise(p, size, MADV_NOHUGEPAGE);
+        for (size_t i = 0; i < size; i += 4096) {
+            p[i] = 0xfe;
+        }
+        faults += size / 4096;
+        munmap(p, size);
+    }
+    return faults;
+}
+
+// Page faults per second of @nthreads threads, while another thread keeps
+// mapping and unmapping memory (if @mapper), which should not hold them up
+void concurrent_bench(unsigned nthreads, bool mapper)
+{
+    std::atomic<bool> stop(false);
+    std::vector<size_t> faults(nthreads);
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads.emplace_back([&, i] { faults[i] = fault_loop(16, stop); });
+    }
+    size_t maps = 0;
+    std::thread m;
+    if (mapper) {
+        m = std::thread([&] {
+            while (!stop.load(std::memory_order_relaxed)) {
+                void *p = mmap(nullptr, 65536, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+                munmap(p, 65536);
+                maps++;
+            }
+        });
+    }
+    auto start = std::chrono::system_clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    stop.store(true);
+    for (auto& t : threads) {
+        t.join();
+    }
+    if (mapper) {
+        m.join();
+    }
+    std::chrono::duration<double> sec = std::chrono::system_clock::now() - start;
+    size_t total = 0;
+    for (auto f : faults) {
+        total += f;
+    }
+    printf("%7u %-6s %-12.0f %-12.0f\n", nthreads, mapper ? "yes" : "no",
+            total / sec.count(), maps / sec.count());
+}
+
 int main()
 {
     for (auto i = 1; i <= 5; i++) {
@@ -36,4 +95,11 @@ int main()
 
         printf("\n");
     }
+
+    printf("Concurrent faults\n\n");
+    printf("threads mmap   faults/s     mmaps/s\n");
+    for (unsigned n = 1; n <= std::thread::hardware_concurrency(); n *= 2) {
+        concurrent_bench(n, false);
+        concurrent_bench(n, true);
+    }
 }
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+// To compile on Linux, use: g++ -g -pthread -std=c++11 tests/tst-futex.cc
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, const char* msg)
+{
+    ++tests;
+    fails += !ok;
+    std::cout << (ok ? "PASS" : "FAIL") << ": " << msg << "\n";
+}
+
+static long futex(int* uaddr, int op, int val, const timespec* timeout,
+        int* uaddr2, int val3)
+{
+    return syscall(SYS_futex, uaddr, op, val, timeout, uaddr2, val3);
+}
+
+// REQUEUE and WAKE_OP take a second count in place of the timeout
+static const timespec* val2(uintptr_t v)
+{
+    return reinterpret_cast<const timespec*>(v);
+}
+
+static void wait_for_waiters()
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+}
+
+int main(int argc, char** argv)
+{
+    int f1 = 0, f2 = 0;
+    std::atomic<int> woken(0);
+
+    report(futex(&f1, FUTEX_WAKE, 1, nullptr, nullptr, 0) == 0,
+            "wake without waiters");
+    report(futex(&f1, FUTEX_WAIT, 1, nullptr, nullptr, 0) == -1 &&
+            errno == EWOULDBLOCK, "wait on a changed value");
+
+    timespec rel { 0, 10000000 };
+    report(futex(&f1, FUTEX_WAIT, 0, &rel, nullptr, 0) == -1 &&
+            errno == ETIMEDOUT, "relative timeout");
+
+    timespec abs;
+    clock_gettime(CLOCK_MONOTONIC, &abs);
+    report(futex(&f1, FUTEX_WAIT_BITSET, 0, &abs, nullptr,
+            FUTEX_BITSET_MATCH_ANY) == -1 && errno == ETIMEDOUT,
+            "absolute monotonic timeout");
+    clock_gettime(CLOCK_REALTIME, &abs);
+    report(futex(&f1, FUTEX_WAIT_BITSET | FUTEX_CLOCK_REALTIME, 0, &abs,
+            nullptr, FUTEX_BITSET_MATCH_ANY) == -1 && errno == ETIMEDOUT,
+            "absolute realtime timeout");
+
+    std::thread waiters[4];
+    for (auto& t : waiters) {
+        t = std::thread([&] {
+            if (futex(&f1, FUTEX_WAIT, 0, nullptr, nullptr, 0) == 0) {
+                woken++;
+            }
+        });
+    }
+    wait_for_waiters();
+    report(futex(&f1, FUTEX_WAKE, 1, nullptr, nullptr, 0) == 1,
+            "wake one");
+
+    report(futex(&f1, FUTEX_CMP_REQUEUE, 1, val2(INT32_MAX), &f2, 1) == -1 &&
+            errno == EAGAIN, "cmp_requeue on a changed value");
+    report(futex(&f1, FUTEX_CMP_REQUEUE, 1, val2(INT32_MAX), &f2, 0) == 3,
+            "cmp_requeue wakes one and requeues two");
+    report(futex(&f1, FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0) == 0,
+            "nothing left on the original futex");
+
+    // f2 += 1, then wake one waiter on f2 if it was 0
+    int op = FUTEX_OP(FUTEX_OP_ADD, 1, FUTEX_OP_CMP_EQ, 0);
+    report(futex(&f1, FUTEX_WAKE_OP, 1, val2(1), &f2, op) == 1 && f2 == 1,
+            "wake_op");
+
+    std::thread bitset_waiter([&] {
+        if (futex(&f2, FUTEX_WAIT_BITSET, 1, nullptr, nullptr, 2) == 0) {
+            woken++;
+        }
+    });
+    wait_for_waiters();
+    report(futex(&f2, FUTEX_WAKE_BITSET, INT32_MAX, nullptr, nullptr, 4) == 1,
+            "wake_bitset only wakes matching waiters");
+    report(futex(&f2, FUTEX_WAKE_BITSET, INT32_MAX, nullptr, nullptr, 2) == 1,
+            "wake_bitset");
+
+    for (auto& t : waiters) {
+        t.join();
+    }
+    bitset_waiter.join();
+    report(woken == 5, "all waiters woken");
+
+    std::cout << "SUMMARY: " << tests << " tests, " << fails << " failures\n";
+    return fails == 0 ? 0 : 1;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+// To compile on Linux, use: g++ -g -std=c++11 tests/tst-libaio.cc -laio
+
+#include <libaio.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <iostream>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, const char* msg)
+{
+    ++tests;
+    fails += !ok;
+    std::cout << (ok ? "PASS" : "FAIL") << ": " << msg << "\n";
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = argc > 1 ? argv[1] : "/tmp/tst-libaio";
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+    report(fd >= 0, "open");
+
+    io_context_t ctx = 0;
+    report(io_setup(0, &ctx) == -EINVAL, "io_setup with no events");
+    report(io_setup(4, &ctx) == 0 && ctx, "io_setup");
+
+    static char wbuf[4096], rbuf[4096];
+    memset(wbuf, 'x', sizeof(wbuf));
+
+    iocb cb;
+    iocb* cbs[] = { &cb };
+    io_event ev;
+    io_prep_pwrite(&cb, fd, wbuf, sizeof(wbuf), 0);
+    cb.data = wbuf;
+    report(io_submit(ctx, 1, cbs) == 1, "submit pwrite");
+    report(io_getevents(ctx, 1, 1, &ev, nullptr) == 1, "reap pwrite");
+    report(ev.obj == &cb && ev.data == wbuf && ev.res == sizeof(wbuf),
+            "pwrite completion");
+
+    int efd = eventfd(0, 0);
+    io_prep_pread(&cb, fd, rbuf, sizeof(rbuf), 0);
+    io_set_eventfd(&cb, efd);
+    report(io_submit(ctx, 1, cbs) == 1, "submit pread");
+    uint64_t count = 0;
+    report(read(efd, &count, sizeof(count)) == sizeof(count) && count == 1,
+            "eventfd notified");
+    timespec zero {0, 0};
+    report(io_getevents(ctx, 1, 1, &ev, &zero) == 1, "reap pread");
+    report(ev.res == sizeof(rbuf) && !memcmp(rbuf, wbuf, sizeof(rbuf)),
+            "pread completion");
+
+    report(io_getevents(ctx, 1, 1, &ev, &zero) == 0, "getevents timeout");
+
+    io_prep_fsync(&cb, fd);
+    report(io_submit(ctx, 1, cbs) == 1, "submit fsync");
+    report(io_getevents(ctx, 1, 1, &ev, nullptr) == 1 && ev.res == 0,
+            "fsync completion");
+
+    io_prep_pread(&cb, -1, rbuf, sizeof(rbuf), 0);
+    report(io_submit(ctx, 1, cbs) == -EBADF, "submit on a bad fd");
+
+    report(io_destroy(ctx) == 0, "io_destroy");
+    close(efd);
+    close(fd);
+    unlink(path);
+
+    std::cout << "SUMMARY: " << tests << " tests, " << fails << " failures\n";
+    return fails == 0 ? 0 : 1;
+}
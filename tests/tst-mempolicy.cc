@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+// To compile on Linux, use: g++ -g -std=c++11 tests/tst-mempolicy.cc
+
+// The NUMA system calls, as used by libnuma.  Passes on machines with one
+// node or more.
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <iostream>
+
+enum { MPOL_DEFAULT, MPOL_PREFERRED, MPOL_BIND, MPOL_INTERLEAVE };
+enum { MPOL_F_NODE = 1, MPOL_F_ADDR = 2, MPOL_F_MEMS_ALLOWED = 4 };
+enum { MPOL_MF_MOVE = 2 };
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, const char* msg)
+{
+    ++tests;
+    fails += !ok;
+    std::cout << (ok ? "PASS" : "FAIL") << ": " << msg << "\n";
+}
+
+static long get_mempolicy(int* mode, unsigned long* mask, unsigned long maxnode,
+        void* addr, int flags)
+{
+    return syscall(__NR_get_mempolicy, mode, mask, maxnode, addr, flags);
+}
+
+static long set_mempolicy(int mode, const unsigned long* mask, unsigned long maxnode)
+{
+    return syscall(__NR_set_mempolicy, mode, mask, maxnode);
+}
+
+static long mbind(void* addr, unsigned long len, int mode,
+        const unsigned long* mask, unsigned long maxnode, unsigned flags)
+{
+    return syscall(__NR_mbind, addr, len, mode, mask, maxnode, flags);
+}
+
+static long move_pages(int pid, unsigned long count, void** pages,
+        const int* nodes, int* status, int flags)
+{
+    return syscall(__NR_move_pages, pid, count, pages, nodes, status, flags);
+}
+
+int main(int argc, char** argv)
+{
+    constexpr unsigned long maxnode = 8 * sizeof(unsigned long);
+    unsigned long allowed = 0;
+    int mode = -1;
+    report(get_mempolicy(&mode, &allowed, maxnode, nullptr, MPOL_F_MEMS_ALLOWED) == 0 &&
+            (allowed & 1), "node 0 is allowed");
+
+    // libnuma passes one more than the number of bits in its mask; only
+    // maxnode - 1 bits may be written
+    unsigned long masks[2] = { 0, 0x5a5a5a5aUL };
+    report(get_mempolicy(&mode, masks, maxnode + 1, nullptr, MPOL_F_MEMS_ALLOWED) == 0 &&
+            masks[0] == allowed && masks[1] == 0x5a5a5a5aUL,
+            "maxnode of a word's bits plus one");
+
+    report(get_mempolicy(&mode, nullptr, 0, nullptr, 0) == 0 && mode == MPOL_DEFAULT,
+            "default policy");
+
+    unsigned long node0 = 1;
+    report(set_mempolicy(MPOL_BIND, &node0, maxnode) == 0, "bind to node 0");
+    unsigned long mask = 0;
+    report(get_mempolicy(&mode, &mask, maxnode, nullptr, 0) == 0 &&
+            mode == MPOL_BIND && mask == 1, "bind policy is reported");
+
+    void* p = malloc(1 << 20);
+    memset(p, 1, 1 << 20);
+    free(p);
+
+    unsigned long none = 0;
+    report(set_mempolicy(MPOL_BIND, &none, maxnode) == -1 && errno == EINVAL,
+            "bind to no nodes");
+    report(set_mempolicy(MPOL_INTERLEAVE, &allowed, maxnode) == 0, "interleave");
+    int node = -1;
+    report(get_mempolicy(&node, nullptr, 0, nullptr, MPOL_F_NODE) == 0 &&
+            node >= 0 && (allowed & (1UL << node)), "next interleave node");
+    report(set_mempolicy(MPOL_DEFAULT, nullptr, 0) == 0, "back to default");
+
+    size_t len = 16 * 4096;
+    auto buf = static_cast<char*>(mmap(nullptr, len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    report(buf != MAP_FAILED, "mmap");
+    report(mbind(buf + 1, len, MPOL_BIND, &node0, maxnode, 0) == -1 && errno == EINVAL,
+            "mbind of an unaligned address");
+    report(mbind(buf, len / 2, MPOL_BIND, &node0, maxnode, MPOL_MF_MOVE) == 0,
+            "mbind of half the mapping");
+    mask = 0;
+    report(get_mempolicy(&mode, &mask, maxnode, buf, MPOL_F_ADDR) == 0 &&
+            mode == MPOL_BIND && mask == 1, "policy of the bound half");
+    report(get_mempolicy(&mode, &mask, maxnode, buf + len / 2, MPOL_F_ADDR) == 0 &&
+            mode == MPOL_DEFAULT, "policy of the other half");
+
+    buf[0] = 1;
+    report(get_mempolicy(&node, nullptr, 0, buf, MPOL_F_NODE | MPOL_F_ADDR) == 0 &&
+            node == 0, "node of a bound page");
+
+    void* pages[] = { buf, buf + len / 2 };
+    int nodes[] = { 0, 0 };
+    int status[] = { -1, -1 };
+    buf[len / 2] = 1;
+    report(move_pages(0, 2, pages, nodes, status, 0) == 0 &&
+            status[0] == 0 && status[1] == 0, "move_pages to node 0");
+    status[0] = status[1] = -1;
+    report(move_pages(0, 2, pages, nullptr, status, 0) == 0 &&
+            status[0] == 0 && status[1] == 0, "move_pages query");
+
+    munmap(buf, len);
+
+    std::cout << "SUMMARY: " << tests << " tests, " << fails << " failures\n";
+    return fails == 0 ? 0 : 1;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Memory pressure notifications and the reclaim statistics in /proc
+
+#include <osv/shrinker.h>
+
+#include <sys/sysinfo.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, const char* msg)
+{
+    ++tests;
+    fails += !ok;
+    std::cout << (ok ? "PASS" : "FAIL") << ": " << msg << "\n";
+}
+
+static std::string pressure_level()
+{
+    std::ifstream f("/proc/memory_pressure");
+    std::string key, level;
+    f >> key >> level;
+    return key == "level" ? level : "";
+}
+
+static bool readable(int fd, int timeout_ms)
+{
+    pollfd pfd = { fd, POLLIN, 0 };
+    return poll(&pfd, 1, timeout_ms) == 1 && (pfd.revents & POLLIN);
+}
+
+int main(int argc, char** argv)
+{
+    report(osv_memory_pressure_fd(0, 0) == -1 && errno == EINVAL, "relaxed level is refused");
+    report(osv_memory_pressure_fd(OSV_MEMORY_EMERGENCY + 1, 0) == -1 && errno == EINVAL,
+            "unknown level is refused");
+    report(osv_memory_pressure_fd(OSV_MEMORY_NORMAL, O_APPEND) == -1 && errno == EINVAL,
+            "unknown flag is refused");
+
+    int emergency = osv_memory_pressure_fd(OSV_MEMORY_EMERGENCY, O_NONBLOCK);
+    report(emergency >= 0, "open emergency level");
+    uint64_t count;
+    report(read(emergency, &count, sizeof(count)) == -1 && errno == EAGAIN,
+            "no emergency yet");
+    report(!readable(emergency, 0), "emergency fd is not readable");
+
+    std::ifstream shrinkers("/proc/shrinkers");
+    std::string header;
+    report(std::getline(shrinkers, header) && header.find("freed_bytes") != std::string::npos,
+            "/proc/shrinkers");
+    auto level = pressure_level();
+    report(!level.empty(), "/proc/memory_pressure");
+
+    // Take memory until free memory drops under the normal level, if we
+    // start above it
+    if (level == "relaxed") {
+        int normal = osv_memory_pressure_fd(OSV_MEMORY_NORMAL, O_NONBLOCK);
+        report(normal >= 0, "open normal level");
+        struct sysinfo info;
+        constexpr size_t chunk = 1 << 20;
+        std::vector<void*> chunks;
+        bool notified = false;
+        while (!(notified = readable(normal, 0))) {
+            sysinfo(&info);
+            if (info.freeram < info.totalram / 100 * 15) {
+                notified = readable(normal, 1000);
+                break;
+            }
+            auto p = malloc(chunk);
+            if (!p) {
+                break;
+            }
+            memset(p, 1, chunk);
+            chunks.push_back(p);
+        }
+        report(notified, "normal level is notified");
+        report(read(normal, &count, sizeof(count)) == ssize_t(sizeof(count)) && count >= 1,
+                "read notification count");
+        for (auto p : chunks) {
+            free(p);
+        }
+        close(normal);
+    } else {
+        std::cout << "Skipping notification test, memory level is " << level << "\n";
+    }
+    close(emergency);
+
+    std::cout << "SUMMARY: " << tests << " tests, " << fails << " failures\n";
+    return fails == 0 ? 0 : 1;
+}
@@ -59,6 +59,51 @@ static int verify_pattern(int fd, size_t size, unsigned char pattern, int mmap_f
     return 0;
 }
 
+static unsigned char advice_pattern(size_t i)
+{
+    return (i >> 12) ^ i;
+}
+
+// Reads a file through a mapping, forwards and then backwards a page at a
+// time, after giving the mapping some madvise() advice.  The file is longer
+// than the windows of pages faulted in around, and ahead of, each fault.
+static int verify_advice(int fd, size_t size, int advice)
+{
+    size_t len = (size + 4095) & ~size_t(4095);
+    auto* p = reinterpret_cast<unsigned char*>(mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0));
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    if (madvise(p, len, advice) < 0) {
+        perror("madvise");
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        if (p[i] != advice_pattern(i)) {
+            printf("pattern didn't match at %zu\n", i);
+            return -1;
+        }
+    }
+    for (size_t i = size; i < len; i++) {
+        if (p[i]) {
+            printf("tail past the end of file isn't zero\n");
+            return -1;
+        }
+    }
+    for (size_t i = len; i > 0; i -= 4096) {
+        if (p[i - 4096] != advice_pattern(i - 4096)) {
+            printf("pattern didn't match at %zu\n", i - 4096);
+            return -1;
+        }
+    }
+    if (munmap(p, len) < 0) {
+        perror("munmap");
+        return -1;
+    }
+    return 0;
+}
+
 static int check_mapping(void *addr, size_t size, unsigned flags, int fd,
                          size_t offset, int expected_errno)
 {
@@ -143,6 +188,20 @@ int main(int argc, char *argv[])
     report(munmap(b, 4096) == 0, "munmap temporary mapping");
     report(close(fd) == 0, "close again");
 
+    fd = open("/tmp/mmap-file-test", O_CREAT|O_TRUNC|O_RDWR, 0666);
+    report(fd > 0, "open file again: O_TRUNC");
+    constexpr size_t big_size = 600 * 4096 + 100;
+    static unsigned char big[big_size];
+    for (size_t i = 0; i < big_size; i++) {
+        big[i] = advice_pattern(i);
+    }
+    report(write(fd, big, big_size) == ssize_t(big_size), "write file for madvise");
+    report(verify_advice(fd, big_size, MADV_NORMAL) == 0, "read mapping with MADV_NORMAL");
+    report(verify_advice(fd, big_size, MADV_SEQUENTIAL) == 0, "read mapping with MADV_SEQUENTIAL");
+    report(verify_advice(fd, big_size, MADV_RANDOM) == 0, "read mapping with MADV_RANDOM");
+    report(verify_advice(fd, big_size, MADV_WILLNEED) == 0, "read mapping with MADV_WILLNEED");
+    report(close(fd) == 0, "close again");
+
     // TODO: map an append-only file with prot asking for PROT_WRITE, mmap should return EACCES.
     // TODO: map a file under a fs mounted with the flag NO_EXEC and prot asked for PROT_EXEC (expect EPERM).
 
@@ -12,10 +12,13 @@
 
 #ifdef __OSV__
 #include <osv/sched.hh>
+#include <osv/mmu.hh>
+#include <osv/virt_to_phys.hh>
 #endif
 
 #include <sys/mman.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <iostream>
 #include <cassert>
@@ -74,6 +77,17 @@ int main(int argc, char **argv)
     assert(try_write(hp+8192));
     munmap(buf, 3*hugepagesize);
 
+    // test mprotect over several vmas, whose TLB flushes are batched
+    buf = mmap(NULL, 3*4096, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+    assert(buf != MAP_FAILED);
+    mprotect(buf+4096, 4096, PROT_READ|PROT_WRITE|PROT_EXEC);
+    assert(try_write(buf) && try_write(buf+4096) && try_write(buf+8192));
+    mprotect(buf, 3*4096, PROT_READ);
+    assert(!try_write(buf));
+    assert(!try_write(buf+4096));
+    assert(!try_write(buf+8192));
+    munmap(buf, 3*4096);
+
     // test that mprotect with PROT_NONE disables even read
     buf = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
     assert(buf != MAP_FAILED);
@@ -235,6 +249,41 @@ int main(int argc, char **argv)
     assert(small != nullptr);
     assert(munmap(small, 64) == 0);
 
+    // Memory populated with small pages keeps its contents when it is
+    // collapsed into huge pages in the background
+    size_t thp_size = 4 << 20;
+    auto thp = static_cast<unsigned*>(mmap(NULL, thp_size, PROT_READ|PROT_WRITE,
+            MAP_ANONYMOUS|MAP_PRIVATE, -1, 0));
+    assert(thp != MAP_FAILED);
+    assert(madvise(thp, thp_size, MADV_NOHUGEPAGE) == 0);
+    for (size_t i = 0; i < thp_size / sizeof(*thp); i++) {
+        thp[i] = i;
+    }
+#ifdef __OSV__
+    auto collapsed = mmu::get_collapse_stats().collapsed;
+#endif
+    assert(madvise(thp, thp_size, MADV_HUGEPAGE) == 0);
+#ifdef __OSV__
+    // At least one whole 2MB region lies in the mapping
+    for (int i = 0; i < 100 && mmu::get_collapse_stats().collapsed == collapsed; i++) {
+        usleep(100000);
+    }
+    assert(mmu::get_collapse_stats().collapsed > collapsed);
+    // and that region is now backed by one huge page
+    auto region = (reinterpret_cast<uintptr_t>(thp) + mmu::huge_page_size - 1) &
+            ~(mmu::huge_page_size - 1);
+    auto base = mmu::virt_to_phys(reinterpret_cast<void*>(region));
+    assert(base % mmu::huge_page_size == 0);
+    for (size_t off = 0; off < mmu::huge_page_size; off += mmu::page_size) {
+        assert(mmu::virt_to_phys(reinterpret_cast<void*>(region + off)) == base + off);
+    }
+#endif
+    for (size_t i = 0; i < thp_size / sizeof(*thp); i++) {
+        assert(thp[i] == i);
+        thp[i] = ~i;
+    }
+    assert(munmap(thp, thp_size) == 0);
+
     // TODO: verify that mmapping more than available physical memory doesn't
     // panic just return -1 and ENOMEM.
     // TODO: verify that huge-page-sized allocations get a huge-page aligned address
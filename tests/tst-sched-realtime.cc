@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+// To compile on Linux, use: g++ -g -pthread -std=c++11 tests/tst-sched-realtime.cc
+// (and run it as root)
+
+// The SCHED_FIFO and SCHED_RR policies, and the throttling which keeps a
+// spinning real-time thread from locking out the rest of its cpu.
+
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, const char* msg)
+{
+    ++tests;
+    fails += !ok;
+    std::cout << (ok ? "PASS" : "FAIL") << ": " << msg << "\n";
+}
+
+static bool set_policy(pthread_t t, int policy, int priority)
+{
+    sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    return pthread_setschedparam(t, policy, &param) == 0;
+}
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void* set_flag(void* arg)
+{
+    pthread_mutex_lock(&lock);
+    static_cast<std::atomic<bool>*>(arg)->store(true);
+    pthread_mutex_unlock(&lock);
+    return nullptr;
+}
+
+int main(int argc, char** argv)
+{
+    report(sched_get_priority_min(SCHED_FIFO) == 1 &&
+            sched_get_priority_max(SCHED_FIFO) == 99, "SCHED_FIFO priorities");
+    report(sched_get_priority_min(SCHED_OTHER) == 0 &&
+            sched_get_priority_max(SCHED_OTHER) == 0, "SCHED_OTHER priorities");
+    report(sched_get_priority_max(12345) == -1 && errno == EINVAL,
+            "priorities of an unknown policy");
+
+    auto self = pthread_self();
+    report(!set_policy(self, SCHED_FIFO, 0) && !set_policy(self, SCHED_OTHER, 1),
+            "priority outside the policy's range");
+
+    int policy;
+    sched_param param;
+    report(set_policy(self, SCHED_RR, 5) &&
+            pthread_getschedparam(self, &policy, &param) == 0 &&
+            policy == SCHED_RR && param.sched_priority == 5, "SCHED_RR");
+    timespec ts;
+    report(sched_rr_get_interval(0, &ts) == 0 && (ts.tv_sec || ts.tv_nsec),
+            "SCHED_RR time slice");
+    report(pthread_setschedprio(self, 7) == 0 && sched_getscheduler(0) == SCHED_RR &&
+            sched_getparam(0, &param) == 0 && param.sched_priority == 7,
+            "pthread_setschedprio keeps the policy");
+    report(set_policy(self, SCHED_OTHER, 0) && sched_getscheduler(0) == SCHED_OTHER,
+            "back to SCHED_OTHER");
+
+    // A SCHED_FIFO thread spinning on a cpu runs ahead of a SCHED_OTHER
+    // thread on the same cpu, but only until it is throttled
+    cpu_set_t cs;
+    CPU_ZERO(&cs);
+    CPU_SET(0, &cs);
+    report(pthread_setaffinity_np(self, sizeof(cs), &cs) == 0, "pin to cpu 0");
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(cs), &cs);
+
+    // The thread is created first, so it does not inherit our policy
+    std::atomic<bool> ran(false);
+    pthread_t t;
+    pthread_mutex_lock(&lock);
+    pthread_create(&t, &attr, set_flag, &ran);
+    report(set_policy(self, SCHED_FIFO, 10), "SCHED_FIFO");
+    pthread_mutex_unlock(&lock);
+    auto start = std::chrono::steady_clock::now();
+    while (!ran.load() &&
+            std::chrono::steady_clock::now() - start < std::chrono::milliseconds(100)) {
+    }
+    report(!ran.load(), "SCHED_OTHER thread waits behind a SCHED_FIFO one");
+    while (!ran.load() &&
+            std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+    }
+    report(ran.load(), "SCHED_FIFO spinner is throttled");
+    set_policy(self, SCHED_OTHER, 0);
+    pthread_join(t, nullptr);
+    pthread_attr_destroy(&attr);
+
+    std::cout << "SUMMARY: " << tests << " tests, " << fails << " failures\n";
+    return fails == 0 ? 0 : 1;
+}